@@ -120,10 +120,12 @@ paddr_t ram_getfirstfree(void);
 
 struct tlbshootdown {
 	/*
-	 * Change this to what you need for your VM design.
+	 * A page and the ASID it is mapped under. Whoever queues the
+	 * shootdown waits on the target cpu's completion ticket, so
+	 * no semaphore travels with the request.
 	 */
 	vaddr_t target;
-	struct semaphore *sem;
+	unsigned asid;
 };
 
 #define TLBSHOOTDOWN_MAX 16
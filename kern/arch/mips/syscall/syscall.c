@@ -36,6 +36,7 @@
 #include <current.h>
 #include <syscall.h>
 #include <endian.h>
+#include <copyinout.h>
 
 
 /*
@@ -208,6 +209,37 @@ syscall(struct trapframe *tf)
         err = sys_sbrk((int)tf->tf_a0, &retval);
         break;
 
+	    case SYS_mmap:
+		{
+			/*
+			 * addr, len, prot and flags come in a0-a3. The fd
+			 * is on the stack after them, and the 64-bit offset
+			 * after that, aligned.
+			 */
+			int fd;
+			uint32_t offset[2];
+			uint64_t off;
+
+			err = copyin((const_userptr_t)(tf->tf_sp + 16), &fd,
+				     sizeof(fd));
+			if (err) {
+				break;
+			}
+			err = copyin((const_userptr_t)(tf->tf_sp + 24), offset,
+				     sizeof(offset));
+			if (err) {
+				break;
+			}
+			join32to64(offset[0], offset[1], &off);
+			err = sys_mmap((userptr_t)tf->tf_a0, tf->tf_a1,
+				       tf->tf_a2, tf->tf_a3, fd, off, &retval);
+		}
+		break;
+
+	    case SYS_munmap:
+		err = sys_munmap((userptr_t)tf->tf_a0, tf->tf_a1);
+		break;
+
 	    default:
 		kprintf("Unknown syscall %d\n", callno);
 		err = ENOSYS;
@@ -103,6 +103,12 @@ free_kpages(vaddr_t addr)
 	(void)addr;
 }
 
+void
+vm_sample_references(void)
+{
+	/* nothing - dumbvm never evicts. */
+}
+
 void
 vm_tlbshootdown_all(void)
 {
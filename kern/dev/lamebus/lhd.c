@@ -37,8 +37,11 @@
 #include <uio.h>
 #include <membar.h>
 #include <synch.h>
+#include <thread.h>
+#include <current.h>
 #include <platform/bus.h>
 #include <vfs.h>
+#include <iostat.h>
 #include <lamebus/lhd.h>
 #include "autoconf.h"
 
@@ -60,6 +63,24 @@
 /* Buffer (offset within slot)  */
 #define LHD_BUFFER      32768
 
+/*
+ * A request waiting for (or using) the device. These live on the
+ * stack of the thread that made them.
+ */
+struct lhd_request {
+	uint32_t lr_sector;		/* first sector */
+	uint32_t lr_len;		/* number of sectors */
+	unsigned lr_pri;		/* IOPRI_* class */
+	unsigned lr_passed;		/* times others went first */
+	struct lhd_request *lr_next;	/* queue link */
+};
+
+/*
+ * Once this many other requests have gone ahead of one, it goes next
+ * no matter what.
+ */
+#define LHD_MAXPASSED	16
+
 /*
  * Shortcut for reading a register.
  */
@@ -179,6 +200,222 @@ lhd_reset(struct lhd_softc *lh)
 }
 #endif
 
+/*
+ * Start an operation on one sector. The card only ever does one
+ * sector per command, through its one-sector buffer at LHD_BUFFER
+ * (that's where the buffer sits in the slot, not how big it is).
+ * Must have the device (see lhd_submit).
+ */
+static
+void
+lhd_start(struct lhd_softc *lh, uint32_t sector, uint32_t statval)
+{
+	/* Tell it what sector we want... */
+	lhd_wreg(lh, LHD_REG_SECT, sector);
+
+	/* and start the operation. */
+	lhd_wreg(lh, LHD_REG_STAT, statval);
+}
+
+/*
+ * Write LEN sectors starting at SECTOR. While the card writes one
+ * sector, the next is copied in from the caller (which may be a user
+ * address and take a fault) into lh_stage, so between commands there
+ * is only a copy from lh_stage to the card.
+ */
+static
+int
+lhd_write(struct lhd_softc *lh, uint32_t sector, uint32_t len,
+	  struct uio *uio)
+{
+	uint32_t i;
+	int result;
+
+	result = uiomove(lh->lh_stage, LHD_SECTSIZE, uio);
+	if (result) {
+		return result;
+	}
+
+	for (i=0; i<len; i++) {
+		memcpy(lh->lh_buf, lh->lh_stage, LHD_SECTSIZE);
+		membar_store_store();
+		lhd_start(lh, sector+i, LHD_WORKING|LHD_ISWRITE);
+
+		/* Fetch the next sector while this one is going. */
+		if (i+1 < len) {
+			result = uiomove(lh->lh_stage, LHD_SECTSIZE, uio);
+		}
+
+		/* Now wait until the interrupt handler tells us we're done. */
+		P(lh->lh_done);
+		if (result == 0) {
+			result = lh->lh_result;
+		}
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Read LEN sectors starting at SECTOR. Each sector is copied off the
+ * card into lh_stage and the next one started before handing the
+ * data to the caller, so the card reads the next sector while we do
+ * that.
+ */
+static
+int
+lhd_read(struct lhd_softc *lh, uint32_t sector, uint32_t len,
+	 struct uio *uio)
+{
+	uint32_t i;
+	int result;
+
+	lhd_start(lh, sector, LHD_WORKING);
+
+	for (i=0; i<len; i++) {
+		/* Wait until the interrupt handler tells us we're done. */
+		P(lh->lh_done);
+		result = lh->lh_result;
+		if (result) {
+			return result;
+		}
+
+		membar_load_load();
+		memcpy(lh->lh_stage, lh->lh_buf, LHD_SECTSIZE);
+		membar_any_any();
+		if (i+1 < len) {
+			lhd_start(lh, sector+i+1, LHD_WORKING);
+		}
+
+		result = uiomove(lh->lh_stage, LHD_SECTSIZE, uio);
+		if (result) {
+			if (i+1 < len) {
+				/* Let the one we started finish. */
+				P(lh->lh_done);
+			}
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Request scheduling.
+ *
+ * Requests wait in lh_queue until the device is free and they are the
+ * one lhd_before ranks first. Then the request has the device for all
+ * its sectors, so they go to the disk back to back. The order is:
+ *
+ *    - a request passed over LHD_MAXPASSED times (the deadline), so
+ *      heavy traffic in one class or one place can't starve others;
+ *    - a request starting right where the head is, as it costs no
+ *      seek at all; this is how adjacent requests get merged, since
+ *      the card can't take more than a sector per command anyway;
+ *    - the most urgent class (journal, swap, normal, background);
+ *    - within a class, C-LOOK: the nearest request at or past the
+ *      head, sweeping toward the end of the disk, and then back to
+ *      the lowest-numbered one.
+ */
+
+/*
+ * True if A should go before B.
+ */
+static
+bool
+lhd_before(struct lhd_softc *lh, struct lhd_request *a,
+	   struct lhd_request *b)
+{
+	bool a_late, b_late, a_ahead, b_ahead;
+
+	a_late = a->lr_passed >= LHD_MAXPASSED;
+	b_late = b->lr_passed >= LHD_MAXPASSED;
+	if (a_late != b_late) {
+		return a_late;
+	}
+	if (a_late) {
+		return a->lr_passed > b->lr_passed;
+	}
+
+	if ((a->lr_sector == lh->lh_headpos) !=
+	    (b->lr_sector == lh->lh_headpos)) {
+		return a->lr_sector == lh->lh_headpos;
+	}
+
+	if (a->lr_pri != b->lr_pri) {
+		return a->lr_pri < b->lr_pri;
+	}
+
+	a_ahead = a->lr_sector >= lh->lh_headpos;
+	b_ahead = b->lr_sector >= lh->lh_headpos;
+	if (a_ahead != b_ahead) {
+		return a_ahead;
+	}
+	return a->lr_sector < b->lr_sector;
+}
+
+/*
+ * Choose the next request to run. Must hold lh_qlock.
+ */
+static
+struct lhd_request *
+lhd_pick(struct lhd_softc *lh)
+{
+	struct lhd_request *r, *best;
+
+	best = lh->lh_queue;
+	for (r = lh->lh_queue; r != NULL; r = r->lr_next) {
+		if (lhd_before(lh, r, best)) {
+			best = r;
+		}
+	}
+	return best;
+}
+
+/*
+ * Queue a request and wait until it has the device.
+ */
+static
+void
+lhd_submit(struct lhd_softc *lh, struct lhd_request *req)
+{
+	struct lhd_request **rp, *r;
+
+	lock_acquire(lh->lh_qlock);
+	req->lr_next = lh->lh_queue;
+	lh->lh_queue = req;
+
+	while (lh->lh_busy || lhd_pick(lh) != req) {
+		cv_wait(lh->lh_qcv, lh->lh_qlock);
+	}
+
+	for (rp = &lh->lh_queue; *rp != req; rp = &(*rp)->lr_next) {
+		/* nothing */
+	}
+	*rp = req->lr_next;
+	for (r = lh->lh_queue; r != NULL; r = r->lr_next) {
+		r->lr_passed++;
+	}
+	lh->lh_busy = true;
+	lock_release(lh->lh_qlock);
+}
+
+/*
+ * Give up the device when a request is done, and let the next go.
+ */
+static
+void
+lhd_complete(struct lhd_softc *lh, struct lhd_request *req)
+{
+	lock_acquire(lh->lh_qlock);
+	KASSERT(lh->lh_busy);
+	lh->lh_busy = false;
+	lh->lh_headpos = req->lr_sector + req->lr_len;
+	cv_broadcast(lh->lh_qcv, lh->lh_qlock);
+	lock_release(lh->lh_qlock);
+}
+
 /*
  * I/O function (for both reads and writes)
  */
@@ -192,8 +429,10 @@ lhd_io(struct device *d, struct uio *uio)
 	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
 	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
 	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
-	uint32_t i;
-	uint32_t statval = LHD_WORKING;
+	struct lhd_request req;
+	struct timespec start, started;
+	unsigned service, usecs;
+	bool iswrite = uio->uio_rw == UIO_WRITE;
 	int result;
 
 	/* Don't allow I/O that isn't sector-aligned. */
@@ -207,61 +446,43 @@ lhd_io(struct device *d, struct uio *uio)
 		return EINVAL;
 	}
 
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
+	if (len == 0) {
+		return 0;
 	}
 
-	/* Loop over all the sectors we were asked to do. */
-	for (i=0; i<len; i++) {
-
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
-
-		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
-		 */
-		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-			membar_store_store();
-			if (result) {
-				V(lh->lh_clear);
-				return result;
-			}
-		}
-
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
-
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
-
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
-
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
-
-		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
-		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			membar_load_load();
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-		}
+	/* Wait until it's our turn. */
+	iostat_start(&start);
+	req.lr_sector = sector;
+	req.lr_len = len;
+	req.lr_pri = curthread->t_iopri;
+	req.lr_passed = 0;
+	lhd_submit(lh, &req);
+	iostat_start(&started);
+
+	if (iswrite) {
+		result = lhd_write(lh, sector, len, uio);
+	}
+	else {
+		result = lhd_read(lh, sector, len, uio);
+	}
 
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
+	/* Let the next one go. */
+	lhd_complete(lh, &req);
 
-		/* If we failed, return the error. */
-		if (result) {
-			return result;
-		}
+	service = iostat_elapsed(&started);
+	usecs = iostat_done(IOHIST_DISK_IO, &start);
+	if (service > usecs) {
+		service = usecs;
+	}
+	iostat_add(iswrite ? IOSTAT_DISK_WRITES : IOSTAT_DISK_READS, 1);
+	iostat_add(iswrite ? IOSTAT_DISK_WSECTORS : IOSTAT_DISK_RSECTORS, len);
+	if (result) {
+		iostat_add(IOSTAT_DISK_ERRORS, 1);
 	}
+	iotrace(iswrite ? IOTRACE_WRITE : IOTRACE_READ, d->d_devnumber,
+		sector, len, usecs - service, service, result);
 
-	return 0;
+	return result;
 }
 
 static const struct device_ops lhd_devops = {
@@ -284,17 +505,28 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
+	/* And our staging area for the sector not on the card. */
+	lh->lh_stage = kmalloc(LHD_SECTSIZE);
+	if (lh->lh_stage == NULL) {
 		return ENOMEM;
 	}
+
+	/* Create the synchronization primitives. */
 	lh->lh_done = sem_create("lhd-done", 0);
 	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
-		return ENOMEM;
+		goto fail_stage;
+	}
+	lh->lh_qlock = lock_create("lhd-queue");
+	if (lh->lh_qlock == NULL) {
+		goto fail_done;
 	}
+	lh->lh_qcv = cv_create("lhd-queue");
+	if (lh->lh_qcv == NULL) {
+		goto fail_qlock;
+	}
+	lh->lh_queue = NULL;
+	lh->lh_busy = false;
+	lh->lh_headpos = 0;
 
 	/* Set up the VFS device structure. */
 	lh->lh_dev.d_ops = &lhd_devops;
@@ -305,4 +537,15 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 
 	/* Add the VFS device structure to the VFS device list. */
 	return vfs_adddev(name, &lh->lh_dev, 1);
+
+ fail_qlock:
+	lock_destroy(lh->lh_qlock);
+	lh->lh_qlock = NULL;
+ fail_done:
+	sem_destroy(lh->lh_done);
+	lh->lh_done = NULL;
+ fail_stage:
+	kfree(lh->lh_stage);
+	lh->lh_stage = NULL;
+	return ENOMEM;
 }
@@ -37,6 +37,8 @@
  */
 #define LHD_SECTSIZE  512
 
+struct lhd_request;	/* in lhd.c */
+
 /*
  * Hardware device data associated with lhd (LAMEbus hard disk)
  */
@@ -51,9 +53,16 @@ struct lhd_softc {
 	 */
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
+	void *lh_stage;			/* Next/last sector, off the card */
 	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+	struct semaphore *lh_done;	/* Synchronization with irq */
+
+	/* Request queue */
+	struct lock *lh_qlock;		/* protects the following */
+	struct cv *lh_qcv;		/* device or queue changed */
+	struct lhd_request *lh_queue;	/* waiting requests, unordered */
+	bool lh_busy;			/* a request has the device */
+	uint32_t lh_headpos;		/* sector after the last one done */
 
 	struct device lh_dev;		/* VFS device structure */
 };
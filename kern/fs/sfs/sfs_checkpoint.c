@@ -0,0 +1,387 @@
+/*
+ * Checkpointing.
+ *
+ * The journal can be trimmed up to the oldest record something still
+ * depends on: the first record of a running transaction, the oldest
+ * change to a dirty buffer, or the oldest unwritten change to the
+ * freemap. A checkpoint writes out the oldest of those buffers (and
+ * the freemap, if it's the one in the way) to move that point
+ * forward, and then trims to it.
+ *
+ * Checkpoints are taken by a checkpoint thread, one per volume, so
+ * that no file system operation has to stop in the middle and take
+ * one. sfs_checkpoint_poll, called after each journal record, wakes
+ * it once the journal is SFS_CKPT_START percent full. If it falls
+ * behind and the journal reaches SFS_CKPT_FULL percent, new
+ * transactions wait for it at sfs_checkpoint_throttle instead of
+ * running the journal head into the tail, which is a panic.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <thread.h>
+#include <current.h>
+#include <buf.h>
+#include <iostat.h>
+#include <spinlock.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+/* Journal fill levels, in percent */
+#define SFS_CKPT_START	50	/* start checkpointing */
+#define SFS_CKPT_FULL	85	/* hold back new transactions */
+
+/* Most buffers written out per checkpoint */
+#define SFS_CKPT_BATCH	32
+
+////////////////////////////////////////////////////////////
+// finding the tail
+
+/*
+ * None of the things that hold the tail back is searched for; each is
+ * kept so that its oldest LSN is at the front:
+ *
+ *  - Transactions go on the list sfs_transhead/sfs_transtail from
+ *    sfs_trans_callback, which runs under the journal lock as the LSN
+ *    is handed out, so the list is in LSN order (sfs_trans_oldest).
+ *
+ *  - Dirty buffers with journaled changes are on the list
+ *    sfs_dirtyhead/sfs_dirtytail, in order of oldest_lsn. A buffer
+ *    joins when its first change is journaled (sfs_dirty_insert, from
+ *    sfs_jphys_write_wrapper) and leaves when it's written or
+ *    detached (sfs_dirty_remove). LSNs are handed out in order, so it
+ *    goes on at or very near the end; we search back from there
+ *    because two threads can get their LSNs and reach here in
+ *    opposite orders.
+ *
+ *  - The freemap is written as a whole and has one oldest LSN.
+ *
+ * The list is under sfs_dirtylock, a spinlock, because buffers are
+ * detached with buffer cache locks held (see buffer_reclaim).
+ */
+
+void
+sfs_dirty_insert(struct sfs_fs *sfs, struct b_fsdata *bd)
+{
+	struct b_fsdata *after;
+
+	KASSERT(bd->oldest_lsn != 0);
+
+	spinlock_acquire(&sfs->sfs_dirtylock);
+	after = sfs->sfs_dirtytail;
+	while (after != NULL && after->oldest_lsn > bd->oldest_lsn) {
+		after = after->dirty_prev;
+	}
+	bd->dirty_prev = after;
+	if (after == NULL) {
+		bd->dirty_next = sfs->sfs_dirtyhead;
+		sfs->sfs_dirtyhead = bd;
+	}
+	else {
+		bd->dirty_next = after->dirty_next;
+		after->dirty_next = bd;
+	}
+	if (bd->dirty_next == NULL) {
+		sfs->sfs_dirtytail = bd;
+	}
+	else {
+		bd->dirty_next->dirty_prev = bd;
+	}
+	spinlock_release(&sfs->sfs_dirtylock);
+}
+
+void
+sfs_dirty_remove(struct sfs_fs *sfs, struct b_fsdata *bd)
+{
+	KASSERT(bd->oldest_lsn != 0);
+
+	spinlock_acquire(&sfs->sfs_dirtylock);
+	if (bd->dirty_prev == NULL) {
+		KASSERT(sfs->sfs_dirtyhead == bd);
+		sfs->sfs_dirtyhead = bd->dirty_next;
+	}
+	else {
+		bd->dirty_prev->dirty_next = bd->dirty_next;
+	}
+	if (bd->dirty_next == NULL) {
+		KASSERT(sfs->sfs_dirtytail == bd);
+		sfs->sfs_dirtytail = bd->dirty_prev;
+	}
+	else {
+		bd->dirty_next->dirty_prev = bd->dirty_prev;
+	}
+	bd->dirty_prev = bd->dirty_next = NULL;
+	spinlock_release(&sfs->sfs_dirtylock);
+}
+
+/*
+ * The oldest LSN anything still depends on; 0 if nothing does.
+ */
+static
+sfs_lsn_t
+sfs_checkpoint_taillsn(struct sfs_fs *sfs)
+{
+	sfs_lsn_t oldest_lsn, lsn;
+
+	oldest_lsn = sfs_trans_oldest(sfs);
+
+	spinlock_acquire(&sfs->sfs_dirtylock);
+	if (sfs->sfs_dirtyhead != NULL) {
+		lsn = sfs->sfs_dirtyhead->oldest_lsn;
+		if (oldest_lsn == 0 || lsn < oldest_lsn) {
+			oldest_lsn = lsn;
+		}
+	}
+	spinlock_release(&sfs->sfs_dirtylock);
+
+	lsn = sfs->oldest_freemap_lsn;
+	if (lsn != 0 && (oldest_lsn == 0 || lsn < oldest_lsn)) {
+		oldest_lsn = lsn;
+	}
+
+	return oldest_lsn;
+}
+
+/*
+ * Trim the journal as far as the current state allows. This is the
+ * whole checkpoint when it has to be done inline (see
+ * sfs_checkpoint_poll).
+ */
+int
+sfs_checkpoint(struct sfs_fs *sfs)
+{
+	sfs_lsn_t taillsn, nextlsn;
+
+	/*
+	 * Peek first: anything that starts depending on the journal
+	 * after this does so at nextlsn or later. (A change to a buffer
+	 * is journaled before the buffer goes on the dirty list, but
+	 * it's made inside a transaction that's already holding the
+	 * tail back.)
+	 */
+	nextlsn = sfs_jphys_peeknextlsn(sfs);
+	taillsn = sfs_checkpoint_taillsn(sfs);
+	if (taillsn == 0) {
+		taillsn = nextlsn;
+	}
+
+	/* Don't write a trim record that changes nothing. */
+	if (taillsn > sfs->sfs_ckpttail) {
+		sfs_jphys_trim(sfs, taillsn);
+		sfs->sfs_ckpttail = taillsn;
+	}
+
+	// We sucessfully took a checkpoint! Clear the odometer.
+	sfs_jphys_clearodometer(sfs->sfs_jphys);
+	iostat_add(IOSTAT_CHECKPOINTS, 1);
+	return 0;
+}
+
+/*
+ * Write out the oldest dirty buffers, oldest first, so the tail can
+ * move past them; and the freemap, if it's among the oldest.
+ *
+ * Changes made since the oldest running transaction began aren't
+ * worth writing out yet: the transaction holds the tail back anyway.
+ */
+static
+void
+sfs_checkpoint_flush(struct sfs_fs *sfs)
+{
+	daddr_t blocks[SFS_CKPT_BATCH];
+	struct b_fsdata *bd;
+	sfs_lsn_t limit, lsn;
+	unsigned num, i;
+	int result;
+
+	/* flush what's older than this; 0 for everything */
+	limit = sfs_trans_oldest(sfs);
+
+	lsn = sfs->oldest_freemap_lsn;
+	if (lsn != 0 && (limit == 0 || lsn < limit)) {
+		result = sfs_writefreemap(sfs);
+		if (result) {
+			kprintf("sfs: %s: checkpoint: writing freemap: %s\n",
+				sfs->sfs_sb.sb_volname, strerror(result));
+		}
+	}
+
+	num = 0;
+	spinlock_acquire(&sfs->sfs_dirtylock);
+	for (bd = sfs->sfs_dirtyhead; bd != NULL && num < SFS_CKPT_BATCH;
+	     bd = bd->dirty_next) {
+		if (limit != 0 && bd->oldest_lsn >= limit) {
+			break;
+		}
+		blocks[num++] = bd->diskblock;
+	}
+	spinlock_release(&sfs->sfs_dirtylock);
+
+	for (i = 0; i < num; i++) {
+		/*
+		 * The buffer may have been written, dropped, or even
+		 * replaced (and not yet read in) since we looked;
+		 * buffer_flush copes with all of that.
+		 */
+		result = buffer_flush(&sfs->sfs_absfs, blocks[i], 0);
+		if (result) {
+			kprintf("sfs: %s: checkpoint: writing block %u: %s\n",
+				sfs->sfs_sb.sb_volname,
+				(unsigned)blocks[i], strerror(result));
+		}
+	}
+}
+
+/*
+ * The checkpoint thread.
+ */
+static
+void
+sfs_checkpoint_thread(void *data1, unsigned long data2)
+{
+	struct sfs_fs *sfs = data1;
+	sfs_lsn_t before;
+
+	(void)data2;
+
+	lock_acquire(sfs->sfs_ckptlock);
+	while (1) {
+		while (!sfs->sfs_ckptquit && !sfs->sfs_ckptwanted) {
+			cv_wait(sfs->sfs_ckptcv, sfs->sfs_ckptlock);
+		}
+		if (sfs->sfs_ckptquit) {
+			break;
+		}
+		sfs->sfs_ckptwanted = false;
+		lock_release(sfs->sfs_ckptlock);
+
+		before = sfs->sfs_ckpttail;
+		sfs_checkpoint_flush(sfs);
+		sfs_checkpoint(sfs);
+
+		lock_acquire(sfs->sfs_ckptlock);
+		sfs->sfs_ckptprogress = sfs->sfs_ckpttail > before;
+		sfs->sfs_ckptgen++;
+		cv_broadcast(sfs->sfs_ckptdonecv, sfs->sfs_ckptlock);
+	}
+	sfs->sfs_ckptrunning = false;
+	cv_broadcast(sfs->sfs_ckptdonecv, sfs->sfs_ckptlock);
+	lock_release(sfs->sfs_ckptlock);
+}
+
+/*
+ * Start the checkpoint thread, at mount time. If it can't be started
+ * checkpoints are taken inline, as they once were.
+ */
+int
+sfs_checkpoint_start(struct sfs_fs *sfs)
+{
+	int result;
+
+	lock_acquire(sfs->sfs_ckptlock);
+	KASSERT(!sfs->sfs_ckptrunning);
+	sfs->sfs_ckptquit = false;
+	sfs->sfs_ckptwanted = false;
+	sfs->sfs_ckptrunning = true;
+	lock_release(sfs->sfs_ckptlock);
+
+	result = thread_fork("sfs_ckpt", NULL, sfs_checkpoint_thread, sfs, 0);
+	if (result) {
+		lock_acquire(sfs->sfs_ckptlock);
+		sfs->sfs_ckptrunning = false;
+		lock_release(sfs->sfs_ckptlock);
+		return result;
+	}
+	return 0;
+}
+
+/*
+ * Stop the checkpoint thread and wait for it to finish.
+ */
+void
+sfs_checkpoint_stop(struct sfs_fs *sfs)
+{
+	lock_acquire(sfs->sfs_ckptlock);
+	sfs->sfs_ckptquit = true;
+	cv_signal(sfs->sfs_ckptcv, sfs->sfs_ckptlock);
+	while (sfs->sfs_ckptrunning) {
+		cv_wait(sfs->sfs_ckptdonecv, sfs->sfs_ckptlock);
+	}
+	lock_release(sfs->sfs_ckptlock);
+}
+
+/*
+ * Called after writing a journal record: wake the checkpoint thread
+ * if the journal is getting full. Doesn't wait.
+ *
+ * If the last checkpoint couldn't get the journal below the mark,
+ * another one won't either until the head has moved on at least a
+ * block (the odometer counts blocks since the last checkpoint).
+ */
+void
+sfs_checkpoint_poll(struct sfs_fs *sfs)
+{
+	bool running;
+
+	if (sfs_jphys_fill(sfs) < SFS_CKPT_START ||
+	    sfs_jphys_getodometer(sfs->sfs_jphys) == 0) {
+		return;
+	}
+
+	lock_acquire(sfs->sfs_ckptlock);
+	running = sfs->sfs_ckptrunning;
+	if (running && !sfs->sfs_ckptwanted) {
+		sfs->sfs_ckptwanted = true;
+		cv_signal(sfs->sfs_ckptcv, sfs->sfs_ckptlock);
+	}
+	lock_release(sfs->sfs_ckptlock);
+
+	if (!running) {
+		/*
+		 * No thread. The caller is in the middle of an
+		 * operation and may be holding buffers, so don't
+		 * write any out; just trim.
+		 */
+		sfs_checkpoint(sfs);
+	}
+}
+
+/*
+ * Called at the start of a transaction: if the journal is nearly
+ * full, wait for checkpoints to make room.
+ *
+ * Only top-level operations wait. A thread with buffers reserved is
+ * already inside another operation (e.g. a reclaim triggered from
+ * remove) and may hold a buffer the checkpoint needs to write. And
+ * if a checkpoint frees nothing, presumably because of transactions
+ * no checkpoint can get past, give up and let the caller go on
+ * rather than wait for something that isn't coming.
+ */
+void
+sfs_checkpoint_throttle(struct sfs_fs *sfs)
+{
+	unsigned gen;
+
+	if (curthread->t_did_reserve_buffers ||
+	    sfs_jphys_fill(sfs) < SFS_CKPT_FULL) {
+		return;
+	}
+
+	iostat_add(IOSTAT_CHECKPOINT_WAITS, 1);
+
+	lock_acquire(sfs->sfs_ckptlock);
+	while (sfs->sfs_ckptrunning && sfs_jphys_fill(sfs) >= SFS_CKPT_FULL) {
+		gen = sfs->sfs_ckptgen;
+		sfs->sfs_ckptwanted = true;
+		cv_signal(sfs->sfs_ckptcv, sfs->sfs_ckptlock);
+		while (sfs->sfs_ckptrunning && sfs->sfs_ckptgen == gen) {
+			cv_wait(sfs->sfs_ckptdonecv, sfs->sfs_ckptlock);
+		}
+		if (!sfs->sfs_ckptprogress) {
+			break;
+		}
+	}
+	lock_release(sfs->sfs_ckptlock);
+}
@@ -89,6 +89,17 @@ sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
 	/* Pointer to our freemap data in memory. */
 	freemapdata = bitmap_getdata(sfs->sfs_freemap);
 
+	/*
+	 * Before writing, flush the journal through the newest change
+	 * to the freemap (write-ahead), and then it no longer holds
+	 * back the journal tail.
+	 */
+	if (rw == UIO_WRITE) {
+		sfs_jphys_flush(sfs, sfs->newest_freemap_lsn);
+		sfs->newest_freemap_lsn = 0;
+		sfs->oldest_freemap_lsn = 0;
+	}
+
 	/* For each block in the free block bitmap... */
 	for (j=0; j<freemapblocks; j++) {
 
@@ -102,9 +113,6 @@ sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
 					       ptr, SFS_BLOCKSIZE);
 		}
 		else {
-			sfs->newest_freemap_lsn = 0;
-			sfs->oldest_freemap_lsn = 0;
-			sfs_jphys_flush(sfs, sfs->newest_freemap_lsn);
 			result = sfs_writeblock(&sfs->sfs_absfs,
 						SFS_FREEMAP_START + j, NULL,
 						ptr, SFS_BLOCKSIZE);
@@ -118,6 +126,26 @@ sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
 	return 0;
 }
 
+/*
+ * Write out the freemap if it's dirty. For the checkpointer, when
+ * unwritten freemap changes are what's holding back the journal tail.
+ */
+int
+sfs_writefreemap(struct sfs_fs *sfs)
+{
+	int result = 0;
+
+	lock_acquire(sfs->sfs_freemaplock);
+	if (sfs->sfs_freemapdirty) {
+		result = sfs_freemapio(sfs, UIO_WRITE);
+		if (result == 0) {
+			sfs->sfs_freemapdirty = false;
+		}
+	}
+	lock_release(sfs->sfs_freemaplock);
+	return result;
+}
+
 /*
  * Sync routine. This is what gets invoked if you do FS_SYNC on the
  * sfs filesystem structure.
@@ -220,6 +248,8 @@ sfs_attachbuf(struct fs *fs, daddr_t diskblock, struct buf *buf)
 	newdata->oldest_lsn = 0;
 	newdata->newest_lsn = 0;
 	newdata->buf = buf;
+	newdata->dirty_prev = NULL;
+	newdata->dirty_next = NULL;
 
 	olddata = buffer_set_fsdata(buf, (void*)newdata);
 	KASSERT(olddata == NULL);
@@ -232,12 +262,15 @@ void
 sfs_detachbuf(struct fs *fs, daddr_t diskblock, struct buf *buf)
 {
 	struct sfs_fs *sfs = fs->fs_data;
-	void *bufdata;
+	struct b_fsdata *bufdata;
 
-	(void)sfs;
 	(void)diskblock;
 
 	bufdata = buffer_set_fsdata(buf, NULL);
+	if (bufdata->oldest_lsn != 0) {
+		/* invalidated while dirty */
+		sfs_dirty_remove(sfs, bufdata);
+	}
 	kfree(bufdata);
 }
 
@@ -271,6 +304,14 @@ void
 sfs_fs_destroy(struct sfs_fs *sfs)
 {
 	sfs_jphys_destroy(sfs->sfs_jphys);
+	KASSERT(!sfs->sfs_ckptrunning);
+	KASSERT(sfs->sfs_dirtyhead == NULL);
+	spinlock_cleanup(&sfs->sfs_dirtylock);
+	sfs_trans_cleanup(sfs);
+	spinlock_cleanup(&sfs->sfs_translock);
+	cv_destroy(sfs->sfs_ckptdonecv);
+	cv_destroy(sfs->sfs_ckptcv);
+	lock_destroy(sfs->sfs_ckptlock);
 	lock_destroy(sfs->sfs_renamelock);
 	lock_destroy(sfs->sfs_freemaplock);
 	lock_destroy(sfs->sfs_vnlock);
@@ -296,6 +337,18 @@ sfs_unmount(struct fs *fs)
 	int result;
 	unsigned ix, i, num;
 
+	/*
+	 * Stop the checkpoint thread before taking any locks it might
+	 * need. It may have trimmed since VFS synced us, so flush again
+	 * to leave the journal empty for sfs_jphys_stopwriting.
+	 */
+	sfs_checkpoint_stop(sfs);
+	result = sfs_jphys_flushall(sfs);
+	if (result) {
+		sfs_checkpoint_start(sfs);
+		return result;
+	}
+
 	result = sfs_getgraveyard(&sfs->sfs_absfs, &grave_node);
 	if (result) {
 		panic("Gravyard is fucked up");
@@ -328,6 +381,7 @@ sfs_unmount(struct fs *fs)
 	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
 		lock_release(sfs->sfs_freemaplock);
 		lock_release(sfs->sfs_vnlock);
+		sfs_checkpoint_start(sfs);
 		return EBUSY;
 	}
 
@@ -415,10 +469,11 @@ sfs_fs_create(void)
 		goto cleanup_object;
 	}
 
-	sfs->sfs_transactions = array_create();
-	if (sfs->sfs_transactions == NULL) {
-		goto cleanup_trans;
-	}
+	/* transaction table */
+	spinlock_init(&sfs->sfs_translock);
+	sfs->sfs_transhead = NULL;
+	sfs->sfs_transtail = NULL;
+	sfs->sfs_transfree = NULL;
 
 	/* freemap */
 	sfs->sfs_freemap = NULL;
@@ -427,11 +482,6 @@ sfs_fs_create(void)
 	sfs->oldest_freemap_lsn = 0;
 
 	/* locks */
-	sfs->trans_lock = lock_create("trans_lock");
-	if (sfs->trans_lock == NULL) {
-		goto cleanup_translock;
-	}
-
 	sfs->sfs_vnlock = lock_create("sfs_vnlock");
 	if (sfs->sfs_vnlock == NULL) {
 		goto cleanup_vnodes;
@@ -445,26 +495,53 @@ sfs_fs_create(void)
 		goto cleanup_freemaplock;
 	}
 
+	/* checkpoint thread; started at mount */
+	sfs->sfs_ckptlock = lock_create("sfs_ckptlock");
+	if (sfs->sfs_ckptlock == NULL) {
+		goto cleanup_renamelock;
+	}
+	sfs->sfs_ckptcv = cv_create("sfs_ckpt");
+	if (sfs->sfs_ckptcv == NULL) {
+		goto cleanup_ckptlock;
+	}
+	sfs->sfs_ckptdonecv = cv_create("sfs_ckptdone");
+	if (sfs->sfs_ckptdonecv == NULL) {
+		goto cleanup_ckptcv;
+	}
+	sfs->sfs_ckptrunning = false;
+	sfs->sfs_ckptquit = false;
+	sfs->sfs_ckptwanted = false;
+	sfs->sfs_ckptprogress = false;
+	sfs->sfs_ckptgen = 0;
+	sfs->sfs_ckpttail = 0;
+
+	spinlock_init(&sfs->sfs_dirtylock);
+	sfs->sfs_dirtyhead = NULL;
+	sfs->sfs_dirtytail = NULL;
+
 	/* journal */
 	sfs->sfs_jphys = sfs_jphys_create();
 	if (sfs->sfs_jphys == NULL) {
-		goto cleanup_renamelock;
+		goto cleanup_ckptdonecv;
 	}
 
 	return sfs;
 
+cleanup_ckptdonecv:
+	cv_destroy(sfs->sfs_ckptdonecv);
+cleanup_ckptcv:
+	cv_destroy(sfs->sfs_ckptcv);
+cleanup_ckptlock:
+	lock_destroy(sfs->sfs_ckptlock);
 cleanup_renamelock:
 	lock_destroy(sfs->sfs_renamelock);
 cleanup_freemaplock:
 	lock_destroy(sfs->sfs_freemaplock);
 cleanup_vnlock:
 	lock_destroy(sfs->sfs_vnlock);
-cleanup_translock:
-	lock_destroy(sfs->trans_lock);
 cleanup_vnodes:
 	vnodearray_destroy(sfs->sfs_vnodes);
-cleanup_trans:
-	array_destroy(sfs->sfs_transactions);
+	spinlock_cleanup(&sfs->sfs_translock);
 cleanup_object:
 	kfree(sfs);
 fail:
@@ -664,7 +741,7 @@ sfs_recover_operation(struct sfs_fs *sfs, bool redo, void* recptr, struct bitmap
 			kprintf("\n");
 
 			// Compute checksum
-			block_checksum = checksum(data);
+			block_checksum = sfs_checksum(sfs, data);
 
 			// If may be garbage, zero out
 			bool new_alloc = jentry->new_alloc;
@@ -801,6 +878,16 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 		return EINVAL;
 	}
 
+	if (sfs->sfs_sb.sb_flags & ~SFS_SBF_ALL) {
+		kprintf("sfs: Unknown flags in superblock (0x%x)\n",
+			sfs->sfs_sb.sb_flags & ~SFS_SBF_ALL);
+		lock_release(sfs->sfs_vnlock);
+		lock_release(sfs->sfs_freemaplock);
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
+		return EINVAL;
+	}
+
 	if (sfs->sfs_sb.sb_journalblocks >= sfs->sfs_sb.sb_nblocks) {
 		kprintf("sfs: warning - journal takes up whole volume\n");
 	}
@@ -1162,6 +1249,14 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	// Done!!! Yay!!! Nothing is broken!!! 
 	sfs_jphys_trim(sfs, sfs_jphys_peeknextlsn(sfs));
 
+	/* Checkpoints are taken in the background from here on. */
+	result = sfs_checkpoint_start(sfs);
+	if (result) {
+		kprintf("sfs: %s: no checkpoint thread, checkpointing "
+			"inline: %s\n", sfs->sfs_sb.sb_volname,
+			strerror(result));
+	}
+
 	/* Hand back the abstract fs */
 	*ret = &sfs->sfs_absfs;
 	return 0;
@@ -66,6 +66,9 @@ sfs_vnode_create(uint32_t ino, unsigned type)
 	sv->sv_type = type;
 	sv->sv_dinobuf = NULL;
 	sv->sv_dinobufcount = 0;
+	sv->sv_ra_next = 0;
+	sv->sv_ra_window = 0;
+	sv->sv_ra_issued = 0;
 	return sv;
 }
 
@@ -203,7 +206,7 @@ sfs_reclaim(struct vnode *v)
 		}
 		reserve_buffers(SFS_BLOCKSIZE);
 	} else {
-		unreserve_buffers(SFS_BLOCKSIZE);
+		unreserve_buffers_nested(SFS_BLOCKSIZE);
 		result = sfs_getgraveyard(&sfs->sfs_absfs, &grave_node);
 		if (result) {
 			panic("Gravyard is fucked up");
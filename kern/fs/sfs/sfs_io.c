@@ -40,6 +40,8 @@
 #include <vfs.h>
 #include <buf.h>
 #include <device.h>
+#include <thread.h>
+#include <current.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -99,7 +101,7 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 }
 
 /*
- * Read a block.
+ * Read a block, or a cluster of consecutive blocks.
  */
 int
 sfs_readblock(struct fs *fs, daddr_t block, void *data, size_t len)
@@ -108,14 +110,16 @@ sfs_readblock(struct fs *fs, daddr_t block, void *data, size_t len)
 	struct iovec iov;
 	struct uio ku;
 
-	KASSERT(len == SFS_BLOCKSIZE);
+	KASSERT(len == SFS_BLOCKSIZE || len == SFS_CLUSTERSIZE);
 
-	SFSUIO(&iov, &ku, data, block, UIO_READ);
+	uio_kinit(&iov, &ku, data, len, ((off_t)block)*SFS_BLOCKSIZE,
+		  UIO_READ);
 	return sfs_rwblock(sfs, &ku);
 }
 
 /*
- * Write a block.
+ * Write a block, or a cluster of consecutive blocks. Clusters only
+ * ever hold file data, never the journal.
  */
 int
 sfs_writeblock(struct fs *fs, daddr_t block, void *fsbufdata,
@@ -125,12 +129,14 @@ sfs_writeblock(struct fs *fs, daddr_t block, void *fsbufdata,
 	struct iovec iov;
 	struct uio ku;
 	bool isjournal;
+	unsigned oldpri;
 	int result;
 	struct b_fsdata* b_fsdata = (struct b_fsdata*)fsbufdata;
 
-	KASSERT(len == SFS_BLOCKSIZE);
+	KASSERT(len == SFS_BLOCKSIZE || len == SFS_CLUSTERSIZE);
 
 	isjournal = sfs_block_is_journal(sfs, block);
+	KASSERT(!isjournal || len == SFS_BLOCKSIZE);
 	//kprintf("Writeblock metadata: %p\n", fsbufdata);
 
 	if (isjournal) {
@@ -166,18 +172,28 @@ sfs_writeblock(struct fs *fs, daddr_t block, void *fsbufdata,
 		//kprintf("FLUSH (daddr %d): lsn %lld", b_fsdata->diskblock, b_fsdata->newest_lsn);
 		sfs_jphys_flush(sfs, b_fsdata->newest_lsn);
 		//kprintf("...Done.\n\n");
-		b_fsdata->newest_lsn = 0;
-		b_fsdata->oldest_lsn = 0;
 	}
 
-	SFSUIO(&iov, &ku, data, block, UIO_WRITE);
+	/* Everything else waits on the journal, so it goes first */
+	oldpri = curthread->t_iopri;
+	if (isjournal) {
+		curthread->t_iopri = IOPRI_JOURNAL;
+	}
+	uio_kinit(&iov, &ku, data, len, ((off_t)block)*SFS_BLOCKSIZE,
+		  UIO_WRITE);
 	result = sfs_rwblock(sfs, &ku);
+	curthread->t_iopri = oldpri;
 	if (result) {
 		return result;
 	}
 
 	if (isjournal) {
 		sfs_wrote_journal_block(sfs, block);
+	} else if (b_fsdata != NULL && b_fsdata->oldest_lsn != 0) {
+		/* on disk now; it no longer holds back the journal tail */
+		sfs_dirty_remove(sfs, b_fsdata);
+		b_fsdata->newest_lsn = 0;
+		b_fsdata->oldest_lsn = 0;
 	}
 
 	return 0;
@@ -187,6 +203,108 @@ sfs_writeblock(struct fs *fs, daddr_t block, void *fsbufdata,
 //
 // File-level I/O
 
+/*
+ * Check whether the aligned cluster of file blocks around FILEBLOCK
+ * (which is at DISKBLOCK) lies on an equally aligned run of disk
+ * blocks, so that it can be cached as one buffer.
+ *
+ * Locking: must hold vnode lock.
+ */
+static
+int
+sfs_cluster_contiguous(struct sfs_vnode *sv, uint32_t fileblock,
+		       daddr_t diskblock, bool *ret)
+{
+	uint32_t firstfb, i;
+	daddr_t firstdb, block;
+	int result;
+
+	*ret = false;
+	if (fileblock % SFS_CLUSTERBLOCKS != diskblock % SFS_CLUSTERBLOCKS) {
+		return 0;
+	}
+	firstfb = fileblock - fileblock % SFS_CLUSTERBLOCKS;
+	firstdb = diskblock - diskblock % SFS_CLUSTERBLOCKS;
+
+	for (i=0; i<SFS_CLUSTERBLOCKS; i++) {
+		if (firstfb + i == fileblock) {
+			continue;
+		}
+		result = sfs_bmap(sv, firstfb + i, false, &block);
+		if (result) {
+			return result;
+		}
+		if (block != firstdb + i) {
+			return 0;
+		}
+	}
+	*ret = true;
+	return 0;
+}
+
+/*
+ * Get the buffer holding a block of file data, and the offset of the
+ * block within it.
+ *
+ * If the block's cluster is laid out contiguously on disk, the whole
+ * cluster is read as one buffer, so sequential reads take one disk
+ * transfer per cluster. Otherwise this is an ordinary one-block
+ * buffer. A caller that will overwrite the whole block (DOREAD false)
+ * gets a cluster only if one is cached already, since reading the rest
+ * of the cluster just to write one block would cost more than it saves.
+ *
+ * Locking: must hold vnode lock.
+ *
+ * Requires up to 2 buffers, one of which may be a cluster.
+ */
+static
+int
+sfs_databuf(struct sfs_vnode *sv, uint32_t fileblock, daddr_t diskblock,
+	    bool doread, struct buf **ret, uint32_t *offset)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	size_t cached;
+	bool cluster;
+	int result;
+
+	cached = buffer_cached_size(&sfs->sfs_absfs, diskblock);
+	if (cached == SFS_CLUSTERSIZE) {
+		cluster = true;
+	}
+	else if (cached == SFS_BLOCKSIZE || !doread) {
+		cluster = false;
+	}
+	else {
+		result = sfs_cluster_contiguous(sv, fileblock, diskblock,
+						&cluster);
+		if (result) {
+			return result;
+		}
+	}
+
+	if (cluster) {
+		*offset = (diskblock % SFS_CLUSTERBLOCKS) * SFS_BLOCKSIZE;
+		result = buffer_read(&sfs->sfs_absfs,
+				     diskblock - diskblock % SFS_CLUSTERBLOCKS,
+				     SFS_CLUSTERSIZE, ret);
+		if (result != EBUSY) {
+			return result;
+		}
+		/*
+		 * The cached cluster went away and the one we read in
+		 * place of it would cover a block we're holding (the
+		 * inode, say). Just use the one block.
+		 */
+	}
+
+	*offset = 0;
+	if (doread) {
+		return buffer_read(&sfs->sfs_absfs, diskblock, SFS_BLOCKSIZE,
+				   ret);
+	}
+	return buffer_get(&sfs->sfs_absfs, diskblock, SFS_BLOCKSIZE, ret);
+}
+
 /*
  * Do I/O to a block of a file that doesn't cover the whole block.  We
  * need to read in the original block first, even if we're writing, so
@@ -208,7 +326,7 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	struct buf *iobuffer;
 	unsigned char *ioptr;
 	daddr_t diskblock;
-	uint32_t fileblock;
+	uint32_t fileblock, bufoffset;
 	int result;
 	unsigned new_checksum = 0;
 
@@ -241,8 +359,8 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 		/*
 		 * Read the block.
 		 */
-		result = buffer_read(&sfs->sfs_absfs, diskblock, SFS_BLOCKSIZE,
-				     &iobuffer);
+		result = sfs_databuf(sv, fileblock, diskblock, true,
+				     &iobuffer, &bufoffset);
 		if (result) {
 			return result;
 		}
@@ -251,7 +369,7 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	/*
 	 * Now perform the requested operation into/out of the buffer.
 	 */
-	ioptr = buffer_map(iobuffer);
+	ioptr = (unsigned char *)buffer_map(iobuffer) + bufoffset;
 	result = uiomove(ioptr+skipstart, len, uio);
 	if (result) {
 		buffer_release(iobuffer);
@@ -263,7 +381,7 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	 */
 	if (uio->uio_rw == UIO_WRITE) {
 		// Compute checksum and journal
-		new_checksum = checksum(ioptr);
+		new_checksum = sfs_checksum(sfs, ioptr);
 		sfs_jphys_write_wrapper(sfs, NULL, 
 			jentry_block_write(diskblock, new_checksum, false));
 
@@ -287,9 +405,9 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 	struct buf *iobuf;
-	void *ioptr;
+	unsigned char *ioptr;
 	daddr_t diskblock;
-	uint32_t fileblock;
+	uint32_t fileblock, bufoffset;
 	int result;
 	bool doalloc = (uio->uio_rw==UIO_WRITE);
 	unsigned new_checksum = 0;
@@ -316,14 +434,8 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 		return uiomovezeros(SFS_BLOCKSIZE, uio);
 	}
 
-	if (uio->uio_rw == UIO_READ) {
-		result = buffer_read(&sfs->sfs_absfs, diskblock, SFS_BLOCKSIZE,
-				     &iobuf);
-	}
-	else {
-		result = buffer_get(&sfs->sfs_absfs, diskblock, SFS_BLOCKSIZE,
-				    &iobuf);
-	}
+	result = sfs_databuf(sv, fileblock, diskblock,
+			     uio->uio_rw == UIO_READ, &iobuf, &bufoffset);
 	if (result) {
 		return result;
 	}
@@ -331,7 +443,7 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 	/*
 	 * Do the I/O into the buffer.
 	 */
-	ioptr = buffer_map(iobuf);
+	ioptr = (unsigned char *)buffer_map(iobuf) + bufoffset;
 	result = uiomove(ioptr, SFS_BLOCKSIZE, uio);
 	if (result) {
 		buffer_release(iobuf);
@@ -339,7 +451,7 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 	}
 
 	if (uio->uio_rw == UIO_WRITE) {
-		new_checksum = checksum(ioptr);
+		new_checksum = sfs_checksum(sfs, ioptr);
 		sfs_jphys_write_wrapper(sfs, NULL, 
 			jentry_block_write(diskblock, new_checksum, false));
 		buffer_mark_valid(iobuf);
@@ -350,6 +462,100 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 	return 0;
 }
 
+/*
+ * Read-ahead.
+ *
+ * Each vnode remembers where the last read ended. A read that starts
+ * there (or in the block before, for reads smaller than a block) is
+ * sequential, and doubles the read-ahead window up to
+ * SFS_RA_MAXBLOCKS; any other read turns read-ahead off. The blocks
+ * in the window past the end of the read are handed to the buffer
+ * cache to fetch in the background, whole clusters where the file is
+ * laid out that way, so the reader finds them cached by the time it
+ * gets there. To keep the cost per read down, nothing more is issued
+ * until the reader has used up half of what was issued last time.
+ *
+ * This is per vnode, not per open file, as the vnode is all VOP_READ
+ * sees; two readers going through one file at different places will
+ * just turn read-ahead off for each other.
+ *
+ * Locking: must hold vnode lock.
+ */
+static
+void
+sfs_readahead(struct sfs_vnode *sv, off_t pos, size_t len, off_t filesize)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t first, last, end, maxblock, fb;
+	daddr_t diskblock;
+	bool cluster, noncontig;
+
+	KASSERT(len > 0 && pos + len <= filesize);
+
+	first = pos / SFS_BLOCKSIZE;
+	last = (pos + len - 1) / SFS_BLOCKSIZE;
+
+	if (first == sv->sv_ra_next || first + 1 == sv->sv_ra_next) {
+		if (sv->sv_ra_window == 0) {
+			sv->sv_ra_window = SFS_RA_MINBLOCKS;
+		}
+		else if (sv->sv_ra_window < SFS_RA_MAXBLOCKS) {
+			sv->sv_ra_window *= 2;
+		}
+	}
+	else {
+		sv->sv_ra_window = 0;
+		sv->sv_ra_issued = 0;
+	}
+	sv->sv_ra_next = last + 1;
+
+	if (sv->sv_ra_window == 0 ||
+	    sv->sv_ra_issued > last + sv->sv_ra_window / 2) {
+		return;
+	}
+
+	maxblock = (filesize - 1) / SFS_BLOCKSIZE;
+	end = last + sv->sv_ra_window;
+	if (end > maxblock) {
+		end = maxblock;
+	}
+	fb = sv->sv_ra_issued > last ? sv->sv_ra_issued : last + 1;
+
+	/* Check each cluster for contiguity once, not once per block */
+	noncontig = false;
+	for (; fb <= end; fb++) {
+		if (fb % SFS_CLUSTERBLOCKS == 0) {
+			noncontig = false;
+		}
+		if (sfs_bmap(sv, fb, false, &diskblock)) {
+			break;
+		}
+		if (diskblock == 0) {
+			/* a hole; nothing to read, and no cluster */
+			noncontig = true;
+			continue;
+		}
+		if (!noncontig) {
+			if (sfs_cluster_contiguous(sv, fb, diskblock,
+						   &cluster)) {
+				break;
+			}
+			if (cluster) {
+				buffer_prefetch(&sfs->sfs_absfs,
+				    diskblock - diskblock % SFS_CLUSTERBLOCKS,
+				    SFS_CLUSTERSIZE);
+				/* skip to the cluster's last block */
+				fb += SFS_CLUSTERBLOCKS - 1 -
+					fb % SFS_CLUSTERBLOCKS;
+				continue;
+			}
+			noncontig = true;
+		}
+		buffer_prefetch(&sfs->sfs_absfs, diskblock, SFS_BLOCKSIZE);
+	}
+	sv->sv_ra_issued = fb;
+}
+
 /*
  * Do I/O of a whole region of data, whether or not it's block-aligned.
  *
@@ -364,6 +570,7 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	uint32_t nblocks, i;
 	int result = 0;
 	uint32_t origresid, extraresid = 0;
+	off_t readpos;
 	struct sfs_dinode *inodeptr;
 
 	KASSERT(lock_do_i_hold(sv->sv_lock));
@@ -399,6 +606,7 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 			uio->uio_resid -= extraresid;
 		}
 	}
+	readpos = uio->uio_offset;
 
 	/*
 	 * First, do any leading partial block.
@@ -465,6 +673,16 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 		inodeptr->sfi_size = uio->uio_offset;
 		sfs_dinode_mark_dirty(sv);
 	}
+
+	/*
+	 * If reading, start on what's likely to be read next. This is
+	 * done after our own I/O so that doesn't queue up behind it.
+	 */
+	if (uio->uio_rw == UIO_READ && result == 0 &&
+	    origresid - extraresid > 0) {
+		sfs_readahead(sv, readpos, origresid - extraresid,
+			      inodeptr->sfi_size);
+	}
 	sfs_dinode_unload(sv);
 
 	/* Add in any extra amount we couldn't read because of EOF */
@@ -34,7 +34,10 @@
 #include <synch.h>
 #include <proc.h>
 #include <current.h>
+#include <thread.h>
 #include <buf.h>
+#include <device.h>
+#include <iostat.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -46,6 +49,12 @@
  * The interface to this module is documented in design/jphys.txt.
  */
 
+/*
+ * Length of the group commit window, in rounds of thread_yield; see
+ * sfs_jphys_writer.
+ */
+#define SFS_JPHYS_GROUPROUNDS	4
+
 ////////////////////////////////////////////////////////////
 // types
 
@@ -75,11 +84,16 @@ struct sfs_jposition {
  * also at the beginning of jp_oldestjblock, because we discard
  * journal blocks once they're written out.
  *
- * The on-disk tail is not actually tracked; it's just written out
- * when we trim the log. XXX: we should track it so we can check for
- * head/tail collisions. The reason this is problematic is that we
- * need to check its physical location, not just its LSN, and all we
- * get (or can expect to get) in sfs_jphys_trim is the LSN.
+ * The on-disk tail is tracked by journal block, in jp_tailjblock:
+ * sfs_jphys_trim gets only an LSN, but jp_firstlsns still has the
+ * first LSN of every block written since mount (entries are only
+ * replaced when the head comes around again), so it can walk the
+ * tail forward to the block holding that LSN. Blocks from before
+ * mount aren't in jp_firstlsns; startwriting fills them in with the
+ * first LSN written after mount, which is enough to tell whether a
+ * trim discards them. jp_tailjblock is only moved once the trim
+ * record is on disk, so the space between it and the head is space
+ * recovery might still read.
  */
 struct sfs_jphys {
 	bool jp_physrecovered;		/* container-level recovery done */
@@ -104,6 +118,15 @@ struct sfs_jphys {
 	struct spinlock jp_lsnmaplock;	/* lock for the following */
 	sfs_lsn_t *jp_firstlsns;	/* first lsn in each journal block */
 	uint32_t jp_oldestjblock;	/* oldest journal block in memory */
+	uint32_t jp_tailjblock;		/* journal block of on-disk tail */
+
+	/* Group commit; see sfs_jphys_flush. Protected by jp_lock. */
+	bool jp_writerrunning;		/* journal writer thread exists */
+	bool jp_writerquit;		/* and should exit */
+	struct thread *jp_writer;	/* the journal writer */
+	struct cv *jp_writercv;		/* to wake the writer */
+	struct cv *jp_flushcv;		/* to wait for the writer */
+	sfs_lsn_t jp_flushwant;		/* newest LSN asked to be flushed */
 
 	/* These are only valid during recovery and not afterwards updated. */
 	struct sfs_jposition jp_recov_tailpos;
@@ -220,9 +243,10 @@ sfs_advance_journal(struct sfs_fs *sfs)
 
 	/* Update the LSN map. */
 	spinlock_acquire(&jp->jp_lsnmaplock);
-	if (jp->jp_headjblock == jp->jp_oldestjblock) {
-		/* XXX this is the in-memory tail, need to check the on-disk tail too */
-		panic("sfs: journal head overran journal tail\n");
+	if (jp->jp_headjblock == jp->jp_oldestjblock ||
+	    jp->jp_headjblock == jp->jp_tailjblock) {
+		panic("sfs: %s: journal head overran journal tail\n",
+		      sfs->sfs_sb.sb_volname);
 	}
 	jp->jp_firstlsns[jp->jp_headjblock] = jp->jp_headfirstlsn;
 	spinlock_release(&jp->jp_lsnmaplock);
@@ -538,25 +562,30 @@ bool sfs_jphys_iswriting(struct sfs_fs *sfs) {
  *
  * - If the LSN we want to write out is in the current journal head
  * block, we need to pad the current head block and get a new one.
- * We do this first.
+ * We do this first. Padding wastes the rest of the block, so with
+ * many threads each flushing its own record we would burn most of a
+ * journal block per flush. To avoid that, flushes are handed to a
+ * per-volume journal writer thread (group commit): the first request
+ * wakes it, it waits a moment for more records and more requests to
+ * arrive, and then pads once and writes out everything on behalf of
+ * all of them. See sfs_jphys_writer.
+ *
+ * Flushes made from sfs_writeblock for journal buffers (case 1) and
+ * those made by the writer itself don't go through the writer; they
+ * never need padding, and the writer can't wait for itself.
  */
+static
 int
-sfs_jphys_flush(struct sfs_fs *sfs, sfs_lsn_t lsn)
+sfs_jphys_flush_direct(struct sfs_fs *sfs, sfs_lsn_t lsn)
 {
 	struct sfs_jphys *jp = sfs->sfs_jphys;
-	uint32_t jblock, headjblock, diskblock;
+	uint32_t jblock, headjblock, diskblock, firstjblock, nflushed;
 	sfs_lsn_t headfirstlsn;
+	struct timespec start;
+	unsigned usecs;
 	int result;
 
-	if (lsn == 0) {
-		/*
-		 * This can reasonably happen during recovery; don't
-		 * choke on it.
-		 */
-		return 0;
-	}
-
-	KASSERT(jp->jp_writermode);
+	iostat_start(&start);
 
 	lock_acquire(jp->jp_lock);
 
@@ -565,11 +594,24 @@ sfs_jphys_flush(struct sfs_fs *sfs, sfs_lsn_t lsn)
 	if (lsn >= jp->jp_headfirstlsn && jp->jp_headbyte > 0) {
 		/*
 		 * We will need to flush out the current journal head;
-		 * advance the head.
+		 * advance the head. If it's in the middle of turning
+		 * over, wait for that first, as sfs_jphys_write does;
+		 * the LSN might land in the old head then and need no
+		 * padding after all.
 		 */
-		sfs_pad_journal(sfs);
-		if (jp->jp_nextbuf == NULL && jp->jp_gettingnext == curthread){
-			sfs_getnextbuf(sfs);
+		while (jp->jp_nextbuf == NULL) {
+			KASSERT(jp->jp_gettingnext != curthread);
+			cv_wait(jp->jp_nextcv, jp->jp_lock);
+		}
+		if (lsn >= jp->jp_headfirstlsn && jp->jp_headbyte > 0) {
+			iostat_add(IOSTAT_JOURNAL_PADS, 1);
+			iostat_add(IOSTAT_JOURNAL_PADBYTES,
+				   SFS_BLOCKSIZE - jp->jp_headbyte);
+			sfs_pad_journal(sfs);
+			if (jp->jp_nextbuf == NULL &&
+			    jp->jp_gettingnext == curthread) {
+				sfs_getnextbuf(sfs);
+			}
 		}
 	}
 
@@ -585,6 +627,8 @@ sfs_jphys_flush(struct sfs_fs *sfs, sfs_lsn_t lsn)
 	/* Lock the state */
 	spinlock_acquire(&jp->jp_lsnmaplock);
 	jblock = jp->jp_oldestjblock;
+	firstjblock = jblock;
+	nflushed = 0;
 	while (1) {
 		if (lsn < jp->jp_firstlsns[jblock]) {
 			/* flushed as far as we need */
@@ -623,6 +667,7 @@ sfs_jphys_flush(struct sfs_fs *sfs, sfs_lsn_t lsn)
 
 		/* Get the spinlock again and go on to the next block */
 		spinlock_acquire(&jp->jp_lsnmaplock);
+		nflushed++;
 		jblock++;
 		if (jblock >= sfs->sfs_sb.sb_journalblocks) {
 			jblock = 0;
@@ -632,6 +677,158 @@ sfs_jphys_flush(struct sfs_fs *sfs, sfs_lsn_t lsn)
 	KASSERT(lsn < headfirstlsn);
 
 	spinlock_release(&jp->jp_lsnmaplock);
+
+	if (nflushed > 0) {
+		usecs = iostat_elapsed(&start);
+		iostat_add(IOSTAT_JOURNAL_FLUSHES, 1);
+		iotrace(IOTRACE_JFLUSH, sfs->sfs_device->d_devnumber,
+			sfs->sfs_sb.sb_journalstart + firstjblock, nflushed,
+			0, usecs, 0);
+	}
+	return 0;
+}
+
+/*
+ * Check if everything up to and including LSN is on disk: that is,
+ * if it's older than the oldest journal block still in memory.
+ */
+static
+bool
+sfs_jphys_isflushed(struct sfs_jphys *jp, sfs_lsn_t lsn)
+{
+	bool ret;
+
+	spinlock_acquire(&jp->jp_lsnmaplock);
+	ret = lsn < jp->jp_firstlsns[jp->jp_oldestjblock];
+	spinlock_release(&jp->jp_lsnmaplock);
+	return ret;
+}
+
+/*
+ * The journal writer thread; one per volume, running while the
+ * journal is in writer mode.
+ *
+ * It sleeps until someone asks for a flush, in jp_flushwant. If what
+ * they want is in the head block, which would have to be padded, it
+ * first yields for a short window so that the threads that are
+ * about to add records or ask for flushes of their own get to run.
+ * The window ends early once the head block fills up by itself (no
+ * padding needed any more) or a round goes by with no new records
+ * (nobody else is coming; a lone fsync shouldn't wait). Then it
+ * pads, writes out everything in the journal, and wakes everyone
+ * waiting in sfs_jphys_flush.
+ *
+ * Since it writes up to the newest record and not just to the newest
+ * request, records added during the window are covered too, and
+ * their owners find them already on disk when they come to flush.
+ */
+static
+void
+sfs_jphys_writer(void *data1, unsigned long data2)
+{
+	struct sfs_fs *sfs = data1;
+	struct sfs_jphys *jp = sfs->sfs_jphys;
+	sfs_lsn_t target, seen;
+	unsigned rounds;
+
+	(void)data2;
+
+	lock_acquire(jp->jp_lock);
+	jp->jp_writer = curthread;
+	while (1) {
+		while (!jp->jp_writerquit &&
+		       sfs_jphys_isflushed(jp, jp->jp_flushwant)) {
+			/* wake anyone satisfied by someone else's writes */
+			cv_broadcast(jp->jp_flushcv, jp->jp_lock);
+			cv_wait(jp->jp_writercv, jp->jp_lock);
+		}
+		if (jp->jp_writerquit) {
+			break;
+		}
+
+		/* group commit window */
+		target = jp->jp_flushwant;
+		rounds = 0;
+		while (target >= jp->jp_headfirstlsn &&
+		       rounds < SFS_JPHYS_GROUPROUNDS) {
+			seen = jp->jp_nextlsn;
+			lock_release(jp->jp_lock);
+			thread_yield();
+			lock_acquire(jp->jp_lock);
+			rounds++;
+			target = jp->jp_flushwant;
+			if (jp->jp_nextlsn == seen) {
+				break;
+			}
+		}
+
+		/* if we're padding anyway, take everything along */
+		if (target >= jp->jp_headfirstlsn) {
+			target = jp->jp_nextlsn - 1;
+		}
+		lock_release(jp->jp_lock);
+
+		sfs_jphys_flush_direct(sfs, target);
+
+		lock_acquire(jp->jp_lock);
+		cv_broadcast(jp->jp_flushcv, jp->jp_lock);
+	}
+	jp->jp_writer = NULL;
+	jp->jp_writerrunning = false;
+	cv_broadcast(jp->jp_flushcv, jp->jp_lock);
+	lock_release(jp->jp_lock);
+}
+
+int
+sfs_jphys_flush(struct sfs_fs *sfs, sfs_lsn_t lsn)
+{
+	struct sfs_jphys *jp = sfs->sfs_jphys;
+	struct timespec start;
+	int result;
+
+	if (lsn == 0) {
+		/*
+		 * This can reasonably happen during recovery; don't
+		 * choke on it.
+		 */
+		return 0;
+	}
+
+	KASSERT(jp->jp_writermode);
+
+	if (sfs_jphys_isflushed(jp, lsn)) {
+		return 0;
+	}
+
+	iostat_start(&start);
+
+	lock_acquire(jp->jp_lock);
+	KASSERT(lsn < jp->jp_nextlsn);
+	if (!jp->jp_writerrunning || jp->jp_writer == curthread) {
+		lock_release(jp->jp_lock);
+		result = sfs_jphys_flush_direct(sfs, lsn);
+		iostat_done(IOHIST_JOURNAL_FLUSH, &start);
+		return result;
+	}
+
+	iostat_add(IOSTAT_JOURNAL_GROUPED, 1);
+	if (lsn > jp->jp_flushwant) {
+		jp->jp_flushwant = lsn;
+	}
+	while (!sfs_jphys_isflushed(jp, lsn)) {
+		if (!jp->jp_writerrunning) {
+			/* the writer went away under us; do it ourselves */
+			lock_release(jp->jp_lock);
+			result = sfs_jphys_flush_direct(sfs, lsn);
+			iostat_done(IOHIST_JOURNAL_FLUSH, &start);
+			return result;
+		}
+		cv_signal(jp->jp_writercv, jp->jp_lock);
+		cv_wait(jp->jp_flushcv, jp->jp_lock);
+	}
+	lock_release(jp->jp_lock);
+
+	iostat_done(IOHIST_JOURNAL_FLUSH, &start);
 	return 0;
 }
 
@@ -672,7 +869,7 @@ sfs_jphys_flushforjournalblock(struct sfs_fs *sfs, daddr_t diskblock)
 	lsn = jp->jp_firstlsns[jblock] - 1;
 	spinlock_release(&jp->jp_lsnmaplock);
 
-	return sfs_jphys_flush(sfs, lsn);
+	return sfs_jphys_flush_direct(sfs, lsn);
 }
 
 /*
@@ -749,19 +946,70 @@ sfs_jphys_peeknextlsn(struct sfs_fs *sfs)
  * Trim the journal to a given LSN. The LSN specified is left in the
  * journal, but all LSNs before it are discarded and will no longer
  * be seen at recovery time.
+ *
+ * The trim record is flushed before returning, and then the space it
+ * frees is counted free (see jp_tailjblock above); so this waits for
+ * the disk and must be called where sfs_jphys_flush can be.
  */
 void
 sfs_jphys_trim(struct sfs_fs *sfs, sfs_lsn_t taillsn)
 {
 	struct sfs_jphys *jp = sfs->sfs_jphys;
 	struct sfs_jphys_trim rec;
+	uint32_t jblock, nextjblock;
+	sfs_lsn_t lsn;
 
 	KASSERT(jp->jp_writermode);
 
 	rec.jt_taillsn = taillsn;
-	sfs_jphys_write_internal(sfs, 0, NULL,
-				 SFS_JPHYS_CONTAINER, SFS_JPHYS_TRIM,
-				 &rec, sizeof(rec));
+	lsn = sfs_jphys_write_internal(sfs, 0, NULL,
+				       SFS_JPHYS_CONTAINER, SFS_JPHYS_TRIM,
+				       &rec, sizeof(rec));
+	sfs_jphys_flush(sfs, lsn);
+
+	/*
+	 * Walk the tail forward to the block TAILLSN is in. The head
+	 * can't move while we hold jp_lock, and TAILLSN is older than
+	 * the trim record so it can't be past the head.
+	 */
+	lock_acquire(jp->jp_lock);
+	spinlock_acquire(&jp->jp_lsnmaplock);
+	jblock = jp->jp_tailjblock;
+	while (jblock != jp->jp_headjblock) {
+		nextjblock = jblock + 1;
+		if (nextjblock == sfs->sfs_sb.sb_journalblocks) {
+			nextjblock = 0;
+		}
+		if (jp->jp_firstlsns[nextjblock] > taillsn) {
+			break;
+		}
+		jblock = nextjblock;
+	}
+	jp->jp_tailjblock = jblock;
+	spinlock_release(&jp->jp_lsnmaplock);
+	lock_release(jp->jp_lock);
+}
+
+/*
+ * Return how full the journal is, as a percentage: the blocks from
+ * the on-disk tail to the head, inclusive, out of the whole journal.
+ * Doesn't lock out the head; it's a hint for deciding when to
+ * checkpoint.
+ */
+unsigned
+sfs_jphys_fill(struct sfs_fs *sfs)
+{
+	struct sfs_jphys *jp = sfs->sfs_jphys;
+	uint32_t journalblocks, used;
+
+	journalblocks = sfs->sfs_sb.sb_journalblocks;
+
+	spinlock_acquire(&jp->jp_lsnmaplock);
+	used = jp->jp_headjblock + journalblocks - jp->jp_tailjblock;
+	spinlock_release(&jp->jp_lsnmaplock);
+
+	used = used % journalblocks + 1;
+	return used * 100 / journalblocks;
 }
 
 /*
@@ -1866,6 +2114,27 @@ sfs_jphys_create(void)
 	spinlock_init(&jp->jp_lsnmaplock);
 	jp->jp_firstlsns = NULL;
 	jp->jp_oldestjblock = 0;
+	jp->jp_tailjblock = 0;
+
+	jp->jp_writerrunning = false;
+	jp->jp_writerquit = false;
+	jp->jp_writer = NULL;
+	jp->jp_writercv = cv_create("sfs_jwriter");
+	if (jp->jp_writercv == NULL) {
+		cv_destroy(jp->jp_nextcv);
+		lock_destroy(jp->jp_lock);
+		kfree(jp);
+		return NULL;
+	}
+	jp->jp_flushcv = cv_create("sfs_jflush");
+	if (jp->jp_flushcv == NULL) {
+		cv_destroy(jp->jp_writercv);
+		cv_destroy(jp->jp_nextcv);
+		lock_destroy(jp->jp_lock);
+		kfree(jp);
+		return NULL;
+	}
+	jp->jp_flushwant = 0;
 
 	jp->jp_recov_tailpos.jp_jblock = 0;
 	jp->jp_recov_tailpos.jp_blockoffset = 0;
@@ -1889,6 +2158,9 @@ sfs_jphys_destroy(struct sfs_jphys *jp)
 	kfree(jp->jp_firstlsns);
 	KASSERT(jp->jp_headbuf == NULL);
 	KASSERT(jp->jp_nextbuf == NULL);
+	KASSERT(!jp->jp_writerrunning);
+	cv_destroy(jp->jp_flushcv);
+	cv_destroy(jp->jp_writercv);
 	cv_destroy(jp->jp_nextcv);
 	lock_destroy(jp->jp_lock);
 	kfree(jp);
@@ -1945,6 +2217,17 @@ sfs_jphys_startwriting(struct sfs_fs *sfs)
 		jp->jp_firstlsns[i] = 0;
 	}
 
+	/*
+	 * The blocks from the recovered tail up to the head were
+	 * written before we mounted; we don't know their LSNs, only
+	 * that they're all older than the head. See jp_tailjblock.
+	 */
+	jp->jp_tailjblock = jp->jp_recov_tailpos.jp_jblock;
+	for (i = jp->jp_tailjblock; i != jp->jp_headjblock;
+	     i = (i + 1) % journalblocks) {
+		jp->jp_firstlsns[i] = jp->jp_headfirstlsn;
+	}
+
 	/*
 	 * Note: we get the journal head buffers in fsmanaged mode (see
 	 * buf.h for the description) so sync operations don't try to
@@ -1981,9 +2264,43 @@ sfs_jphys_startwriting(struct sfs_fs *sfs)
 	jp->jp_oldestjblock = jp->jp_headjblock;
 
 	jp->jp_writermode = true;
+
+	/*
+	 * Start the journal writer. If we can't, flushes are done by
+	 * the threads asking for them, as they'd be without it; that
+	 * works, just less well, so don't fail the mount over it.
+	 */
+	jp->jp_writerquit = false;
+	jp->jp_flushwant = 0;
+	jp->jp_writerrunning = true;
+	result = thread_fork("sfs_jwriter", NULL, sfs_jphys_writer, sfs, 0);
+	if (result) {
+		kprintf("sfs: %s: no journal writer thread: %s\n",
+			sfs->sfs_sb.sb_volname, strerror(result));
+		jp->jp_writerrunning = false;
+	}
 	return 0;
 }
 
+/*
+ * Stop the journal writer thread, if it's running, and wait for it to
+ * go away.
+ */
+static
+void
+sfs_jphys_stopwriter(struct sfs_fs *sfs)
+{
+	struct sfs_jphys *jp = sfs->sfs_jphys;
+
+	lock_acquire(jp->jp_lock);
+	jp->jp_writerquit = true;
+	cv_signal(jp->jp_writercv, jp->jp_lock);
+	while (jp->jp_writerrunning) {
+		cv_wait(jp->jp_flushcv, jp->jp_lock);
+	}
+	lock_release(jp->jp_lock);
+}
+
 /*
  * Turn off writer mode again if we haven't actually gone live yet.
  */
@@ -1995,6 +2312,8 @@ sfs_jphys_unstartwriting(struct sfs_fs *sfs)
 	KASSERT(jp->jp_physrecovered);
 	KASSERT(jp->jp_writermode);
 
+	sfs_jphys_stopwriter(sfs);
+
 	/*
 	 * Don't assert that the journal's been flushed. If we're
 	 * dying, it might not be.
@@ -2021,6 +2340,8 @@ sfs_jphys_stopwriting(struct sfs_fs *sfs)
 {
 	struct sfs_jphys *jp = sfs->sfs_jphys;
 
+	sfs_jphys_stopwriter(sfs);
+
 	lock_acquire(jp->jp_lock);
 
 	KASSERT(jp->jp_physrecovered);
@@ -1,104 +1,152 @@
+
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
-#include <wchan.h>
-#include <synch.h>
-#include <proc.h>
+#include <spinlock.h>
+#include <thread.h>
 #include <current.h>
 #include <buf.h>
 #include <sfs.h>
-#include <array.h>
 #include "sfsprivate.h"
 
+// Transactions are found through the thread that runs them, not by
+//  searching: begin pushes one on curthread->t_trans and commit pops
+//  it, so threads of the same process can each have their own. The
+//  per-volume list is only there so the checkpoint code can see the
+//  oldest one; it's kept in LSN order for free (see
+//  sfs_trans_callback), so adding, removing, and finding the oldest
+//  are all O(1) and sfs_translock is only held for a few pointers.
+//
+// Committed transactions go on a free list instead of back to
+//  kmalloc; there are never more of them than threads in the fs at
+//  once, and they're freed at unmount.
+
+// Get a transaction, from the free list if there is one.
+static struct trans *sfs_trans_get(struct sfs_fs *sfs) {
+	struct trans *tr;
+
+	spinlock_acquire(&sfs->sfs_translock);
+	tr = sfs->sfs_transfree;
+	if (tr != NULL) {
+		sfs->sfs_transfree = tr->next;
+	}
+	spinlock_release(&sfs->sfs_translock);
+
+	if (tr == NULL) {
+		tr = kmalloc(sizeof(struct trans));
+		if (tr == NULL) {
+			// Nothing journaled yet, but callers have no way
+			//  to back out of an operation here.
+			panic("sfs: %s: out of memory for transaction\n",
+				sfs->sfs_sb.sb_volname);
+		}
+	}
+	tr->sfs = sfs;
+	tr->first_lsn = 0;
+	tr->outer = NULL;
+	tr->prev = tr->next = NULL;
+	return tr;
+}
+
 int sfs_trans_begin(struct sfs_fs* sfs, int trans_type) {
-	// create trans, add it to table
-	sfs_jphys_write_wrapper(sfs, 
-		(struct sfs_jphys_writecontext *)0xdeadbeef, jentry_trans_begin(trans_type));
+	struct trans *tr;
+
+	// make room in the journal first, if it's nearly full
+	sfs_checkpoint_throttle(sfs);
+
+	tr = sfs_trans_get(sfs);
+	tr->outer = curthread->t_trans;
+	curthread->t_trans = tr;
+
+	// the callback puts it in the table once it has an LSN
+	sfs_jphys_write_wrapper(sfs,
+		(struct sfs_jphys_writecontext *)tr, jentry_trans_begin(trans_type));
 
 	return 0;
 }
+
 void sfs_trans_callback(struct sfs_fs *sfs, sfs_lsn_t newlsn,
 	struct sfs_jphys_writecontext *ctx) {
-	(void) ctx;
-	struct trans* new_trans = kmalloc(sizeof(struct trans));
+	struct trans *tr = (struct trans *)ctx;
 
-	new_trans->id = curproc->pid;
-	new_trans->first_lsn = newlsn;
+	KASSERT(tr == curthread->t_trans);
+	KASSERT(tr->sfs == sfs);
+	tr->first_lsn = newlsn;
 
-	lock_acquire(sfs->trans_lock);
-	array_add(sfs->sfs_transactions, new_trans, NULL);
-	lock_release(sfs->trans_lock);
+	// We're called with the journal locked, so transactions are added
+	//  in LSN order and the oldest is always first. The checkpoint
+	//  code relies on that.
+	spinlock_acquire(&sfs->sfs_translock);
+	tr->prev = sfs->sfs_transtail;
+	tr->next = NULL;
+	if (tr->prev != NULL) {
+		tr->prev->next = tr;
+	}
+	else {
+		sfs->sfs_transhead = tr;
+	}
+	sfs->sfs_transtail = tr;
+	spinlock_release(&sfs->sfs_translock);
 }
 
 int sfs_trans_commit(struct sfs_fs* sfs, int trans_type) {
-	// find trans, remove it from table, destroy it.
-	(void) sfs;
-	unsigned len, i;
-	struct trans* trans_ptr;
-
-	lock_acquire(sfs->trans_lock);
-	len = array_num(sfs->sfs_transactions);
-	for (i = 0; i < len; i++) {
-		trans_ptr = array_get(sfs->sfs_transactions, i);
-		if (trans_ptr->id == curproc->pid) {
-			array_remove(sfs->sfs_transactions, i);
-			break;
-		}
-	}
-	lock_release(sfs->trans_lock);
+	struct trans *tr;
+
+	tr = curthread->t_trans;
+	KASSERT(tr != NULL);
+	// Begins and commits nest, so the innermost is always ours
+	KASSERT(tr->sfs == sfs);
+	curthread->t_trans = tr->outer;
 
 	sfs_jphys_write_wrapper(sfs, NULL, jentry_trans_commit(trans_type));
-	return 0;
-}
 
-int sfs_checkpoint(struct sfs_fs* sfs) {
-	unsigned len, i;
-	struct trans* trans_ptr;
-	struct buf *buffer_ptr;
-	unsigned oldest_lsn = 0xFFFFFFFF;
-	struct lock *buffer_lock = buffer_get_lock();
-	struct array *dirty_buffers = buffer_get_dirty_array();
-	struct b_fsdata *data_ptr;
-
-	// Find the earliest active_trans
-	lock_acquire(sfs->trans_lock);
-	len = array_num(sfs->sfs_transactions);
-	for (i = 0; i < len; i++) {
-		trans_ptr = array_get(sfs->sfs_transactions, i);
-		if (oldest_lsn > trans_ptr->first_lsn)
-			oldest_lsn = trans_ptr->first_lsn;
-	}
-	lock_release(sfs->trans_lock);
-
-	// Find the earlist dirty buffer
-	lock_acquire(buffer_lock);
-	len = array_num(dirty_buffers);
-	for (i = 0; i < len; i++) {
-		buffer_ptr = array_get(dirty_buffers, i);
-		if (buffer_ptr == NULL)
-			continue;
-		data_ptr = (struct b_fsdata *)buffer_get_fsdata(buffer_ptr);
-		if (sfs_block_is_journal(sfs, data_ptr->diskblock)) {
-			continue;
+	// Now that the commit is in the journal, take it out of the
+	//  table and put it on the free list. If the journal wasn't
+	//  being written when we began, the callback never ran and it
+	//  was never in the table.
+	spinlock_acquire(&sfs->sfs_translock);
+	if (tr->first_lsn != 0) {
+		if (tr->prev != NULL) {
+			tr->prev->next = tr->next;
+		}
+		else {
+			sfs->sfs_transhead = tr->next;
+		}
+		if (tr->next != NULL) {
+			tr->next->prev = tr->prev;
+		}
+		else {
+			sfs->sfs_transtail = tr->prev;
 		}
-		if (data_ptr->oldest_lsn < oldest_lsn)
-			oldest_lsn = data_ptr->oldest_lsn;
 	}
-	lock_release(buffer_lock);
+	tr->prev = NULL;
+	tr->next = sfs->sfs_transfree;
+	sfs->sfs_transfree = tr;
+	spinlock_release(&sfs->sfs_translock);
+
+	return 0;
+}
 
-	// Special case for the freemap. Don't trim if the freemap is written
-	if (sfs->oldest_freemap_lsn < oldest_lsn)
-		oldest_lsn = sfs->oldest_freemap_lsn;
+// First LSN of the oldest running transaction; 0 if none.
+sfs_lsn_t sfs_trans_oldest(struct sfs_fs *sfs) {
+	sfs_lsn_t lsn = 0;
 
-	// Trim!
-	if (oldest_lsn == 0xFFFFFFFF) {
-		oldest_lsn = sfs_jphys_peeknextlsn(sfs);
+	spinlock_acquire(&sfs->sfs_translock);
+	if (sfs->sfs_transhead != NULL) {
+		lsn = sfs->sfs_transhead->first_lsn;
 	}
+	spinlock_release(&sfs->sfs_translock);
+	return lsn;
+}
 
-	// kprintf("Trim to %d\n", oldest_lsn);
-	sfs_jphys_trim(sfs, oldest_lsn);
+// At unmount: free the spare transactions.
+void sfs_trans_cleanup(struct sfs_fs *sfs) {
+	struct trans *tr;
 
-	// We sucessfully took a checkpoint! Clear the odometer.
-	sfs_jphys_clearodometer(sfs->sfs_jphys);
-	return 0;
+	KASSERT(sfs->sfs_transhead == NULL);
+	while (sfs->sfs_transfree != NULL) {
+		tr = sfs->sfs_transfree;
+		sfs->sfs_transfree = tr->next;
+		kfree(tr);
+	}
 }
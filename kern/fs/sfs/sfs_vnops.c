@@ -384,14 +384,18 @@ sfs_fsync(struct vnode *v)
 }
 
 /*
- * Called for mmap().
+ * Called for mmap(). The VM system does the mapping, through the page
+ * cache, which reads and writes the file with VOP_READ and VOP_WRITE; all
+ * we need to do is say that's fine.
+ *
+ * Locking: not needed
  */
 static
 int
-sfs_mmap(struct vnode *v   /* add stuff as needed */)
+sfs_mmap(struct vnode *v)
 {
 	(void)v;
-	return ENOSYS;
+	return 0;
 }
 
 /*
@@ -581,17 +585,14 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 
 	result = sfs_dinode_load(sv);
 	if (result) {
-		unreserve_buffers(SFS_BLOCKSIZE);
-		lock_release(sv->sv_lock);
-		return result;
+		goto out;
 	}
 	sv_dino = sfs_dinode_map(sv);
 
 	if (sv_dino->sfi_linkcount == 0) {
 		sfs_dinode_unload(sv);
-		unreserve_buffers(SFS_BLOCKSIZE);
-		lock_release(sv->sv_lock);
-		return ENOENT;
+		result = ENOENT;
+		goto out;
 	}
 
 	sfs_dinode_unload(sv);
@@ -599,39 +600,30 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	/* Look up the name */
 	result = sfs_dir_findname(sv, name, &ino, NULL, NULL);
 	if (result!=0 && result!=ENOENT) {
-		unreserve_buffers(SFS_BLOCKSIZE);
-		lock_release(sv->sv_lock);
-		return result;
+		goto out;
 	}
 
 	/* If it exists and we didn't want it to, fail */
 	if (result==0 && excl) {
-		unreserve_buffers(SFS_BLOCKSIZE);
-		lock_release(sv->sv_lock);
-		return EEXIST;
+		result = EEXIST;
+		goto out;
 	}
 
 	if (result==0) {
 		/* We got something; load its vnode and return */
 		result = sfs_loadvnode(sfs, ino, SFS_TYPE_INVAL, &newguy);
 		if (result) {
-			unreserve_buffers(SFS_BLOCKSIZE);
-			lock_release(sv->sv_lock);
-			return result;
+			goto out;
 		}
 
 		*ret = &newguy->sv_absvn;
-		unreserve_buffers(SFS_BLOCKSIZE);
-		lock_release(sv->sv_lock);
-		return 0;
+		goto out;
 	}
 
 	/* Didn't exist - create it */
 	result = sfs_makeobj(sfs, SFS_TYPE_FILE, &newguy);
 	if (result) {
-		unreserve_buffers(SFS_BLOCKSIZE);
-		lock_release(sv->sv_lock);
-		return result;
+		goto out;
 	}
 
 	/* sfs_makeobj loads the inode for us */
@@ -646,9 +638,7 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 		sfs_dinode_unload(newguy);
 		lock_release(newguy->sv_lock);
 		VOP_DECREF(&newguy->sv_absvn);
-		lock_release(sv->sv_lock);
-		unreserve_buffers(SFS_BLOCKSIZE);
-		return result;
+		goto out;
 	}
 
 	/* Update the linkcount of the new file */
@@ -662,11 +652,14 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	*ret = &newguy->sv_absvn;
 
 	sfs_dinode_unload(newguy);
-	unreserve_buffers(SFS_BLOCKSIZE);
 	lock_release(newguy->sv_lock);
+
+out:
+	/* Every way out ends the transaction, even if nothing was done */
+	unreserve_buffers(SFS_BLOCKSIZE);
 	lock_release(sv->sv_lock);
 	sfs_trans_commit(sfs, TRANS_CREAT);
-	return 0;
+	return result;
 }
 
 /*
@@ -692,7 +685,6 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 	struct sfs_dinode *inodeptr;
 	int result;
 
-	sfs_trans_begin(sfs, TRANS_LINK);
 	KASSERT(file->vn_fs == dir->vn_fs);
 
 	/* Hard links to directories aren't allowed. */
@@ -701,6 +693,7 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 	}
 	KASSERT(file != dir);
 
+	sfs_trans_begin(sfs, TRANS_LINK);
 	reserve_buffers(SFS_BLOCKSIZE);
 
 	/* directory must be locked first */
@@ -709,20 +702,14 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 
 	result = sfs_dinode_load(f);
 	if (result) {
-		lock_release(f->sv_lock);
-		lock_release(sv->sv_lock);
-		unreserve_buffers(SFS_BLOCKSIZE);
-		return result;
+		goto out;
 	}
 
 	/* Create the link */
 	result = sfs_dir_link(sv, name, f->sv_ino, NULL);
 	if (result) {
 		sfs_dinode_unload(f);
-		lock_release(f->sv_lock);
-		lock_release(sv->sv_lock);
-		unreserve_buffers(SFS_BLOCKSIZE);
-		return result;
+		goto out;
 	}
 
 	/* and update the link count, marking the inode dirty */
@@ -733,11 +720,13 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 	sfs_dinode_mark_dirty(f);	// Journaled. Linkcount update
 
 	sfs_dinode_unload(f);
+
+out:
 	lock_release(f->sv_lock);
 	lock_release(sv->sv_lock);
 	unreserve_buffers(SFS_BLOCKSIZE);
 	sfs_trans_commit(sfs, TRANS_LINK);
-	return 0;
+	return result;
 }
 
 /*
@@ -865,6 +854,7 @@ die_simple:
 die_early:
 	unreserve_buffers(SFS_BLOCKSIZE);
 	lock_release(sv->sv_lock);
+	sfs_trans_commit(sfs, TRANS_MKDIR);
 	return result;
 }
 
@@ -888,13 +878,12 @@ sfs_rmdir(struct vnode *v, const char *name)
 	int result, result2;
 	int slot;
 
-	sfs_trans_begin(sfs, TRANS_RMDIR);
-
 	/* Cannot remove the . or .. entries from a directory! */
 	if (!strcmp(name, ".") || !strcmp(name, "..")) {
 		return EINVAL;
 	}
 
+	sfs_trans_begin(sfs, TRANS_RMDIR);
 	lock_acquire(sv->sv_lock);
 	reserve_buffers(SFS_BLOCKSIZE);
 
@@ -1026,13 +1015,12 @@ sfs_remove(struct vnode *dir, const char *name)
 		panic("Gravyard is funcked up");
 	}
 
-	sfs_trans_begin(sfs, TRANS_REMOVE);
-
 	/* need to check this to avoid deadlock even in error condition */
 	if (!strcmp(name, ".") || !strcmp(name, "..")) {
 		return EISDIR;
 	}
 
+	sfs_trans_begin(sfs, TRANS_REMOVE);
 	lock_acquire(sv->sv_lock);
 	reserve_buffers(SFS_BLOCKSIZE);
 
@@ -1202,8 +1190,6 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 	struct sfs_direntry sd;
 	int found_dir1;
 
-	sfs_trans_begin(sfs, TRANS_RENAME);
-
 	/* make gcc happy */
 	obj2_inodeptr = NULL;
 
@@ -1219,6 +1205,8 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 		return ENAMETOOLONG;
 	}
 
+	sfs_trans_begin(sfs, TRANS_RENAME);
+
 	/*
 	 * We only allow one rename to occur at a time. This appears
 	 * to be necessary to preserve the consistency of the
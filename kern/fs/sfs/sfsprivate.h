@@ -55,6 +55,19 @@ extern const struct vnode_ops sfs_dirops;
 #define SFSUIO(iov, uio, ptr, block, rw) \
     uio_kinit(iov, uio, ptr, SFS_BLOCKSIZE, ((off_t)(block))*SFS_BLOCKSIZE, rw)
 
+/*
+ * File data laid out contiguously on disk is cached in clusters of
+ * this many blocks, one buffer (and one disk transfer) per cluster.
+ */
+#define SFS_CLUSTERBLOCKS 8
+#define SFS_CLUSTERSIZE   (SFS_CLUSTERBLOCKS * SFS_BLOCKSIZE)
+
+/*
+ * Sequential read-ahead window limits, in blocks.
+ */
+#define SFS_RA_MINBLOCKS  SFS_CLUSTERBLOCKS
+#define SFS_RA_MAXBLOCKS  (16 * SFS_CLUSTERBLOCKS)
+
 /* Print macros for verbose recovery */
 #ifdef SFS_VERBOSE_RECOVERY
 #define SAY(...) kprintf(__VA_ARGS__)
@@ -78,6 +91,14 @@ int sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock,
 		bool doalloc, daddr_t *diskblock);
 int sfs_itrunc(struct sfs_vnode *sv, off_t len);
 
+/* Functions in sfs_checkpoint.c */
+int sfs_checkpoint_start(struct sfs_fs *sfs);
+void sfs_checkpoint_stop(struct sfs_fs *sfs);
+void sfs_checkpoint_poll(struct sfs_fs *sfs);
+void sfs_checkpoint_throttle(struct sfs_fs *sfs);
+void sfs_dirty_insert(struct sfs_fs *sfs, struct b_fsdata *bd);
+void sfs_dirty_remove(struct sfs_fs *sfs, struct b_fsdata *bd);
+
 /* Functions in sfs_dir.c */
 int sfs_readdir(struct sfs_vnode *sv, int slot, struct sfs_direntry *sd);
 int sfs_writedir(struct sfs_vnode *sv, int slot, struct sfs_direntry *sd);
@@ -94,6 +115,9 @@ int sfs_lookonce(struct sfs_vnode *sv, const char *name,
 		struct sfs_vnode **ret,
 		int *slot);
 
+/* Functions in sfs_fsops.c */
+int sfs_writefreemap(struct sfs_fs *sfs);
+
 /* Functions in sfs_inode.c */
 int sfs_dinode_load(struct sfs_vnode *sv);
 void sfs_dinode_unload(struct sfs_vnode *sv);
@@ -131,6 +155,7 @@ void sfs_wrote_journal_block(struct sfs_fs *sfs, daddr_t diskblock);
 /* interface for checkpointing */
 sfs_lsn_t sfs_jphys_peeknextlsn(struct sfs_fs *sfs);
 void sfs_jphys_trim(struct sfs_fs *sfs, sfs_lsn_t taillsn);
+unsigned sfs_jphys_fill(struct sfs_fs *sfs);
 uint32_t sfs_jphys_getodometer(struct sfs_jphys *jp);
 void sfs_jphys_clearodometer(struct sfs_jphys *jp);
 /* reader interface */
@@ -176,9 +201,12 @@ void *jentry_block_write(daddr_t written_addr, uint32_t new_checksum, bool new_a
 void *jentry_resize(daddr_t inode_addr, size_t old_size, size_t new_size);
 void jentry_print(void* recptr);
 uint32_t checksum(unsigned char *data);
+uint32_t sfs_checksum(struct sfs_fs *sfs, void *data);
 
 void sfs_trans_callback(struct sfs_fs *sfs, sfs_lsn_t newlsn,
 	struct sfs_jphys_writecontext *ctx);
+sfs_lsn_t sfs_trans_oldest(struct sfs_fs *sfs);
+void sfs_trans_cleanup(struct sfs_fs *sfs);
 
 // #define sfs_jphys_write_wrapper(args...) sfs_jphys_write_wrapper_debug(__FILE__, __LINE__, __FUNCTION__, args)
 
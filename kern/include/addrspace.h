@@ -36,6 +36,7 @@
 
 
 #include <vm.h>
+#include <spinlock.h>
 #include <pagetable.h>
 #include "opt-dumbvm.h"
 
@@ -49,10 +50,24 @@ struct vnode;
  * You write this.
  */
 
+/*
+ * A region may be backed by part of a file (an executable segment). Pages
+ * overlapping [file_vaddr, file_vaddr + file_size) are read from the vnode
+ * at file_offset on first touch; everything else starts out zero.
+ *
+ * Regions made by mmap have map_flags set. A MAP_PRIVATE mapping is loaded
+ * like an executable segment and is private from then on; the pages of a
+ * MAP_SHARED mapping come from the page cache (see pagecache.h).
+ */
 struct region {
     vaddr_t base;
     size_t size;
     int permission;
+    struct vnode *vnode;
+    off_t file_offset;
+    vaddr_t file_vaddr;
+    size_t file_size;
+    int map_flags;
 };
 
 struct addrspace {
@@ -67,9 +82,16 @@ struct addrspace {
 #else
         struct lock **pt_locks;
         struct pt_entry** pagetable;
+        struct spinlock pt_spinlock;    /* L2 creation, pt_seq, pt_writers */
+        unsigned pt_seq;                /* Bumped by every resident pte update */
+        unsigned pt_writers;            /* Updates in progress */
         struct array *as_regions;
         vaddr_t heap_start;
         vaddr_t heap_end;
+        vaddr_t mmap_base;      /* Lowest mmap region; mmaps grow down */
+        unsigned asid;          /* TLB PID, valid while asid_gen is current */
+        unsigned asid_gen;
+        uint32_t asid_cpus;     /* cpus that may cache our translations */
 #endif
 };
 
@@ -110,6 +132,24 @@ struct addrspace {
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
  *
+ *    as_define_file - back part of an already defined region with a
+ *                file. Takes a reference to the vnode.
+ *
+ *    as_file_page - check whether the page at VADDR has file data.
+ *
+ *    as_load_page - fill the frame at PADDR with the page at VADDR:
+ *                file data where there is any, zeroes elsewhere.
+ *
+ *    as_define_mmap - map LEN bytes of the file V at OFFSET below the
+ *                lowest existing mapping. Takes a reference to the
+ *                vnode. Hands back the address.
+ *
+ *    as_munmap - remove the mapping at VADDR, which must be LEN bytes
+ *                long.
+ *
+ *    as_shared_file_page - check whether the page at VADDR belongs to a
+ *                MAP_SHARED mapping, and if so which page of which file.
+ *
  * Note that when using dumbvm, addrspace.c is not used and these
  * functions are found in dumbvm.c.
  */
@@ -129,6 +169,17 @@ int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
 int               as_check_region(struct addrspace *as, vaddr_t va);
+int               as_define_file(struct addrspace *as, struct vnode *v,
+                                 off_t offset, vaddr_t vaddr, size_t filesize);
+bool              as_file_page(struct addrspace *as, vaddr_t vaddr);
+int               as_load_page(struct addrspace *as, vaddr_t vaddr,
+                               paddr_t paddr);
+int               as_define_mmap(struct addrspace *as, struct vnode *v,
+                                 off_t offset, size_t len, int prot,
+                                 int flags, vaddr_t *ret);
+int               as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len);
+bool              as_shared_file_page(struct addrspace *as, vaddr_t vaddr,
+                                      struct vnode **v, off_t *offset);
 
 /*
  * Functions in loadelf.c
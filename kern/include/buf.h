@@ -39,16 +39,17 @@ struct fs;  /* fs.h */
  * virtually indexed, where the key is a vnode and block offset within
  * the vnode.)
  *
- * In the real world you'd want buffers to be able to be different
- * sizes (since not every FS in existence uses the same block size,
- * and some can use different block sizes as a formatting option) but
- * to reduce complexity here we'll require all buffers to be the
- * ONE_TRUE_BUFFER_SIZE, which is defined in buf.c.
- *
- * In any event each FS should use buffers of only one size, or at
- * least of a consistent size for any particular disk offset, because
- * handling partial or overlapping buffers would be extremely
- * problematic.
+ * Buffers can be one block (MIN_BUFFER_SIZE, defined in buf.c) or a
+ * power-of-two number of consecutive blocks up to MAX_BUFFER_SIZE,
+ * which lets a file system cache and transfer file data in bigger
+ * pieces. A buffer of N blocks must start at a block number that is
+ * a multiple of N.
+ *
+ * Buffers never overlap. Getting a buffer that would overlap others
+ * writes the others out (if dirty) and drops them first, so an FS can
+ * switch the size it uses for a block when it needs to; it fails with
+ * EBUSY if the caller is holding one of the others itself. Switching
+ * back and forth often is of course slow.
  */
 
 struct buf; /* Opaque. */
@@ -78,7 +79,8 @@ struct buf; /* Opaque. */
  *      responsible for writing out any managed buffers it's holding.
  *
  * buffer_flush looks for an existing buffer and writes it out (if
- * dirty) immediately without returning it.
+ * dirty) immediately without returning it. A SIZE of 0 means whatever
+ * size the buffer is, for callers that only know the block number.
  *
  * buffer_drop looks for an existing buffer and invalidates it
  * immediately without returning it.
@@ -173,16 +175,36 @@ void drop_fs_buffers(struct fs *fs);
  * by a process that's halfway through a truncate and waiting for
  * another buffer to become available.
  *
+ * An operation that has to give up its reservation in the middle
+ * (to wait for one again, as a nested sfs_reclaim does) uses
+ * unreserve_buffers_nested, which doesn't throttle the writer; that
+ * waits for the final unreserve_buffers, outside the operation.
+ *
  * FS-managed buffers (see above) are reserved separately; these
  * reservations are global rather than per-process, and we expect the
  * count to be known.
  */
 void reserve_buffers(size_t size);
 void unreserve_buffers(size_t size);
+void unreserve_buffers_nested(size_t size);
 
 void reserve_fsmanaged_buffers(unsigned count, size_t size);
 void unreserve_fsmanaged_buffers(unsigned count, size_t size);
 
+/*
+ * For the VM system: free up to NPAGES pages' worth of clean buffers
+ * that haven't been used lately, and shrink the cache to match.
+ * Returns the number of blocks freed; 0 if every idle buffer was
+ * used recently. Never waits for a lock.
+ */
+unsigned buffer_reclaim(unsigned npages);
+
+/*
+ * Once-a-second tick from the clock, in interrupt context: wakes the
+ * syncer when the oldest dirty buffer is due to be written.
+ */
+void buffer_timer(void);
+
 /*
  * Print stats.
  */
@@ -193,8 +215,28 @@ void buffer_printstats(void);
  */
 void buffer_bootstrap(void);
 
-struct array *buffer_get_dirty_array(void);
-struct lock *buffer_get_lock(void);
-
+/*
+ * Lookup without getting the buffer, for file systems that already
+ * hold it busy. Returns the buffer holding the block, which may be
+ * bigger than the block.
+ */
 struct buf *buffer_find(struct fs *fs, daddr_t physblock);
+
+/*
+ * Size of the cached buffer holding a block, 0 if none. Only a hint.
+ */
+size_t buffer_cached_size(struct fs *fs, daddr_t physblock);
+
+/*
+ * Read-ahead: start reading a buffer in the background and return
+ * without waiting. Best effort; see buf.c.
+ */
+void buffer_prefetch(struct fs *fs, daddr_t block, size_t size);
+
+/*
+ * Call a function on each dirty buffer of a file system. The buffer
+ * cache is locked during each call; the function must not sleep.
+ */
+void buffer_foreach_dirty(struct fs *fs, void (*func)(struct buf *, void *),
+			  void *data);
 #endif /* _BUF_H_ */
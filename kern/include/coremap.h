@@ -1,94 +1,175 @@
-#include <pagetable.h>
-#include <addrspace.h>
-
-// TODO: coremap interface goes here
-
-#ifndef _COREMAP_H_
-#define _COREMAP_H_
-
-/* Macros for access to the coremap entry */
-//#define CM_IS_KERNEL(CE) (1 & (CE).vm_addr)
-//#define CM_ALLOCATED(CE) (2 & (CE).vm_addr)
-//#define CM_HAS_NEXT(CE)  (4 & (CE).vm_addr)
-//#define CM_VM_ADDR(CE)   (0xFFFFF000 & (CE).vm_addr)
-//
-//#define CM_SET_IS_KERNEL(CE, value) ((CE).vm_addr = (CE).vm_addr & 0xFFFFFFFE | value)
-//#define CM_SET_ALLOCATED(CE, value) ((CE).vm_addr = (CE).vm_addr & 0xFFFFFFFD | (value << 1))
-//#define CM_SET_HAS_NEXT(CE, value)  ((CE).vm_addr = (CE).vm_addr & 0xFFFFFFFB | (value << 2))
-//#define CM_SET_VM_ADDR(CE, value)   ((CE).vm_addr = (CE).vm_addr & 0x00000FFF | (value << 12))
-
-#define CM_IS_BUSY(CE)		((CE).busy)
-#define CM_SET_BUSY(CE)		((CE).busy = true)
-#define CM_UNSET_BUSY(CE)	((CE).busy = false)
-
-struct cm_entry {
-	vaddr_t vm_addr;		// The vm translation of the physical address. Only upper 20 bits get used
-	bool is_kernel;		// Note if this is a kernel page or not
-	bool allocated;		// Note if the physical address is allocated or not
-	bool has_next;		// Indicating that we have a cross-page allocation. Only used for the kernel???
-	bool busy;
-	bool used_recently;
-	bool dirty;
-	struct addrspace *as;
-};
-
-struct vnode *back_store;
-struct bitmap *disk_map;
-
-int find_free_page(void);
-
-void cm_bootstrap(void);
-
-/* 
- * Evict the "next" page from memory. This will be dependent on the eviction 
- * policy that we choose (clock, random, etc.). This is where we will switch 
- * out different eviction policies 
- */
-// Consider returning the page we evicted
-int cm_choose_evict_page(void);
-
-/* 
- * Evict page from memory. This function will update coremap, write to 
- * backstore and update the backing_index entry; 
- */
-int cm_evict_page(struct addrspace* as, vaddr_t va);
-
-/*
- * Allocate a page of memory, pointing back to the virtual address in the
- * address space that references it
- */
-paddr_t cm_alloc_page(struct addrspace *as, vaddr_t va);
-
-/* Find a contiguous npages of memory */
-paddr_t cm_alloc_npages(unsigned npages);
-
-/* 
- * Deallocates a page of memory specified by the physical address
- */
-bool cm_dealloc_page(struct addrspace *as, paddr_t paddr);
-
-/* Load page from the backing store into a specific page of physical memory (used as a helper function for page_load) */
-paddr_t cm_load_page(struct addrspace *as, vaddr_t va);
-
-/* Blocks until a coremap entry can be set as dirty */
-void cm_set_dirty(paddr_t paddr);
-
-int cm_get_free_page(void);
-
-/* Should be called any time a coremap is allocated/deallocated */
-void cm_used_change(int amount);
-
-/* Should be called any time memory is given out */
-void cm_mem_change(int amount);
-
-/* Returns the amount of memory that can still be backed by the backing store */
-unsigned cm_mem_free(void);
-
-void bs_bootstrap(void);
-int bs_write_out(int cm_index);
-int bs_read_in(struct addrspace *as, vaddr_t va, int cm_index);
-unsigned bs_alloc_index(void);
-void bs_dealloc_index(unsigned index);
-int bs_write_page(void *vaddr, unsigned offset);
-int bs_read_page(void *vaddr, unsigned offset);
+#include <pagetable.h>
+#include <addrspace.h>
+
+// TODO: coremap interface goes here
+
+#ifndef _COREMAP_H_
+#define _COREMAP_H_
+
+/* Macros for access to the coremap entry */
+//#define CM_IS_KERNEL(CE) (1 & (CE).vm_addr)
+//#define CM_ALLOCATED(CE) (2 & (CE).vm_addr)
+//#define CM_HAS_NEXT(CE)  (4 & (CE).vm_addr)
+//#define CM_VM_ADDR(CE)   (0xFFFFF000 & (CE).vm_addr)
+//
+//#define CM_SET_IS_KERNEL(CE, value) ((CE).vm_addr = (CE).vm_addr & 0xFFFFFFFE | value)
+//#define CM_SET_ALLOCATED(CE, value) ((CE).vm_addr = (CE).vm_addr & 0xFFFFFFFD | (value << 1))
+//#define CM_SET_HAS_NEXT(CE, value)  ((CE).vm_addr = (CE).vm_addr & 0xFFFFFFFB | (value << 2))
+//#define CM_SET_VM_ADDR(CE, value)   ((CE).vm_addr = (CE).vm_addr & 0x00000FFF | (value << 12))
+
+#define CM_IS_BUSY(CE)		((CE).busy)
+#define CM_SET_BUSY(CE)		((CE).busy = true)
+#define CM_UNSET_BUSY(CE)	((CE).busy = false)
+
+/*
+ * Additional mappings of a frame that is shared copy-on-write between
+ * address spaces. The primary mapping lives in the cm_entry itself.
+ */
+struct cm_sharer {
+	struct addrspace *as;
+	vaddr_t vm_addr;
+	unsigned slot;			// This mapping's swap slot, 0 if none yet
+	struct cm_sharer *next;
+};
+
+struct cm_entry {
+	vaddr_t vm_addr;		// The vm translation of the physical address. Only upper 20 bits get used
+	bool is_kernel;		// Note if this is a kernel page or not
+	bool allocated;		// Note if the physical address is allocated or not
+	bool has_next;		// Indicating that we have a cross-page allocation. Only used for the kernel???
+	bool busy;
+	bool used_recently;
+	bool dirty;			// The primary mapping's swap slot is stale. Sharers' slots always are
+	unsigned slot;			// The primary mapping's swap slot, 0 if it has none yet
+	unsigned refcount;		// Number of pagetable entries mapping this frame
+	struct cm_sharer *sharers;	// Mappings other than (as, vm_addr)
+	struct addrspace *as;
+	bool free_head;		// First page of a free block in the buddy allocator
+	unsigned char free_order;	// log2 of the size of that block
+	int free_next;		// Free block list links (coremap indices, -1 terminated)
+	int free_prev;
+};
+
+/* Buddy blocks go up to 2^(CM_MAX_ORDER - 1) pages */
+#define CM_MAX_ORDER	11
+
+/* Free frames are moved between the global pool and a cpu in batches */
+#define CM_PCPU_BATCH	16
+#define CM_PCPU_MAX	(2 * CM_PCPU_BATCH)
+
+struct vnode *back_store;
+struct bitmap *disk_map;
+
+int find_free_page(void);
+
+void cm_bootstrap(void);
+
+/* 
+ * Evict the "next" page from memory. This will be dependent on the eviction 
+ * policy that we choose (clock, random, etc.). This is where we will switch 
+ * out different eviction policies 
+ */
+// Consider returning the page we evicted
+int cm_choose_evict_page(void);
+
+/* Page replacement policies */
+#define CM_EVICT_RANDOM	0
+#define CM_EVICT_CLOCK	1
+
+/* Select the page replacement policy by name. Returns EINVAL if unknown */
+int cm_set_evict_policy(const char *name);
+const char *cm_get_evict_policy(void);
+
+/* Note that the page was referenced. Called when its TLB entry is loaded */
+void cm_mark_referenced(paddr_t paddr);
+/* Clear it again, returning whether it was set */
+bool cm_clear_referenced(paddr_t paddr);
+
+/* 
+ * Evict page from memory. This function will update coremap, write to 
+ * backstore and update the backing_index entry; 
+ */
+int cm_evict_page(struct addrspace* as, vaddr_t va);
+
+/*
+ * Allocate a page of memory, pointing back to the virtual address in the
+ * address space that references it. cm_alloc_page zero-fills it.
+ * cm_alloc_page_busy leaves the old contents in place and the frame busy;
+ * the caller fills it and then calls cm_unbusy_page.
+ */
+paddr_t cm_alloc_page(struct addrspace *as, vaddr_t va);
+paddr_t cm_alloc_page_busy(struct addrspace *as, vaddr_t va);
+void cm_unbusy_page(paddr_t paddr);
+
+/* Find a contiguous npages of memory */
+paddr_t cm_alloc_npages(unsigned npages);
+
+/* 
+ * Deallocates a page of memory specified by the physical address
+ */
+bool cm_dealloc_page(struct addrspace *as, paddr_t paddr);
+
+/*
+ * Add a copy-on-write mapping of an already resident user page. Returns
+ * EBUSY if the frame is busy; the caller should drop its locks and retry.
+ */
+int cm_share_page(struct addrspace *as, vaddr_t va, paddr_t paddr);
+
+/* Returns true if more than one pagetable entry maps the frame */
+bool cm_page_shared(paddr_t paddr);
+
+/*
+ * TLB flags a resident user page may be mapped with without taking a fault:
+ * VALID, plus WRITABLE if it is already dirty and private. 0 if the frame
+ * is busy and must not be mapped ahead of time.
+ */
+uint32_t cm_preload_flags(paddr_t paddr);
+
+/*
+ * Break copy-on-write sharing for the mapping (as, va) of paddr. Returns the
+ * physical address of a private copy, or 0 if the frame is busy.
+ */
+paddr_t cm_cow_page(struct addrspace *as, vaddr_t va, paddr_t paddr);
+
+/*
+ * Drop the mapping (as, va) of a user page, freeing the frame if it was the
+ * last one. Returns false if the frame is busy, like cm_dealloc_page.
+ */
+bool cm_release_page(struct addrspace *as, vaddr_t va, paddr_t paddr);
+
+/* Load page from the backing store into a specific page of physical memory (used as a helper function for page_load) */
+paddr_t cm_load_page(struct addrspace *as, vaddr_t va);
+
+/* Blocks until a coremap entry can be set as dirty */
+void cm_set_dirty(paddr_t paddr);
+
+int cm_get_free_page(void);
+
+/* Should be called any time a coremap is allocated/deallocated */
+void cm_used_change(int amount);
+
+/* Should be called any time memory is given out */
+void cm_mem_change(int amount);
+
+/* Returns the amount of memory that can still be backed by the backing store */
+unsigned cm_mem_free(void);
+
+/* True if free frames are well above the point the pageout daemon starts */
+bool cm_memory_plentiful(void);
+
+/* Largest run of swap slots moved in one transfer */
+#define BS_CLUSTER	8
+
+void bs_bootstrap(void);
+int bs_write_out(int cm_index);
+int bs_read_in(struct addrspace *as, vaddr_t va, int cm_index);
+unsigned bs_alloc_index(void);
+unsigned bs_alloc_index_near(unsigned hint);
+void bs_dealloc_index(unsigned index);
+void bs_share_index(unsigned index);
+bool bs_index_shared(unsigned index);
+int bs_write_page(void *vaddr, unsigned offset);
+int bs_read_page(void *vaddr, unsigned offset);
+int bs_write_pages(void **vaddrs, unsigned npages, unsigned offset);
+int bs_read_pages(void **vaddrs, unsigned npages, unsigned offset);
 #endif
\ No newline at end of file
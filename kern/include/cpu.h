@@ -85,10 +85,17 @@ struct cpu {
 	 * struct tlbshootdown is machine-dependent and might
 	 * reasonably be either an address space and vaddr pair, or a
 	 * paddr, or something else.
+	 *
+	 * Every batch of mappings queued gets a ticket from
+	 * c_shootdown_seq; once the cpu has flushed them it raises
+	 * c_shootdown_done to match and wakes c_shootdown_wchan.
 	 */
 	uint32_t c_ipi_pending;		/* One bit for each IPI number */
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	int c_numshootdown;
+	unsigned c_shootdown_seq;	/* Last ticket handed out */
+	unsigned c_shootdown_done;	/* Last ticket completed */
+	struct wchan *c_shootdown_wchan;
 	struct spinlock c_ipi_lock;
 };
 
@@ -155,6 +162,8 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_cpus queues a batch of mappings on every cpu in a
+ * mask of cpu numbers, one IPI each, and waits until all are done.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -170,6 +179,8 @@ void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
 void ipi_tlbshootdown_allcpus(const struct tlbshootdown *mapping);
+void ipi_tlbshootdown_cpus(uint32_t cpumask,
+			   const struct tlbshootdown *mappings, unsigned n);
 
 void interprocessor_interrupt(void);
 
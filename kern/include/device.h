@@ -63,6 +63,17 @@ struct device_ops {
 	int (*devop_ioctl)(struct device *, int op, userptr_t data);
 };
 
+/*
+ * I/O priority classes, for devices that schedule requests. Lower is
+ * more urgent. A thread's requests go in the class in t_iopri; code
+ * doing I/O on behalf of something more or less urgent than ordinary
+ * reads and writes sets it around the call.
+ */
+#define IOPRI_JOURNAL		0	/* everything else waits for it */
+#define IOPRI_SWAP		1	/* paging */
+#define IOPRI_NORMAL		2	/* default */
+#define IOPRI_BACKGROUND	3	/* writeback, read-ahead */
+
 /*
  * Macros to shorten the calling sequences.
  */
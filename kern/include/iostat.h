@@ -0,0 +1,78 @@
+#ifndef _IOSTAT_H_
+#define _IOSTAT_H_
+
+#include <kern/time.h>
+
+/*
+ * I/O instrumentation: per-cpu event counters, log2 latency histograms
+ * for the slow paths of the storage stack, and an optional trace ring
+ * of block I/O events.
+ *
+ * Counters and histograms are always on. They are kept per cpu, like
+ * the VM counters, so that they cost an increment with interrupts off
+ * and no shared cache line; they are summed only when printed. The
+ * trace is off until turned on from the menu (iotrace on), and keeps
+ * the last IOTRACE_SIZE events.
+ *
+ * Everything can be printed from the kernel menu (iostat, iotrace) or
+ * read as text from the device iostat:, e.g. with cat.
+ */
+
+/* Event counters */
+enum iostat {
+	IOSTAT_DISK_READS,	/* Read requests to disk */
+	IOSTAT_DISK_WRITES,	/* Write requests to disk */
+	IOSTAT_DISK_RSECTORS,	/* Sectors read */
+	IOSTAT_DISK_WSECTORS,	/* Sectors written */
+	IOSTAT_DISK_ERRORS,	/* Requests that failed */
+	IOSTAT_JOURNAL_FLUSHES,	/* Journal flushes that wrote something */
+	IOSTAT_JOURNAL_GROUPED,	/* Flushes handed to the journal writer */
+	IOSTAT_JOURNAL_PADS,	/* Journal blocks padded early to flush */
+	IOSTAT_JOURNAL_PADBYTES,/* Bytes of journal lost to that */
+	IOSTAT_CHECKPOINTS,	/* Journal checkpoints */
+	IOSTAT_CHECKPOINT_WAITS,/* Transactions held for a full journal */
+	IOSTAT_NUM
+};
+
+/* Latency histograms */
+enum iohist {
+	IOHIST_BUFFER_READ,	/* buffer_read misses: reading the block in */
+	IOHIST_BUFFER_EVICT,	/* buffer_evict, including writing it out */
+	IOHIST_JOURNAL_FLUSH,	/* sfs_jphys_flush */
+	IOHIST_DISK_IO,		/* Disk requests, queueing included */
+	IOHIST_NUM
+};
+
+/* Trace event types */
+#define IOTRACE_READ		'R'	/* Disk read */
+#define IOTRACE_WRITE		'W'	/* Disk write */
+#define IOTRACE_JFLUSH		'J'	/* Journal flush */
+
+void iostat_bootstrap(void);
+
+void iostat_add(enum iostat which, unsigned amount);
+
+/*
+ * Time an operation: iostat_start before, iostat_done after to add it
+ * to a histogram. iostat_elapsed and iostat_done return the time since
+ * the start, in microseconds; only iostat_done records it.
+ */
+void iostat_start(struct timespec *start);
+unsigned iostat_elapsed(const struct timespec *start);
+unsigned iostat_done(enum iohist which, const struct timespec *start);
+
+/*
+ * Record a trace event, if tracing is on. UNIT is the VFS device
+ * number, BLOCK and COUNT what was moved, in the device's units,
+ * QUEUED the time spent waiting and USECS the time spent doing it.
+ */
+void iotrace(char type, unsigned unit, uint32_t block, unsigned count,
+	     unsigned queued, unsigned usecs, int result);
+void iotrace_enable(bool on);
+void iotrace_clear(void);
+
+/* Print everything, for the menu. */
+void iostat_printstats(void);
+void iotrace_print(void);
+
+#endif /* _IOSTAT_H_ */
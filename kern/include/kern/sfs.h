@@ -51,6 +51,10 @@
 #define SFS_ROOTDIR_INO   1             /* loc'n of the root dir inode */
 #define SFS_GRAVEYARD_INO 2             /* loc'n of the root dir inode */
 
+/* Superblock flags (sb_flags) */
+#define SFS_SBF_FASTSUM   0x00000001    /* word-at-a-time data checksums */
+#define SFS_SBF_ALL       0x00000001    /* all flags we know about */
+
 /* Number of bits in a block */
 #define SFS_BITSPERBLOCK (SFS_BLOCKSIZE * CHAR_BIT)
 
@@ -90,7 +94,8 @@ struct sfs_superblock {
 	char sb_volname[SFS_VOLNAME_SIZE];	/* Name of this volume */
 	uint32_t sb_journalstart;		/* First block in journal */
 	uint32_t sb_journalblocks;		/* # of blocks in journal */
-	uint32_t reserved[116];			/* unused, set to 0 */
+	uint32_t sb_flags;			/* SFS_SBF_* */
+	uint32_t reserved[115];			/* unused, set to 0 */
 };
 
 /*
@@ -124,6 +129,8 @@ struct b_fsdata {
 	uint64_t oldest_lsn;
 	uint64_t newest_lsn;
 	struct buf *buf;
+	struct b_fsdata *dirty_prev;	/* dirty list, if oldest_lsn != 0 */
+	struct b_fsdata *dirty_next;
 };
 
 /*
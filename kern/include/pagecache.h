@@ -0,0 +1,74 @@
+#ifndef _PAGECACHE_H_
+#define _PAGECACHE_H_
+
+#include <types.h>
+
+struct vnode;
+struct uio;
+struct addrspace;
+
+/*
+ * Page cache. Pages of files mapped MAP_SHARED live in coremap frames
+ * indexed by (vnode, offset), one frame per file page no matter how many
+ * address spaces map it. read() and write() on a file go through the
+ * frames of any pages that are cached, so they see stores made through
+ * mappings and mappings see what they write.
+ *
+ * A page stays cached while something maps it or has it pinned. The last
+ * one out writes it back with VOP_WRITE, so it goes through the file
+ * system like any other write, and frees the frame. Under memory pressure
+ * the pageout daemon takes cold pages away from their mappings the same
+ * way (see pc_reclaim); the next touch reads them in again.
+ *
+ * Frames come from cm_alloc_npages, so the coremap's own eviction never
+ * picks them.
+ */
+
+void pc_bootstrap(void);
+
+/*
+ * Find or read in the page of V at OFFSET (page aligned) for a fault.
+ * The page comes back pinned in *RET; the caller maps it with pc_map
+ * under its pagetable lock, or gives up with pc_unpin. Must be called
+ * without any pagetable lock held.
+ */
+int pc_get(struct vnode *v, off_t offset, paddr_t *ret);
+
+/*
+ * Record that (AS, VA) now maps the pinned page at PADDR, and unpin it.
+ * The caller holds the pagetable lock of (AS, VA). ENOMEM if the
+ * mapping couldn't be recorded; the page is still pinned then.
+ */
+int pc_map(paddr_t paddr, struct addrspace *as, vaddr_t va);
+void pc_unpin(paddr_t paddr);
+
+/*
+ * Add a mapping (AS, VA) of a page already mapped elsewhere (fork). May
+ * be called with pagetable locks held.
+ */
+int pc_ref(paddr_t paddr, struct addrspace *as, vaddr_t va);
+
+/*
+ * Drop the mapping (AS, VA) of PADDR, after the pagetable entry has
+ * been cleared. Writes the page back and frees it if that was the last
+ * hold on it, so it must be called without pagetable locks.
+ */
+void pc_unref(paddr_t paddr, struct addrspace *as, vaddr_t va);
+
+/* A mapping of PADDR was written to. */
+void pc_set_dirty(paddr_t paddr);
+
+/* read()/write() through the cache. */
+int pc_read(struct vnode *v, struct uio *uio);
+int pc_write(struct vnode *v, struct uio *uio);
+
+/* Write back the dirty pages of V, or of every file if V is NULL. */
+int pc_sync(struct vnode *v);
+
+/*
+ * For the pageout daemon: take one cold page away from its mappings,
+ * write it back and free its frame. false if there was none to take.
+ */
+bool pc_reclaim(void);
+
+#endif /* _PAGECACHE_H_ */
@@ -1,51 +1,86 @@
-// TODO: pagetable interface goes here
-
-#ifndef _PAGETABLE_H_
-#define _PAGETABLE_H_
-
-#include <vm.h>
-#include <addrspace.h>
-#include <synch.h>
-
-#define PT_LEVEL_SIZE 1024
-
-/* Macros for access to the pagetable entry */
-#define PT_SET_DIRTY(PE) ((PE).p_addr |= DIRTY)
-#define PT_SET_CLEAN(PE) ((PE).p_addr &= !DIRTY)
-
-// Forward declare.
-struct addrspace;
-
-struct pt_entry {
-    paddr_t p_addr;			// The corresponding translation of the physical address. It will include both the 20 bit physical address and 10 bits of TLB flags 
-    short store_index;		// Where the entry is located in backing storage. Negative if not on disk.
-    bool in_memory;			// true if the page is in memory
-    bool allocated;			// true if the page has been allocated
-};
-
-struct pt_entry* pte_lock(struct addrspace *as, vaddr_t vaddr);
-struct pt_entry* pte_unlock(struct addrspace *as, vaddr_t vaddr);
-bool pte_locked(struct addrspace *as, vaddr_t vaddr);
-
-/* Create a new page table. The new page table will be associated with an addrspace. */
-struct pt_entry** pagetable_create(void);
-
-/* 
- * Creates a pagetable entry given a virtual address. The resulting 
- * pt_entry<->cm_entry pairing is guaranteed to be consistent (map correctly
- * to each other) and in memory.
- */
-struct pt_entry* pt_alloc_page(struct addrspace *as, vaddr_t v_addr);
-
-
-// Deallocate page
-void pt_dealloc_page(struct addrspace *as, vaddr_t v_addr);
-
-/*
- * Returns the page table entry from the current process's page table with the
- * specified virtual address
- */
-struct pt_entry* pt_get_entry(struct addrspace *as, vaddr_t v_addr);
-void pt_destroy(struct addrspace *as, struct pt_entry** pagetable);
-
+// TODO: pagetable interface goes here
+
+#ifndef _PAGETABLE_H_
+#define _PAGETABLE_H_
+
+#include <vm.h>
+#include <addrspace.h>
+#include <synch.h>
+
+#define PT_LEVEL_SIZE 1024
+
+// Forward declare.
+struct addrspace;
+
+/*
+ * A pagetable entry is one 32-bit word, so an L2 table is exactly one page.
+ * A resident page records its frame; the swap slot it owns (if any) is kept
+ * in the coremap entry for that frame. A page that is swapped out records
+ * its slot instead. 20 bits of slot number allow for 4GB of swap. A page
+ * of a shared file mapping is always resident while mapped; its frame is
+ * owned by the page cache, not by this address space.
+ */
+struct pt_entry {
+    unsigned frame : 20;		// Frame number if in_memory, swap slot otherwise
+    unsigned : 9;
+    unsigned pcache : 1;		// true if the frame belongs to the page cache
+    unsigned in_memory : 1;		// true if the page is in memory
+    unsigned allocated : 1;		// true if the page has been allocated
+};
+
+#define PT_MAX_SLOTS (1 << 20)
+
+/* Macros for access to the pagetable entry */
+#define PT_PADDR(PE) ((paddr_t)(PE)->frame << 12)
+#define PT_SLOT(PE) ((unsigned)(PE)->frame)
+#define PT_SET_RESIDENT(PE, PADDR) ((PE)->frame = (PADDR) >> 12, (PE)->in_memory = 1)
+#define PT_SET_SWAPPED(PE, SLOT) ((PE)->frame = (SLOT), (PE)->in_memory = 0)
+
+struct pt_entry* pte_lock(struct addrspace *as, vaddr_t vaddr);
+struct pt_entry* pte_unlock(struct addrspace *as, vaddr_t vaddr);
+bool pte_locked(struct addrspace *as, vaddr_t vaddr);
+
+/* Make sure the L2 table and lock covering vaddr exist. ENOMEM if not */
+int pt_prepare(struct addrspace *as, vaddr_t vaddr);
+
+/* Allocate a zeroed, page-sized L2 table. NULL if out of memory */
+struct pt_entry* pt_alloc_table(void);
+
+/*
+ * Lockless lookups. Anything that takes a resident page away or changes
+ * what a resident pte maps (eviction, cleaning, copy on write) brackets
+ * the change and its TLB shootdown with pt_write_begin/pt_write_end while
+ * holding the pte lock. A reader that wants to load a translation without
+ * the pte lock calls pt_read_begin, reads the pte with pt_peek_entry and
+ * loads the TLB with interrupts off, then checks pt_read_valid before
+ * turning interrupts back on, and undoes the TLB load if it fails.
+ */
+void pt_write_begin(struct addrspace *as);
+void pt_write_end(struct addrspace *as);
+bool pt_read_begin(struct addrspace *as, unsigned *seq);
+bool pt_read_valid(struct addrspace *as, unsigned seq);
+struct pt_entry* pt_peek_entry(struct addrspace *as, vaddr_t vaddr);
+
+/* Create a new page table. The new page table will be associated with an addrspace. */
+struct pt_entry** pagetable_create(void);
+
+/* 
+ * Creates a pagetable entry given a virtual address. The resulting 
+ * pt_entry<->cm_entry pairing is guaranteed to be consistent (map correctly
+ * to each other) and in memory. The page is zeroed, unless BUSY is set, in
+ * which case the caller fills it and clears the coremap busy bit.
+ */
+struct pt_entry* pt_alloc_page(struct addrspace *as, vaddr_t v_addr, bool busy);
+
+
+// Deallocate page
+void pt_dealloc_page(struct addrspace *as, vaddr_t v_addr);
+
+/*
+ * Returns the page table entry from the current process's page table with the
+ * specified virtual address
+ */
+struct pt_entry* pt_get_entry(struct addrspace *as, vaddr_t v_addr);
+void pt_destroy(struct addrspace *as, struct pt_entry** pagetable);
+
 #endif
\ No newline at end of file
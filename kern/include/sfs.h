@@ -71,6 +71,11 @@ struct sfs_vnode {
 	struct buf *sv_dinobuf;		/* buffer holding dinode */
 	uint32_t sv_dinobufcount;	/* # times dinobuf has been loaded */
 	struct lock *sv_lock;		/* lock for vnode */
+
+	/* read-ahead state (see sfs_io.c); protected by sv_lock */
+	uint32_t sv_ra_next;		/* block after the last read */
+	uint32_t sv_ra_window;		/* current window, in blocks */
+	uint32_t sv_ra_issued;		/* first block not yet prefetched */
 };
 
 /*
@@ -90,18 +95,40 @@ struct sfs_fs {
 
 	struct sfs_jphys *sfs_jphys;	/* physical journal container */
 
-	struct array *sfs_transactions;
+	/* running transactions, oldest first, and spares (sfs_trans.c) */
+	struct spinlock sfs_translock;
+	struct trans *sfs_transhead;
+	struct trans *sfs_transtail;
+	struct trans *sfs_transfree;
+
 	uint64_t newest_freemap_lsn;	/* most recent lsn of an operation modifying the freemap */
 	uint64_t oldest_freemap_lsn;	/* oldest unwritten lsn of an operation modifying the freemap */
-	struct lock *trans_lock;
+
+	/* buffers with journaled changes, oldest first (sfs_checkpoint.c) */
+	struct spinlock sfs_dirtylock;
+	struct b_fsdata *sfs_dirtyhead;
+	struct b_fsdata *sfs_dirtytail;
+
+	/* checkpoint thread (see sfs_checkpoint.c); under sfs_ckptlock */
+	struct lock *sfs_ckptlock;
+	struct cv *sfs_ckptcv;		/* wakes the checkpoint thread */
+	struct cv *sfs_ckptdonecv;	/* checkpoint done or thread gone */
+	bool sfs_ckptrunning;		/* thread exists */
+	bool sfs_ckptquit;		/* and should exit */
+	bool sfs_ckptwanted;		/* a checkpoint has been asked for */
+	bool sfs_ckptprogress;		/* the last one moved the tail */
+	unsigned sfs_ckptgen;		/* checkpoints taken */
+	uint64_t sfs_ckpttail;		/* lsn last trimmed to (checkpoint only) */
 };
 
-// We probably want to have 2 functions for transaction begin
-// and transaction commit. Which will modify the transction
-// table and assign the pids.
+// A running transaction. It belongs to the thread that began it
+// (curthread->t_trans, innermost first; reclaim can begin one inside
+// another) and sits on the volume's list in order of first_lsn.
 struct trans {
-	int id;
-	unsigned first_lsn;
+	struct sfs_fs *sfs;		/* volume it runs on */
+	uint64_t first_lsn;
+	struct trans *outer;		/* enclosing transaction, this thread */
+	struct trans *prev, *next;	/* sfs_transhead list, or free list */
 };
 
 /*
@@ -73,6 +73,9 @@ int sys_waitpid(pid_t pid, userptr_t returncode, int flags, pid_t *retval);
 int sys_getpid(pid_t *retval);
 int sys_execv(char* porgname, char** args, int *retval, bool iskernel);
 int sys_sbrk(int amount, int *retval);
+int sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+	     off_t offset, int *retval);
+int sys_munmap(userptr_t addr, size_t len);
 int sys_sync(void);
 int sys_mkdir(userptr_t path, mode_t mode);
 int sys_rmdir(userptr_t path);
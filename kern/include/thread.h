@@ -41,6 +41,7 @@
 #include <threadlist.h>
 
 struct cpu;
+struct trans;
 
 /* get machine-dependent defs */
 #include <machine/thread.h>
@@ -109,6 +110,9 @@ struct thread {
 
 	/* VFS */
 	bool t_did_reserve_buffers;	/* reserve_buffers() in effect */
+	unsigned t_iopri;		/* I/O priority class (IOPRI_*) */
+	unsigned t_dirtied_units;	/* buffer blocks dirtied this op */
+	struct trans *t_trans;		/* innermost fs transaction */
 
 	/* add more here as needed */
 };
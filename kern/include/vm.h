@@ -32,6 +32,8 @@
 
 #include <machine/vm.h>
 
+struct addrspace;
+
 /*
  * VM system-related definitions.
  *
@@ -52,9 +54,44 @@
 
 #define VM_STACKPAGES 18
 
+/* Fault and eviction counters, kept per cpu and summed by vm_printstats */
+enum vmstat {
+	VMSTAT_FAULT,		/* All calls to vm_fault */
+	VMSTAT_FAULT_TLB,	/* Page was resident; only the TLB missed */
+	VMSTAT_FAULT_FAST,	/* ...and was refilled without the pte lock */
+	VMSTAT_FAULT_ZERO,	/* First write to an anonymous page */
+	VMSTAT_FAULT_ZEROPAGE,	/* Read of an untouched page, given the zero page */
+	VMSTAT_FAULT_FILE,	/* First touch of a page read from an executable */
+	VMSTAT_FAULT_DISK,	/* Page read back in from the backing store */
+	VMSTAT_FAULT_COW,	/* Private copy of a page shared by fork */
+	VMSTAT_FAULT_PCACHE,	/* First touch of a shared file mapping */
+	VMSTAT_EVICT,		/* Pages evicted */
+	VMSTAT_EVICT_DIRTY,	/* ...of which had to be written out */
+	VMSTAT_REFSAMPLE,	/* TLB flushes done to sample references */
+	VMSTAT_TLB_PRELOAD,	/* Neighbouring pages mapped along with a fault */
+	VMSTAT_DIRECT_RECLAIM,	/* Faults that found no free frame and evicted */
+	VMSTAT_PAGEOUT_RECLAIM,	/* Frames freed by the pageout daemon */
+	VMSTAT_PAGEOUT_CLEAN,	/* Dirty pages written back by the pageout daemon */
+	VMSTAT_BUFFER_RECLAIM,	/* Times clean buffers were freed instead */
+	VMSTAT_READAROUND,	/* Neighbouring pages read in along with a fault */
+	VMSTAT_SWAP_READS,	/* Transfers from the backing store */
+	VMSTAT_SWAP_WRITES,	/* Transfers to the backing store */
+	VMSTAT_PCACHE_FILL,	/* Page cache pages read in */
+	VMSTAT_PCACHE_WRITEBACK,	/* Page cache pages written back */
+	VMSTAT_PCACHE_RECLAIM,	/* Page cache pages taken by the pageout daemon */
+	VMSTAT_NUM
+};
+
 /* Initialization function */
 void vm_bootstrap(void);
 
+/* Statistics */
+void vmstat_inc(enum vmstat which);
+void vm_printstats(void);
+
+/* Called from hardclock to drive reference sampling for page replacement */
+void vm_sample_references(void);
+
 /* Fault handling function called by trap code */
 int vm_fault(int faulttype, vaddr_t faultaddress);
 
@@ -70,4 +107,22 @@ void vm_tlbshootdown(const struct tlbshootdown *);
 void vm_tlbflush_all(void);
 void vm_tlbflush(vaddr_t target);
 
+/*
+ * Address space IDs. Translations are tagged with the ASID of the address
+ * space they belong to, so switching address spaces does not flush the TLB.
+ * vm_asid_invalidate retires an address space's ASID, which orphans all of
+ * its translations on every cpu at once.
+ */
+void vm_asid_activate(struct addrspace *as);
+void vm_asid_deactivate(void);
+void vm_asid_invalidate(struct addrspace *as);
+
+/*
+ * Invalidate pages of (possibly several) address spaces on every cpu that
+ * may hold translations for them, with one IPI per cpu. Sleeps until done.
+ */
+void vm_shootdown(struct addrspace *as, vaddr_t vaddr);
+void vm_shootdown_batch(struct addrspace *const *ases, const vaddr_t *vaddrs,
+                        unsigned n);
+
 #endif /* _VM_H_ */
@@ -46,6 +46,7 @@
 #include <mainbus.h>
 #include <vfs.h>
 #include <buf.h>
+#include <iostat.h>
 #include <device.h>
 #include <syscall.h>
 #include <test.h>
@@ -161,6 +162,9 @@ boot(void)
 	/* Buffer cache */
 	buffer_bootstrap();
 
+	/* I/O statistics device */
+	iostat_bootstrap();
+
 	/* Default bootfs - but ignore failure, in case emu0 doesn't exist */
 	vfs_setbootfs("emu0");
 
@@ -39,12 +39,18 @@
 #include <proc.h>
 #include <vfs.h>
 #include <buf.h>
+#include <iostat.h>
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
+#include <vm.h>
+#if !OPT_DUMBVM
+#include <coremap.h>
+#endif
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-dumbvm.h"
 
 /*
  * In-kernel menu and command dispatcher.
@@ -425,6 +431,87 @@ cmd_bufstats(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_iostats(int nargs, char **args)
+{
+	if (nargs == 1) {
+		(void)args;
+		iostat_printstats();
+	}
+	else {
+		kprintf("Usage: iostat\n");
+	}
+
+	return 0;
+}
+
+/*
+ * With no argument, print the I/O trace; otherwise turn it on or off,
+ * or empty it.
+ */
+static
+int
+cmd_iotrace(int nargs, char **args)
+{
+	if (nargs == 1) {
+		iotrace_print();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "on")) {
+		iotrace_enable(true);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "off")) {
+		iotrace_enable(false);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "clear")) {
+		iotrace_clear();
+	}
+	else {
+		kprintf("Usage: iotrace [on|off|clear]\n");
+	}
+
+	return 0;
+}
+
+#if !OPT_DUMBVM
+static
+int
+cmd_vmstats(int nargs, char **args)
+{
+	if (nargs == 1) {
+		(void)args;
+		vm_printstats();
+	}
+	else {
+		kprintf("Usage: vm\n");
+	}
+
+	return 0;
+}
+
+/*
+ * Select the page replacement policy. Meant to be given on the boot
+ * command line ahead of the program to run.
+ */
+static
+int
+cmd_vmpolicy(int nargs, char **args)
+{
+	if (nargs == 1) {
+		kprintf("%s\n", cm_get_evict_policy());
+	}
+	else if (nargs == 2 && cm_set_evict_policy(args[1]) == 0) {
+		kprintf("vm: page replacement policy is now %s\n",
+			cm_get_evict_policy());
+	}
+	else {
+		kprintf("Usage: vmpolicy [random|clock]\n");
+	}
+
+	return 0;
+}
+#endif
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -542,6 +629,12 @@ static const char *mainmenu[] = {
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
 	"[buf] Print buffer cache stats      ",
+	"[iostat] Print I/O latency stats    ",
+	"[iotrace] Print/control I/O trace   ",
+#if !OPT_DUMBVM
+	"[vm] Print VM fault/eviction stats  ",
+	"[vmpolicy] Set page replacement     ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -604,6 +697,12 @@ static struct {
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
 	{ "buf",        cmd_bufstats },
+	{ "iostat",     cmd_iostats },
+	{ "iotrace",    cmd_iotrace },
+#if !OPT_DUMBVM
+	{ "vm",         cmd_vmstats },
+	{ "vmpolicy",   cmd_vmpolicy },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
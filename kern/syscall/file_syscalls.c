@@ -15,6 +15,7 @@
 #include <vnode.h>
 #include <stat.h>
 #include <endian.h>
+#include <pagecache.h>
 
 /**
  * Opens the file/device/kernel object named by the pathname 'filename'. 'flags' specifies how to open the file.
@@ -117,7 +118,8 @@ int sys_read(int filehandle, void *buf, size_t size, int *retval)
 	read_uio.uio_rw = UIO_READ;
 	read_uio.uio_space = proc_getas();
 
-	err = VOP_READ(file->file_node, &read_uio);
+	// Mapped pages of the file may be newer than the file itself
+	err = pc_read(file->file_node, &read_uio);
 
 	// Still update stuff in case we manage to write some of the stuff before
 	// the error
@@ -176,7 +178,7 @@ int sys_write(int filehandle, const void *buf, size_t size, int *retval)
 	write_uio.uio_rw = UIO_WRITE;
 	write_uio.uio_space = proc_getas();
 
-	err = VOP_WRITE(file->file_node, &write_uio);
+	err = pc_write(file->file_node, &write_uio);
 
 	// Still update stuff in case we manage to write some of the stuff before
 	// the error
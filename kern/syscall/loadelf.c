@@ -42,8 +42,8 @@
  * circumstances, as_prepare_load and as_complete_load probably don't
  * need to do anything.
  *
- * If you wanted to support memory-mapped executables you would need
- * to rearrange this to map each segment.
+ * Without dumbvm, executables are memory-mapped: load_segment only
+ * attaches each segment to its region and pages are read on demand.
  *
  * To support dynamically linked executables with shared libraries
  * you'd need to change this to load the "ELF interpreter" (dynamic
@@ -52,6 +52,7 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/stat.h>
 #include <lib.h>
 #include <uio.h>
 #include <proc.h>
@@ -59,6 +60,9 @@
 #include <addrspace.h>
 #include <vnode.h>
 #include <elf.h>
+#include "opt-dumbvm.h"
+
+#if OPT_DUMBVM
 
 /*
  * Load a segment at virtual address VADDR. The segment in memory
@@ -145,6 +149,66 @@ load_segment(struct addrspace *as, struct vnode *v,
 	return result;
 }
 
+#else
+
+/*
+ * Load a segment at virtual address VADDR. The segment in memory
+ * extends from VADDR up to (but not including) VADDR+MEMSIZE. The
+ * segment on disk is located at file offset OFFSET and has length
+ * FILESIZE.
+ *
+ * FILESIZE may be less than MEMSIZE; if so the remaining portion of
+ * the in-memory segment should be zero-filled.
+ *
+ * Nothing is actually read here. The segment is attached to its
+ * region, and vm_fault reads each page from the executable the first
+ * time it is touched; pages past FILESIZE come up zero-filled. Since
+ * that doesn't go through uiomove, check here that the segment is in
+ * user space and that the file is long enough, so that a bad
+ * executable fails exec instead of faulting later.
+ */
+static
+int
+load_segment(struct addrspace *as, struct vnode *v,
+	     off_t offset, vaddr_t vaddr,
+	     size_t memsize, size_t filesize,
+	     int is_executable)
+{
+	struct stat st;
+	int result;
+
+	(void)is_executable;
+
+	if (filesize > memsize) {
+		kprintf("ELF: warning: segment filesize > segment memsize\n");
+		filesize = memsize;
+	}
+
+	if (vaddr + memsize < vaddr || vaddr + memsize > USERSPACETOP) {
+		return EFAULT;
+	}
+
+	result = VOP_STAT(v, &st);
+	if (result) {
+		return result;
+	}
+	if (offset + (off_t)filesize > st.st_size) {
+		/* short read; problem with executable? */
+		kprintf("ELF: short read on segment - file truncated?\n");
+		return ENOEXEC;
+	}
+
+	DEBUG(DB_EXEC, "ELF: Mapping %lu bytes at 0x%lx\n",
+	      (unsigned long) filesize, (unsigned long) vaddr);
+
+	if (filesize == 0) {
+		return 0;
+	}
+	return as_define_file(as, v, offset, vaddr, filesize);
+}
+
+#endif /* OPT_DUMBVM */
+
 /*
  * Load an ELF executable user program into the current address space.
  *
@@ -0,0 +1,80 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/mman.h>
+#include <lib.h>
+#include <proc.h>
+#include <current.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <vnode.h>
+#include <file.h>
+#include <syscall.h>
+
+/*
+ * mmap - map part of an open file. Shared mappings go through the page
+ * cache; private ones are read in on first touch like an executable and
+ * are anonymous memory from then on. The address is always chosen by
+ * us, so ADDR is only a hint, and one we don't take.
+ */
+int
+sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+	 off_t offset, int *retval)
+{
+	struct file_obj *file;
+	struct vnode *v;
+	vaddr_t va;
+	int mode, err;
+
+	(void)addr;
+
+	if (len == 0 || offset < 0 || offset % PAGE_SIZE != 0) {
+		return EINVAL;
+	}
+	if (flags != MAP_SHARED && flags != MAP_PRIVATE) {
+		return EINVAL;
+	}
+	if (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) {
+		return EINVAL;
+	}
+
+	err = filetable_get(curproc->p_filetable, fd, &file);
+	if (err) {
+		return err;
+	}
+	v = file->file_node;
+	mode = file->file_mode & O_ACCMODE;
+
+	// The mapping has to be readable, and a shared one can only be
+	// written if the file can
+	if (mode == O_WRONLY ||
+	    (flags == MAP_SHARED && (prot & PROT_WRITE) && mode != O_RDWR)) {
+		filetable_put(curproc->p_filetable, fd, file);
+		return EACCES;
+	}
+
+	err = VOP_MMAP(v);
+	if (err == 0) {
+		err = as_define_mmap(curproc->p_addrspace, v, offset, len,
+				     prot, flags, &va);
+	}
+	filetable_put(curproc->p_filetable, fd, file);
+	if (err) {
+		return err;
+	}
+
+	*retval = (int)va;
+	return 0;
+}
+
+/*
+ * munmap - remove a mapping made by mmap. It has to be removed whole.
+ */
+int
+sys_munmap(userptr_t addr, size_t len)
+{
+	if ((vaddr_t)addr % PAGE_SIZE != 0 || len == 0) {
+		return EINVAL;
+	}
+	return as_munmap(curproc->p_addrspace, (vaddr_t)addr, len);
+}
@@ -47,6 +47,7 @@
 #include <vnode.h>
 #include <file.h>
 #include <syscall.h>
+#include <pagecache.h>
 
 /*
  * Note: if you are receiving this code as a patch to integrate with
@@ -107,14 +108,18 @@
 
 
 /*
- * sync - call vfs_sync
+ * sync - write back mapped pages, then call vfs_sync
  */
 int
 sys_sync(void)
 {
-	int err;
+	int err, pcerr;
 
+	pcerr = pc_sync(NULL);
 	err = vfs_sync();
+	if (err == 0) {
+		err = pcerr;
+	}
 	if (err==EIO) {
 		/* This is the only likely failure case */
 		kprintf("Warning: I/O error during sync\n");
@@ -365,7 +370,7 @@ sys_fstat(int fd, userptr_t statptr)
 }
 
 /*
- * fsync - call VOP_FSYNC
+ * fsync - write back mapped pages, then call VOP_FSYNC
  */
 int
 sys_fsync(int fd)
@@ -383,7 +388,10 @@ sys_fsync(int fd)
 	 * and we're not using any of its non-constant fields.
 	 */
 
-	err = VOP_FSYNC(file->file_node);
+	err = pc_sync(file->file_node);
+	if (err == 0) {
+		err = VOP_FSYNC(file->file_node);
+	}
 	filetable_put(curproc->p_filetable, fd, file);
 	return err;
 }
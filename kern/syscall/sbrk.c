@@ -35,12 +35,14 @@ sys_sbrk(int amount, int *retval) {
         return EINVAL;
     }
 
-    SBRK_DEBUG("new heap_end = %x, stack top = %x\n", as->heap_end + amount, USERSTACK - VM_STACKPAGES * PAGE_SIZE);
-    if (as->heap_end + amount < USERSTACK - VM_STACKPAGES * PAGE_SIZE) {
+    // The heap grows up towards the mmap regions, which sit below the stack
+    SBRK_DEBUG("new heap_end = %x, mmap base = %x\n", as->heap_end + amount, as->mmap_base);
+    if (as->heap_end + amount < as->mmap_base) {
         cm_mem_change(-amount);
         as->heap_end += amount;
         return 0;
     }
 
-    panic("sbrk not handled");
+    SBRK_DEBUG("heap would run into mmap regions\n");
+    return ENOMEM;
 }
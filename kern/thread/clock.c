@@ -34,6 +34,8 @@
 #include <clock.h>
 #include <thread.h>
 #include <current.h>
+#include <vm.h>
+#include <buf.h>
 
 /*
  * Time handling.
@@ -83,6 +85,8 @@ timerclock(void)
 	spinlock_acquire(&lbolt_lock);
 	wchan_wakeall(lbolt, &lbolt_lock);
 	spinlock_release(&lbolt_lock);
+
+	buffer_timer();
 }
 
 /*
@@ -103,6 +107,7 @@ hardclock(void)
 	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
 		schedule();
 	}
+	vm_sample_references();
 
 	// Kick off threads when their time runs out
 	curthread->time_left--;
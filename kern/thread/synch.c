@@ -191,6 +191,21 @@ lock_acquire(struct lock *lock)
         spinlock_release(&lock->lk_lock);
 }
 
+bool
+lock_tryacquire(struct lock *lock)
+{
+        bool got;
+
+        KASSERT(!lock_do_i_hold(lock));
+        spinlock_acquire(&lock->lk_lock);
+        got = lock->lk_holder == NULL;
+        if (got) {
+                lock->lk_holder = curthread;
+        }
+        spinlock_release(&lock->lk_lock);
+        return got;
+}
+
 void
 lock_release(struct lock *lock)
 {
@@ -49,7 +49,9 @@
 #include <synch.h>
 #include <addrspace.h>
 #include <mainbus.h>
+#include <platform/maxcpus.h>
 #include <vnode.h>
+#include <device.h>
 
 #include "opt-synchprobs.h"
 
@@ -160,6 +162,9 @@ thread_create(const char *name)
 
 	/* VFS fields */
 	thread->t_did_reserve_buffers = false;
+	thread->t_iopri = IOPRI_NORMAL;
+	thread->t_dirtied_units = 0;
+	thread->t_trans = NULL;
 
 	/* If you add to struct thread, be sure to initialize here */
 
@@ -205,6 +210,12 @@ cpu_create(unsigned hardware_number)
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
+	c->c_shootdown_seq = 0;
+	c->c_shootdown_done = 0;
+	c->c_shootdown_wchan = wchan_create("shootdown");
+	if (c->c_shootdown_wchan == NULL) {
+		panic("cpu_create: Out of memory\n");
+	}
 	spinlock_init(&c->c_ipi_lock);
 
 	result = cpuarray_add(&allcpus, c, &c->c_number);
@@ -267,6 +278,7 @@ thread_destroy(struct thread *thread)
 
 	/* VFS fields, cleaned up in thread_exit */
 	KASSERT(thread->t_did_reserve_buffers == false);
+	KASSERT(thread->t_trans == NULL);
 
 	/* Thread subsystem fields */
 	KASSERT(thread->t_proc == NULL);
@@ -862,6 +874,7 @@ thread_exit(void)
 	cur = curthread;
 
 	KASSERT(cur->t_did_reserve_buffers == false);
+	KASSERT(cur->t_trans == NULL);
 
 	/*
 	 * Detach from our process. You might need to move this action
@@ -1282,41 +1295,89 @@ ipi_broadcast(int code)
 void
 ipi_tlbshootdown_allcpus(const struct tlbshootdown *mapping)
 {
-	struct cpu *c;
-	unsigned i, numcpus;
-
-	numcpus = cpuarray_num(&allcpus);
-	for (i = 0; i < numcpus; i++) {
-		c = cpuarray_get(&allcpus, i);
-		ipi_tlbshootdown(c, mapping);
-	}
-	for (i = 0; i < numcpus; i++) {
-		P(mapping->sem);
-	}
+	ipi_tlbshootdown_cpus(0xffffffff, mapping, 1);
 }
 
-void
-ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
+/*
+ * Queue mappings on a cpu and send it one IPI. If they don't all fit
+ * in c_shootdown, the cpu will flush its whole TLB instead. Returns
+ * the ticket to wait for. Caller holds the target's IPI lock.
+ */
+static
+unsigned
+ipi_tlbshootdown_queue(struct cpu *target,
+		       const struct tlbshootdown *mappings, unsigned n)
 {
-	int n;
+	unsigned i;
+	int num;
 
-	spinlock_acquire(&target->c_ipi_lock);
+	KASSERT(spinlock_do_i_hold(&target->c_ipi_lock));
 
-	n = target->c_numshootdown;
-	if (n == TLBSHOOTDOWN_MAX) {
-		target->c_numshootdown = TLBSHOOTDOWN_ALL;
-	}
-	else {
-		target->c_shootdown[n] = *mapping;
-		target->c_numshootdown = n+1;
+	for (i = 0; i < n; i++) {
+		num = target->c_numshootdown;
+		if (num == TLBSHOOTDOWN_ALL) {
+			break;
+		}
+		if (num == TLBSHOOTDOWN_MAX) {
+			target->c_numshootdown = TLBSHOOTDOWN_ALL;
+			break;
+		}
+		target->c_shootdown[num] = mappings[i];
+		target->c_numshootdown = num+1;
 	}
 
 	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
 	mainbus_send_ipi(target);
 
+	return ++target->c_shootdown_seq;
+}
+
+void
+ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
+{
+	spinlock_acquire(&target->c_ipi_lock);
+	ipi_tlbshootdown_queue(target, mapping, 1);
 	spinlock_release(&target->c_ipi_lock);
 }
 
+/*
+ * Shoot down a batch of mappings on every cpu whose number is set in
+ * CPUMASK (including this one, if set), and wait until they have all
+ * been invalidated. All the IPIs go out before we wait on any of them.
+ */
+void
+ipi_tlbshootdown_cpus(uint32_t cpumask,
+		      const struct tlbshootdown *mappings, unsigned n)
+{
+	struct cpu *c;
+	unsigned i, numcpus;
+	unsigned tickets[MAXCPUS];
+
+	numcpus = cpuarray_num(&allcpus);
+	KASSERT(numcpus <= MAXCPUS);
+
+	for (i = 0; i < numcpus; i++) {
+		if ((cpumask & ((uint32_t)1 << i)) == 0) {
+			continue;
+		}
+		c = cpuarray_get(&allcpus, i);
+		spinlock_acquire(&c->c_ipi_lock);
+		tickets[i] = ipi_tlbshootdown_queue(c, mappings, n);
+		spinlock_release(&c->c_ipi_lock);
+	}
+	for (i = 0; i < numcpus; i++) {
+		if ((cpumask & ((uint32_t)1 << i)) == 0) {
+			continue;
+		}
+		c = cpuarray_get(&allcpus, i);
+		spinlock_acquire(&c->c_ipi_lock);
+		while ((int)(c->c_shootdown_done - tickets[i]) < 0) {
+			wchan_sleep(c->c_shootdown_wchan, &c->c_ipi_lock);
+		}
+		spinlock_release(&c->c_ipi_lock);
+	}
+}
+
 void
 interprocessor_interrupt(void)
 {
@@ -1359,6 +1420,8 @@ interprocessor_interrupt(void)
 			}
 		}
 		curcpu->c_numshootdown = 0;
+		curcpu->c_shootdown_done = curcpu->c_shootdown_seq;
+		wchan_wakeall(curcpu->c_shootdown_wchan, &curcpu->c_ipi_lock);
 	}
 
 	curcpu->c_ipi_pending = 0;
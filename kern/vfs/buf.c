@@ -32,24 +32,49 @@
 #include <lib.h>
 #include <array.h>
 #include <clock.h>
+#include <spinlock.h>
+#include <wchan.h>
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
 #include <mainbus.h>
 #include <vfs.h>
 #include <fs.h>
+#include <device.h>
+#include <vm.h>
+#include <coremap.h>
 #include <buf.h>
+#include <iostat.h>
 
 DECLARRAY(buf, static __UNUSED inline);
 DEFARRAY(buf, static __UNUSED inline);
 
 /*
- * The required size for all buffers. This is the size SFS uses. In a
- * real system you wouldn't have this restriction, but for us managing
- * buffers of different sizes just creates complications and would
- * serve no purpose.
+ * Buffer sizes. The smallest buffer is one sector, the block size SFS
+ * uses for everything; larger buffers hold a run of consecutive
+ * blocks, so that file data can be cached (and moved to and from the
+ * disk) in bigger pieces.
+ *
+ * A buffer of N blocks, where N must be a power of two, starts at a
+ * block number that is a multiple of N. So a block can be covered by
+ * at most one buffer of each size, all of those lie in the same
+ * MAX_BUFFER_BLOCKS-aligned group, and the group always hashes to the
+ * same partition. Buffers may not overlap; asking for one that would
+ * overlap others writes the others out and drops them first.
+ *
+ * Memory is accounted in MIN_BUFFER_SIZE units.
+ */
+#define MIN_BUFFER_SIZE			512
+#define MAX_BUFFER_SIZE			4096
+#define MAX_BUFFER_BLOCKS		(MAX_BUFFER_SIZE / MIN_BUFFER_SIZE)
+#define BUFFER_UNITS(size)		((size) / MIN_BUFFER_SIZE)
+
+/*
+ * Number of partitions the cache is split into. Each block always
+ * hashes to the same partition, and each partition has its own lock,
+ * so threads working on unrelated blocks don't wait for each other.
  */
-#define ONE_TRUE_BUFFER_SIZE		512
+#define BUFFER_PARTITIONS		16
 
 /*
  * Illegal array index.
@@ -76,9 +101,10 @@ DEFARRAY(buf, static __UNUSED inline);
  */
 struct buf {
 	/* maintenance */
-	unsigned b_tableindex;	/* index into {de,at}tached_buffers */
-	unsigned b_dirtyindex;	/* index into dirty_buffers */
-	unsigned b_bucketindex;	/* index into buffer_hash bucket */
+	struct bufpart *b_part;	/* partition we belong to */
+	unsigned b_tableindex;	/* index into {de,at}tached buffers */
+	unsigned b_dirtyindex;	/* index into dirty buffers */
+	unsigned b_bucketindex;	/* index into hash bucket */
 	unsigned b_dirtyepoch;	/* when we became dirty */
 
 	/* status flags */
@@ -87,6 +113,9 @@ struct buf {
 	unsigned b_valid:1;	/* contains real data */
 	unsigned b_dirty:1;	/* data needs to be written to disk */
 	unsigned b_fsmanaged:1;	/* managed by file system */
+	unsigned b_prefetched:1; /* read ahead and not used yet */
+	unsigned b_hot:1;	/* in the main queue, not on probation */
+	unsigned b_referenced:1; /* used since reclaim last looked */
 	struct thread *b_holder; /* who did buffer_mark_busy() */
 	struct timespec b_timestamp; /* when it became dirty */
 
@@ -101,6 +130,15 @@ struct buf {
 	void *b_fsdata;		/* fs-specific metadata */
 };
 
+/*
+ * A ghost: the key of a buffer recently evicted from probation.
+ */
+struct bufghost {
+	struct fs *bg_fs;	/* NULL if unused */
+	daddr_t bg_block;
+	unsigned bg_next;	/* next slot in same hash chain */
+};
+
 /*
  * Buffer hash table.
  */
@@ -110,84 +148,174 @@ struct bufhash {
 };
 
 /*
- * Global state.
+ * One partition of the cache.
  *
- * The main table of buffers is attached_buffers[]. This is an
- * LRU-ordered array. All buffers in attached_buffers[] should be
- * attached (that is, they are associated with a specific fs and
- * block), and should also be in buffer_hash.
+ * The main table of buffers is bp_attached. This is an LRU-ordered
+ * array. All buffers in bp_attached should be attached (that is, they
+ * are associated with a specific fs and block), and should also be in
+ * bp_hash.
  *
- * Buffers that are dirty *also* appear in dirty_buffers[]; this array
- * is ordered by how recently the buffer was *first* modified.
+ * Buffers that are dirty *also* appear in bp_dirty; this array is
+ * ordered by how recently the buffer was *first* modified.
  *
- * Buffers that are not attached appear (only) in detached_buffers[],
- * which is not ordered.
+ * Buffers that are not attached appear (only) in bp_detached, which
+ * is not ordered.
+ *
+ * Replacement is 2Q. A newly attached buffer is on probation: it
+ * keeps its place in bp_attached when used, so probationary buffers
+ * age in FIFO order, and the first to go when they take up more than
+ * their share (TWOQ_IN) of the partition. When one is evicted its key
+ * goes into bp_ghosts, and a miss that finds its key there means the
+ * block is being reused after all, so the new buffer goes straight
+ * into the main queue (b_hot). Main-queue buffers move to the recent
+ * end when used, like plain LRU. A big sequential read thus cycles
+ * through the probationary buffers without pushing out the directory
+ * and inode blocks in the main queue.
  *
  * Space in all three arrays is preallocated when buffers are created
  * so insert ops won't fail on the fly.
  *
- * The ordered arrays (attached_buffers and dirty_buffers) are
- * preallocated with extra space (and may contain NULL entries) and
- * are compacted only when the extra space runs out.
+ * The ordered arrays (bp_attached and bp_dirty) are preallocated with
+ * extra space (and may contain NULL entries) and are compacted only
+ * when the extra space runs out.
+ *
+ * Epochs and generations: the dirty epoch is incremented whenever an
+ * explicit sync call is made, and is used to know when to stop
+ * syncing. The dirty generation, conversely, is incremented whenever
+ * bp_dirty is compacted so syncs in progress know they need to
+ * restart from the beginning of it. The attached generation is the
+ * same, but for bp_attached.
+ *
+ * Everything here is protected by bp_lock. A buffer normally stays
+ * in one partition for its whole life; a partition whose buffers are
+ * all busy takes an idle one from another partition (see
+ * buffer_steal) rather than fail.
  */
+struct bufpart {
+	struct lock *bp_lock;
+	struct cv *bp_busy_cv;
+
+	struct bufhash bp_hash;
+
+	struct bufarray bp_attached;
+	unsigned bp_attached_first;	/* hint for first empty element */
+	unsigned bp_attached_thresh;	/* size limit before compacting */
+
+	struct bufarray bp_dirty;
+	unsigned bp_dirty_first;	/* hint for first empty element */
+	unsigned bp_dirty_thresh;	/* size limit before compacting */
+
+	struct bufarray bp_detached;
+
+	unsigned bp_dirty_epoch;
+	unsigned bp_dirty_generation;
+	unsigned bp_attached_generation;
+
+	struct bufghost *bp_ghosts;	/* ring of recently evicted keys */
+	unsigned bp_num_ghosts;		/* size of ring */
+	unsigned bp_next_ghost;		/* next ring slot to overwrite */
+	unsigned *bp_ghost_buckets;	/* hash chains of ring slots */
+
+	/* counters */
+	unsigned bp_num_buffers;	/* attached plus detached */
+	unsigned bp_num_units;		/* size of those buffers */
+	unsigned bp_num_large;		/* attached and bigger than a block */
+	unsigned bp_attached_count;
+	unsigned bp_busy_count;
+	unsigned bp_dirty_count;
+	unsigned bp_probation_units;	/* attached and not b_hot */
+
+	/* stats */
+	unsigned bp_total_gets;
+	unsigned bp_valid_gets;
+	unsigned bp_read_gets;
+	unsigned bp_total_writeouts;
+	unsigned bp_total_evictions;
+	unsigned bp_dirty_evictions;
+	unsigned bp_steals;
+	unsigned bp_overlaps;
+	unsigned bp_prefetches;
+	unsigned bp_prefetch_hits;
+	unsigned bp_ghost_hits;
+	unsigned bp_reclaims;		/* units freed by buffer_reclaim */
+};
 
-static struct bufhash buffer_hash;
-
-static struct bufarray attached_buffers;
-static unsigned attached_buffers_first;   /* hint for first empty element */
-static unsigned attached_buffers_thresh;  /* size limit before compacting */
-
-static struct bufarray dirty_buffers;
-static unsigned dirty_buffers_first;      /* hint for first empty element */
-static unsigned dirty_buffers_thresh;     /* size limit before compacting */
+/*
+ * Global state.
+ */
 
-static struct bufarray detached_buffers;
+static struct bufpart buffer_parts[BUFFER_PARTITIONS];
 
 /*
- * Epochs and generations.
+ * Counters shared by all partitions, in MIN_BUFFER_SIZE units.
+ * num_total_units and max_total_units are protected by
+ * buffer_total_lock; the reservation count by buffer_reserve_lock.
  *
- * The dirty_epoch is incremented whenever an explicit sync call is
- * made, and is used to know when to stop syncing. The
- * dirty_buffers_generation, conversely, is incremented whenever the
- * dirty_buffers table is compacted so syncs in progress know they
- * need to restart from the beginning of it. The attached_buffers
- * generation is the same, but for the attached_buffers table.
+ * max_total_units is how big the cache may get right now. It moves
+ * between min_total_units and grow_total_units as the VM system
+ * takes memory back (buffer_reclaim) or has plenty to spare
+ * (buffer_grow). It is never below num_total_units.
  */
 
-static unsigned dirty_epoch;
-static unsigned dirty_buffers_generation;
-static unsigned attached_buffers_generation;
+static struct spinlock buffer_total_lock;
+static unsigned num_total_units;
+static unsigned max_total_units;
+static unsigned min_total_units;
+static unsigned grow_total_units;
+
+static struct lock *buffer_reserve_lock;
+static struct cv *buffer_reserve_cv;
+static unsigned num_reserved_buffers;
 
 /*
- * Counters.
+ * Write-behind. num_dirty_units counts dirty buffers, and
+ * num_written_units everything written out since boot, in
+ * MIN_BUFFER_SIZE units; both are protected by buffer_total_lock.
+ *
+ * The syncer sleeps on syncer_wchan until someone sets syncer_wanted:
+ * buffer_mark_dirty when the dirty count passes the background
+ * threshold, or buffer_timer when syncer_ticks (seconds until the
+ * oldest dirty buffer expires) runs out. Writers being throttled wait
+ * on buffer_throttle_cv, which the syncer signals as it writes;
+ * syncer_rounds counts its runs so they can give up waiting.
  */
 
-static unsigned attached_buffers_count;
-static unsigned busy_buffers_count;
-static unsigned dirty_buffers_count;
+static unsigned num_dirty_units;
+static unsigned num_written_units;
 
-static unsigned num_reserved_buffers;
-static unsigned num_total_buffers;
-static unsigned max_total_buffers;
+static struct spinlock syncer_lock;
+static struct wchan *syncer_wchan;
+static bool syncer_wanted;
+static unsigned syncer_ticks;
+static unsigned syncer_ratio_wakeups;		/* stats */
+static unsigned syncer_age_wakeups;		/* stats */
 
-static unsigned num_total_gets;
-static unsigned num_valid_gets;
-static unsigned num_read_gets;
-static unsigned num_total_writeouts;
-static unsigned num_total_evictions;
-static unsigned num_dirty_evictions;
+static struct lock *buffer_throttle_lock;
+static struct cv *buffer_throttle_cv;
+static unsigned syncer_rounds;
+static unsigned syncer_written_units;		/* stats */
+static unsigned throttled_writers;		/* stats */
+static unsigned throttled_rounds;		/* stats */
 
 /*
- * Lock
+ * Read-ahead queue, protected by buffer_prefetch_lock. See
+ * buffer_prefetch.
  */
 
-static struct lock *buffer_lock;
+#define PREFETCH_QUEUE		32
 
-/*
- * CVs
- */
-static struct cv *buffer_busy_cv;
-static struct cv *buffer_reserve_cv;
+struct prefetch {
+	struct fs *pf_fs;
+	daddr_t pf_block;
+	size_t pf_size;
+};
+
+static struct lock *buffer_prefetch_lock;
+static struct cv *buffer_prefetch_cv;		/* queue not empty */
+static struct cv *buffer_prefetch_done_cv;	/* prefetcher went idle */
+static struct prefetch prefetch_queue[PREFETCH_QUEUE];
+static unsigned prefetch_head, prefetch_count;
+static struct fs *prefetch_busy_fs;		/* fs being read, if any */
 
 /*
  * Magic numbers (also search the code for "voodoo:")
@@ -198,14 +326,18 @@ static struct cv *buffer_reserve_cv;
  * factor buffer reservation calls into some of these decisions somehow.
  */
 
-/* Number of buffers to reserve for each file system operation. */
+/*
+ * Number of buffers to reserve for each file system operation, and
+ * the units that takes when one of them may be as big as possible.
+ */
 #define RESERVE_BUFFERS		8
+#define RESERVE_UNITS		(RESERVE_BUFFERS - 1 + MAX_BUFFER_BLOCKS)
 
-/* Factor for choosing attached_buffers_thresh. */
+/* Factor for choosing bp_attached_thresh. */
 #define ATTACHED_THRESH_NUM	3
 #define ATTACHED_THRESH_DENOM	2
 
-/* Factor for choosing dirty_buffers_thresh. */
+/* Factor for choosing bp_dirty_thresh. */
 #define DIRTY_THRESH_NUM	5
 #define DIRTY_THRESH_DENOM	4
 
@@ -217,24 +349,47 @@ static struct cv *buffer_reserve_cv;
 #define SYNCER_IFOLD_NUM	2
 #define SYNCER_IFOLD_DENOM	5
 
-#if 0
-/* Threshold proportion (of bufs dirty) for starting the syncer */
-#define SYNCER_DIRTY_NUM	1
-#define SYNCER_DIRTY_DENOM	2
+/* Proportion of buffers dirty at which the syncer starts writing. */
+#define SYNCER_BACKGROUND_NUM	1
+#define SYNCER_BACKGROUND_DENOM	10
+
+/* Proportion of buffers dirty past which writers are throttled. */
+#define SYNCER_THROTTLE_NUM	1
+#define SYNCER_THROTTLE_DENOM	4
 
-/* Target proportion (of total bufs) for syncer to clean in one run */
-#define SYNCER_TARGET_NUM	1
-#define SYNCER_TARGET_DENOM	4
+/* Seconds a buffer may stay dirty before the syncer writes it anyway. */
+#define SYNCER_EXPIRE		2
 
-/* Limit on the previous proportion, as proportion of dirty buffers */
-#define SYNCER_LIMIT_NUM	1
-#define SYNCER_LIMIT_DENOM	2
-#endif
+/* Most buffers the syncer sorts and writes in one run. */
+#define SYNCER_BATCH		64
 
-/* Overall limit on fraction of main memory to use for buffers */
+/* Most syncer runs a throttled writer waits for. */
+#define THROTTLE_MAXROUNDS	4
+
+/* 2Q: share of a partition for buffers on probation */
+#define TWOQ_IN_NUM		1
+#define TWOQ_IN_DENOM		4
+
+/* 2Q: ghosts kept per partition, as a proportion of its share */
+#define TWOQ_OUT_NUM		1
+#define TWOQ_OUT_DENOM		2
+
+/* Fraction of main memory to use for buffers at first */
 #define BUFFER_MAXMEM_NUM	1
 #define BUFFER_MAXMEM_DENOM	4
 
+/* Least fraction of main memory the VM system can shrink us to */
+#define BUFFER_MINMEM_NUM	1
+#define BUFFER_MINMEM_DENOM	16
+
+/* Most fraction of main memory we'll grow to when it's free anyway */
+#define BUFFER_GROWMEM_NUM	1
+#define BUFFER_GROWMEM_DENOM	2
+
+/* How much of main memory to grow by per syncer run */
+#define BUFFER_GROWSTEP_NUM	1
+#define BUFFER_GROWSTEP_DENOM	64
+
 /* Macro for applying a NUM/DENOM pair. */
 #define SCALE(x, K) (((x) * K##_NUM) / K##_DENOM)
 
@@ -242,32 +397,36 @@ static struct cv *buffer_reserve_cv;
  * Forward declaration (XXX: reorg to make this go away)
  */
 static void buffer_release_internal(struct buf *b);
+static void buffer_grow(void);
 
 ////////////////////////////////////////////////////////////
 // state invariants
 
 /*
- * Check consistency of the global state.
+ * Check consistency of a partition.
  */
 static
 void
-bufcheck(void)
+bufcheck(struct bufpart *bp)
 {
-	KASSERT(attached_buffers_count <= bufarray_num(&attached_buffers));
-	KASSERT(attached_buffers_first <= bufarray_num(&attached_buffers));
-	KASSERT(bufarray_num(&attached_buffers) <= attached_buffers_thresh);
+	KASSERT(lock_do_i_hold(bp->bp_lock));
 
-	KASSERT(dirty_buffers_count <= bufarray_num(&dirty_buffers));
-	KASSERT(dirty_buffers_first <= bufarray_num(&dirty_buffers));
-	KASSERT(bufarray_num(&dirty_buffers) <= dirty_buffers_thresh);
+	KASSERT(bp->bp_attached_count <= bufarray_num(&bp->bp_attached));
+	KASSERT(bp->bp_attached_first <= bufarray_num(&bp->bp_attached));
+	KASSERT(bufarray_num(&bp->bp_attached) <= bp->bp_attached_thresh);
 
-	KASSERT(bufarray_num(&detached_buffers) + attached_buffers_count
-		== num_total_buffers);
-	// This is not true any more, because busy_buffers_count now
+	KASSERT(bp->bp_dirty_count <= bufarray_num(&bp->bp_dirty));
+	KASSERT(bp->bp_dirty_first <= bufarray_num(&bp->bp_dirty));
+	KASSERT(bufarray_num(&bp->bp_dirty) <= bp->bp_dirty_thresh);
+
+	KASSERT(bufarray_num(&bp->bp_detached) + bp->bp_attached_count
+		== bp->bp_num_buffers);
+	// This is not true any more, because bp_busy_count now
 	// includes buffers marked busy by syncing.
-	//KASSERT(busy_buffers_count <= num_reserved_buffers);
-	KASSERT(num_reserved_buffers <= max_total_buffers);
-	KASSERT(num_total_buffers <= max_total_buffers);
+	//KASSERT(bp_busy_count <= num_reserved_buffers);
+	KASSERT(bp->bp_num_buffers <= bp->bp_num_units);
+	KASSERT(bp->bp_probation_units <= bp->bp_num_units);
+	KASSERT(bp->bp_num_units <= max_total_units);
 }
 
 ////////////////////////////////////////////////////////////
@@ -415,6 +574,48 @@ buffer_hashfunc(struct fs *fs, daddr_t physblock)
 	return val;
 }
 
+/*
+ * Choose the partition for a block. All the blocks in one
+ * MAX_BUFFER_BLOCKS-aligned group share a partition, so that buffers
+ * that might overlap are always under the same lock; consecutive
+ * groups are spread over all the partitions.
+ */
+static
+struct bufpart *
+buffer_partition(struct fs *fs, daddr_t physblock)
+{
+	unsigned hash;
+
+	hash = buffer_hashfunc(fs, physblock / MAX_BUFFER_BLOCKS);
+	return &buffer_parts[hash % BUFFER_PARTITIONS];
+}
+
+/*
+ * Hash a block within its partition, leaving out the bits that chose
+ * the partition.
+ */
+static
+unsigned
+buffer_parthashfunc(struct fs *fs, daddr_t physblock)
+{
+	daddr_t key;
+
+	key = physblock % MAX_BUFFER_BLOCKS +
+		physblock / MAX_BUFFER_BLOCKS / BUFFER_PARTITIONS
+		* MAX_BUFFER_BLOCKS;
+	return buffer_hashfunc(fs, key);
+}
+
+/*
+ * Choose the bucket for a block within its partition's bufhash.
+ */
+static
+unsigned
+bufhash_bucket(struct bufhash *bh, struct fs *fs, daddr_t physblock)
+{
+	return buffer_parthashfunc(fs, physblock) % bh->bh_numbuckets;
+}
+
 /*
  * Add a buffer to a bufhash.
  */
@@ -422,12 +623,11 @@ static
 int
 bufhash_add(struct bufhash *bh, struct buf *b)
 {
-	unsigned hash, bn;
+	unsigned bn;
 
 	KASSERT(b->b_bucketindex == INVALID_INDEX);
 
-	hash = buffer_hashfunc(b->b_fs, b->b_physblock);
-	bn = hash % bh->bh_numbuckets;
+	bn = bufhash_bucket(bh, b->b_fs, b->b_physblock);
 	return bufarray_add(&bh->bh_buckets[bn], b, &b->b_bucketindex);
 }
 
@@ -438,10 +638,9 @@ static
 void
 bufhash_remove(struct bufhash *bh, struct buf *b)
 {
-	unsigned hash, bn;
+	unsigned bn;
 
-	hash = buffer_hashfunc(b->b_fs, b->b_physblock);
-	bn = hash % bh->bh_numbuckets;
+	bn = bufhash_bucket(bh, b->b_fs, b->b_physblock);
 
 	KASSERT(bufarray_get(&bh->bh_buckets[bn], b->b_bucketindex) == b);
 	bufarray_set(&bh->bh_buckets[bn], b->b_bucketindex, NULL);
@@ -457,12 +656,11 @@ static
 struct buf *
 bufhash_get(struct bufhash *bh, struct fs *fs, daddr_t physblock)
 {
-	unsigned hash, bn;
+	unsigned bn;
 	unsigned num, i;
 	struct buf *b;
 
-	hash = buffer_hashfunc(fs, physblock);
-	bn = hash % bh->bh_numbuckets;
+	bn = bufhash_bucket(bh, fs, physblock);
 
 	num = bufarray_num(&bh->bh_buckets[bn]);
 	for (i=0; i<num; i++) {
@@ -476,16 +674,120 @@ bufhash_get(struct bufhash *bh, struct fs *fs, daddr_t physblock)
 	return NULL;
 }
 
+////////////////////////////////////////////////////////////
+// ghosts
+
+/*
+ * The ghost ring is also threaded onto hash chains, one bucket per
+ * ring slot, so that looking up a key on every miss doesn't mean
+ * scanning the whole ring under the partition lock. Slots in use are
+ * on the chain for their key; unused slots (bg_fs NULL) are on none.
+ */
+static
+unsigned *
+bufghost_bucket(struct bufpart *bp, struct fs *fs, daddr_t block)
+{
+	unsigned hash;
+
+	hash = buffer_parthashfunc(fs, block);
+	return &bp->bp_ghost_buckets[hash % bp->bp_num_ghosts];
+}
+
+/*
+ * Take a slot that's in use off its hash chain and mark it unused.
+ */
+static
+void
+bufghost_unlink(struct bufpart *bp, unsigned ix)
+{
+	struct bufghost *bg;
+	unsigned *pp;
+
+	bg = &bp->bp_ghosts[ix];
+	KASSERT(bg->bg_fs != NULL);
+	pp = bufghost_bucket(bp, bg->bg_fs, bg->bg_block);
+	while (*pp != ix) {
+		KASSERT(*pp != INVALID_INDEX);
+		pp = &bp->bp_ghosts[*pp].bg_next;
+	}
+	*pp = bg->bg_next;
+	bg->bg_next = INVALID_INDEX;
+	bg->bg_fs = NULL;
+}
+
+/*
+ * Remember the key of a buffer evicted from probation, forgetting
+ * the oldest one remembered if need be.
+ */
+static
+void
+bufghost_add(struct bufpart *bp, struct fs *fs, daddr_t block)
+{
+	struct bufghost *bg;
+	unsigned ix, *pp;
+
+	ix = bp->bp_next_ghost;
+	bg = &bp->bp_ghosts[ix];
+	if (bg->bg_fs != NULL) {
+		bufghost_unlink(bp, ix);
+	}
+	bg->bg_fs = fs;
+	bg->bg_block = block;
+	pp = bufghost_bucket(bp, fs, block);
+	bg->bg_next = *pp;
+	*pp = ix;
+	bp->bp_next_ghost = (ix + 1) % bp->bp_num_ghosts;
+}
+
+/*
+ * Check for and forget the ghost of a block.
+ */
+static
+bool
+bufghost_remove(struct bufpart *bp, struct fs *fs, daddr_t block)
+{
+	struct bufghost *bg;
+	unsigned ix;
+
+	ix = *bufghost_bucket(bp, fs, block);
+	while (ix != INVALID_INDEX) {
+		bg = &bp->bp_ghosts[ix];
+		if (bg->bg_fs == fs && bg->bg_block == block) {
+			bufghost_unlink(bp, ix);
+			return true;
+		}
+		ix = bg->bg_next;
+	}
+	return false;
+}
+
+/*
+ * Forget all ghosts of a file system, so they can't match another
+ * one mounted later in the same place in memory.
+ */
+static
+void
+bufghost_drop_fs(struct bufpart *bp, struct fs *fs)
+{
+	unsigned i;
+
+	for (i=0; i<bp->bp_num_ghosts; i++) {
+		if (bp->bp_ghosts[i].bg_fs == fs) {
+			bufghost_unlink(bp, i);
+		}
+	}
+}
+
 ////////////////////////////////////////////////////////////
 // buffer tables
 
 /*
- * Preallocate the buffer lists so adding things to them on the fly
- * can't blow up.
+ * Preallocate a partition's buffer lists so adding things to them on
+ * the fly can't blow up.
  */
 static
 int
-preallocate_buffer_arrays(unsigned newtotal)
+preallocate_buffer_arrays(struct bufpart *bp, unsigned newtotal)
 {
 	int result;
 	unsigned newathresh, newdthresh;
@@ -493,77 +795,81 @@ preallocate_buffer_arrays(unsigned newtotal)
 	newathresh = (newtotal*ATTACHED_THRESH_NUM)/ATTACHED_THRESH_DENOM;
 	newdthresh = (newtotal*DIRTY_THRESH_NUM)/DIRTY_THRESH_DENOM;
 
-	result = bufarray_preallocate(&detached_buffers, newtotal);
+	result = bufarray_preallocate(&bp->bp_detached, newtotal);
 	if (result) {
 		return result;
 	}
 
-	result = bufarray_preallocate(&attached_buffers, newathresh);
+	result = bufarray_preallocate(&bp->bp_attached, newathresh);
 	if (result) {
 		return result;
 	}
-	attached_buffers_thresh = newathresh;
+	if (newathresh > bp->bp_attached_thresh) {
+		bp->bp_attached_thresh = newathresh;
+	}
 
-	result = bufarray_preallocate(&dirty_buffers, newdthresh);
+	result = bufarray_preallocate(&bp->bp_dirty, newdthresh);
 	if (result) {
 		return result;
 	}
-	dirty_buffers_thresh = newdthresh;
+	if (newdthresh > bp->bp_dirty_thresh) {
+		bp->bp_dirty_thresh = newdthresh;
+	}
 
 	return 0;
 }
 
 /*
- * Go through the attached_buffers array and close up gaps.
+ * Go through the attached buffers array and close up gaps.
  */
 static
 void
-compact_attached_buffers(void)
+compact_attached_buffers(struct bufpart *bp)
 {
-	bufarray_compact(&attached_buffers, &attached_buffers_first,
+	bufarray_compact(&bp->bp_attached, &bp->bp_attached_first,
 			 buf_fixup_tableindex);
-	KASSERT(attached_buffers_count == bufarray_num(&attached_buffers));
+	KASSERT(bp->bp_attached_count == bufarray_num(&bp->bp_attached));
 
 	/* it does not matter if this overflows */
-	attached_buffers_generation++;
+	bp->bp_attached_generation++;
 }
 
 /*
- * Go through the dirty_buffers array and close up gaps.
+ * Go through the dirty buffers array and close up gaps.
  */
 static
 void
-compact_dirty_buffers(void)
+compact_dirty_buffers(struct bufpart *bp)
 {
-	bufarray_compact(&dirty_buffers, &dirty_buffers_first,
+	bufarray_compact(&bp->bp_dirty, &bp->bp_dirty_first,
 			 buf_fixup_dirtyindex);
-	KASSERT(dirty_buffers_count == bufarray_num(&dirty_buffers));
+	KASSERT(bp->bp_dirty_count == bufarray_num(&bp->bp_dirty));
 
 	/* it does not matter if this overflows */
-	dirty_buffers_generation++;
+	bp->bp_dirty_generation++;
 }
 
 /*
- * Get a buffer from the pool of detached buffers.
+ * Get a buffer of size SIZE (or of any size, if SIZE is 0) from the
+ * pool of detached buffers.
  */
 static
 struct buf *
-buffer_remove_detached(void)
+buffer_remove_detached(struct bufpart *bp, size_t size)
 {
 	struct buf *b;
-	unsigned num;
-	int result;
+	unsigned i;
 
-	num = bufarray_num(&detached_buffers);
-	if (num > 0) {
-		b = bufarray_get(&detached_buffers, num-1);
-		KASSERT(b->b_tableindex == num-1);
+	i = bufarray_num(&bp->bp_detached);
+	while (i-- > 0) {
+		b = bufarray_get(&bp->bp_detached, i);
+		KASSERT(b->b_tableindex == i);
+		if (size != 0 && b->b_size != size) {
+			continue;
+		}
+		bufarray_remove_unordered(&bp->bp_detached, i,
+					  buf_fixup_tableindex);
 		b->b_tableindex = INVALID_INDEX;
-
-		/* shrink array (should not fail) */
-		result = bufarray_setsize(&detached_buffers, num-1);
-		KASSERT(result == 0);
-
 		return b;
 	}
 
@@ -577,13 +883,14 @@ static
 void
 buffer_insert_detached(struct buf *b)
 {
+	struct bufpart *bp = b->b_part;
 	int result;
 
 	KASSERT(b->b_attached == 0);
 	KASSERT(b->b_busy == 0);
 	KASSERT(b->b_tableindex == INVALID_INDEX);
 
-	result = bufarray_add(&detached_buffers, b, &b->b_tableindex);
+	result = bufarray_add(&bp->bp_detached, b, &b->b_tableindex);
 	/* arrays are preallocated to avoid failure here */
 	KASSERT(result == 0);
 }
@@ -595,6 +902,7 @@ static
 void
 buffer_remove_attached(struct buf *b, unsigned expected_busy)
 {
+	struct bufpart *bp = b->b_part;
 	unsigned ix;
 
 	KASSERT(b->b_attached == 1);
@@ -602,18 +910,18 @@ buffer_remove_attached(struct buf *b, unsigned expected_busy)
 
 	ix = b->b_tableindex;
 
-	KASSERT(bufarray_get(&attached_buffers, ix) == b);
+	KASSERT(bufarray_get(&bp->bp_attached, ix) == b);
 
 	/* Remove from table, leave NULL behind (compact lazily, later) */
-	bufarray_set(&attached_buffers, ix, NULL);
+	bufarray_set(&bp->bp_attached, ix, NULL);
 	b->b_tableindex = INVALID_INDEX;
 
 	/* cache the first empty slot  */
-	if (ix < attached_buffers_first) {
-		attached_buffers_first = ix;
+	if (ix < bp->bp_attached_first) {
+		bp->bp_attached_first = ix;
 	}
 
-	attached_buffers_count--;
+	bp->bp_attached_count--;
 }
 
 /*
@@ -623,21 +931,22 @@ static
 void
 buffer_insert_attached(struct buf *b)
 {
+	struct bufpart *bp = b->b_part;
 	unsigned num;
 	int result;
 
 	KASSERT(b->b_attached == 1);
 	KASSERT(b->b_tableindex == INVALID_INDEX);
 
-	num = bufarray_num(&attached_buffers);
-	if (num >= attached_buffers_thresh) {
-		compact_attached_buffers();
+	num = bufarray_num(&bp->bp_attached);
+	if (num >= bp->bp_attached_thresh) {
+		compact_attached_buffers(bp);
 	}
 
-	result = bufarray_add(&attached_buffers, b, &b->b_tableindex);
+	result = bufarray_add(&bp->bp_attached, b, &b->b_tableindex);
 	/* arrays are preallocated to avoid failure here */
 	KASSERT(result == 0);
-	attached_buffers_count++;
+	bp->bp_attached_count++;
 }
 
 /*
@@ -647,6 +956,7 @@ static
 void
 buffer_remove_dirty(struct buf *b)
 {
+	struct bufpart *bp = b->b_part;
 	unsigned ix;
 
 	KASSERT(b->b_attached == 1);
@@ -655,15 +965,15 @@ buffer_remove_dirty(struct buf *b)
 
 	ix = b->b_dirtyindex;
 
-	KASSERT(bufarray_get(&dirty_buffers, ix) == b);
+	KASSERT(bufarray_get(&bp->bp_dirty, ix) == b);
 
 	/* Remove from table, leave NULL behind (compact lazily, later) */
-	bufarray_set(&dirty_buffers, ix, NULL);
+	bufarray_set(&bp->bp_dirty, ix, NULL);
 	b->b_dirtyindex = INVALID_INDEX;
 
 	/* cache the first empty slot  */
-	if (ix < dirty_buffers_first) {
-		dirty_buffers_first = ix;
+	if (ix < bp->bp_dirty_first) {
+		bp->bp_dirty_first = ix;
 	}
 }
 
@@ -674,6 +984,7 @@ static
 void
 buffer_insert_dirty(struct buf *b)
 {
+	struct bufpart *bp = b->b_part;
 	unsigned num;
 	int result;
 
@@ -681,12 +992,12 @@ buffer_insert_dirty(struct buf *b)
 	KASSERT(b->b_busy == 1);
 	KASSERT(b->b_dirtyindex == INVALID_INDEX);
 
-	num = bufarray_num(&dirty_buffers);
-	if (num >= dirty_buffers_thresh) {
-		compact_dirty_buffers();
+	num = bufarray_num(&bp->bp_dirty);
+	if (num >= bp->bp_dirty_thresh) {
+		compact_dirty_buffers(bp);
 	}
 
-	result = bufarray_add(&dirty_buffers, b, &b->b_dirtyindex);
+	result = bufarray_add(&bp->bp_dirty, b, &b->b_dirtyindex);
 	/* arrays are preallocated to avoid failure here */
 	KASSERT(result == 0);
 }
@@ -695,31 +1006,41 @@ buffer_insert_dirty(struct buf *b)
 // ops on buffers
 
 /*
- * Create a fresh buffer.
+ * Create a fresh buffer of size SIZE in partition BP, if the global
+ * limit allows.
  */
 static
 struct buf *
-buffer_create(void)
+buffer_create(struct bufpart *bp, size_t size)
 {
 	struct buf *b;
 	int result;
 
-	result = preallocate_buffer_arrays(num_total_buffers+1);
-	if (result) {
+	spinlock_acquire(&buffer_total_lock);
+	if (num_total_units + BUFFER_UNITS(size) > max_total_units) {
+		spinlock_release(&buffer_total_lock);
 		return NULL;
 	}
+	num_total_units += BUFFER_UNITS(size);
+	spinlock_release(&buffer_total_lock);
+
+	result = preallocate_buffer_arrays(bp, bp->bp_num_buffers+1);
+	if (result) {
+		goto fail;
+	}
 
 	b = kmalloc(sizeof(*b));
 	if (b == NULL) {
-		return NULL;
+		goto fail;
 	}
 
-	b->b_data = kmalloc(ONE_TRUE_BUFFER_SIZE);
+	b->b_data = kmalloc(size);
 	if (b->b_data == NULL) {
 		kfree(b);
-		return NULL;
+		goto fail;
 	}
 
+	b->b_part = bp;
 	b->b_tableindex = INVALID_INDEX;
 	b->b_dirtyindex = INVALID_INDEX;
 	b->b_bucketindex = INVALID_INDEX;
@@ -729,15 +1050,50 @@ buffer_create(void)
 	b->b_valid = 0;
 	b->b_dirty = 0;
 	b->b_fsmanaged = 0;
+	b->b_prefetched = 0;
+	b->b_hot = 0;
+	b->b_referenced = 0;
 	b->b_holder = NULL;
 	b->b_timestamp.tv_sec = 0;
 	b->b_timestamp.tv_nsec = 0;
 	b->b_fs = NULL;
 	b->b_physblock = 0;
-	b->b_size = ONE_TRUE_BUFFER_SIZE;
+	b->b_size = size;
 	b->b_fsdata = NULL;
-	num_total_buffers++;
+	bp->bp_num_buffers++;
+	bp->bp_num_units += BUFFER_UNITS(size);
 	return b;
+
+ fail:
+	spinlock_acquire(&buffer_total_lock);
+	num_total_units -= BUFFER_UNITS(size);
+	spinlock_release(&buffer_total_lock);
+	return NULL;
+}
+
+/*
+ * Free a detached buffer that is the wrong size to reuse, to make room
+ * for one that is the right size.
+ */
+static
+void
+buffer_destroy(struct buf *b)
+{
+	struct bufpart *bp = b->b_part;
+	size_t size = b->b_size;
+
+	KASSERT(b->b_attached == 0);
+	KASSERT(b->b_busy == 0);
+	KASSERT(b->b_tableindex == INVALID_INDEX);
+
+	bp->bp_num_buffers--;
+	bp->bp_num_units -= BUFFER_UNITS(size);
+	kfree(b->b_data);
+	kfree(b);
+
+	spinlock_acquire(&buffer_total_lock);
+	num_total_units -= BUFFER_UNITS(size);
+	spinlock_release(&buffer_total_lock);
 }
 
 /*
@@ -754,17 +1110,26 @@ buffer_attach(struct buf *b, struct fs *fs, daddr_t block)
 	KASSERT(b->b_valid == 0);
 	KASSERT(b->b_busy == 0);
 	KASSERT(b->b_fsdata == NULL);
+	KASSERT(b->b_part == buffer_partition(fs, block));
+	KASSERT(block % BUFFER_UNITS(b->b_size) == 0);
 	b->b_attached = 1;
 	b->b_fs = fs;
 	b->b_physblock = block;
 
-	result = bufhash_add(&buffer_hash, b);
+	result = bufhash_add(&b->b_part->bp_hash, b);
 	if (result) {
 		b->b_attached = 0;
+		b->b_hot = 0;
 		b->b_fs = NULL;
 		b->b_physblock = 0;
 		return result;
 	}
+	if (b->b_size > MIN_BUFFER_SIZE) {
+		b->b_part->bp_num_large++;
+	}
+	if (!b->b_hot) {
+		b->b_part->bp_probation_units += BUFFER_UNITS(b->b_size);
+	}
 	return 0;
 }
 
@@ -775,9 +1140,17 @@ static
 void
 buffer_detach(struct buf *b)
 {
+	struct bufpart *bp = b->b_part;
+
 	KASSERT(b->b_attached == 1);
 	KASSERT(b->b_busy == 0);
-	bufhash_remove(&buffer_hash, b);
+	bufhash_remove(&bp->bp_hash, b);
+	if (b->b_size > MIN_BUFFER_SIZE) {
+		bp->bp_num_large--;
+	}
+	if (!b->b_hot) {
+		bp->bp_probation_units -= BUFFER_UNITS(b->b_size);
+	}
 
 	if (b->b_fsdata != NULL) {
 		kprintf("vfs: %s left behind fs-specific buffer data\n",
@@ -785,9 +1158,12 @@ buffer_detach(struct buf *b)
 		b->b_fsdata = NULL;
 	}
 	b->b_attached = 0;
+	b->b_prefetched = 0;
+	b->b_hot = 0;
+	b->b_referenced = 0;
 	b->b_fs = NULL;
 	b->b_physblock = 0;
-	cv_broadcast(buffer_busy_cv, buffer_lock);
+	cv_broadcast(bp->bp_busy_cv, bp->bp_lock);
 }
 
 /*
@@ -797,16 +1173,20 @@ buffer_detach(struct buf *b)
  * and reattached) under us, which can happen if it gets released and
  * then gets evicted before we wake up. If it gets detached and
  * reattached to the same block, we won't notice, but in that case we
- * probably don't care either.
+ * probably don't care either. A buffer that was detached may also
+ * have moved to another partition by then; that is caught the same
+ * way, before we look at anything its new partition protects.
  */
 static
 int
 buffer_mark_busy(struct buf *b)
 {
+	struct bufpart *bp = b->b_part;
 	struct fs *fs;
 	daddr_t block;
 
 	KASSERT(b->b_holder != curthread);
+	KASSERT(lock_do_i_hold(bp->bp_lock));
 	fs = b->b_fs;
 	block = b->b_physblock;
 	while (b->b_busy) {
@@ -814,7 +1194,10 @@ buffer_mark_busy(struct buf *b)
 		    block != b->b_physblock) {
 			return EDEADBUF;
 		}
-		cv_wait(buffer_busy_cv, buffer_lock);
+		cv_wait(bp->bp_busy_cv, bp->bp_lock);
+		if (b->b_part != bp) {
+			return EDEADBUF;
+		}
 	}
 	if (!b->b_attached || fs != b->b_fs || block != b->b_physblock) {
 		return EDEADBUF;
@@ -822,7 +1205,7 @@ buffer_mark_busy(struct buf *b)
 	b->b_busy = 1;
 	KASSERT(b->b_fsmanaged == 0);
 	b->b_holder = curthread;
-	busy_buffers_count++;
+	bp->bp_busy_count++;
 	return 0;
 }
 
@@ -833,6 +1216,8 @@ static
 void
 buffer_unmark_busy(struct buf *b)
 {
+	struct bufpart *bp = b->b_part;
+
 	KASSERT(b->b_busy != 0);
 	b->b_busy = 0;
 	if (b->b_fsmanaged) {
@@ -842,8 +1227,81 @@ buffer_unmark_busy(struct buf *b)
 		KASSERT(b->b_holder == curthread);
 	}
 	b->b_holder = NULL;
-	busy_buffers_count--;
-	cv_broadcast(buffer_busy_cv, buffer_lock);
+	bp->bp_busy_count--;
+	cv_broadcast(bp->bp_busy_cv, bp->bp_lock);
+}
+
+/*
+ * Wake the syncer. Safe to call from interrupt context; AGED says
+ * whether it's for the timer (stats only).
+ */
+static
+void
+syncer_wakeup(bool aged)
+{
+	spinlock_acquire(&syncer_lock);
+	if (!syncer_wanted) {
+		syncer_wanted = true;
+		if (aged) {
+			syncer_age_wakeups++;
+		}
+		else {
+			syncer_ratio_wakeups++;
+		}
+		wchan_wakeone(syncer_wchan, &syncer_lock);
+	}
+	spinlock_release(&syncer_lock);
+}
+
+/*
+ * Count a buffer going dirty in num_dirty_units. If that takes the
+ * total past the background threshold, start the syncer; if no
+ * expiry is pending (nothing it could write was dirty), start the
+ * timer for this one.
+ */
+static
+void
+buffer_count_dirty(struct buf *b)
+{
+	unsigned units, old, thresh;
+
+	units = BUFFER_UNITS(b->b_size);
+	spinlock_acquire(&buffer_total_lock);
+	old = num_dirty_units;
+	num_dirty_units += units;
+	thresh = SCALE(max_total_units, SYNCER_BACKGROUND);
+	spinlock_release(&buffer_total_lock);
+
+	if (old <= thresh && old + units > thresh) {
+		syncer_wakeup(false);
+	}
+	else {
+		spinlock_acquire(&syncer_lock);
+		if (syncer_ticks == 0) {
+			syncer_ticks = SYNCER_EXPIRE;
+		}
+		spinlock_release(&syncer_lock);
+	}
+}
+
+/*
+ * Count a buffer going clean. WRITTEN is true if it went to disk
+ * rather than being thrown away.
+ */
+static
+void
+buffer_count_clean(struct buf *b, bool written)
+{
+	unsigned units;
+
+	units = BUFFER_UNITS(b->b_size);
+	spinlock_acquire(&buffer_total_lock);
+	KASSERT(num_dirty_units >= units);
+	num_dirty_units -= units;
+	if (written) {
+		num_written_units += units;
+	}
+	spinlock_release(&buffer_total_lock);
 }
 
 /*
@@ -853,9 +1311,10 @@ static
 int
 buffer_readin(struct buf *b)
 {
+	struct bufpart *bp = b->b_part;
 	int result;
 
-	KASSERT(lock_do_i_hold(buffer_lock));
+	KASSERT(lock_do_i_hold(bp->bp_lock));
 	KASSERT(b->b_attached);
 	KASSERT(b->b_busy);
 	KASSERT(b->b_fs != NULL);
@@ -864,9 +1323,9 @@ buffer_readin(struct buf *b)
 		return 0;
 	}
 
-	lock_release(buffer_lock);
+	lock_release(bp->bp_lock);
 	result = FSOP_READBLOCK(b->b_fs, b->b_physblock, b->b_data, b->b_size);
-	lock_acquire(buffer_lock);
+	lock_acquire(bp->bp_lock);
 	if (result == 0) {
 		b->b_valid = 1;
 	}
@@ -888,10 +1347,11 @@ static
 int
 buffer_writeout_internal(struct buf *b)
 {
+	struct bufpart *bp = b->b_part;
 	int result;
 
-	KASSERT(lock_do_i_hold(buffer_lock));
-	bufcheck();
+	KASSERT(lock_do_i_hold(bp->bp_lock));
+	bufcheck(bp);
 
 	KASSERT(b->b_attached);
 	KASSERT(b->b_valid);
@@ -902,13 +1362,14 @@ buffer_writeout_internal(struct buf *b)
 		return 0;
 	}
 
-	num_total_writeouts++;
-	lock_release(buffer_lock);
+	bp->bp_total_writeouts++;
+	lock_release(bp->bp_lock);
 	result = FSOP_WRITEBLOCK(b->b_fs, b->b_physblock, b->b_fsdata,
 				 b->b_data, b->b_size);
-	lock_acquire(buffer_lock);
+	lock_acquire(bp->bp_lock);
 	if (result == 0) {
-		dirty_buffers_count--;
+		bp->bp_dirty_count--;
+		buffer_count_clean(b, true);
 		b->b_dirty = 0;
 		buffer_remove_dirty(b);
 	}
@@ -918,11 +1379,12 @@ buffer_writeout_internal(struct buf *b)
 int
 buffer_writeout(struct buf *b)
 {
+	struct bufpart *bp = b->b_part;
 	int result;
 
-	lock_acquire(buffer_lock);
+	lock_acquire(bp->bp_lock);
 	result = buffer_writeout_internal(b);
-	lock_release(buffer_lock);
+	lock_release(bp->bp_lock);
 	return result;
 }
 
@@ -967,26 +1429,33 @@ buffer_is_valid(struct buf *b)
 void
 buffer_mark_dirty(struct buf *b)
 {
+	struct bufpart *bp = b->b_part;
+
 	KASSERT(b->b_busy);
 	KASSERT(b->b_valid);
 
-	lock_acquire(buffer_lock);
+	lock_acquire(bp->bp_lock);
 	if (b->b_dirty) {
 		/* nothing to do */
-		lock_release(buffer_lock);
+		lock_release(bp->bp_lock);
 		return;
 	}
 
 	b->b_dirty = 1;
-	b->b_dirtyepoch = dirty_epoch;
+	b->b_dirtyepoch = bp->bp_dirty_epoch;
 	gettime(&b->b_timestamp);
 
 	/* XXX: should we avoid putting fsmanaged buffers on the dirty list? */
 
 	buffer_insert_dirty(b);
-	dirty_buffers_count++;
-	/* Here we might prod the syncer, but currently it doesn't need it */
-	lock_release(buffer_lock);
+	bp->bp_dirty_count++;
+	if (!b->b_fsmanaged) {
+		/* charged to the writer; see buffer_throttle */
+		curthread->t_dirtied_units += BUFFER_UNITS(b->b_size);
+	}
+	lock_release(bp->bp_lock);
+
+	buffer_count_dirty(b);
 }
 
 /*
@@ -1065,6 +1534,7 @@ static
 void
 buffer_clean(struct buf *b)
 {
+	struct bufpart *bp = b->b_part;
 	int result;
 
 	KASSERT(b->b_busy == 0);
@@ -1072,82 +1542,92 @@ buffer_clean(struct buf *b)
 	/* not busy, won't sleep, can't fail */
 	KASSERT(result == 0);
 
-	lock_release(buffer_lock);
+	lock_release(bp->bp_lock);
 	FSOP_DETACHBUF(b->b_fs, b->b_physblock, b);
-	lock_acquire(buffer_lock);
+	lock_acquire(bp->bp_lock);
 	buffer_unmark_busy(b);
 
 	buffer_remove_attached(b, 0);
 	b->b_valid = 0;
 	if (b->b_dirty) {
 		b->b_dirty = 0;
-		dirty_buffers_count--;
+		bp->bp_dirty_count--;
+		buffer_count_clean(b, false);
 		buffer_remove_dirty(b);
 	}
 	buffer_detach(b);
 }
 
 /*
- * Evict a buffer.
+ * Evict a buffer from partition BP.
+ *
+ * The victim is the oldest idle clean buffer on probation if
+ * probation is over its share, and otherwise the oldest idle clean
+ * one in the main queue; failing that, the oldest idle clean buffer
+ * of the other kind. Only when no idle buffer is clean do we take the
+ * oldest dirty one and wait to write it out. (The syncer's job is to
+ * make that rare.)
+ *
+ * Returns EAGAIN if every buffer in the partition is busy.
  */
 static
 int
-buffer_evict(struct buf **ret)
+buffer_evict(struct bufpart *bp, struct buf **ret)
 {
 	unsigned num, i;
-	struct buf *b, *db;
+	struct buf *b, *cb, *ob, *db;
+	struct timespec start;
+	bool wanthot;
 	int result;
 
+	iostat_start(&start);
+
 	/*
 	 * Find a target buffer.
 	 */
 
  tryagain:
-	num = bufarray_num(&attached_buffers);
-	b = db = NULL;
+	wanthot = bp->bp_probation_units <=
+		SCALE(bp->bp_num_units, TWOQ_IN);
+	num = bufarray_num(&bp->bp_attached);
+	b = ob = db = NULL;
 	for (i=0; i<num; i++) {
-		if (i >= num/2 && db != NULL) {
-			/*
-			 * voodoo: avoid preferring very recent clean
-			 * buffers to older dirty buffers.
-			 */
-			break;
-		}
-		b = bufarray_get(&attached_buffers, i);
-		if (b == NULL) {
-			continue;
-		}
-		if (b->b_busy == 1) {
-			b = NULL;
+		cb = bufarray_get(&bp->bp_attached, i);
+		if (cb == NULL || cb->b_busy == 1) {
 			continue;
 		}
 		/* fsmanaged buffers are always busy */
-		KASSERT(b->b_fsmanaged == 0);
-		if (b->b_dirty == 1) {
+		KASSERT(cb->b_fsmanaged == 0);
+		if (cb->b_dirty == 1) {
 			if (db == NULL) {
 				/* remember first dirty buffer we saw */
-				db = b;
+				db = cb;
 			}
-			b = NULL;
 			continue;
 		}
-		break;
+		if (cb->b_hot == wanthot) {
+			b = cb;
+			break;
+		}
+		if (ob == NULL) {
+			/* first clean buffer of the other kind */
+			ob = cb;
+		}
 	}
-	if (b == NULL && db != NULL) {
-		b = db;
+	if (b == NULL) {
+		b = ob != NULL ? ob : db;
 	}
 	if (b == NULL) {
-		/* No buffers at all...? */
-		kprintf("buffer_evict: no targets!?\n");
+		/* No idle buffers here */
 		return EAGAIN;
 	}
 
 	/*
 	 * Flush the buffer out if necessary.
 	 */
-	num_total_evictions++;
+	bp->bp_total_evictions++;
 	if (b->b_dirty) {
-		num_dirty_evictions++;
+		bp->bp_dirty_evictions++;
 		KASSERT(b->b_busy == 0);
 		/* lock may be released here */
 		result = buffer_sync(b);
@@ -1166,93 +1646,342 @@ buffer_evict(struct buf **ret)
 
 	KASSERT(b->b_dirty == 0);
 
+	/*
+	 * Remember it if it leaves probation, unless it was read
+	 * ahead and never used, which says nothing about reuse.
+	 */
+	if (!b->b_hot && !b->b_prefetched) {
+		bufghost_add(bp, b->b_fs, b->b_physblock);
+	}
+
 	/*
 	 * Detach it from its old key, and return it in a state where
 	 * it can be reattached properly.
 	 */
 	buffer_clean(b);
 
+	iostat_done(IOHIST_BUFFER_EVICT, &start);
 	*ret = b;
 	return 0;
 }
 
-struct buf *
-buffer_find(struct fs *fs, daddr_t physblock)
-{
-	return bufhash_get(&buffer_hash, fs, physblock);
-}
-
 /*
- * Find a buffer for the given block, if one already exists; otherwise
- * attach one but don't bother to read it in. Set fsmanaged mode if
- * FSMANAGED is true.
+ * Take an idle buffer from some other partition and add it to the
+ * detached pool of BP. Used when every buffer in BP is busy and no
+ * more can be created, which would otherwise fail even though the
+ * reservation logic promised the caller a buffer.
+ *
+ * Releases BP's lock while visiting the others, so only one
+ * partition lock is ever held at a time; the caller must look up its
+ * block again afterwards.
  */
 static
 int
-buffer_get_internal(struct fs *fs, daddr_t block, size_t size, bool fsmanaged,
-		    struct buf **ret)
+buffer_steal(struct bufpart *bp)
 {
+	struct bufpart *victim;
 	struct buf *b;
+	unsigned i;
 	int result;
 
-	KASSERT(lock_do_i_hold(buffer_lock));
-	bufcheck();
+	KASSERT(lock_do_i_hold(bp->bp_lock));
 
-	KASSERT(size == ONE_TRUE_BUFFER_SIZE);
-	if (!fsmanaged) {
-		KASSERT(curthread->t_did_reserve_buffers == true);
+	/* Make room first, so that nothing can fail once we have it */
+	result = preallocate_buffer_arrays(bp, bp->bp_num_buffers+1);
+	if (result) {
+		return result;
 	}
 
-	num_total_gets++;
-
-again:
-	b = buffer_find(fs, block);
-	if (b != NULL) {
-		result = buffer_mark_busy(b);
-		if (result) {
-			KASSERT(result == EDEADBUF);
-			goto again;
+	lock_release(bp->bp_lock);
+	b = NULL;
+	for (i=1; i<BUFFER_PARTITIONS && b == NULL; i++) {
+		victim = &buffer_parts[(bp - buffer_parts + i)
+				       % BUFFER_PARTITIONS];
+		lock_acquire(victim->bp_lock);
+		b = buffer_remove_detached(victim, 0);
+		if (b == NULL && buffer_evict(victim, &b) != 0) {
+			b = NULL;
+		}
+		if (b != NULL) {
+			/* see buffer_mark_busy */
+			b->b_part = NULL;
+			victim->bp_num_buffers--;
+			victim->bp_num_units -= BUFFER_UNITS(b->b_size);
 		}
-		num_valid_gets++;
-		buffer_remove_attached(b, 1);
+		lock_release(victim->bp_lock);
+	}
+	lock_acquire(bp->bp_lock);
 
-		/* move it to the tail (recent end) of the LRU list */
-		buffer_insert_attached(b);
+	if (b == NULL) {
+		/* No buffers at all...? */
+		kprintf("buffer_evict: no targets!?\n");
+		return EAGAIN;
 	}
-	else {
-		b = buffer_remove_detached();
-		if (b == NULL && num_total_buffers < max_total_buffers) {
-			/* Can create a new buffer... */
-			b = buffer_create();
-		}
-		if (b == NULL) {
-			result = buffer_evict(&b);
-			if (result) {
-				return result;
-			}
-			KASSERT(b != NULL);
-		}
 
-		KASSERT(b->b_size == ONE_TRUE_BUFFER_SIZE);
-		result = buffer_attach(b, fs, block);
-		if (result) {
-			buffer_insert_detached(b);
-			return result;
-		}
-		KASSERT(b->b_busy == 0);
-		result = buffer_mark_busy(b);
-		/* b wasn't busy, so we didn't wait and it didn't disappear */
-		KASSERT(result == 0);
+	b->b_part = bp;
+	bp->bp_num_buffers++;
+	bp->bp_num_units += BUFFER_UNITS(b->b_size);
+	bp->bp_steals++;
+	buffer_insert_detached(b);
+	return 0;
+}
 
-		/* move it to the tail (recent end) of the LRU list */
+/*
+ * Find the buffer, of whatever size, that holds a block.
+ */
+static
+struct buf *
+buffer_find_covering(struct bufpart *bp, struct fs *fs, daddr_t block)
+{
+	struct buf *b;
+	daddr_t start;
+	unsigned n;
+
+	b = bufhash_get(&bp->bp_hash, fs, block);
+	if (b != NULL || bp->bp_num_large == 0) {
+		return b;
+	}
+	for (n = 2; n <= MAX_BUFFER_BLOCKS; n *= 2) {
+		start = block - block % n;
+		if (start == block) {
+			continue;
+		}
+		b = bufhash_get(&bp->bp_hash, fs, start);
+		if (b != NULL && start + BUFFER_UNITS(b->b_size) > block) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Find a buffer that overlaps the SIZE bytes starting at BLOCK but
+ * isn't exactly that buffer, if there is one.
+ */
+static
+struct buf *
+buffer_find_overlap(struct bufpart *bp, struct fs *fs, daddr_t block,
+		    size_t size)
+{
+	struct buf *b;
+	daddr_t k;
+
+	/* a buffer at or covering BLOCK */
+	b = buffer_find_covering(bp, fs, block);
+	if (b != NULL && (b->b_physblock != block || b->b_size != size)) {
+		return b;
+	}
+
+	/* smaller buffers further inside the range */
+	for (k = block + 1; k < block + BUFFER_UNITS(size); k++) {
+		b = bufhash_get(&bp->bp_hash, fs, k);
+		if (b != NULL) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Get rid of one buffer that overlaps the one we want, writing it out
+ * first if it's dirty. Returns 0 if there was none, EDEADBUF if we did
+ * something (and may have released the lock) so the caller should look
+ * again, EBUSY if the caller itself holds the overlapping buffer, or
+ * an error from writing.
+ */
+static
+int
+buffer_drop_overlap(struct bufpart *bp, struct fs *fs, daddr_t block,
+		    size_t size)
+{
+	struct buf *b;
+	int result;
+
+	b = buffer_find_overlap(bp, fs, block, size);
+	if (b == NULL) {
+		return 0;
+	}
+	if (b->b_busy && b->b_holder == curthread) {
+		/* we'd wait for ourselves */
+		return EBUSY;
+	}
+
+	result = buffer_mark_busy(b);
+	if (result) {
+		/* already gone */
+		return EDEADBUF;
+	}
+	if (b->b_dirty) {
+		result = buffer_writeout_internal(b);
+		KASSERT(result != EDEADBUF);
+		if (result) {
+			buffer_unmark_busy(b);
+			return result;
+		}
+	}
+	buffer_unmark_busy(b);
+
+	bp->bp_overlaps++;
+	buffer_clean(b);
+	buffer_insert_detached(b);
+	return EDEADBUF;
+}
+
+/*
+ * Look up the buffer holding a block, if there is one; it may be
+ * bigger than one block. The buffer is not marked busy, so the caller
+ * must already hold it (or not care if it changes).
+ */
+struct buf *
+buffer_find(struct fs *fs, daddr_t physblock)
+{
+	struct bufpart *bp;
+	struct buf *b;
+
+	bp = buffer_partition(fs, physblock);
+	lock_acquire(bp->bp_lock);
+	b = buffer_find_covering(bp, fs, physblock);
+	lock_release(bp->bp_lock);
+	return b;
+}
+
+/*
+ * Return the size of the cached buffer holding a block, or 0 if the
+ * block isn't cached. Only a hint; it can change as soon as we return.
+ */
+size_t
+buffer_cached_size(struct fs *fs, daddr_t physblock)
+{
+	struct bufpart *bp;
+	struct buf *b;
+	size_t size;
+
+	bp = buffer_partition(fs, physblock);
+	lock_acquire(bp->bp_lock);
+	b = buffer_find_covering(bp, fs, physblock);
+	size = b != NULL ? b->b_size : 0;
+	lock_release(bp->bp_lock);
+	return size;
+}
+
+/*
+ * Find a buffer for the given block, if one already exists; otherwise
+ * attach one but don't bother to read it in. Set fsmanaged mode if
+ * FSMANAGED is true.
+ */
+static
+int
+buffer_get_internal(struct bufpart *bp, struct fs *fs, daddr_t block,
+		    size_t size, bool fsmanaged, struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	KASSERT(lock_do_i_hold(bp->bp_lock));
+	bufcheck(bp);
+
+	KASSERT(size >= MIN_BUFFER_SIZE && size <= MAX_BUFFER_SIZE);
+	KASSERT(size % MIN_BUFFER_SIZE == 0);
+	KASSERT((BUFFER_UNITS(size) & (BUFFER_UNITS(size) - 1)) == 0);
+	KASSERT(block % BUFFER_UNITS(size) == 0);
+	if (!fsmanaged) {
+		KASSERT(curthread->t_did_reserve_buffers == true);
+	}
+
+	bp->bp_total_gets++;
+
+again:
+	b = bufhash_get(&bp->bp_hash, fs, block);
+	if (b != NULL && b->b_size == size) {
+		result = buffer_mark_busy(b);
+		if (result) {
+			KASSERT(result == EDEADBUF);
+			goto again;
+		}
+		bp->bp_valid_gets++;
+		b->b_referenced = 1;
+		if (b->b_prefetched) {
+			b->b_prefetched = 0;
+			bp->bp_prefetch_hits++;
+		}
+		if (b->b_hot) {
+			/* move it to the tail (recent end) of the LRU list */
+			buffer_remove_attached(b, 1);
+			buffer_insert_attached(b);
+		}
+	}
+	else {
+		/* lock may be released here */
+		result = buffer_drop_overlap(bp, fs, block, size);
+		if (result == EDEADBUF) {
+			goto again;
+		}
+		if (result) {
+			return result;
+		}
+
+		b = buffer_remove_detached(bp, size);
+		if (b == NULL) {
+			/* Can create a new buffer if under the limit... */
+			b = buffer_create(bp, size);
+		}
+		if (b == NULL) {
+			/* ...or after freeing a detached one of another size */
+			b = buffer_remove_detached(bp, 0);
+			if (b != NULL) {
+				buffer_destroy(b);
+				goto again;
+			}
+			result = buffer_evict(bp, &b);
+			if (result == EAGAIN) {
+				/* lock is released and retaken here */
+				result = buffer_steal(bp);
+				if (result) {
+					return result;
+				}
+				goto again;
+			}
+			if (result) {
+				return result;
+			}
+			KASSERT(b != NULL);
+			/*
+			 * Evicting releases the lock, so someone may
+			 * have attached this block, or one overlapping
+			 * it, meanwhile. Look again; the victim is
+			 * picked up from the detached list then.
+			 */
+			buffer_insert_detached(b);
+			goto again;
+		}
+
+		KASSERT(b->b_size == size);
+		if (bufghost_remove(bp, fs, block)) {
+			/* evicted from probation and wanted again */
+			bp->bp_ghost_hits++;
+			b->b_hot = 1;
+		}
+		b->b_referenced = 1;
+		result = buffer_attach(b, fs, block);
+		if (result) {
+			buffer_insert_detached(b);
+			return result;
+		}
+		KASSERT(b->b_busy == 0);
+		result = buffer_mark_busy(b);
+		/* b wasn't busy, so we didn't wait and it didn't disappear */
+		KASSERT(result == 0);
+
+		/* move it to the tail (recent end) of the LRU list */
 		buffer_insert_attached(b);
 
 		/*
 		 * Call the FS's buffer attach routine. We do this
 		 * after buffer_attach (rather than in it) so we can
 		 * do it safely with the buffer marked busy and
-		 * without holding buffer_lock, as buffer_lock isn't
-		 * supposed to be exposed to file system code.
+		 * without holding the partition lock, as buffer cache
+		 * locks aren't supposed to be exposed to file system
+		 * code.
 		 *
 		 * Note: b_fsmanaged, if requested, hasn't been set
 		 * yet.  There's some chance that this might confuse
@@ -1261,9 +1990,9 @@ again:
 		 * duplicating the code.
 		 */
 
-		lock_release(buffer_lock);
+		lock_release(bp->bp_lock);
 		result = FSOP_ATTACHBUF(b->b_fs, block, b);
-		lock_acquire(buffer_lock);
+		lock_acquire(bp->bp_lock);
 		if (result) {
 			buffer_unmark_busy(b);
 			buffer_insert_detached(b);
@@ -1289,24 +2018,26 @@ again:
  */
 static
 int
-buffer_read_internal(struct fs *fs, daddr_t block, size_t size, bool fsmanaged,
-		     struct buf **ret)
+buffer_read_internal(struct bufpart *bp, struct fs *fs, daddr_t block,
+		     size_t size, bool fsmanaged, struct buf **ret)
 {
+	struct timespec start;
 	int result;
 
-	KASSERT(lock_do_i_hold(buffer_lock));
+	KASSERT(lock_do_i_hold(bp->bp_lock));
 
-	result = buffer_get_internal(fs, block, size, fsmanaged, ret);
+	result = buffer_get_internal(bp, fs, block, size, fsmanaged, ret);
 	if (result) {
-		lock_release(buffer_lock);
 		*ret = NULL;
 		return result;
 	}
 
 	if (!(*ret)->b_valid) {
-		num_read_gets++;
+		bp->bp_read_gets++;
+		iostat_start(&start);
 		/* may lose (and then re-acquire) lock here */
 		result = buffer_readin(*ret);
+		iostat_done(IOHIST_BUFFER_READ, &start);
 		if (result) {
 			buffer_release_internal(*ret);
 			*ret = NULL;
@@ -1324,11 +2055,14 @@ buffer_read_internal(struct fs *fs, daddr_t block, size_t size, bool fsmanaged,
 int
 buffer_get(struct fs *fs, daddr_t block, size_t size, struct buf **ret)
 {
+	struct bufpart *bp;
 	int result;
 
-	lock_acquire(buffer_lock);
-	result = buffer_get_internal(fs, block, size, false/*fsmanaged*/, ret);
-	lock_release(buffer_lock);
+	bp = buffer_partition(fs, block);
+	lock_acquire(bp->bp_lock);
+	result = buffer_get_internal(bp, fs, block, size,
+				     false/*fsmanaged*/, ret);
+	lock_release(bp->bp_lock);
 
 	return result;
 }
@@ -1340,11 +2074,14 @@ buffer_get(struct fs *fs, daddr_t block, size_t size, struct buf **ret)
 int
 buffer_read(struct fs *fs, daddr_t block, size_t size, struct buf **ret)
 {
+	struct bufpart *bp;
 	int result;
 
-	lock_acquire(buffer_lock);
-	result = buffer_read_internal(fs, block, size, false/*fsmanaged*/,ret);
-	lock_release(buffer_lock);
+	bp = buffer_partition(fs, block);
+	lock_acquire(bp->bp_lock);
+	result = buffer_read_internal(bp, fs, block, size,
+				      false/*fsmanaged*/, ret);
+	lock_release(bp->bp_lock);
 
 	return result;
 }
@@ -1356,11 +2093,14 @@ int
 buffer_get_fsmanaged(struct fs *fs, daddr_t block, size_t size,
 		     struct buf **ret)
 {
+	struct bufpart *bp;
 	int result;
 
-	lock_acquire(buffer_lock);
-	result = buffer_get_internal(fs, block, size, true/*fsmanaged*/, ret);
-	lock_release(buffer_lock);
+	bp = buffer_partition(fs, block);
+	lock_acquire(bp->bp_lock);
+	result = buffer_get_internal(bp, fs, block, size,
+				     true/*fsmanaged*/, ret);
+	lock_release(bp->bp_lock);
 
 	return result;
 }
@@ -1372,11 +2112,14 @@ int
 buffer_read_fsmanaged(struct fs *fs, daddr_t block, size_t size,
 		      struct buf **ret)
 {
+	struct bufpart *bp;
 	int result;
 
-	lock_acquire(buffer_lock);
-	result = buffer_read_internal(fs, block, size, true/*fsmanaged*/, ret);
-	lock_release(buffer_lock);
+	bp = buffer_partition(fs, block);
+	lock_acquire(bp->bp_lock);
+	result = buffer_read_internal(bp, fs, block, size,
+				      true/*fsmanaged*/, ret);
+	lock_release(bp->bp_lock);
 
 	return result;
 }
@@ -1392,21 +2135,25 @@ buffer_read_fsmanaged(struct fs *fs, daddr_t block, size_t size,
 int
 buffer_flush(struct fs *fs, daddr_t block, size_t size)
 {
+	struct bufpart *bp;
 	struct buf *b;
 	int result = 0;
 
-	lock_acquire(buffer_lock);
-	bufcheck();
+	bp = buffer_partition(fs, block);
+	lock_acquire(bp->bp_lock);
+	bufcheck(bp);
 
-	KASSERT(size == ONE_TRUE_BUFFER_SIZE);
-
-	b = buffer_find(fs, block);
+	b = bufhash_get(&bp->bp_hash, fs, block);
 	if (b == NULL) {
 		goto done;
 	}
-	KASSERT(b->b_valid);
+	KASSERT(size == 0 || b->b_size == size);
 
-	if (!b->b_dirty) {
+	/*
+	 * The buffer may still be being read in (buffer_readin drops
+	 * the lock while b_valid is false). It can't be dirty then.
+	 */
+	if (!b->b_valid || !b->b_dirty) {
 		/* Not dirty; don't need to do anything. */
 		goto done;
 	}
@@ -1434,7 +2181,7 @@ buffer_flush(struct fs *fs, daddr_t block, size_t size)
 
 	buffer_unmark_busy(b);
 done:
-	lock_release(buffer_lock);
+	lock_release(bp->bp_lock);
 	return result;
 }
 
@@ -1445,16 +2192,17 @@ done:
 void
 buffer_drop(struct fs *fs, daddr_t block, size_t size)
 {
+	struct bufpart *bp;
 	struct buf *b;
 	int result;
 
-	lock_acquire(buffer_lock);
-	bufcheck();
-
-	KASSERT(size == ONE_TRUE_BUFFER_SIZE);
+	bp = buffer_partition(fs, block);
+	lock_acquire(bp->bp_lock);
+	bufcheck(bp);
 
-	b = buffer_find(fs, block);
+	b = bufhash_get(&bp->bp_hash, fs, block);
 	if (b != NULL) {
+		KASSERT(b->b_size == size);
 		/*
 		 * While the FS shouldn't ever drop a buffer that it's also
 		 * actively using, the buffer might be getting synced. So
@@ -1464,7 +2212,7 @@ buffer_drop(struct fs *fs, daddr_t block, size_t size)
 		result = buffer_mark_busy(b);
 		if (result == EDEADBUF) {
 			/* someone else already dropped it */
-			lock_release(buffer_lock);
+			lock_release(bp->bp_lock);
 			return;
 		}
 		KASSERT(result == 0);
@@ -1473,15 +2221,15 @@ buffer_drop(struct fs *fs, daddr_t block, size_t size)
 		buffer_clean(b);
 		buffer_insert_detached(b);
 	}
-	lock_release(buffer_lock);
+	lock_release(bp->bp_lock);
 }
 
 static
 void
 buffer_release_internal(struct buf *b)
 {
-	KASSERT(lock_do_i_hold(buffer_lock));
-	bufcheck();
+	KASSERT(lock_do_i_hold(b->b_part->bp_lock));
+	bufcheck(b->b_part);
 
 	if (!b->b_fsmanaged) {
 		/* buffers must be release while still reserved */
@@ -1495,7 +2243,7 @@ buffer_release_internal(struct buf *b)
 		buffer_clean(b);
 		buffer_insert_detached(b);
 	}
-	else {
+	else if (b->b_hot) {
 		/* move it to the end of the LRU list */
 		buffer_remove_attached(b, 0);
 		buffer_insert_attached(b);
@@ -1508,9 +2256,11 @@ buffer_release_internal(struct buf *b)
 void
 buffer_release(struct buf *b)
 {
-	lock_acquire(buffer_lock);
+	struct bufpart *bp = b->b_part;
+
+	lock_acquire(bp->bp_lock);
 	buffer_release_internal(b);
-	lock_release(buffer_lock);
+	lock_release(bp->bp_lock);
 }
 
 /*
@@ -1519,12 +2269,14 @@ buffer_release(struct buf *b)
 void
 buffer_release_and_invalidate(struct buf *b)
 {
-	lock_acquire(buffer_lock);
-	bufcheck();
+	struct bufpart *bp = b->b_part;
+
+	lock_acquire(bp->bp_lock);
+	bufcheck(bp);
 
 	b->b_valid = 0;
 	buffer_release_internal(b);
-	lock_release(buffer_lock);
+	lock_release(bp->bp_lock);
 }
 
 ////////////////////////////////////////////////////////////
@@ -1546,22 +2298,54 @@ buffer_set_fsdata(struct buf *buf, void *newfsd)
 	return oldfsd;
 }
 
+/*
+ * Call FUNC on every dirty buffer belonging to FS, one partition at a
+ * time. The partition is locked while FUNC runs, so FUNC must not
+ * sleep or call back into the buffer cache; it may look at the
+ * buffer's fs-specific data.
+ */
+void
+buffer_foreach_dirty(struct fs *fs, void (*func)(struct buf *, void *),
+		     void *data)
+{
+	struct bufpart *bp;
+	struct buf *b;
+	unsigned p, i;
+
+	for (p=0; p<BUFFER_PARTITIONS; p++) {
+		bp = &buffer_parts[p];
+		lock_acquire(bp->bp_lock);
+		for (i=0; i<bufarray_num(&bp->bp_dirty); i++) {
+			b = bufarray_get(&bp->bp_dirty, i);
+			if (b == NULL || b->b_fs != fs) {
+				continue;
+			}
+			func(b, data);
+		}
+		lock_release(bp->bp_lock);
+	}
+}
+
 ////////////////////////////////////////////////////////////
 // explicit sync
 
+/*
+ * Sync the buffers of one partition.
+ */
+static
 int
-sync_fs_buffers(struct fs *fs)
+sync_part_buffers(struct bufpart *bp, struct fs *fs)
 {
 	unsigned i;
 	struct buf *b;
 	unsigned my_epoch, my_generation;
 	int result;
 
-	lock_acquire(buffer_lock);
-	bufcheck();
+	KASSERT(lock_do_i_hold(bp->bp_lock));
+	bufcheck(bp);
 
-	my_epoch = dirty_epoch++;
-	if (dirty_epoch == 0) {
+	my_epoch = bp->bp_dirty_epoch++;
+	if (bp->bp_dirty_epoch == 0) {
 		/*
 		 * Handling this instead of dying is not that
 		 * difficult, but for OS/161 it's not really worth the
@@ -1570,11 +2354,11 @@ sync_fs_buffers(struct fs *fs)
 		panic("vfs: buffer cache syncer epoch wrapped around\n");
 	}
 
-	my_generation = dirty_buffers_generation;
+	my_generation = bp->bp_dirty_generation;
 
 	/* Don't cache the array size; it might change as we work. */
-	for (i=0; i<bufarray_num(&dirty_buffers); i++) {
-		b = bufarray_get(&dirty_buffers, i);
+	for (i=0; i<bufarray_num(&bp->bp_dirty); i++) {
+		b = bufarray_get(&bp->bp_dirty, i);
 		if (b == NULL || b->b_fs != fs) {
 			continue;
 		}
@@ -1601,202 +2385,423 @@ sync_fs_buffers(struct fs *fs)
 			 */
 		}
 		else if (result) {
-			lock_release(buffer_lock);
 			return result;
 		}
 
-		if (my_generation != dirty_buffers_generation) {
+		if (my_generation != bp->bp_dirty_generation) {
 			/* compact_dirty_buffers ran; restart loop */
 			i = 0;
-			my_generation = dirty_buffers_generation;
+			my_generation = bp->bp_dirty_generation;
 			/* compensate for the i++ */
 			i--;
 		}
 	}
 
-	lock_release(buffer_lock);
+	return 0;
+}
+
+int
+sync_fs_buffers(struct fs *fs)
+{
+	struct bufpart *bp;
+	unsigned p;
+	int result;
+
+	for (p=0; p<BUFFER_PARTITIONS; p++) {
+		bp = &buffer_parts[p];
+		lock_acquire(bp->bp_lock);
+		result = sync_part_buffers(bp, fs);
+		lock_release(bp->bp_lock);
+		if (result) {
+			return result;
+		}
+	}
 	return 0;
 }
 
 ////////////////////////////////////////////////////////////
-// for unmounting
+// read-ahead
 
 /*
- * Invalidate and detach all buffers belonging to a filesystem. Every
- * fs should do this as part of its unmount routine once it's sure
- * that the fs is idle.
+ * Ask for a buffer to be read in the background, because the file
+ * system expects to want it soon. This never waits for I/O: the
+ * request goes on a queue for the prefetcher thread, and is dropped
+ * if the queue is full or the block is already cached (at any size).
+ * A buffer brought in this way that is then used counts as a
+ * prefetch hit.
  *
- * Panic if we hit a dirty buffer, as sync should just have been
- * called and no buffers should get dirty again after that.
+ * Since the prefetcher holds no file system locks, the FS must cope
+ * with the block having been freed and reused by the time it's read;
+ * all that costs is a wasted read.
  */
 void
-drop_fs_buffers(struct fs *fs)
+buffer_prefetch(struct fs *fs, daddr_t block, size_t size)
 {
+	struct bufpart *bp;
+	struct prefetch *pf;
+	bool cached;
 	unsigned i;
-	struct buf *b;
-	unsigned my_generation;
-
-	lock_acquire(buffer_lock);
-	bufcheck();
-
-	my_generation = attached_buffers_generation;
-	/* Don't cache the array size; it might change as we work. */
-	for (i=0; i<bufarray_num(&attached_buffers); i++) {
-		b = bufarray_get(&attached_buffers, i);
-		if (b == NULL || b->b_fs != fs) {
-			continue;
-		}
 
-		KASSERT(b->b_valid);
-		if (b->b_dirty) {
-			panic("drop_fs_buffers: buffer did not get synced\n");
-		}
-		if (b->b_busy) {
-			panic("drop_fs_buffers: buffer is busy\n");
-		}
+	KASSERT(size >= MIN_BUFFER_SIZE && size <= MAX_BUFFER_SIZE);
+	KASSERT(block % BUFFER_UNITS(size) == 0);
 
-		buffer_clean(b);
-		buffer_insert_detached(b);
+	bp = buffer_partition(fs, block);
+	lock_acquire(bp->bp_lock);
+	cached = bufhash_get(&bp->bp_hash, fs, block) != NULL ||
+		buffer_find_overlap(bp, fs, block, size) != NULL;
+	lock_release(bp->bp_lock);
+	if (cached) {
+		return;
+	}
 
-		if (my_generation != attached_buffers_generation) {
-			/* compact_attached_buffers ran; restart loop */
-			i = 0;
-			my_generation = dirty_buffers_generation;
-			/* compensate for the i++ */
-			i--;
+	lock_acquire(buffer_prefetch_lock);
+	if (prefetch_count == PREFETCH_QUEUE) {
+		lock_release(buffer_prefetch_lock);
+		return;
+	}
+	for (i=0; i<prefetch_count; i++) {
+		pf = &prefetch_queue[(prefetch_head + i) % PREFETCH_QUEUE];
+		if (pf->pf_fs == fs && pf->pf_block == block) {
+			lock_release(buffer_prefetch_lock);
+			return;
 		}
 	}
-
-	lock_release(buffer_lock);
+	pf = &prefetch_queue[(prefetch_head + prefetch_count) % PREFETCH_QUEUE];
+	pf->pf_fs = fs;
+	pf->pf_block = block;
+	pf->pf_size = size;
+	prefetch_count++;
+	cv_signal(buffer_prefetch_cv, buffer_prefetch_lock);
+	lock_release(buffer_prefetch_lock);
 }
 
-////////////////////////////////////////////////////////////
-// syncer
-
 /*
- * The syncer has two goals: first, to ensure a steady supply of old,
- * clean buffers for eviction; and second, to make sure no buffer
- * remains dirty for too long (no matter how heavily used it is) to
- * avoid data loss in a crash.
- *
- * Pursuant to this, when activated, we write out:
- *    - any of the oldest N recently used buffers that are dirty;
- *    - any of the oldest N+K recently used buffers that are dirty and
- *      are older than one second;
- *    - any dirty buffers that are older than two seconds.
- *
- * Any buffers that can still be allocated (max_total_buffers -
- * num_total_buffers) are counted as very old clean buffers, so at
- * first we don't sync anything at all until one of the time limits
- * kicks in.
+ * Read one queued block. Called with a buffer reservation.
  */
-
 static
 void
-sync_some_buffers(void)
+prefetch_one(struct prefetch *pf)
 {
-	struct timespec now, age;
-	unsigned sync_always; /* N */
-	unsigned sync_ifold; /* N + K */
-	unsigned seenbuffers;
-	unsigned my_generation;
-	unsigned i;
+	struct bufpart *bp;
 	struct buf *b;
 	int result;
 
-	KASSERT(lock_do_i_hold(buffer_lock));
-	bufcheck();
-
-	if (dirty_buffers_count == 0) {
+	bp = buffer_partition(pf->pf_fs, pf->pf_block);
+	lock_acquire(bp->bp_lock);
+	result = buffer_get_internal(bp, pf->pf_fs, pf->pf_block,
+				     pf->pf_size, false, &b);
+	if (result) {
+		lock_release(bp->bp_lock);
 		return;
 	}
+	if (!b->b_valid) {
+		bp->bp_read_gets++;
+		/* may lose (and then re-acquire) lock here */
+		result = buffer_readin(b);
+		if (result == 0) {
+			b->b_prefetched = 1;
+			bp->bp_prefetches++;
+		}
+	}
+	buffer_release_internal(b);
+	lock_release(bp->bp_lock);
+}
 
-	gettime(&now);
-	sync_always = SCALE(max_total_buffers, SYNCER_ALWAYS);
-	sync_ifold = SCALE(max_total_buffers, SYNCER_IFOLD);
-	seenbuffers = 0;
+/*
+ * The prefetcher. One thread is enough, as there's only one disk to
+ * keep busy, and it keeps the queue in the order the FS asked.
+ */
+static
+void
+prefetch_thread(void *x1, unsigned long x2)
+{
+	struct prefetch pf;
 
-	/*
-	 * Buffers not allocated yet are buffers we have effectively
-	 * already processed.
-	 */
-	seenbuffers += max_total_buffers - num_total_buffers;
+	(void)x1;
+	(void)x2;
+
+	curthread->t_iopri = IOPRI_BACKGROUND;
 
-	my_generation = attached_buffers_generation;
-	i = 0;
+	lock_acquire(buffer_prefetch_lock);
 	while (1) {
-		/* Don't cache the array size; it might change as we work. */
-		if (i >= bufarray_num(&attached_buffers)) {
-			/* no more buffers to look at */
-			break;
-		}
-		if (seenbuffers >= sync_ifold) {
-			/* checked enough */
-			break;
+		while (prefetch_count == 0) {
+			cv_wait(buffer_prefetch_cv, buffer_prefetch_lock);
 		}
+		pf = prefetch_queue[prefetch_head];
+		prefetch_head = (prefetch_head + 1) % PREFETCH_QUEUE;
+		prefetch_count--;
+		prefetch_busy_fs = pf.pf_fs;
+		lock_release(buffer_prefetch_lock);
+
+		reserve_buffers(MIN_BUFFER_SIZE);
+		prefetch_one(&pf);
+		unreserve_buffers(MIN_BUFFER_SIZE);
+
+		lock_acquire(buffer_prefetch_lock);
+		prefetch_busy_fs = NULL;
+		cv_broadcast(buffer_prefetch_done_cv, buffer_prefetch_lock);
+	}
+}
 
-		b = bufarray_get(&attached_buffers, i);
-		i++;
-		if (b == NULL) {
-			continue;
-		}
-		seenbuffers++;
-		if (!b->b_dirty) {
-			continue;
+/*
+ * Throw away queued prefetches for a file system and wait until the
+ * prefetcher isn't using it.
+ */
+static
+void
+prefetch_cancel(struct fs *fs)
+{
+	struct prefetch *pf;
+	unsigned i, kept;
+
+	lock_acquire(buffer_prefetch_lock);
+	kept = 0;
+	for (i=0; i<prefetch_count; i++) {
+		pf = &prefetch_queue[(prefetch_head + i) % PREFETCH_QUEUE];
+		if (pf->pf_fs != fs) {
+			prefetch_queue[(prefetch_head + kept) % PREFETCH_QUEUE]
+				= *pf;
+			kept++;
 		}
+	}
+	prefetch_count = kept;
+	while (prefetch_busy_fs == fs) {
+		cv_wait(buffer_prefetch_done_cv, buffer_prefetch_lock);
+	}
+	lock_release(buffer_prefetch_lock);
+}
 
-		if (seenbuffers >= sync_always) {
-			timespec_sub(&now, &b->b_timestamp, &age);
-			if (age.tv_sec < 1) {
-				/* less than a second old */
+////////////////////////////////////////////////////////////
+// for unmounting
+
+/*
+ * Invalidate and detach all buffers belonging to a filesystem. Every
+ * fs should do this as part of its unmount routine once it's sure
+ * that the fs is idle.
+ *
+ * Panic if we hit a dirty buffer, as sync should just have been
+ * called and no buffers should get dirty again after that.
+ */
+void
+drop_fs_buffers(struct fs *fs)
+{
+	struct bufpart *bp;
+	unsigned p, i;
+	struct buf *b;
+	unsigned my_generation;
+
+	/* the prefetcher mustn't be bringing in new ones as we go */
+	prefetch_cancel(fs);
+
+	for (p=0; p<BUFFER_PARTITIONS; p++) {
+		bp = &buffer_parts[p];
+		lock_acquire(bp->bp_lock);
+		bufcheck(bp);
+		bufghost_drop_fs(bp, fs);
+
+		my_generation = bp->bp_attached_generation;
+		/* Don't cache the array size; it might change as we work. */
+		for (i=0; i<bufarray_num(&bp->bp_attached); i++) {
+			b = bufarray_get(&bp->bp_attached, i);
+			if (b == NULL || b->b_fs != fs) {
 				continue;
 			}
-		}
 
-		/* This can sleep */
-		result = buffer_sync(b);
-		if (result == EDEADBUF) {
-			/*
-			 * The buffer was invalidated/evicted while we
-			 * were waiting to mark it busy. It no longer
-			 * needs syncing, so carry on.
-			 */
+			KASSERT(b->b_valid);
+			if (b->b_dirty) {
+				panic("drop_fs_buffers: buffer did not get "
+				      "synced\n");
+			}
+			if (b->b_busy) {
+				panic("drop_fs_buffers: buffer is busy\n");
+			}
+
+			buffer_clean(b);
+			buffer_insert_detached(b);
+
+			if (my_generation != bp->bp_attached_generation) {
+				/* compact_attached_buffers ran; restart loop */
+				i = 0;
+				my_generation = bp->bp_attached_generation;
+				/* compensate for the i++ */
+				i--;
+			}
 		}
-		else if (result) {
-			/*
-			 * XXX we should probably do something to
-			 * avoid retrying it over and over.
-			 */
-			kprintf("syncer: %s: block %u: Warning: %s\n",
-				FSOP_GETVOLNAME(b->b_fs), b->b_physblock,
-				strerror(result));
+
+		lock_release(bp->bp_lock);
+	}
+}
+
+////////////////////////////////////////////////////////////
+// syncer
+
+/*
+ * The syncer has two goals: first, to ensure a steady supply of old,
+ * clean buffers for eviction; and second, to make sure no buffer
+ * remains dirty for too long (no matter how heavily used it is) to
+ * avoid data loss in a crash.
+ *
+ * Pursuant to this, when activated, we pick (in each partition):
+ *    - any of the oldest N recently used buffers that are dirty;
+ *    - any of the oldest N+K recently used buffers that are dirty and
+ *      are older than one second;
+ *    - any dirty buffers that are older than SYNCER_EXPIRE seconds;
+ *    - when more than SYNCER_BACKGROUND of the cache is dirty, the
+ *      oldest dirty buffers regardless of age.
+ *
+ * Any buffers that can still be allocated (the partition's share of
+ * max_total_units, less what it has) are counted as very old clean
+ * buffers, so at first we don't sync anything at all until one of the
+ * limits kicks in. All of this is counted in MIN_BUFFER_SIZE units,
+ * so a big buffer counts for as many blocks as it holds.
+ *
+ * The picks from all partitions go into one batch, which is sorted
+ * by block number before anything is written so the disk sees one
+ * sweep instead of sixteen interleaved ones. If the batch fills up we
+ * go around again straight away. The partition we start from rotates
+ * so a full batch doesn't always favor the same ones.
+ */
+
+struct syncer_key {
+	struct fs *sk_fs;
+	daddr_t sk_block;
+	size_t sk_size;
+};
+
+static struct syncer_key syncer_batch[SYNCER_BATCH];
+static unsigned syncer_batch_count;
+static unsigned syncer_next_part;
+
+/*
+ * Buffers the partition could still get before reaching its share.
+ */
+static
+unsigned
+buffers_unallocated(struct bufpart *bp)
+{
+	unsigned share;
+
+	share = max_total_units / BUFFER_PARTITIONS;
+	return bp->bp_num_units < share ? share - bp->bp_num_units : 0;
+}
+
+/*
+ * Add a buffer to the batch, keeping it sorted by file system and
+ * block. Returns false if the batch is full.
+ */
+static
+bool
+syncer_add(struct buf *b)
+{
+	struct syncer_key *sk;
+	unsigned i;
+
+	if (b->b_busy) {
+		/* whoever has it will release it dirty; catch it next time */
+		return true;
+	}
+	for (i=0; i<syncer_batch_count; i++) {
+		sk = &syncer_batch[i];
+		if (sk->sk_fs == b->b_fs && sk->sk_block == b->b_physblock) {
+			/* already picked; it's on both lists */
+			return true;
 		}
+	}
+	if (syncer_batch_count == SYNCER_BATCH) {
+		return false;
+	}
 
-		if (my_generation != attached_buffers_generation) {
-			/* compact_attached_buffers ran; restart loop */
-			i = 0;
-			seenbuffers = 0;
-			seenbuffers += max_total_buffers - num_total_buffers;
-			my_generation = attached_buffers_generation;
-			continue;
+	/* insertion sort; the batch is small */
+	i = syncer_batch_count;
+	while (i > 0) {
+		sk = &syncer_batch[i - 1];
+		if ((uintptr_t)sk->sk_fs < (uintptr_t)b->b_fs ||
+		    (sk->sk_fs == b->b_fs && sk->sk_block < b->b_physblock)) {
+			break;
 		}
+		syncer_batch[i] = *sk;
+		i--;
 	}
+	syncer_batch[i].sk_fs = b->b_fs;
+	syncer_batch[i].sk_block = b->b_physblock;
+	syncer_batch[i].sk_size = b->b_size;
+	syncer_batch_count++;
+	return true;
+}
 
-	my_generation = dirty_buffers_generation;
-	i = 0;
-	while (1) {
-		/* Don't cache the array size; it might change as we work. */
-		if (i >= bufarray_num(&dirty_buffers)) {
+/*
+ * Pick the buffers in BP that need writing, per the rules above.
+ * Returns false if the batch filled up.
+ */
+static
+bool
+syncer_collect(struct bufpart *bp, const struct timespec *now,
+	       bool overlimit)
+{
+	struct timespec age;
+	unsigned sync_always; /* N */
+	unsigned sync_ifold; /* N + K */
+	unsigned seenbuffers;
+	unsigned i;
+	struct buf *b;
+
+	KASSERT(lock_do_i_hold(bp->bp_lock));
+	bufcheck(bp);
+
+	if (bp->bp_dirty_count == 0) {
+		return true;
+	}
+
+	sync_always = SCALE(max_total_units / BUFFER_PARTITIONS,
+			    SYNCER_ALWAYS);
+	sync_ifold = SCALE(max_total_units / BUFFER_PARTITIONS,
+			   SYNCER_IFOLD);
+
+	/*
+	 * Buffers not allocated yet are buffers we have effectively
+	 * already processed.
+	 */
+	seenbuffers = buffers_unallocated(bp);
+
+	/* Nothing here sleeps, so the arrays can't be compacted under us. */
+	for (i=0; i<bufarray_num(&bp->bp_attached); i++) {
+		if (seenbuffers >= sync_ifold) {
+			/* checked enough */
 			break;
 		}
-		b = bufarray_get(&dirty_buffers, i);
-		i++;
+
+		b = bufarray_get(&bp->bp_attached, i);
+		if (b == NULL) {
+			continue;
+		}
+		seenbuffers += BUFFER_UNITS(b->b_size);
+		if (!b->b_dirty || b->b_fsmanaged) {
+			continue;
+		}
+
+		if (seenbuffers >= sync_always) {
+			timespec_sub(now, &b->b_timestamp, &age);
+			if (age.tv_sec < 1) {
+				/* less than a second old */
+				continue;
+			}
+		}
+		if (!syncer_add(b)) {
+			return false;
+		}
+	}
+
+	for (i=0; i<bufarray_num(&bp->bp_dirty); i++) {
+		b = bufarray_get(&bp->bp_dirty, i);
 		if (b == NULL) {
 			continue;
 		}
 		KASSERT(b->b_dirty);
-		timespec_sub(&now, &b->b_timestamp, &age);
-		if (age.tv_sec < 2) {
+		if (b->b_fsmanaged) {
+			continue;
+		}
+		timespec_sub(now, &b->b_timestamp, &age);
+		if (age.tv_sec < SYNCER_EXPIRE && !overlimit) {
 			/*
 			 * Because buffers are added to dirty[] in
 			 * order and it's never reshuffled, once we
@@ -1805,35 +2810,163 @@ sync_some_buffers(void)
 			 */
 			break;
 		}
-
-		result = buffer_sync(b);
-		if (result == EDEADBUF) {
-			/* as above */
+		if (!syncer_add(b)) {
+			return false;
 		}
-		else if (result) {
-			/*
-			 * XXX we should probably do something to
-			 * avoid retrying it over and over.
-			 */
-			kprintf("syncer: %s: block %u: Warning: %s\n",
-				FSOP_GETVOLNAME(b->b_fs), b->b_physblock,
-				strerror(result));
+	}
+	return true;
+}
+
+/*
+ * Write out one buffer from the batch, if it's still there and still
+ * dirty. Returns the units written.
+ */
+static
+unsigned
+syncer_write(struct syncer_key *sk)
+{
+	struct bufpart *bp;
+	struct buf *b;
+	unsigned units;
+	int result;
+
+	bp = buffer_partition(sk->sk_fs, sk->sk_block);
+	lock_acquire(bp->bp_lock);
+	b = bufhash_get(&bp->bp_hash, sk->sk_fs, sk->sk_block);
+	if (b == NULL || b->b_size != sk->sk_size || !b->b_dirty ||
+	    b->b_fsmanaged || b->b_busy) {
+		/* gone, rewritten, or in use since we looked */
+		lock_release(bp->bp_lock);
+		return 0;
+	}
+	units = BUFFER_UNITS(b->b_size);
+
+	/* This can sleep */
+	result = buffer_sync(b);
+	if (result == EDEADBUF) {
+		/*
+		 * The buffer was invalidated/evicted while we were
+		 * waiting to mark it busy. It no longer needs syncing,
+		 * so carry on.
+		 */
+		units = 0;
+	}
+	else if (result) {
+		/*
+		 * XXX we should probably do something to avoid
+		 * retrying it over and over.
+		 */
+		kprintf("syncer: %s: block %u: Warning: %s\n",
+			FSOP_GETVOLNAME(b->b_fs), b->b_physblock,
+			strerror(result));
+		units = 0;
+	}
+	lock_release(bp->bp_lock);
+	return units;
+}
+
+/*
+ * Seconds until the oldest dirty buffer the syncer can write expires;
+ * 0 if there aren't any.
+ */
+static
+unsigned
+syncer_next_expiry(const struct timespec *now)
+{
+	struct bufpart *bp;
+	struct buf *b;
+	struct timespec age;
+	unsigned p, i, oldest;
+	bool any;
+
+	any = false;
+	oldest = 0;
+	for (p=0; p<BUFFER_PARTITIONS; p++) {
+		bp = &buffer_parts[p];
+		lock_acquire(bp->bp_lock);
+		for (i=0; i<bufarray_num(&bp->bp_dirty); i++) {
+			b = bufarray_get(&bp->bp_dirty, i);
+			if (b == NULL || b->b_fsmanaged) {
+				continue;
+			}
+			/* dirty[] is in age order; first one is oldest */
+			timespec_sub(now, &b->b_timestamp, &age);
+			if (!any || (unsigned)age.tv_sec > oldest) {
+				oldest = age.tv_sec;
+			}
+			any = true;
+			break;
 		}
+		lock_release(bp->bp_lock);
+	}
+	if (!any) {
+		return 0;
+	}
+	return oldest < SYNCER_EXPIRE ? SYNCER_EXPIRE - oldest : 1;
+}
 
-		if (my_generation != dirty_buffers_generation) {
-			/* compact_dirty_buffers ran; restart loop */
-			i = 0;
-			my_generation = dirty_buffers_generation;
-			continue;
+/*
+ * One syncer run: collect, sort, write. Returns true if it should run
+ * again right away.
+ */
+static
+bool
+syncer_run(void)
+{
+	struct timespec now;
+	unsigned i, p, written, units, expiry;
+	unsigned dirty, thresh;
+	bool full;
+
+	gettime(&now);
+	spinlock_acquire(&buffer_total_lock);
+	dirty = num_dirty_units;
+	thresh = SCALE(max_total_units, SYNCER_BACKGROUND);
+	spinlock_release(&buffer_total_lock);
+
+	syncer_batch_count = 0;
+	full = false;
+	for (i=0; i<BUFFER_PARTITIONS && !full; i++) {
+		p = (syncer_next_part + i) % BUFFER_PARTITIONS;
+		lock_acquire(buffer_parts[p].bp_lock);
+		full = !syncer_collect(&buffer_parts[p], &now, dirty > thresh);
+		lock_release(buffer_parts[p].bp_lock);
+	}
+	syncer_next_part = (syncer_next_part + 1) % BUFFER_PARTITIONS;
+
+	written = 0;
+	for (i=0; i<syncer_batch_count; i++) {
+		units = syncer_write(&syncer_batch[i]);
+		if (units > 0) {
+			written += units;
+			/* let throttled writers look at the new totals */
+			lock_acquire(buffer_throttle_lock);
+			syncer_written_units += units;
+			cv_broadcast(buffer_throttle_cv, buffer_throttle_lock);
+			lock_release(buffer_throttle_lock);
 		}
 	}
+
+	lock_acquire(buffer_throttle_lock);
+	syncer_rounds++;
+	cv_broadcast(buffer_throttle_cv, buffer_throttle_lock);
+	lock_release(buffer_throttle_lock);
+
+	gettime(&now);
+	expiry = syncer_next_expiry(&now);
+	spinlock_acquire(&syncer_lock);
+	syncer_ticks = expiry;
+	spinlock_release(&syncer_lock);
+
+	/* Keep going while the batch fills and we're getting somewhere. */
+	return full && written > 0;
 }
 
 /*
- * If OS/161 had a more powerful clock system, we might arrange to run
- * the syncer either when enough buffers become dirty or every second
- * or two when dirty buffers exist. But we don't really have the
- * facilities for that, so instead we'll just run once a second.
+ * The syncer runs when there's something for it to do: the dirty
+ * count has passed SYNCER_BACKGROUND (see buffer_count_dirty), a
+ * dirty buffer is about to expire (see buffer_timer), a writer is
+ * being throttled, or the cache could grow.
  */
 static
 void
@@ -1842,12 +2975,107 @@ syncer_thread(void *x1, unsigned long x2)
 	(void)x1;
 	(void)x2;
 
+	/* writeback shouldn't hold up anyone waiting for the disk */
+	curthread->t_iopri = IOPRI_BACKGROUND;
+
 	while (1) {
-		clocksleep(1);
-		lock_acquire(buffer_lock);
-		sync_some_buffers();
-		lock_release(buffer_lock);
+		spinlock_acquire(&syncer_lock);
+		while (!syncer_wanted) {
+			wchan_sleep(syncer_wchan, &syncer_lock);
+		}
+		syncer_wanted = false;
+		spinlock_release(&syncer_lock);
+
+		buffer_grow();
+		while (syncer_run()) {
+			/* batch was full; go again */
+		}
+	}
+}
+
+/*
+ * Once a second, from the clock interrupt. Count down to the next
+ * expiry and wake the syncer when it arrives, or when the VM system
+ * has memory to spare that the cache could grow into. Reads the
+ * totals unlocked; they're only hints here.
+ */
+void
+buffer_timer(void)
+{
+	bool wake;
+
+	if (syncer_wchan == NULL) {
+		/* not bootstrapped yet */
+		return;
+	}
+
+	spinlock_acquire(&syncer_lock);
+	wake = false;
+	if (syncer_ticks > 0) {
+		syncer_ticks--;
+		wake = (syncer_ticks == 0);
+	}
+	spinlock_release(&syncer_lock);
+
+	if (wake) {
+		syncer_wakeup(true);
+	}
+	else if (max_total_units < grow_total_units && cm_memory_plentiful()) {
+		syncer_wakeup(true);
+	}
+}
+
+/*
+ * Throttle a writer that just finished an operation in which it
+ * dirtied DIRTIED units, if the cache is more than SYNCER_THROTTLE
+ * dirty. It waits until the syncer has written a share of what it
+ * dirtied, proportional to how far over the limit we are (nothing at
+ * the limit, all of it at twice the limit), or until the cache is
+ * back under the limit. A writer never waits for more than
+ * THROTTLE_MAXROUNDS syncer runs, in case the syncer can't get at the
+ * dirty buffers (e.g. they're all busy).
+ *
+ * Called with no buffers held or reserved. The caller may still hold
+ * file system locks, which is one more reason the wait is bounded.
+ */
+static
+void
+buffer_throttle(unsigned dirtied)
+{
+	unsigned dirty, limit, excess, owed, startwritten, rounds;
+
+	spinlock_acquire(&buffer_total_lock);
+	dirty = num_dirty_units;
+	limit = SCALE(max_total_units, SYNCER_THROTTLE);
+	spinlock_release(&buffer_total_lock);
+
+	if (dirty <= limit || limit == 0) {
+		return;
 	}
+	excess = dirty - limit;
+	if (excess > limit) {
+		excess = limit;
+	}
+	owed = (dirtied * excess + limit - 1) / limit;
+
+	lock_acquire(buffer_throttle_lock);
+	throttled_writers++;
+	startwritten = syncer_written_units;
+	rounds = syncer_rounds;
+	while (syncer_written_units - startwritten < owed &&
+	       syncer_rounds - rounds < THROTTLE_MAXROUNDS) {
+		spinlock_acquire(&buffer_total_lock);
+		dirty = num_dirty_units;
+		spinlock_release(&buffer_total_lock);
+		if (dirty <= limit) {
+			break;
+		}
+		/* make sure there's another run coming to wait for */
+		syncer_wakeup(false);
+		cv_wait(buffer_throttle_cv, buffer_throttle_lock);
+	}
+	throttled_rounds += syncer_rounds - rounds;
+	lock_release(buffer_throttle_lock);
 }
 
 ////////////////////////////////////////////////////////////
@@ -1867,6 +3095,11 @@ syncer_thread(void *x1, unsigned long x2)
  * Otherwise one can get deadlocks where all threads have N buffers,
  * all are trying to get another, and none are left.
  *
+ * Reservations are counted against the whole cache, not against any
+ * one partition; buffer_steal is what makes that work. They are in
+ * MIN_BUFFER_SIZE units and leave room for one of the buffers to be
+ * as big as a buffer can be.
+ *
  * The number of buffers to reserve is fixed; we could pass in the
  * number (and in fact used to) but counting the exact numbers of
  * buffers required is not worthwhile.
@@ -1874,75 +3107,250 @@ syncer_thread(void *x1, unsigned long x2)
 void
 reserve_buffers(size_t size)
 {
-	unsigned count = RESERVE_BUFFERS;
+	unsigned count = RESERVE_UNITS;
 
-	lock_acquire(buffer_lock);
-	bufcheck();
+	lock_acquire(buffer_reserve_lock);
 
-	KASSERT(size == ONE_TRUE_BUFFER_SIZE);
+	KASSERT(size == MIN_BUFFER_SIZE);
 
 	/* All buffer reservations must be done up front, all at once. */
 	KASSERT(curthread->t_did_reserve_buffers == false);
 
-	while (num_reserved_buffers + count > max_total_buffers) {
-		cv_wait(buffer_reserve_cv, buffer_lock);
+	while (num_reserved_buffers + count > max_total_units) {
+		cv_wait(buffer_reserve_cv, buffer_reserve_lock);
 	}
 	num_reserved_buffers += count;
 	curthread->t_did_reserve_buffers = true;
-	lock_release(buffer_lock);
+	lock_release(buffer_reserve_lock);
 }
 
 /*
- * Release reservation of COUNT buffers.
+ * Release reservation of COUNT buffers. If THROTTLE, the operation is
+ * over, and a heavy writer may be held up here.
  */
+static
 void
-unreserve_buffers(size_t size)
+unreserve_buffers_internal(size_t size, bool throttle)
 {
-	unsigned count = RESERVE_BUFFERS;
+	unsigned count = RESERVE_UNITS;
+	unsigned dirtied;
 
-	lock_acquire(buffer_lock);
-	bufcheck();
+	lock_acquire(buffer_reserve_lock);
 
-	KASSERT(size == ONE_TRUE_BUFFER_SIZE);
+	KASSERT(size == MIN_BUFFER_SIZE);
 
 	KASSERT(curthread->t_did_reserve_buffers == true);
 	KASSERT(count <= num_reserved_buffers);
 
 	curthread->t_did_reserve_buffers = false;
 	num_reserved_buffers -= count;
-	cv_broadcast(buffer_reserve_cv, buffer_lock);
+	cv_broadcast(buffer_reserve_cv, buffer_reserve_lock);
+
+	lock_release(buffer_reserve_lock);
+
+	if (!throttle) {
+		/* still inside the operation; count it all at the end */
+		return;
+	}
+
+	/* Now that the operation is done, make heavy writers pay for it. */
+	dirtied = curthread->t_dirtied_units;
+	curthread->t_dirtied_units = 0;
+	if (dirtied > 0) {
+		buffer_throttle(dirtied);
+	}
+}
+
+void
+unreserve_buffers(size_t size)
+{
+	unreserve_buffers_internal(size, true);
+}
 
-	lock_release(buffer_lock);
+/*
+ * Release the reservation in the middle of an operation, which will
+ * reserve again; see buf.h. buffer_throttle must not wait here, with
+ * buffers and file system state held.
+ */
+void
+unreserve_buffers_nested(size_t size)
+{
+	unreserve_buffers_internal(size, false);
 }
 
 void
 reserve_fsmanaged_buffers(unsigned count, size_t size)
 {
-	lock_acquire(buffer_lock);
-	bufcheck();
+	lock_acquire(buffer_reserve_lock);
 
-	KASSERT(size == ONE_TRUE_BUFFER_SIZE);
+	KASSERT(size >= MIN_BUFFER_SIZE && size <= MAX_BUFFER_SIZE);
+	count *= BUFFER_UNITS(size);
 
-	while (num_reserved_buffers + count > max_total_buffers) {
-		cv_wait(buffer_reserve_cv, buffer_lock);
+	while (num_reserved_buffers + count > max_total_units) {
+		cv_wait(buffer_reserve_cv, buffer_reserve_lock);
 	}
 	num_reserved_buffers += count;
-	lock_release(buffer_lock);
+	lock_release(buffer_reserve_lock);
 }
 
 void
 unreserve_fsmanaged_buffers(unsigned count, size_t size)
 {
-	lock_acquire(buffer_lock);
-	bufcheck();
+	lock_acquire(buffer_reserve_lock);
 
-	KASSERT(size == ONE_TRUE_BUFFER_SIZE);
+	KASSERT(size >= MIN_BUFFER_SIZE && size <= MAX_BUFFER_SIZE);
+	count *= BUFFER_UNITS(size);
 	KASSERT(count <= num_reserved_buffers);
 
 	num_reserved_buffers -= count;
-	cv_broadcast(buffer_reserve_cv, buffer_lock);
+	cv_broadcast(buffer_reserve_cv, buffer_reserve_lock);
+
+	lock_release(buffer_reserve_lock);
+}
+
+////////////////////////////////////////////////////////////
+// sharing memory with the VM system
+
+/*
+ * Free up to NPAGES pages' worth of clean, idle buffers, for the VM
+ * system when it's short of memory, and shrink max_total_units to
+ * match so the cache doesn't just grow back. Returns the number of
+ * MIN_BUFFER_SIZE units freed.
+ *
+ * Which side gives up memory goes by recency: buffers get a second
+ * chance like pages do on the VM clock. A buffer used since reclaim
+ * last looked at it has its reference bit cleared and is skipped;
+ * one that wasn't is freed (unused detached buffers go first). When
+ * every idle buffer has been used lately this frees nothing, and the
+ * VM system evicts a user page instead.
+ *
+ * This is called from the page allocator, possibly holding VM locks
+ * that a thread in here with a partition lock (allocating memory
+ * for a buffer) might be waiting for. So it never waits for a
+ * partition lock, and doesn't drop and retake one either; that means
+ * FSOP_DETACHBUF is called with the partition locked, and so must not
+ * sleep (it normally just frees the fs-specific data).
+ */
+unsigned
+buffer_reclaim(unsigned npages)
+{
+	static unsigned hand;	/* partition to start at; unlocked hint */
+	struct bufpart *bp;
+	struct buf *b;
+	unsigned goal, freed, p, i, num, units;
+	int result;
+
+	goal = npages * (PAGE_SIZE / MIN_BUFFER_SIZE);
+	freed = 0;
+	for (p=0; p<BUFFER_PARTITIONS && freed < goal; p++) {
+		bp = &buffer_parts[(hand + p) % BUFFER_PARTITIONS];
+		/*
+		 * We may be here from inside the cache, with this
+		 * partition locked (e.g. under FSOP_DETACHBUF);
+		 * lock_tryacquire would assert. Skip it like a busy one.
+		 */
+		if (lock_do_i_hold(bp->bp_lock) ||
+		    !lock_tryacquire(bp->bp_lock)) {
+			continue;
+		}
+		bufcheck(bp);
 
-	lock_release(buffer_lock);
+		while (freed < goal &&
+		       (b = buffer_remove_detached(bp, 0)) != NULL) {
+			freed += BUFFER_UNITS(b->b_size);
+			buffer_destroy(b);
+		}
+
+		num = bufarray_num(&bp->bp_attached);
+		for (i=0; i<num && freed < goal; i++) {
+			b = bufarray_get(&bp->bp_attached, i);
+			if (b == NULL || b->b_busy || b->b_dirty) {
+				continue;
+			}
+			if (b->b_referenced) {
+				b->b_referenced = 0;
+				continue;
+			}
+			if (!b->b_hot && !b->b_prefetched) {
+				bufghost_add(bp, b->b_fs, b->b_physblock);
+			}
+
+			/* as buffer_clean, but keeping the lock */
+			result = buffer_mark_busy(b);
+			KASSERT(result == 0);
+			FSOP_DETACHBUF(b->b_fs, b->b_physblock, b);
+			buffer_unmark_busy(b);
+			buffer_remove_attached(b, 0);
+			b->b_valid = 0;
+			buffer_detach(b);
+
+			units = BUFFER_UNITS(b->b_size);
+			buffer_destroy(b);
+			freed += units;
+			bp->bp_reclaims += units;
+		}
+		lock_release(bp->bp_lock);
+	}
+	hand = (hand + p) % BUFFER_PARTITIONS;
+
+	/*
+	 * Shrink the limit, but not below what's reserved (that would
+	 * break the promise reserve_buffers made) or what other
+	 * partitions have taken meanwhile. If we can't get the
+	 * reservation lock just leave it; the memory is freed anyway.
+	 */
+	if (freed > 0 && !lock_do_i_hold(buffer_reserve_lock) &&
+	    lock_tryacquire(buffer_reserve_lock)) {
+		spinlock_acquire(&buffer_total_lock);
+		if (max_total_units - freed > min_total_units) {
+			max_total_units -= freed;
+		}
+		else {
+			max_total_units = min_total_units;
+		}
+		if (max_total_units < num_reserved_buffers) {
+			max_total_units = num_reserved_buffers;
+		}
+		if (max_total_units < num_total_units) {
+			max_total_units = num_total_units;
+		}
+		spinlock_release(&buffer_total_lock);
+		lock_release(buffer_reserve_lock);
+	}
+
+	return freed;
+}
+
+/*
+ * If the VM system has plenty of free memory, let the cache grow
+ * toward grow_total_units. Called by the syncer.
+ */
+static
+void
+buffer_grow(void)
+{
+	unsigned step;
+
+	if (!cm_memory_plentiful()) {
+		return;
+	}
+
+	step = SCALE(mainbus_ramsize(), BUFFER_GROWSTEP) / MIN_BUFFER_SIZE;
+	spinlock_acquire(&buffer_total_lock);
+	if (max_total_units >= grow_total_units) {
+		spinlock_release(&buffer_total_lock);
+		return;
+	}
+	max_total_units += step;
+	if (max_total_units > grow_total_units) {
+		max_total_units = grow_total_units;
+	}
+	spinlock_release(&buffer_total_lock);
+
+	/* reservations may have been waiting for room */
+	lock_acquire(buffer_reserve_lock);
+	cv_broadcast(buffer_reserve_cv, buffer_reserve_lock);
+	lock_release(buffer_reserve_lock);
 }
 
 ////////////////////////////////////////////////////////////
@@ -1951,79 +3359,238 @@ unreserve_fsmanaged_buffers(unsigned count, size_t size)
 void
 buffer_printstats(void)
 {
-	lock_acquire(buffer_lock);
+	struct bufpart *bp;
+	unsigned p;
+	unsigned detached = 0, attached = 0, large = 0, busy = 0, dirty = 0;
+	unsigned gets = 0, hits = 0, reads = 0, writeouts = 0;
+	unsigned evictions = 0, dirty_evictions = 0, steals = 0, overlaps = 0;
+	unsigned prefetches = 0, prefetch_hits = 0, probation = 0;
+	unsigned ghost_hits = 0, reclaims = 0;
+	unsigned total, max, reserved, dirtyunits, written;
+	unsigned ratio_wakeups, age_wakeups, expiry;
+	unsigned rounds, syncer_written, throttled, throttle_rounds;
+	struct timespec now;
+
+	/* Each partition is consistent; the sums are only approximate */
+	for (p=0; p<BUFFER_PARTITIONS; p++) {
+		bp = &buffer_parts[p];
+		lock_acquire(bp->bp_lock);
+		detached += bufarray_num(&bp->bp_detached);
+		attached += bp->bp_attached_count;
+		large += bp->bp_num_large;
+		busy += bp->bp_busy_count;
+		dirty += bp->bp_dirty_count;
+		gets += bp->bp_total_gets;
+		hits += bp->bp_valid_gets;
+		reads += bp->bp_read_gets;
+		writeouts += bp->bp_total_writeouts;
+		evictions += bp->bp_total_evictions;
+		dirty_evictions += bp->bp_dirty_evictions;
+		steals += bp->bp_steals;
+		overlaps += bp->bp_overlaps;
+		prefetches += bp->bp_prefetches;
+		prefetch_hits += bp->bp_prefetch_hits;
+		probation += bp->bp_probation_units;
+		ghost_hits += bp->bp_ghost_hits;
+		reclaims += bp->bp_reclaims;
+		lock_release(bp->bp_lock);
+	}
 
-	kprintf("Buffers: %u of %u allocated\n",
-		num_total_buffers, max_total_buffers);
-	kprintf("   %u detached, %u attached\n",
-		bufarray_num(&detached_buffers), attached_buffers_count);
-	kprintf("   %u reserved\n", num_reserved_buffers);
-	kprintf("   %u busy\n", busy_buffers_count);
-	kprintf("   %u dirty\n", dirty_buffers_count);
+	spinlock_acquire(&buffer_total_lock);
+	total = num_total_units;
+	max = max_total_units;
+	dirtyunits = num_dirty_units;
+	written = num_written_units;
+	spinlock_release(&buffer_total_lock);
+
+	spinlock_acquire(&syncer_lock);
+	ratio_wakeups = syncer_ratio_wakeups;
+	age_wakeups = syncer_age_wakeups;
+	spinlock_release(&syncer_lock);
+
+	lock_acquire(buffer_throttle_lock);
+	rounds = syncer_rounds;
+	syncer_written = syncer_written_units;
+	throttled = throttled_writers;
+	throttle_rounds = throttled_rounds;
+	lock_release(buffer_throttle_lock);
+
+	gettime(&now);
+	expiry = syncer_next_expiry(&now);
+
+	lock_acquire(buffer_reserve_lock);
+	reserved = num_reserved_buffers;
+	lock_release(buffer_reserve_lock);
+
+	kprintf("Buffers: %uk of %uk allocated in %u partitions\n",
+		total * MIN_BUFFER_SIZE / 1024,
+		max * MIN_BUFFER_SIZE / 1024, BUFFER_PARTITIONS);
+	kprintf("   limit moves between %uk and %uk\n",
+		min_total_units * MIN_BUFFER_SIZE / 1024,
+		grow_total_units * MIN_BUFFER_SIZE / 1024);
+	kprintf("   %u detached, %u attached (%u multi-block)\n",
+		detached, attached, large);
+	kprintf("   %uk on probation\n", probation * MIN_BUFFER_SIZE / 1024);
+	kprintf("   %uk reserved\n", reserved * MIN_BUFFER_SIZE / 1024);
+	kprintf("   %u busy\n", busy);
+	kprintf("   %u dirty\n", dirty);
 
 	kprintf("Buffer operations:\n");
-	kprintf("   %u gets (%u hits, %u reads)\n",
-		num_total_gets, num_valid_gets, num_read_gets);
-	kprintf("   %u writeouts\n",
-		num_total_writeouts);
+	kprintf("   %u gets (%u hits, %u reads)\n", gets, hits, reads);
+	kprintf("   %u writeouts\n", writeouts);
 	kprintf("   %u evictions (%u when dirty)\n",
-		num_total_evictions, num_dirty_evictions);
-
-	lock_release(buffer_lock);
+		evictions, dirty_evictions);
+	kprintf("   %u buffers moved between partitions\n", steals);
+	kprintf("   %u overlapping buffers dropped\n", overlaps);
+	kprintf("   %u prefetched (%u used)\n", prefetches, prefetch_hits);
+	kprintf("   %u misses on recently evicted blocks\n", ghost_hits);
+	kprintf("   %uk given back to the VM system\n",
+		reclaims * MIN_BUFFER_SIZE / 1024);
+
+	kprintf("Write-behind:\n");
+	kprintf("   %uk dirty (syncer starts at %uk, throttles at %uk)\n",
+		dirtyunits * MIN_BUFFER_SIZE / 1024,
+		SCALE(max, SYNCER_BACKGROUND) * MIN_BUFFER_SIZE / 1024,
+		SCALE(max, SYNCER_THROTTLE) * MIN_BUFFER_SIZE / 1024);
+	if (expiry > 0) {
+		kprintf("   oldest dirty buffer due in %u seconds\n", expiry);
+	}
+	kprintf("   %u syncer runs (%u woken for dirty ratio, %u by timer)\n",
+		rounds, ratio_wakeups, age_wakeups);
+	kprintf("   %uk written (%uk by the syncer)\n",
+		written * MIN_BUFFER_SIZE / 1024,
+		syncer_written * MIN_BUFFER_SIZE / 1024);
+	kprintf("   %u writers throttled, for %u syncer runs\n",
+		throttled, throttle_rounds);
 }
 
 ////////////////////////////////////////////////////////////
 // bootstrap
 
+/*
+ * Set up one partition.
+ */
+static
+void
+bufpart_init(struct bufpart *bp, unsigned numbuckets)
+{
+	unsigned i;
+	int result;
+
+	bufarray_init(&bp->bp_detached);
+	bufarray_init(&bp->bp_attached);
+	bufarray_init(&bp->bp_dirty);
+	bp->bp_attached_first = 0;
+	bp->bp_attached_thresh = 0;
+	bp->bp_dirty_first = 0;
+	bp->bp_dirty_thresh = 0;
+
+	bp->bp_dirty_epoch = 0;
+	bp->bp_dirty_generation = 0;
+	bp->bp_attached_generation = 0;
+
+	bp->bp_num_buffers = 0;
+	bp->bp_num_units = 0;
+	bp->bp_num_large = 0;
+	bp->bp_attached_count = 0;
+	bp->bp_busy_count = 0;
+	bp->bp_dirty_count = 0;
+	bp->bp_probation_units = 0;
+
+	bp->bp_total_gets = 0;
+	bp->bp_valid_gets = 0;
+	bp->bp_read_gets = 0;
+	bp->bp_total_writeouts = 0;
+	bp->bp_total_evictions = 0;
+	bp->bp_dirty_evictions = 0;
+	bp->bp_steals = 0;
+	bp->bp_overlaps = 0;
+	bp->bp_prefetches = 0;
+	bp->bp_prefetch_hits = 0;
+	bp->bp_ghost_hits = 0;
+	bp->bp_reclaims = 0;
+
+	result = bufhash_init(&bp->bp_hash, numbuckets);
+	if (result) {
+		panic("Creating buffer hash failed\n");
+	}
+
+	bp->bp_num_ghosts = SCALE(max_total_units / BUFFER_PARTITIONS,
+				  TWOQ_OUT);
+	if (bp->bp_num_ghosts == 0) {
+		bp->bp_num_ghosts = 1;
+	}
+	bp->bp_ghosts = kmalloc(bp->bp_num_ghosts * sizeof(bp->bp_ghosts[0]));
+	if (bp->bp_ghosts == NULL) {
+		panic("Creating buffer ghost list failed\n");
+	}
+	bp->bp_ghost_buckets = kmalloc(bp->bp_num_ghosts *
+				       sizeof(bp->bp_ghost_buckets[0]));
+	if (bp->bp_ghost_buckets == NULL) {
+		panic("Creating buffer ghost hash failed\n");
+	}
+	for (i=0; i<bp->bp_num_ghosts; i++) {
+		bp->bp_ghosts[i].bg_fs = NULL;
+		bp->bp_ghosts[i].bg_block = 0;
+		bp->bp_ghosts[i].bg_next = INVALID_INDEX;
+		bp->bp_ghost_buckets[i] = INVALID_INDEX;
+	}
+	bp->bp_next_ghost = 0;
+
+	bp->bp_lock = lock_create("buffer cache lock");
+	if (bp->bp_lock == NULL) {
+		panic("Creating buffer cache lock failed\n");
+	}
+
+	bp->bp_busy_cv = cv_create("bufbusy");
+	if (bp->bp_busy_cv == NULL) {
+		panic("Creating buffer busy cv failed\n");
+	}
+}
+
 void
 buffer_bootstrap(void)
 {
 	size_t max_buffer_mem;
+	unsigned numbuckets, p;
 	int result;
 
-	attached_buffers_count = 0;
-	dirty_buffers_count = 0;
-
 	num_reserved_buffers = 0;
-	num_total_buffers = 0;
+	num_total_units = 0;
+	spinlock_init(&buffer_total_lock);
 
 	/* Limit total memory usage for buffers */
 	max_buffer_mem =
 		(mainbus_ramsize() * BUFFER_MAXMEM_NUM) / BUFFER_MAXMEM_DENOM;
-	max_total_buffers = max_buffer_mem / ONE_TRUE_BUFFER_SIZE;
+	max_total_units = max_buffer_mem / MIN_BUFFER_SIZE;
+	min_total_units = SCALE(mainbus_ramsize(), BUFFER_MINMEM)
+		/ MIN_BUFFER_SIZE;
+	grow_total_units = SCALE(mainbus_ramsize(), BUFFER_GROWMEM)
+		/ MIN_BUFFER_SIZE;
 
 	kprintf("buffers: max count %lu; max size %luk\n",
-		(unsigned long) max_total_buffers,
+		(unsigned long) max_total_units,
 		(unsigned long) max_buffer_mem/1024);
 
-	num_total_gets = 0;
-	num_valid_gets = 0;
-	num_read_gets = 0;
-	num_total_writeouts = 0;
-	num_total_evictions = 0;
-	num_dirty_evictions = 0;
-
-	bufarray_init(&detached_buffers);
-	bufarray_init(&attached_buffers);
-	bufarray_init(&dirty_buffers);
-	attached_buffers_first = 0;
-	attached_buffers_thresh = 0;
-	dirty_buffers_first = 0;
-	dirty_buffers_thresh = 0;
-
-	result = bufhash_init(&buffer_hash, max_total_buffers/16);
-	if (result) {
-		panic("Creating buffer_hash failed\n");
+	/*
+	 * Same total number of buckets as a single table would have,
+	 * sized for as big as buffer_grow can make the cache; a bucket
+	 * is only a pointer, and rehashing later would mean taking
+	 * every partition apart.
+	 */
+	numbuckets = (grow_total_units > max_total_units ?
+		      grow_total_units : max_total_units)
+		/ 16 / BUFFER_PARTITIONS;
+	if (numbuckets == 0) {
+		numbuckets = 1;
 	}
-
-	buffer_lock = lock_create("buffer cache lock");
-	if (buffer_lock == NULL) {
-		panic("Creating buffer cache lock failed\n");
+	for (p=0; p<BUFFER_PARTITIONS; p++) {
+		bufpart_init(&buffer_parts[p], numbuckets);
 	}
 
-	buffer_busy_cv = cv_create("bufbusy");
-	if (buffer_busy_cv == NULL) {
-		panic("Creating buffer_busy_cv failed\n");
+	buffer_reserve_lock = lock_create("buffer reserve lock");
+	if (buffer_reserve_lock == NULL) {
+		panic("Creating buffer reserve lock failed\n");
 	}
 
 	buffer_reserve_cv = cv_create("bufreserve");
@@ -2031,16 +3598,51 @@ buffer_bootstrap(void)
 		panic("Creating buffer_reserve_cv failed\n");
 	}
 
+	buffer_prefetch_lock = lock_create("buffer prefetch lock");
+	if (buffer_prefetch_lock == NULL) {
+		panic("Creating buffer prefetch lock failed\n");
+	}
+
+	buffer_prefetch_cv = cv_create("bufprefetch");
+	if (buffer_prefetch_cv == NULL) {
+		panic("Creating buffer_prefetch_cv failed\n");
+	}
+
+	buffer_prefetch_done_cv = cv_create("bufprefetchdone");
+	if (buffer_prefetch_done_cv == NULL) {
+		panic("Creating buffer_prefetch_done_cv failed\n");
+	}
+
+	prefetch_head = prefetch_count = 0;
+	prefetch_busy_fs = NULL;
+
+	num_dirty_units = num_written_units = 0;
+	spinlock_init(&syncer_lock);
+	syncer_wchan = wchan_create("syncer");
+	if (syncer_wchan == NULL) {
+		panic("Creating syncer wchan failed\n");
+	}
+	syncer_wanted = false;
+	syncer_ticks = 0;
+	syncer_batch_count = syncer_next_part = 0;
+
+	buffer_throttle_lock = lock_create("buffer throttle lock");
+	if (buffer_throttle_lock == NULL) {
+		panic("Creating buffer throttle lock failed\n");
+	}
+
+	buffer_throttle_cv = cv_create("bufthrottle");
+	if (buffer_throttle_cv == NULL) {
+		panic("Creating buffer_throttle_cv failed\n");
+	}
+
 	result = thread_fork("syncer", NULL, syncer_thread, NULL, 0);
 	if (result) {
 		panic("Starting syncer failed\n");
 	}
-}
-
-struct array *buffer_get_dirty_array() {
-	return (struct array *)&dirty_buffers;
-}
 
-struct lock *buffer_get_lock() {
-	return buffer_lock;
+	result = thread_fork("prefetcher", NULL, prefetch_thread, NULL, 0);
+	if (result) {
+		panic("Starting prefetcher failed\n");
+	}
 }
@@ -0,0 +1,420 @@
+/*
+ * I/O statistics and tracing; see iostat.h.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <stdarg.h>
+#include <lib.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
+#include <clock.h>
+#include <uio.h>
+#include <vfs.h>
+#include <device.h>
+#include <iostat.h>
+#include <platform/maxcpus.h>
+
+/*
+ * Histogram buckets. Bucket 0 is under a microsecond; bucket B covers
+ * [2^(B-1), 2^B) microseconds, and the last one everything above.
+ */
+#define IOHIST_BUCKETS	24
+
+/* Trace ring size (events) */
+#define IOTRACE_SIZE	512
+
+struct iohist_cpu {
+	unsigned ih_count;
+	uint64_t ih_total;		/* microseconds */
+	unsigned ih_max;
+	unsigned ih_buckets[IOHIST_BUCKETS];
+};
+
+struct iotrace_event {
+	struct timespec te_when;	/* completion */
+	char te_type;			/* IOTRACE_* */
+	unsigned te_unit;
+	uint32_t te_block;
+	unsigned te_count;
+	unsigned te_queued;		/* microseconds */
+	unsigned te_usecs;
+	int te_result;
+};
+
+/* Per cpu, updated with interrupts off; summed to print */
+static unsigned iostats[MAXCPUS][IOSTAT_NUM];
+static struct iohist_cpu iohists[MAXCPUS][IOHIST_NUM];
+
+static const char *iostat_names[IOSTAT_NUM] = {
+	[IOSTAT_DISK_READS]      = "disk reads",
+	[IOSTAT_DISK_WRITES]     = "disk writes",
+	[IOSTAT_DISK_RSECTORS]   = "sectors read",
+	[IOSTAT_DISK_WSECTORS]   = "sectors written",
+	[IOSTAT_DISK_ERRORS]     = "disk errors",
+	[IOSTAT_JOURNAL_FLUSHES] = "journal flushes",
+	[IOSTAT_JOURNAL_GROUPED] = "journal flush waits",
+	[IOSTAT_JOURNAL_PADS]    = "journal pads",
+	[IOSTAT_JOURNAL_PADBYTES] = "journal pad bytes",
+	[IOSTAT_CHECKPOINTS]     = "checkpoints",
+	[IOSTAT_CHECKPOINT_WAITS] = "checkpoint waits",
+};
+
+static const char *iohist_names[IOHIST_NUM] = {
+	[IOHIST_BUFFER_READ]   = "buffer read misses",
+	[IOHIST_BUFFER_EVICT]  = "buffer evictions",
+	[IOHIST_JOURNAL_FLUSH] = "journal flushes",
+	[IOHIST_DISK_IO]       = "disk requests",
+};
+
+/* The trace ring; iotrace_next counts every event ever recorded */
+static struct spinlock iotrace_lock = SPINLOCK_INITIALIZER;
+static struct iotrace_event iotrace_ring[IOTRACE_SIZE];
+static unsigned iotrace_next;
+static bool iotrace_on;
+
+////////////////////////////////////////////////////////////
+// counters
+
+static
+unsigned
+iostat_cpu(void)
+{
+	return CURCPU_EXISTS() ? curcpu->c_number : 0;
+}
+
+void
+iostat_add(enum iostat which, unsigned amount)
+{
+	int spl;
+
+	KASSERT(which < IOSTAT_NUM);
+	spl = splhigh();
+	iostats[iostat_cpu()][which] += amount;
+	splx(spl);
+}
+
+void
+iostat_start(struct timespec *start)
+{
+	gettime(start);
+}
+
+unsigned
+iostat_elapsed(const struct timespec *start)
+{
+	struct timespec now, diff;
+
+	gettime(&now);
+	timespec_sub(&now, start, &diff);
+	return diff.tv_sec * 1000000 + diff.tv_nsec / 1000;
+}
+
+unsigned
+iostat_done(enum iohist which, const struct timespec *start)
+{
+	struct iohist_cpu *h;
+	unsigned usecs, bucket;
+	int spl;
+
+	KASSERT(which < IOHIST_NUM);
+
+	usecs = iostat_elapsed(start);
+
+	/* bucket is one more than the index of the top bit */
+	bucket = 0;
+	while (bucket < IOHIST_BUCKETS - 1 && (usecs >> bucket) != 0) {
+		bucket++;
+	}
+
+	spl = splhigh();
+	h = &iohists[iostat_cpu()][which];
+	h->ih_count++;
+	h->ih_total += usecs;
+	if (usecs > h->ih_max) {
+		h->ih_max = usecs;
+	}
+	h->ih_buckets[bucket]++;
+	splx(spl);
+
+	return usecs;
+}
+
+////////////////////////////////////////////////////////////
+// trace
+
+void
+iotrace(char type, unsigned unit, uint32_t block, unsigned count,
+	unsigned queued, unsigned usecs, int result)
+{
+	struct iotrace_event *te;
+	struct timespec now;
+
+	/* unlocked peek; an event racing with "iotrace on" is no loss */
+	if (!iotrace_on) {
+		return;
+	}
+
+	gettime(&now);
+	spinlock_acquire(&iotrace_lock);
+	te = &iotrace_ring[iotrace_next % IOTRACE_SIZE];
+	iotrace_next++;
+	te->te_when = now;
+	te->te_type = type;
+	te->te_unit = unit;
+	te->te_block = block;
+	te->te_count = count;
+	te->te_queued = queued;
+	te->te_usecs = usecs;
+	te->te_result = result;
+	spinlock_release(&iotrace_lock);
+}
+
+void
+iotrace_enable(bool on)
+{
+	spinlock_acquire(&iotrace_lock);
+	iotrace_on = on;
+	spinlock_release(&iotrace_lock);
+}
+
+void
+iotrace_clear(void)
+{
+	spinlock_acquire(&iotrace_lock);
+	iotrace_next = 0;
+	spinlock_release(&iotrace_lock);
+}
+
+////////////////////////////////////////////////////////////
+// output
+
+/*
+ * Everything is printed through one of these, so the same code feeds
+ * the console and reads of iostat:. For a read, the text is produced
+ * from the beginning every time and only the part at the uio's offset
+ * is copied out, so a reader going through it in small pieces sees
+ * one stream, as long as the numbers don't move under it.
+ */
+struct iostat_out {
+	struct uio *io_uio;		/* NULL for the console */
+	off_t io_pos;			/* bytes produced so far */
+	int io_result;
+};
+
+static
+void
+iostat_emit(struct iostat_out *out, const char *fmt, ...)
+{
+	char line[128];
+	va_list ap;
+	size_t len, skip, n;
+	int result;
+
+	va_start(ap, fmt);
+	vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+
+	if (out->io_uio == NULL) {
+		kprintf("%s", line);
+		return;
+	}
+
+	len = strlen(line);
+	if (out->io_result == 0 && out->io_uio->uio_resid > 0 &&
+	    out->io_pos + len > out->io_uio->uio_offset) {
+		skip = out->io_uio->uio_offset - out->io_pos;
+		n = len - skip;
+		if (n > out->io_uio->uio_resid) {
+			n = out->io_uio->uio_resid;
+		}
+		result = uiomove(line + skip, n, out->io_uio);
+		if (result) {
+			out->io_result = result;
+		}
+	}
+	out->io_pos += len;
+}
+
+static
+void
+iostat_output_stats(struct iostat_out *out)
+{
+	struct iohist_cpu h;
+	unsigned i, j, b, total, lo;
+
+	iostat_emit(out, "I/O counters:\n");
+	for (i = 0; i < IOSTAT_NUM; i++) {
+		total = 0;
+		for (j = 0; j < MAXCPUS; j++) {
+			total += iostats[j][i];
+		}
+		iostat_emit(out, "   %-20s %u\n", iostat_names[i], total);
+	}
+
+	iostat_emit(out, "I/O latency (microseconds):\n");
+	for (i = 0; i < IOHIST_NUM; i++) {
+		bzero(&h, sizeof(h));
+		for (j = 0; j < MAXCPUS; j++) {
+			h.ih_count += iohists[j][i].ih_count;
+			h.ih_total += iohists[j][i].ih_total;
+			if (iohists[j][i].ih_max > h.ih_max) {
+				h.ih_max = iohists[j][i].ih_max;
+			}
+			for (b = 0; b < IOHIST_BUCKETS; b++) {
+				h.ih_buckets[b] += iohists[j][i].ih_buckets[b];
+			}
+		}
+
+		iostat_emit(out, "   %s: %u", iohist_names[i], h.ih_count);
+		if (h.ih_count == 0) {
+			iostat_emit(out, "\n");
+			continue;
+		}
+		iostat_emit(out, ", mean %u, max %u\n",
+			    (unsigned)(h.ih_total / h.ih_count), h.ih_max);
+		for (b = 0; b < IOHIST_BUCKETS; b++) {
+			if (h.ih_buckets[b] == 0) {
+				continue;
+			}
+			lo = b == 0 ? 0 : 1U << (b - 1);
+			if (b == IOHIST_BUCKETS - 1) {
+				iostat_emit(out, "      %8u+        %u\n",
+					    lo, h.ih_buckets[b]);
+			}
+			else {
+				iostat_emit(out, "      %8u-%-8u %u\n",
+					    lo, (1U << b) - 1, h.ih_buckets[b]);
+			}
+		}
+	}
+}
+
+static
+void
+iostat_output_trace(struct iostat_out *out)
+{
+	struct iotrace_event te;
+	unsigned first, next, i;
+
+	spinlock_acquire(&iotrace_lock);
+	next = iotrace_next;
+	spinlock_release(&iotrace_lock);
+	first = next > IOTRACE_SIZE ? next - IOTRACE_SIZE : 0;
+
+	iostat_emit(out, "I/O trace (%s, %u events):\n",
+		    iotrace_on ? "on" : "off", next - first);
+	if (next == first) {
+		return;
+	}
+	iostat_emit(out, "   %-18s %s %4s %10s %5s %8s %8s %s\n",
+		    "time", "op", "unit", "block", "count", "queued",
+		    "usecs", "error");
+	for (i = first; i < next; i++) {
+		/* copy it out; it may be overwritten as we go */
+		spinlock_acquire(&iotrace_lock);
+		if (iotrace_next - i > IOTRACE_SIZE) {
+			/* already overwritten */
+			spinlock_release(&iotrace_lock);
+			continue;
+		}
+		te = iotrace_ring[i % IOTRACE_SIZE];
+		spinlock_release(&iotrace_lock);
+
+		iostat_emit(out, "   %8llu.%09u  %c %4u %10u %5u %8u %8u %s\n",
+			    (unsigned long long)te.te_when.tv_sec,
+			    (unsigned)te.te_when.tv_nsec,
+			    te.te_type, te.te_unit, te.te_block, te.te_count,
+			    te.te_queued, te.te_usecs,
+			    te.te_result ? strerror(te.te_result) : "-");
+	}
+}
+
+void
+iostat_printstats(void)
+{
+	struct iostat_out out = { NULL, 0, 0 };
+
+	iostat_output_stats(&out);
+}
+
+void
+iotrace_print(void)
+{
+	struct iostat_out out = { NULL, 0, 0 };
+
+	iostat_output_trace(&out);
+}
+
+////////////////////////////////////////////////////////////
+// the iostat: device
+
+static
+int
+iostat_eachopen(struct device *dev, int openflags)
+{
+	(void)dev;
+
+	if ((openflags & O_ACCMODE) != O_RDONLY) {
+		return EACCES;
+	}
+	return 0;
+}
+
+static
+int
+iostat_io(struct device *dev, struct uio *uio)
+{
+	struct iostat_out out = { uio, 0, 0 };
+
+	(void)dev;
+
+	if (uio->uio_rw != UIO_READ) {
+		return EACCES;
+	}
+	iostat_output_stats(&out);
+	iostat_output_trace(&out);
+	return out.io_result;
+}
+
+static
+int
+iostat_ioctl(struct device *dev, int op, userptr_t data)
+{
+	(void)dev;
+	(void)op;
+	(void)data;
+
+	return EINVAL;
+}
+
+static const struct device_ops iostat_devops = {
+	.devop_eachopen = iostat_eachopen,
+	.devop_io = iostat_io,
+	.devop_ioctl = iostat_ioctl,
+};
+
+void
+iostat_bootstrap(void)
+{
+	struct device *dev;
+	int result;
+
+	dev = kmalloc(sizeof(*dev));
+	if (dev == NULL) {
+		panic("iostat: Out of memory\n");
+	}
+	dev->d_ops = &iostat_devops;
+	dev->d_blocks = 0;
+	dev->d_blocksize = 1;
+	dev->d_devnumber = 0;	/* assigned by vfs_adddev */
+	dev->d_data = NULL;
+
+	result = vfs_adddev("iostat", dev, 0);
+	if (result) {
+		panic("iostat: vfs_adddev: %s\n", strerror(result));
+	}
+}
@@ -30,10 +30,16 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <uio.h>
+#include <vnode.h>
 #include <addrspace.h>
 #include <vm.h>
 #include <proc.h>
+#include <thread.h>
 #include <coremap.h>
+#include <pagecache.h>
+#include <elf.h>
+#include <kern/mman.h>
 
 struct addrspace *
 as_create(void)
@@ -56,9 +62,17 @@ as_create(void)
 	KASSERT(as->pt_locks);
 	KASSERT(as->pagetable);
 
+	spinlock_init(&as->pt_spinlock);
+	as->pt_seq = 0;
+	as->pt_writers = 0;
+
 	as->as_regions = array_create();
 	as->heap_start = 0;
 	as->heap_end = 0;
+	as->mmap_base = USERSTACK - VM_STACKPAGES * PAGE_SIZE;
+	as->asid = 0;
+	as->asid_gen = 0;
+	as->asid_cpus = 0;
 
 	return as;
 }
@@ -67,9 +81,9 @@ int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
 	struct addrspace *newas;
-	int i,j, errno, retval, offset, region_len;
+	int i,j, errno, region_len;
+	vaddr_t vaddr;
 	struct region *old_region, *new_region;
-	void *buffer;
 	struct pt_entry *old_entry, *new_entry;
 
 	newas = as_create();
@@ -77,10 +91,9 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 		return ENOMEM;
 	}
 
-	buffer = kmalloc(PAGE_SIZE);
-
 	newas->heap_start = old->heap_start;
 	newas->heap_end = old->heap_end;
+	newas->mmap_base = old->mmap_base;
 
 	// Copy regions
 	region_len = array_num(old->as_regions);
@@ -94,6 +107,13 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 		new_region->base = old_region->base;
 		new_region->size = old_region->size;
 		new_region->permission = old_region->permission;
+		new_region->vnode = old_region->vnode;
+		new_region->file_offset = old_region->file_offset;
+		new_region->file_vaddr = old_region->file_vaddr;
+		new_region->file_size = old_region->file_size;
+		new_region->map_flags = old_region->map_flags;
+		if (new_region->vnode != NULL)
+			VOP_INCREF(new_region->vnode);
 
 		errno = array_add(newas->as_regions, new_region, NULL);
 		if (errno) {
@@ -101,48 +121,82 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 		}
 	}
 
-	// Copy page table
+	/*
+	 * Copy page table. Nothing is copied to or from disk here: resident
+	 * pages are shared copy-on-write through the coremap, and swapped
+	 * pages share the swap slot until one side pages it back in.
+	 */
 	for (i = 0; i < PT_LEVEL_SIZE; i++){
 		if (old->pagetable[i] != NULL){
-			newas->pagetable[i] = kmalloc(PT_LEVEL_SIZE * sizeof(struct pt_entry));
-			memset(newas->pagetable[i], 0, PT_LEVEL_SIZE * sizeof(struct pt_entry));
-			// For each page table entry
-			// Lock the entire L2 pagetable
+			newas->pagetable[i] = pt_alloc_table();
+			if (newas->pagetable[i] == NULL) {
+				as_destroy(newas);
+				return ENOMEM;
+			}
+			newas->pt_locks[i] = lock_create("pt");
+			if (newas->pt_locks[i] == NULL) {
+				// pt_destroy expects a lock with every table
+				free_kpages((vaddr_t)newas->pagetable[i]);
+				newas->pagetable[i] = NULL;
+				as_destroy(newas);
+				return ENOMEM;
+			}
+
+			// Lock the entire L2 pagetable, old before new
 			lock_acquire(old->pt_locks[i]);
+			lock_acquire(newas->pt_locks[i]);
 			for (j = 0; j < PT_LEVEL_SIZE; j++){
-				// We're about to copy this page. Make sure it can't be written to
-				vm_tlbflush((i << 22) & (j << 12));
-
+				vaddr = (i << 22) | (j << 12);
 				old_entry = &old->pagetable[i][j];
 				new_entry = &newas->pagetable[i][j];
 
 				// For every valid pagetable entry...
-				if (old_entry->allocated){
-					offset = bs_alloc_index();
-					if (old_entry->in_memory){
-						// Write it to disk if it's in memory
-						retval = bs_write_page((void *) PADDR_TO_KVADDR(old_entry->p_addr), offset);
-						KASSERT(retval == 0);
-					} else {
-						// Or copy it to the new disk spot if not
-						retval = bs_read_page(buffer, old_entry->store_index);
-						KASSERT(retval == 0);
-
-						retval = bs_write_page(buffer, offset);
-						KASSERT(retval == 0);
+				if (!old_entry->allocated)
+					continue;
+
+				if (old_entry->pcache) {
+					// Shared mappings stay shared
+					errno = pc_ref(PT_PADDR(old_entry), newas, vaddr);
+					if (errno) {
+						lock_release(newas->pt_locks[i]);
+						lock_release(old->pt_locks[i]);
+						as_destroy(newas);
+						return errno;
 					}
-					// Update entry
-					// TODO: this will be caught by coremap
-					new_entry->p_addr = 0;
-					new_entry->store_index = offset;
-					new_entry->in_memory = false;
+					PT_SET_RESIDENT(new_entry, PT_PADDR(old_entry));
+					new_entry->pcache = true;
+					new_entry->allocated = true;
+				} else if (old_entry->in_memory) {
+					PT_SET_RESIDENT(new_entry, PT_PADDR(old_entry));
+					new_entry->allocated = true;
+
+					errno = cm_share_page(newas, vaddr, PT_PADDR(old_entry));
+					if (errno == EBUSY) {
+						// Someone is evicting this page and wants our lock. Let them finish and look again
+						memset(new_entry, 0, sizeof(struct pt_entry));
+						lock_release(newas->pt_locks[i]);
+						lock_release(old->pt_locks[i]);
+						thread_yield();
+						lock_acquire(old->pt_locks[i]);
+						lock_acquire(newas->pt_locks[i]);
+						j--;
+						continue;
+					}
+					KASSERT(errno == 0);
+				} else {
+					bs_share_index(PT_SLOT(old_entry));
+					PT_SET_SWAPPED(new_entry, PT_SLOT(old_entry));
 					new_entry->allocated = true;
 				}
 			}
+			lock_release(newas->pt_locks[i]);
 			lock_release(old->pt_locks[i]);
 		}
 	}
-	kfree(buffer);
+
+	// Our pages are read-only now. Drop the writable translations we still
+	// have on any cpu by moving to a fresh ASID
+	vm_asid_invalidate(old);
 
 	*ret = newas;
 
@@ -151,8 +205,11 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	err0:
 	for (i=0; i < (int)region_len; i++){
 		new_region = (struct region *)array_get(newas->as_regions,i);
-		if (new_region != NULL)
+		if (new_region != NULL) {
+			if (new_region->vnode != NULL)
+				VOP_DECREF(new_region->vnode);
 			kfree(new_region);
+		}
 	}
 	return ENOMEM;
 }
@@ -182,6 +239,8 @@ as_destroy(struct addrspace *as)
     i = len - 1;
     while (len > 0){
         region_ptr = array_get(as->as_regions, i);
+        if (region_ptr->vnode != NULL)
+            VOP_DECREF(region_ptr->vnode);
         kfree(region_ptr);
         array_remove(as->as_regions, i);
         if (i == 0)
@@ -189,6 +248,7 @@ as_destroy(struct addrspace *as)
         i--;
     }
     array_destroy(as->as_regions);
+    spinlock_cleanup(&as->pt_spinlock);
     kfree(as);
 }
 
@@ -206,9 +266,8 @@ as_activate(void)
 		return;
 	}
 
-	// Context switch happens, shootdown everything
-	// ipi_tlbshootdown_allcpus(&(const struct tlbshootdown){vaddr, sem_create("Shootdown", 0)});
-	vm_tlbflush_all();
+	// Our translations are tagged with our ASID, so nothing needs flushing
+	vm_asid_activate(as);
 }
 
 void
@@ -219,7 +278,7 @@ as_deactivate(void)
 	 * anything. See proc.c for an explanation of why it (might)
 	 * be needed.
 	 */
-	 vm_tlbflush_all();
+	vm_asid_deactivate();
 }
 
 /*
@@ -263,6 +322,11 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 	region->base = vaddr;
 	region->size = sz;
 	region->permission = readable + writeable + executable;
+	region->vnode = NULL;
+	region->file_offset = 0;
+	region->file_vaddr = 0;
+	region->file_size = 0;
+	region->map_flags = 0;
 
 	cm_mem_change(-sz);
 
@@ -326,3 +390,238 @@ as_check_region(struct addrspace *as, vaddr_t va)
 	// Can't find the addr in region, this is a segfault
 	return -1;
 }
+
+/*
+ * Back the part of the region containing VADDR that holds FILESIZE bytes
+ * starting at VADDR with the file V at OFFSET. Nothing is read now; see
+ * as_load_page.
+ */
+int
+as_define_file(struct addrspace *as, struct vnode *v,
+	       off_t offset, vaddr_t vaddr, size_t filesize)
+{
+	int i, len;
+	struct region *region;
+
+	len = array_num(as->as_regions);
+	for (i = 0; i < len; i++) {
+		region = array_get(as->as_regions, i);
+		if (vaddr >= region->base &&
+		    vaddr + filesize <= region->base + region->size) {
+			break;
+		}
+	}
+	if (i == len || region->vnode != NULL) {
+		return EINVAL;
+	}
+
+	VOP_INCREF(v);
+	region->vnode = v;
+	region->file_offset = offset;
+	region->file_vaddr = vaddr;
+	region->file_size = filesize;
+
+	return 0;
+}
+
+bool
+as_file_page(struct addrspace *as, vaddr_t vaddr)
+{
+	int i, len;
+	struct region *region;
+
+	vaddr &= PAGE_FRAME;
+	len = array_num(as->as_regions);
+	for (i = 0; i < len; i++) {
+		region = array_get(as->as_regions, i);
+		if (region->vnode != NULL && region->map_flags != MAP_SHARED &&
+		    region->file_vaddr < vaddr + PAGE_SIZE &&
+		    region->file_vaddr + region->file_size > vaddr) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Read the page at VADDR into the frame at PADDR. Segments need not start
+ * or end on page boundaries, so a page can hold the tail of one and the
+ * head of the next; read every piece of file data that falls in it.
+ * The caller must not hold the page's pagetable lock, since the file
+ * system may need memory.
+ */
+int
+as_load_page(struct addrspace *as, vaddr_t vaddr, paddr_t paddr)
+{
+	int i, len, result;
+	struct region *region;
+	struct iovec iov;
+	struct uio ku;
+	vaddr_t start, end;
+	char *kpage;
+
+	vaddr &= PAGE_FRAME;
+	kpage = (char *)PADDR_TO_KVADDR(paddr);
+	bzero(kpage, PAGE_SIZE);
+
+	len = array_num(as->as_regions);
+	for (i = 0; i < len; i++) {
+		region = array_get(as->as_regions, i);
+		if (region->vnode == NULL || region->map_flags == MAP_SHARED) {
+			continue;
+		}
+		start = region->file_vaddr > vaddr ? region->file_vaddr : vaddr;
+		end = region->file_vaddr + region->file_size;
+		if (end > vaddr + PAGE_SIZE) {
+			end = vaddr + PAGE_SIZE;
+		}
+		if (start >= end) {
+			continue;
+		}
+
+		uio_kinit(&iov, &ku, kpage + (start - vaddr), end - start,
+			  region->file_offset + (start - region->file_vaddr),
+			  UIO_READ);
+		result = VOP_READ(region->vnode, &ku);
+		if (result) {
+			return result;
+		}
+		// Mapped files may end, or be truncated, before the mapping does
+		if (ku.uio_resid != 0 && region->map_flags == 0) {
+			kprintf("ELF: short read on page 0x%lx\n",
+				(unsigned long) vaddr);
+			return ENOEXEC;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Map LEN bytes of V at OFFSET, just below the lowest mapping so far.
+ * Like the heap, the space left between the heap and the mappings is
+ * first come, first served; the hole left by unmapping anything but the
+ * lowest mapping isn't reused.
+ */
+int
+as_define_mmap(struct addrspace *as, struct vnode *v, off_t offset,
+	       size_t len, int prot, int flags, vaddr_t *ret)
+{
+	struct region *region;
+	int err;
+
+	KASSERT(offset % PAGE_SIZE == 0);
+	KASSERT(flags == MAP_SHARED || flags == MAP_PRIVATE);
+
+	len = (len + PAGE_SIZE - 1) & PAGE_FRAME;
+	if (len == 0 || len > as->mmap_base - as->heap_end) {
+		return ENOMEM;
+	}
+	// Private pages are anonymous memory once touched
+	if (flags == MAP_PRIVATE && len > cm_mem_free()) {
+		return ENOMEM;
+	}
+
+	region = kmalloc(sizeof(struct region));
+	if (region == NULL) {
+		return ENOMEM;
+	}
+	region->base = as->mmap_base - len;
+	region->size = len;
+	region->permission = ((prot & PROT_READ) ? PF_R : 0) +
+		((prot & PROT_WRITE) ? PF_W : 0) +
+		((prot & PROT_EXEC) ? PF_X : 0);
+	region->vnode = v;
+	region->file_offset = offset;
+	region->file_vaddr = region->base;
+	region->file_size = len;
+	region->map_flags = flags;
+
+	err = array_add(as->as_regions, region, NULL);
+	if (err) {
+		kfree(region);
+		return err;
+	}
+	VOP_INCREF(v);
+	if (flags == MAP_PRIVATE) {
+		cm_mem_change(-len);
+	}
+
+	as->mmap_base = region->base;
+	*ret = region->base;
+	return 0;
+}
+
+/*
+ * Unmap the whole mapping at VADDR. Shared pages drop out of the page
+ * cache as their last mapping goes (see pt_dealloc_page).
+ */
+int
+as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+	struct region *region;
+	struct pt_entry *pte;
+	vaddr_t va;
+	unsigned i, num;
+
+	len = (len + PAGE_SIZE - 1) & PAGE_FRAME;
+	num = array_num(as->as_regions);
+	for (i = 0; i < num; i++) {
+		region = array_get(as->as_regions, i);
+		if (region->map_flags != 0 && region->base == vaddr) {
+			break;
+		}
+	}
+	if (i == num || region->size != len) {
+		return EINVAL;
+	}
+
+	for (va = region->base; va < region->base + region->size;
+	     va += PAGE_SIZE) {
+		if (as->pagetable[va >> 22] == NULL) {
+			continue;
+		}
+		pte = pte_lock(as, va);
+		if (!pte->allocated) {
+			pte_unlock(as, va);
+			continue;
+		}
+		pte_unlock(as, va);
+		pt_dealloc_page(as, va);
+	}
+
+	array_remove(as->as_regions, i);
+	if (as->mmap_base == region->base) {
+		as->mmap_base += region->size;
+	}
+	if (region->map_flags == MAP_PRIVATE) {
+		cm_mem_change(region->size);
+	}
+	VOP_DECREF(region->vnode);
+	kfree(region);
+
+	// Drop whatever translations for the mapping we still have
+	vm_asid_invalidate(as);
+	return 0;
+}
+
+bool
+as_shared_file_page(struct addrspace *as, vaddr_t vaddr, struct vnode **v,
+		    off_t *offset)
+{
+	int i, len;
+	struct region *region;
+
+	vaddr &= PAGE_FRAME;
+	len = array_num(as->as_regions);
+	for (i = 0; i < len; i++) {
+		region = array_get(as->as_regions, i);
+		if (region->map_flags == MAP_SHARED &&
+		    vaddr >= region->base &&
+		    vaddr < region->base + region->size) {
+			*v = region->vnode;
+			*offset = region->file_offset + (vaddr - region->base);
+			return true;
+		}
+	}
+	return false;
+}
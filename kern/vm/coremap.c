@@ -14,8 +14,14 @@
 #include <vfs.h>
 #include <kern/fcntl.h>
 #include <stat.h>
+#include <device.h>
+#include <buf.h>
+#include <pagecache.h>
 
 #include <cpu.h>
+#include <thread.h>
+#include <wchan.h>
+#include <platform/maxcpus.h>
 
 //#define DEBUG_CM
 //#define DEBUG_BS
@@ -36,8 +42,6 @@
 #define BS_DONE (void)0;
 #endif
 
-#define PAGE_RANDOM
-
 #define CM_TO_PADDR(i) ((paddr_t)PAGE_SIZE * (i + cm_base))
 #define PADDR_TO_CM(paddr)  ((paddr / PAGE_SIZE) - cm_base)
 
@@ -50,8 +54,45 @@ static unsigned cm_base;
 static unsigned cm_used;
 static struct spinlock cm_used_lock = SPINLOCK_INITIALIZER;
 
+static int evict_policy = CM_EVICT_CLOCK;
 static unsigned evict_hand = 0;
 
+/*
+ * Free frames. Frames in the global pool are kept by a binary buddy allocator
+ * over coremap indices, with busy and allocated both clear. Each cpu caches a
+ * small stack of single frames, refilled from and returned to the pool in
+ * batches; cached frames are kept busy so nobody else will touch them.
+ *
+ * Lock order is pcpu lock, then cm_free_lock, then busy_lock.
+ */
+struct cm_pcpu {
+    struct spinlock lock;
+    unsigned count;
+    int frames[CM_PCPU_MAX];
+};
+
+static int cm_free_area[CM_MAX_ORDER];
+static unsigned cm_free_count;
+static struct spinlock cm_free_lock = SPINLOCK_INITIALIZER;
+static struct cm_pcpu cm_pcpu[MAXCPUS];
+
+#define CM_CPU() (CURCPU_EXISTS() ? curcpu->c_number : 0)
+
+/*
+ * Pageout daemon. It is woken when free frames drop below pageout_low and
+ * evicts until there are pageout_high free, writing back dirty pages ahead
+ * of the clock hand first so that most of what it evicts is clean.
+ */
+#define PAGEOUT_LOW_DIVISOR	32	/* Low watermark is 1/32 of memory */
+#define PAGEOUT_HIGH_DIVISOR	16	/* High watermark is 1/16 of memory */
+#define PAGEOUT_CLEAN_BATCH	16	/* Dirty pages written back per run */
+
+static unsigned pageout_low, pageout_high;
+static bool pageout_started;
+static bool pageout_wanted;
+static struct wchan *pageout_wchan;
+static struct spinlock pageout_lock = SPINLOCK_INITIALIZER;
+
 static unsigned mem_free;
 static struct lock *mem_free_lock;
 
@@ -59,8 +100,10 @@ static int cm_do_evict(int cm_index, struct addrspace* as, vaddr_t va);
 
 struct vnode *bs_file;
 struct bitmap *bs_map;
+static uint16_t *bs_refs;
+static unsigned bs_nslots;
+static unsigned bs_rotor;
 struct lock *bs_map_lock;
-struct semaphore *tlb_sem;
 
 void cm_used_change(int amount) {
     spinlock_acquire(&cm_used_lock);
@@ -81,13 +124,210 @@ unsigned cm_mem_free() {
     return ret;
 }
 
+/* The buffer cache grows only while this holds (see buffer_grow) */
+bool cm_memory_plentiful(void) {
+    return pageout_started && cm_entries - cm_used >= 2 * pageout_high;
+}
+
 int cm_alloc_entry(struct addrspace *as, vaddr_t vaddr, bool busy);
+static unsigned bs_frame_slot(int cm_index);
+
+/* Add a free block to the buddy free lists. Caller holds cm_free_lock */
+static void cm_buddy_insert(int cm_index, unsigned order) {
+    KASSERT(spinlock_do_i_hold(&cm_free_lock));
+    KASSERT((cm_index & ((1 << order) - 1)) == 0);
+
+    coremap[cm_index].free_head = true;
+    coremap[cm_index].free_order = order;
+    coremap[cm_index].free_prev = -1;
+    coremap[cm_index].free_next = cm_free_area[order];
+    if (cm_free_area[order] >= 0)
+        coremap[cm_free_area[order]].free_prev = cm_index;
+    cm_free_area[order] = cm_index;
+    cm_free_count += 1 << order;
+}
+
+/* Unlink a free block from the buddy free lists. Caller holds cm_free_lock */
+static void cm_buddy_remove(int cm_index) {
+    unsigned order = coremap[cm_index].free_order;
+
+    KASSERT(spinlock_do_i_hold(&cm_free_lock));
+    KASSERT(coremap[cm_index].free_head);
+
+    if (coremap[cm_index].free_prev >= 0)
+        coremap[coremap[cm_index].free_prev].free_next = coremap[cm_index].free_next;
+    else
+        cm_free_area[order] = coremap[cm_index].free_next;
+    if (coremap[cm_index].free_next >= 0)
+        coremap[coremap[cm_index].free_next].free_prev = coremap[cm_index].free_prev;
+    coremap[cm_index].free_head = false;
+    cm_free_count -= 1 << order;
+}
+
+/**
+ * @brief Return a single frame to the buddy allocator
+ * @details Merges the frame with its buddy for as long as the buddy is a
+ *          free block of the same size. Caller holds cm_free_lock
+ */
+static void cm_buddy_free(int cm_index) {
+    unsigned order = 0;
+    int buddy;
+
+    KASSERT(!coremap[cm_index].allocated);
+
+    spinlock_acquire(&busy_lock);
+    coremap[cm_index].busy = false;
+    spinlock_release(&busy_lock);
+
+    while (order < CM_MAX_ORDER - 1) {
+        buddy = cm_index ^ (1 << order);
+        if (buddy + (1 << order) > (int)cm_entries ||
+            !coremap[buddy].free_head || coremap[buddy].free_order != order)
+            break;
+        cm_buddy_remove(buddy);
+        if (buddy < cm_index)
+            cm_index = buddy;
+        order++;
+    }
+    cm_buddy_insert(cm_index, order);
+}
+
+/**
+ * @brief Take a block of 2^order frames from the buddy allocator
+ * @details Splits a larger block if needed. The frames come back busy.
+ *          Caller holds cm_free_lock
+ * @return Coremap index of the first frame, or -1 if there is no such block
+ */
+static int cm_buddy_alloc(unsigned order) {
+    unsigned k;
+    int cm_index;
+
+    for (k = order; k < CM_MAX_ORDER; k++) {
+        if (cm_free_area[k] >= 0)
+            break;
+    }
+    if (k == CM_MAX_ORDER)
+        return -1;
+
+    cm_index = cm_free_area[k];
+    cm_buddy_remove(cm_index);
+    while (k > order) {
+        k--;
+        cm_buddy_insert(cm_index + (1 << k), k);
+    }
+
+    spinlock_acquire(&busy_lock);
+    for (k = 0; k < (1U << order); k++) {
+        KASSERT(!coremap[cm_index + k].busy);
+        KASSERT(!coremap[cm_index + k].allocated);
+        coremap[cm_index + k].busy = true;
+    }
+    spinlock_release(&busy_lock);
+
+    return cm_index;
+}
+
+/**
+ * @brief Pull one specific frame out of the buddy allocator
+ * @details Finds the free block containing the frame and splits it until the
+ *          frame is on its own. Caller holds cm_free_lock
+ * @return false if the frame is not in the buddy allocator
+ */
+static bool cm_buddy_claim(int cm_index) {
+    unsigned k;
+    int head;
+
+    for (k = 0; k < CM_MAX_ORDER; k++) {
+        head = cm_index & ~((1 << k) - 1);
+        if (coremap[head].free_head && coremap[head].free_order == k)
+            break;
+    }
+    if (k == CM_MAX_ORDER)
+        return false;
+
+    cm_buddy_remove(head);
+    while (k > 0) {
+        k--;
+        // Give back the half that does not contain our frame
+        if (cm_index & (1 << k)) {
+            cm_buddy_insert(head, k);
+            head += 1 << k;
+        } else {
+            cm_buddy_insert(head + (1 << k), k);
+        }
+    }
+    KASSERT(head == cm_index);
+    return true;
+}
+
+/* Move frames from the global pool into this cpu's cache */
+static void cm_pcpu_refill(struct cm_pcpu *pc) {
+    int cm_index;
+
+    KASSERT(spinlock_do_i_hold(&pc->lock));
+    spinlock_acquire(&cm_free_lock);
+    while (pc->count < CM_PCPU_BATCH) {
+        cm_index = cm_buddy_alloc(0);
+        if (cm_index < 0)
+            break;
+        pc->frames[pc->count++] = cm_index;
+    }
+    spinlock_release(&cm_free_lock);
+}
+
+/* Return up to n frames from a cpu's cache to the global pool */
+static void cm_pcpu_spill(struct cm_pcpu *pc, unsigned n) {
+    KASSERT(spinlock_do_i_hold(&pc->lock));
+    spinlock_acquire(&cm_free_lock);
+    while (n > 0 && pc->count > 0) {
+        cm_buddy_free(pc->frames[--pc->count]);
+        n--;
+    }
+    spinlock_release(&cm_free_lock);
+}
+
+/* Return every cached frame to the global pool, so that it can coalesce */
+static void cm_pcpu_drain(void) {
+    unsigned i;
+
+    for (i = 0; i < MAXCPUS; i++) {
+        spinlock_acquire(&cm_pcpu[i].lock);
+        cm_pcpu_spill(&cm_pcpu[i], CM_PCPU_MAX);
+        spinlock_release(&cm_pcpu[i].lock);
+    }
+}
+
+/**
+ * @brief Give a single free frame back
+ * @details The frame goes to this cpu's cache, or to the buddy allocator if
+ *          it is part of a larger kernel allocation. The caller must hold the
+ *          busy bit and have cleared the entry
+ */
+static void cm_free_frame(int cm_index, bool single) {
+    struct cm_pcpu *pc;
+
+    KASSERT(coremap[cm_index].busy);
+    KASSERT(!coremap[cm_index].allocated);
+
+    if (!single) {
+        spinlock_acquire(&cm_free_lock);
+        cm_buddy_free(cm_index);
+        spinlock_release(&cm_free_lock);
+        return;
+    }
+
+    pc = &cm_pcpu[CM_CPU()];
+    spinlock_acquire(&pc->lock);
+    if (pc->count == CM_PCPU_MAX)
+        cm_pcpu_spill(pc, CM_PCPU_BATCH);
+    pc->frames[pc->count++] = cm_index;
+    spinlock_release(&pc->lock);
+}
 
 void cm_bootstrap(void) {
 	int i;
     paddr_t mem_start, mem_end;
     uint32_t npages, cm_size;
-    (void) evict_hand;
 
     // get size of memory
     mem_end = ram_getsize();
@@ -124,17 +364,48 @@ void cm_bootstrap(void) {
         coremap[i].has_next = 0;
         coremap[i].dirty = 0;
         coremap[i].used_recently = 0;
+        coremap[i].refcount = 0;
+        coremap[i].slot = 0;
+        coremap[i].sharers = NULL;
         coremap[i].as = NULL;    
+        coremap[i].free_head = 0;
+    }
+
+    // Hand all of memory to the buddy allocator in the largest aligned blocks we can
+    for (i = 0; i < CM_MAX_ORDER; i++)
+        cm_free_area[i] = -1;
+    for (i = 0; i < MAXCPUS; i++) {
+        spinlock_init(&cm_pcpu[i].lock);
+        cm_pcpu[i].count = 0;
+    }
+    spinlock_acquire(&cm_free_lock);
+    for (i = 0; i < (int)cm_entries; ) {
+        unsigned order = CM_MAX_ORDER - 1;
+        while ((i & ((1 << order) - 1)) || i + (1 << order) > (int)cm_entries)
+            order--;
+        cm_buddy_insert(i, order);
+        i += 1 << order;
     }
+    spinlock_release(&cm_free_lock);
+}
 
-    tlb_sem = sem_create("Shootdown", 0);
+/* Wake the pageout daemon if we are running low on free frames */
+static void pageout_kick(void) {
+    if (!pageout_started || cm_entries - cm_used >= pageout_low)
+        return;
+
+    spinlock_acquire(&pageout_lock);
+    pageout_wanted = true;
+    wchan_wakeone(pageout_wchan, &pageout_lock);
+    spinlock_release(&pageout_lock);
 }
 
 /**
  * @brief Allocates a coremap entry to the given address space with the provided
  *        virtual address
  * @details This will get a free coremap entry (evicting if necessary) and mark 
- *          that entry as used
+ *          that entry as used. The frame is not cleared; most callers are
+ *          about to overwrite all of it anyway
  * 
  * @param addrspace Address space to assign this entry to
  * @param vaddr Reverse mapping back to the page table entry refrencing this
@@ -146,16 +417,27 @@ int cm_alloc_entry(struct addrspace *as, vaddr_t vaddr, bool busy) {
     KASSERT(vaddr != 0);
 
     int cm_index;
-    paddr_t pa;
 
     // Get the index of a free page, or -1 if none are free
     cm_index = cm_get_free_page();
     
-    // We don't have any free page any more, needs to evict.
+    // Clean buffers nobody has used lately are cheaper to give up than
+    // a user page; buffer_reclaim never waits for a lock, so it's safe
+    // with the pagetable lock held. Freed small buffers don't always
+    // add up to a free frame, hence the second look
+    if (cm_index < 0 && buffer_reclaim(1) > 0) {
+        vmstat_inc(VMSTAT_BUFFER_RECLAIM);
+        cm_index = cm_get_free_page();
+    }
+
+    // We don't have any free page any more, needs to evict. We can't wait
+    // for the pageout daemon here: it may need the pagetable lock we hold
     if (cm_index < 0) {
         // Do page eviction
         cm_index = cm_evict_page(as, vaddr);
+        vmstat_inc(VMSTAT_DIRECT_RECLAIM);
     }
+    pageout_kick();
 
     // cm_index should be a valid page index at this point
 
@@ -173,10 +455,11 @@ int cm_alloc_entry(struct addrspace *as, vaddr_t vaddr, bool busy) {
     coremap[cm_index].vm_addr = vaddr;
     coremap[cm_index].as = as;
     coremap[cm_index].is_kernel = (as == NULL);
+    coremap[cm_index].refcount = 1;
+    coremap[cm_index].slot = 0;
+    coremap[cm_index].sharers = NULL;
+    coremap[cm_index].used_recently = true;
     coremap[cm_index].busy = busy;
-    pa = CM_TO_PADDR(cm_index);
-
-    bzero((void *)PADDR_TO_KVADDR(pa), PAGE_SIZE);
 
     // Track the number of used coremap entries
     cm_used_change(1);
@@ -187,10 +470,26 @@ int cm_alloc_entry(struct addrspace *as, vaddr_t vaddr, bool busy) {
 }
 
 paddr_t cm_alloc_page(struct addrspace *as, vaddr_t vaddr) {
-    int cm_index = cm_alloc_entry(as, vaddr, false);
+    int cm_index = cm_alloc_entry(as, vaddr, true);
+
+    bzero((void *)PADDR_TO_KVADDR(CM_TO_PADDR(cm_index)), PAGE_SIZE);
+    coremap[cm_index].busy = false;
+
+    return CM_TO_PADDR(cm_index);
+}
+
+paddr_t cm_alloc_page_busy(struct addrspace *as, vaddr_t vaddr) {
+    int cm_index = cm_alloc_entry(as, vaddr, true);
     return CM_TO_PADDR(cm_index);
 }
 
+void cm_unbusy_page(paddr_t paddr) {
+    int cm_index = PADDR_TO_CM(paddr);
+
+    KASSERT(coremap[cm_index].busy);
+    coremap[cm_index].busy = false;
+}
+
 paddr_t cm_load_page(struct addrspace *as, vaddr_t vaddr) {
     int cm_index = cm_alloc_entry(as, vaddr, true);
 
@@ -210,74 +509,153 @@ paddr_t cm_load_page(struct addrspace *as, vaddr_t vaddr) {
 }
 
 /**
- * @brief Linear probing to find free contiguous pages. NOTE: Only used by kernel
- * @details We reserve memory and try to grow it. If we encounter a kernel page
+ * @brief Give up on a partially reserved run in cm_alloc_npages_slow
+ * @details Frames we took out of the free pool go back to it; user pages we
+ *          were going to evict are simply released
+ */
+static void cm_unreserve(unsigned start_index, unsigned end_index) {
+    for (; start_index < end_index; start_index++) {
+        KASSERT(coremap[start_index].busy);
+        if (coremap[start_index].allocated) {
+            spinlock_acquire(&busy_lock);
+            coremap[start_index].busy = false;
+            spinlock_release(&busy_lock);
+        } else {
+            spinlock_acquire(&cm_free_lock);
+            cm_buddy_free(start_index);
+            spinlock_release(&cm_free_lock);
+        }
+    }
+}
+
+/**
+ * @brief Linear probing to find contiguous pages, evicting user pages as needed
+ * @details Only used when the buddy allocator has no block big enough. We
+ *          reserve memory and try to grow it. If we encounter a kernel page
  *          (can't be moved), then we unreserve the previous pages we had and 
  *          start over after it.
  * 
  * @param npages Numer of pages to allocate
- * @return A physical address to the start of the first page, or 0 if there is
- *         no contiguous region of the requested size
+ * @return Coremap index of the first page, or -1 if there is no contiguous
+ *         region of the requested size
  */
-paddr_t cm_alloc_npages(unsigned npages) {
-    // This should be the kernel calling this. Can we check this
+static int cm_alloc_npages_slow(unsigned npages) {
     unsigned start_index = 0, end_index = 0;
-    //spinlock_acquire(&busy_lock);
+    bool usable;
+
     for (end_index = 0; end_index < cm_entries; end_index++) {
+        spinlock_acquire(&cm_free_lock);
         spinlock_acquire(&busy_lock);
-        if (coremap[end_index].busy || coremap[end_index].is_kernel) {
-            // Entry busy or can't be moved. Give up and restart the contiguous region
-            // Set the pages we had reserved to not busy
-            for (; start_index < end_index; start_index++) {
-                KASSERT(coremap[start_index].busy);
-                coremap[start_index].busy = false;
+        usable = !coremap[end_index].busy && !coremap[end_index].is_kernel;
+        if (usable) {
+            // Free frames are sitting in the buddy allocator. Take them out
+            if (!coremap[end_index].allocated) {
+                spinlock_release(&busy_lock);
+                usable = cm_buddy_claim(end_index);
+                KASSERT(usable);
+                spinlock_acquire(&busy_lock);
             }
-            spinlock_release(&busy_lock);
-            KASSERT(start_index == end_index);
+            coremap[end_index].busy = true;
+        }
+        spinlock_release(&busy_lock);
+        spinlock_release(&cm_free_lock);
+
+        if (!usable) {
+            // Entry busy or can't be moved. Give up and restart the contiguous region
+            cm_unreserve(start_index, end_index);
             // start_index should point to the start of a potentially free region
-            start_index++;
+            start_index = end_index + 1;
             continue;
-        } else {
-            // This page is free!!! Reserve it
-            KASSERT(!coremap[end_index].busy);
-            coremap[end_index].busy = true;
-            spinlock_release(&busy_lock);
-            // Check if we are done
-            KASSERT(end_index - start_index < npages);
-            if (end_index - start_index == npages - 1) {
-                // Take ownership of all the reserved ones
-                for (unsigned i = start_index; i <= end_index; i++) {
-                    // We may need to page out user pages to make space for our kernel
-                    if (coremap[i].allocated) {
-                        KASSERT(coremap[i].busy);
-                        cm_do_evict(i, NULL, coremap[i].vm_addr);
-                        KASSERT(!coremap[i].allocated);
-                    }
-                    spinlock_acquire(&busy_lock);
-                    CM_DEBUG("allocating (cm_entry) %d to kernel...", i);
-                    coremap[i].vm_addr = CM_TO_PADDR(i);  // TODO TEMP: for debugging. Should get overridden anyway
-                    coremap[i].is_kernel = true;
-                    coremap[i].allocated = true;
-                    // Can't be set after we set busy to false, so we need some dirty logic here
-                    if (i < end_index)
-                        coremap[i].has_next = true;
+        }
+
+        // Check if we are done
+        KASSERT(end_index - start_index < npages);
+        if (end_index - start_index == npages - 1) {
+            // We may need to page out user pages to make space for our kernel
+            for (unsigned i = start_index; i <= end_index; i++) {
+                if (coremap[i].allocated) {
                     KASSERT(coremap[i].busy);
-                    coremap[i].busy = false;
-                    spinlock_release(&busy_lock);
-                    CM_DONE;
+                    cm_do_evict(i, NULL, coremap[i].vm_addr);
+                    KASSERT(!coremap[i].allocated);
                 }
-
-                cm_used_change(npages);
-
-                //spinlock_release(&busy_lock);
-                return CM_TO_PADDR(start_index);
             }
+            return start_index;
         }
-        // TEST
-        //KASSERT(!spinlock_do_i_hold(&busy_lock)); // Seems to be hanging on this
     }
-    //spinlock_release(&busy_lock);
-    return 0;
+    cm_unreserve(start_index, end_index);
+    return -1;
+}
+
+/**
+ * @brief Allocate contiguous pages for the kernel
+ * @details Single pages come from the per-cpu cache. Larger requests take the
+ *          smallest buddy block that fits and give back the tail. Only if
+ *          neither works do we fall back to evicting user pages.
+ * 
+ * @param npages Numer of pages to allocate
+ * @return A physical address to the start of the first page, or 0 if there is
+ *         no contiguous region of the requested size
+ */
+paddr_t cm_alloc_npages(unsigned npages) {
+    // This should be the kernel calling this. Can we check this
+    unsigned order = 0, i;
+    int start_index = -1;
+
+    KASSERT(npages > 0);
+    while ((1U << order) < npages)
+        order++;
+
+    if (npages == 1) {
+        start_index = cm_get_free_page();
+    } else if (order < CM_MAX_ORDER) {
+        spinlock_acquire(&cm_free_lock);
+        start_index = cm_buddy_alloc(order);
+        spinlock_release(&cm_free_lock);
+        if (start_index < 0) {
+            // Frames parked on other cpus might complete a block
+            cm_pcpu_drain();
+            spinlock_acquire(&cm_free_lock);
+            start_index = cm_buddy_alloc(order);
+            spinlock_release(&cm_free_lock);
+        }
+        if (start_index >= 0) {
+            // Give back what we don't need past the end
+            spinlock_acquire(&cm_free_lock);
+            for (i = npages; i < (1U << order); i++)
+                cm_buddy_free(start_index + i);
+            spinlock_release(&cm_free_lock);
+        }
+    }
+
+    if (start_index < 0)
+        start_index = cm_alloc_npages_slow(npages);
+    if (start_index < 0)
+        return 0;
+    pageout_kick();
+
+    // Take ownership of all the reserved ones
+    for (i = start_index; i < start_index + npages; i++) {
+        KASSERT(coremap[i].busy);
+        KASSERT(!coremap[i].allocated);
+        CM_DEBUG("allocating (cm_entry) %d to kernel...", i);
+        coremap[i].vm_addr = CM_TO_PADDR(i);  // TODO TEMP: for debugging. Should get overridden anyway
+        coremap[i].is_kernel = true;
+        coremap[i].allocated = true;
+        coremap[i].refcount = 1;
+        coremap[i].slot = 0;
+        coremap[i].sharers = NULL;
+        coremap[i].as = NULL;
+        // Can't be set after we set busy to false, so we need some dirty logic here
+        coremap[i].has_next = (i < start_index + npages - 1);
+        spinlock_acquire(&busy_lock);
+        coremap[i].busy = false;
+        spinlock_release(&busy_lock);
+        CM_DONE;
+    }
+
+    cm_used_change(npages);
+
+    return CM_TO_PADDR(start_index);
 }
 
 /*static void cm_wait_for(int cm_index) {
@@ -308,7 +686,7 @@ paddr_t cm_alloc_npages(unsigned npages) {
  */
 bool cm_dealloc_page(struct addrspace *as, paddr_t paddr) {
     int cm_index;
-    bool has_next = true;
+    bool has_next = true, first = true;
 
     cm_index = PADDR_TO_CM(paddr);
 
@@ -356,13 +734,17 @@ bool cm_dealloc_page(struct addrspace *as, paddr_t paddr) {
         coremap[cm_index].has_next      = 0;
         coremap[cm_index].used_recently = 0;
         coremap[cm_index].dirty         = 0;
+        coremap[cm_index].refcount      = 0;
+        coremap[cm_index].slot          = 0;
         coremap[cm_index].as            = 0;
+        KASSERT(coremap[cm_index].sharers == NULL);
 
         cm_used_change(-1);
 
         CM_DONE;
 
-        coremap[cm_index].busy = false;
+        cm_free_frame(cm_index, !has_next && first);
+        first = false;
         cm_index++;
     }
     return true;
@@ -370,12 +752,13 @@ bool cm_dealloc_page(struct addrspace *as, paddr_t paddr) {
 
 /**
  * @brief Gets the index of an unused coremap entry, if one exists
- * @details Linearly probes the coremap until it finds an unused entry, sets it
- *          to busy, and returns it
+ * @details Pops a frame off this cpu's free cache, refilling it from the
+ *          global pool if it is empty. The entry comes back busy
  * @return The index of an unsed coremap entry, or -1 if none exist
  */
 int cm_get_free_page(void) {
-    int i;
+    struct cm_pcpu *pc;
+    int cm_index = -1;
 
     // We should not be using more page table entries than exist
     KASSERT(cm_entries >= cm_used);
@@ -385,32 +768,132 @@ int cm_get_free_page(void) {
         return -1;
     }
 
-    // Linearly probe for a free entry and mark it as busy
-    // Start from end to reduce kernel/user contention
-    //for (i = cm_entries - 1; i > 0; i--) {
-    for (i = 0; i < (int)cm_entries; i++) {
-        spinlock_acquire(&busy_lock);
-        if (!coremap[i].allocated && !coremap[i].busy) {
-            coremap[i].busy = true;
-            spinlock_release(&busy_lock);
-            return i;
+    pc = &cm_pcpu[CM_CPU()];
+    spinlock_acquire(&pc->lock);
+    if (pc->count == 0)
+        cm_pcpu_refill(pc);
+    if (pc->count > 0)
+        cm_index = pc->frames[--pc->count];
+    spinlock_release(&pc->lock);
+
+    KASSERT(cm_index < 0 || coremap[cm_index].busy);
+    return cm_index;
+}
+
+/**
+ * @brief Lock the pagetable entry of a mapping we are about to evict
+ * @details The caller may already hold the lock of the pagetable entry that
+ *          faulted (old_as, old_va). To avoid deadlock, AS locks are acquired
+ *          in order of raw pointer value.
+ * 
+ * @return true if the lock was already held and must not be released
+ */
+static bool cm_lock_mapping(struct addrspace *as, vaddr_t vaddr,
+                            struct addrspace *old_as, vaddr_t old_va) {
+    bool locked = pte_locked(as, vaddr);
+
+    // If we are already holding a lock, then make sure it's the same as the one that belongs to the pagetable entry we're about to evict
+    if (locked) {
+        KASSERT(lock_do_i_hold(as->pt_locks[vaddr >> 22]));
+        return true;
+    }
+
+    if (old_as != NULL && (int)old_as < (int)as) {
+        // user
+        pte_unlock(old_as, old_va);
+        pte_lock(as, vaddr);
+        pte_lock(old_as, old_va);
+    } else {
+        // kernel, or already in order
+        pte_lock(as, vaddr);
+    }
+    return false;
+}
+
+/**
+ * @brief Remove the primary mapping of a frame
+ * @details Promotes the first sharer, if any, to be the primary mapping. The
+ *          new primary's swap slot has never seen this frame, so the frame is
+ *          considered dirty with respect to it. Caller holds the busy bit.
+ * 
+ * @return The swap slot the dropped mapping owned, for the caller to keep or
+ *         free. 0 if none
+ */
+static unsigned cm_drop_primary(int cm_index) {
+    struct cm_sharer *sharer;
+    unsigned slot = coremap[cm_index].slot;
+
+    KASSERT(coremap[cm_index].busy);
+    KASSERT(coremap[cm_index].refcount > 0);
+
+    coremap[cm_index].refcount--;
+    coremap[cm_index].slot = 0;
+    sharer = coremap[cm_index].sharers;
+    if (sharer == NULL) {
+        KASSERT(coremap[cm_index].refcount == 0);
+        return slot;
+    }
+
+    coremap[cm_index].as = sharer->as;
+    coremap[cm_index].vm_addr = sharer->vm_addr;
+    coremap[cm_index].slot = sharer->slot;
+    coremap[cm_index].sharers = sharer->next;
+    coremap[cm_index].dirty = true;
+    kfree(sharer);
+    return slot;
+}
+
+/**
+ * @brief Remove an arbitrary mapping (as, vaddr) of a shared frame
+ * @details Caller holds the busy bit and the pagetable entry lock
+ * 
+ * @return The swap slot the dropped mapping owned, 0 if none
+ */
+static unsigned cm_drop_mapping(int cm_index, struct addrspace *as, vaddr_t vaddr) {
+    struct cm_sharer **link, *sharer;
+    unsigned slot;
+
+    KASSERT(coremap[cm_index].busy);
+
+    if (coremap[cm_index].as == as && coremap[cm_index].vm_addr == vaddr) {
+        return cm_drop_primary(cm_index);
+    }
+
+    for (link = &coremap[cm_index].sharers; *link != NULL; link = &(*link)->next) {
+        sharer = *link;
+        if (sharer->as == as && sharer->vm_addr == vaddr) {
+            *link = sharer->next;
+            coremap[cm_index].refcount--;
+            slot = sharer->slot;
+            kfree(sharer);
+            return slot;
         }
-        spinlock_release(&busy_lock);
     }
+    panic("cm_drop_mapping: (addrspace) %p (vaddr) %x does not map (cm_entry) %d\n",
+          as, vaddr, cm_index);
+}
 
-    // Either cm_used = cm_entries, or there was a free space
-    //KASSERT(false);
-    // The previous assertion is not correct. The state of the coremap could
-    //  have changed between our (cm_entries == cm_used) check and our linear
-    //  probe. A page may have been taken by another processor
-    return -1;
+/**
+ * @brief Try to set the busy bit of a coremap entry without waiting
+ * @return true if we now own the entry
+ */
+static bool cm_try_busy(int cm_index) {
+    bool got;
+
+    spinlock_acquire(&busy_lock);
+    got = !coremap[cm_index].busy;
+    if (got)
+        coremap[cm_index].busy = true;
+    spinlock_release(&busy_lock);
+    return got;
 }
 
 /**
  * @brief Evict a specific page of memory
- * @details This function writes out the page associated with the coremap if dirty,
- *          sets the assocated pagetable entry to not be in memory, shoots down
- *          the associated TLB entry, and sets the coremap to be unused
+ * @details For every pagetable entry mapping the frame, this function writes
+ *          out the page if that entry's swap slot is stale, sets the entry to
+ *          not be in memory and shoots down the associated TLB entry. It then
+ *          sets the coremap to be unused
  * 
  * @param cm_index The index of the coremap entry to evict
  * @return The index of the page that was evicted
@@ -420,62 +903,54 @@ static int cm_do_evict(int cm_index, struct addrspace *old_as, vaddr_t old_va) {
     KASSERT(coremap[cm_index].busy);
     KASSERT(coremap[cm_index].allocated);
 
-    struct addrspace* as = coremap[cm_index].as;
-    vaddr_t vaddr = coremap[cm_index].vm_addr;
+    struct addrspace* as;
+    vaddr_t vaddr;
+    struct pt_entry *pt_entry;
     int err = 0;
+    unsigned slot;
     bool locked;
 
-    locked = pte_locked(as, vaddr);
+    CM_DEBUG("paging out (cm_entry) %d...", cm_index);
 
-    // If we are already holding a lock, then make sure it's the same as the one that belongs to the pagetable entry we're about to evict
-    if (locked)
-        KASSERT(lock_do_i_hold(as->pt_locks[vaddr >> 22]));
+    while (coremap[cm_index].refcount > 0) {
+        as = coremap[cm_index].as;
+        vaddr = coremap[cm_index].vm_addr;
 
-    if (!locked) {
-        // pte_lock(as, vaddr);
-        // To avoid deadlock, acquire AS locks in order of raw pointer value
-        if (old_as != NULL) {
-            // user
-            if ((int)old_as < (int)as){
-                pte_unlock(old_as, old_va);
-                pte_lock(as, vaddr);
-                pte_lock(old_as, old_va);
-            } else {
-                pte_lock(as, vaddr);
-            }
-        } else {
-            // kernel
-            pte_lock(as, vaddr);
-        }
-    }
-        
+        locked = cm_lock_mapping(as, vaddr, old_as, old_va);
 
-    // Pagetable entries can dissappear between the call to cm_do_evict and now. In that case, we don't have to do any work
-    struct pt_entry *pt_entry = pt_get_entry(as, vaddr);
-    if (pt_entry == NULL || !pt_entry->allocated)
-        return cm_index;
+        // Pagetable entries can dissappear between the call to cm_do_evict and now. In that case, we don't have to do any work
+        pt_entry = pt_get_entry(as, vaddr);
+        if (pt_entry != NULL && pt_entry->allocated && pt_entry->in_memory &&
+            PT_PADDR(pt_entry) == CM_TO_PADDR(cm_index)) {
+            // We invalidate the virtual address on all cpus before we touch the pagetable entry
+            pt_write_begin(as);
+            vm_shootdown(as, vaddr);
 
+            // If dirty or never written, write the page to disk and set it to clean
+            if (coremap[cm_index].dirty || coremap[cm_index].slot == 0) {
+                err = bs_write_out(cm_index);
+                KASSERT(!err);
+                coremap[cm_index].dirty = 0;
+            }
 
-    // We invalidate the virtual address on all cpus before we touch the pagetable entry
-    ipi_tlbshootdown_allcpus(&(const struct tlbshootdown){vaddr, tlb_sem});
+            // The pagetable entry now holds the swap slot instead of the frame
+            PT_SET_SWAPPED(pt_entry, coremap[cm_index].slot);
+            coremap[cm_index].slot = 0;
+            pt_write_end(as);
+        }
 
-    CM_DEBUG("paging out (cm_entry) %d from (addrspace) %p...", cm_index, as);
+        slot = cm_drop_primary(cm_index);
+        // The entry went away without taking its slot along
+        if (slot != 0)
+            bs_dealloc_index(slot);
 
-    // If dirty, write the page to disk and set it to clean
-    if (coremap[cm_index].dirty) {
-        err = bs_write_out(cm_index);
-        KASSERT(!err);
-        coremap[cm_index].dirty = 0;
+        if (!locked) pte_unlock(as, vaddr);
     }
 
-    // Set the pagetable entry to not be in memory
-    KASSERT(pt_entry != NULL);
-    pt_entry->in_memory = 0;
-
-    if (!locked) pte_unlock(as, vaddr);
-
     // Set this coremap entry to be unused
     coremap[cm_index].allocated = 0;
+    coremap[cm_index].dirty = 0;
+    coremap[cm_index].used_recently = 0;
 
     CM_DONE;
     
@@ -503,15 +978,14 @@ int cm_evict_page(struct addrspace *as, vaddr_t va){
     return cm_do_evict(cm_index, as, va);
 }
 
-// NOT COMPLETE
-/* Evict the "next" page from memory. This will be dependent on the 
-eviction policy that we choose (clock, random, etc.). This is 
-where we will switch out different eviction policies. The resulting
-page should not be busy, a kernel page, or unallocated */
-#ifdef PAGE_LINEAR
-int cm_choose_evict_page() {
-    int i = 0;
-    while (true) {
+/*
+ * Pick a random allocated user page, walking forward from a random start
+ * until one can be reserved
+ */
+static int cm_choose_random(unsigned limit) {
+    int i = random() % cm_entries;
+    unsigned scanned;
+    for (scanned = 0; limit == 0 || scanned < limit; scanned++) {
         spinlock_acquire(&busy_lock);
         if (coremap[i].busy || coremap[i].is_kernel || !coremap[i].allocated){
             spinlock_release(&busy_lock);
@@ -524,43 +998,424 @@ int cm_choose_evict_page() {
             return i;
         }
     }
+    return -1;
 }
-#elif defined(PAGE_RANDOM)
-int cm_choose_evict_page() {
-    int i = random() % cm_entries;
-    while (true) {
+
+/*
+ * Second chance. Pages referenced since the hand last passed lose their
+ * reference bit and are skipped. During the first revolution we also skip
+ * dirty pages, so a clean victim that needs no write to the backing store
+ * wins if there is one.
+ */
+static int cm_choose_clock(unsigned limit) {
+    unsigned scanned, i;
+
+    for (scanned = 0; limit == 0 || scanned < limit; scanned++) {
         spinlock_acquire(&busy_lock);
-        if (coremap[i].busy || coremap[i].is_kernel || !coremap[i].allocated){
+        i = evict_hand;
+        evict_hand = (evict_hand + 1) % cm_entries;
+
+        if (coremap[i].busy || coremap[i].is_kernel || !coremap[i].allocated) {
             spinlock_release(&busy_lock);
-            i = (i + 1) % cm_entries;
             continue;
-        } else {
-            coremap[i].busy = true;
-            KASSERT(coremap[i].busy);
+        }
+        if (coremap[i].used_recently) {
+            coremap[i].used_recently = false;
             spinlock_release(&busy_lock);
-            return i;
+            continue;
+        }
+        if (coremap[i].dirty && scanned < cm_entries) {
+            spinlock_release(&busy_lock);
+            continue;
         }
+
+        coremap[i].busy = true;
+        spinlock_release(&busy_lock);
+        return i;
     }
+    return -1;
 }
-#elif defined(PAGE_CLOCK)
+
+/*
+ * Choose a victim according to the current policy, giving up after looking
+ * at limit entries (0 for no limit). Returns -1 if we gave up
+ */
+static int cm_choose_victim(unsigned limit) {
+    int cm_index;
+
+    switch (evict_policy) {
+        case CM_EVICT_CLOCK:
+            cm_index = cm_choose_clock(limit);
+            break;
+        default:
+            cm_index = cm_choose_random(limit);
+            break;
+    }
+    if (cm_index < 0)
+        return -1;
+
+    vmstat_inc(VMSTAT_EVICT);
+    if (coremap[cm_index].dirty)
+        vmstat_inc(VMSTAT_EVICT_DIRTY);
+    return cm_index;
+}
+
+/* Evict the "next" page from memory according to the current policy. The
+resulting page should not be busy, a kernel page, or unallocated */
 int cm_choose_evict_page() {
-    while (true) {
+    return cm_choose_victim(0);
+}
+
+/**
+ * @brief Write back a batch of dirty pages without evicting them
+ * @details Looks ahead of the clock hand for dirty pages that have not been
+ *          referenced lately, i.e. the hand's next victims. Their TLB entries
+ *          are shot down, all in one round of IPIs, so that a later write
+ *          faults and marks them dirty again. Shared pages are left alone;
+ *          each mapping has its own slot.
+ */
+static void pageout_clean(unsigned batch) {
+    int victims[PAGEOUT_CLEAN_BATCH];
+    unsigned slots[PAGEOUT_CLEAN_BATCH];
+    struct addrspace *shoot_as[PAGEOUT_CLEAN_BATCH];
+    vaddr_t shoot_va[PAGEOUT_CLEAN_BATCH];
+    unsigned nshoot = 0;
+    void *kvaddrs[BS_CLUSTER];
+    unsigned nvictims = 0, scanned, i, j, k, run;
+    struct addrspace *as;
+    vaddr_t vaddr;
+    struct pt_entry *pt_entry;
+    int err;
+
+    KASSERT(batch <= PAGEOUT_CLEAN_BATCH);
+
+    i = evict_hand;
+    for (scanned = 0; scanned < cm_entries && nvictims < batch; scanned++) {
         spinlock_acquire(&busy_lock);
-        if (coremap[i].busy || coremap[i].is_kernel || !coremap[i].allocated || coremap[i].used_recently){
-            spinlock_release(&busy_lock);
-            if (coremap[i].used_recently) {
-                coremap[i].used_recently = false;
-            }
-            evict_hand = (evict_hand + 1) % cm_entries;
-            continue;
-        } else {
+        if (!coremap[i].busy && !coremap[i].is_kernel && coremap[i].allocated &&
+            coremap[i].dirty && !coremap[i].used_recently &&
+            coremap[i].refcount == 1) {
             coremap[i].busy = true;
+            victims[nvictims++] = i;
+        }
+        spinlock_release(&busy_lock);
+        i = (i + 1) % cm_entries;
+    }
+
+    /*
+     * Mark each page clean, then write protect them all before writing
+     * them. A store that lands before the shootdown still reaches the disk
+     * with the write below; one after it faults and marks the page dirty
+     * again, and it simply gets written later. We don't hold the pagetable
+     * locks during the write. The frames stay busy, so nobody can evict or
+     * free them meanwhile.
+     */
+    for (k = 0; k < nvictims; k++) {
+        i = victims[k];
+        as = coremap[i].as;
+        vaddr = coremap[i].vm_addr;
+        slots[k] = 0;
+
+        pte_lock(as, vaddr);
+        pt_entry = pt_get_entry(as, vaddr);
+        if (pt_entry != NULL && pt_entry->allocated && pt_entry->in_memory &&
+            PT_PADDR(pt_entry) == CM_TO_PADDR(i)) {
+            // Keep lockless refills from mapping it writable until the
+            // shootdown is done
+            pt_write_begin(as);
+            coremap[i].dirty = false;
+            slots[k] = bs_frame_slot(i);
+            shoot_as[nshoot] = as;
+            shoot_va[nshoot] = vaddr;
+            nshoot++;
+        }
+        pte_unlock(as, vaddr);
+    }
+    if (nshoot > 0)
+        vm_shootdown_batch(shoot_as, shoot_va, nshoot);
+    for (k = 0; k < nshoot; k++)
+        pt_write_end(shoot_as[k]);
+
+    // Sort by slot so that neighbours on disk go out in one transfer
+    for (k = 1; k < nvictims; k++) {
+        for (j = k; j > 0 && slots[j - 1] > slots[j]; j--) {
+            unsigned tmp_slot = slots[j];
+            int tmp_victim = victims[j];
+            slots[j] = slots[j - 1];
+            victims[j] = victims[j - 1];
+            slots[j - 1] = tmp_slot;
+            victims[j - 1] = tmp_victim;
+        }
+    }
+
+    for (k = 0; k < nvictims; k += run) {
+        run = 1;
+        if (slots[k] != 0) {
+            kvaddrs[0] = (void *) PADDR_TO_KVADDR(CM_TO_PADDR(victims[k]));
+            while (k + run < nvictims && run < BS_CLUSTER &&
+                   slots[k + run] == slots[k] + run) {
+                kvaddrs[run] = (void *) PADDR_TO_KVADDR(CM_TO_PADDR(victims[k + run]));
+                run++;
+            }
+            err = bs_write_pages(kvaddrs, run, slots[k]);
+            KASSERT(!err);
+            for (j = 0; j < run; j++)
+                vmstat_inc(VMSTAT_PAGEOUT_CLEAN);
+        }
+        for (j = k; j < k + run; j++) {
+            spinlock_acquire(&busy_lock);
+            coremap[victims[j]].busy = false;
             spinlock_release(&busy_lock);
-            return i;
         }
     }
 }
-#endif
+
+/*
+ * Evict one page and put its frame in the free pool
+ * Returns false if there was nothing we could evict
+ */
+static bool pageout_reclaim(void) {
+    int cm_index = cm_choose_victim(2 * cm_entries);
+
+    if (cm_index < 0)
+        return false;
+
+    cm_do_evict(cm_index, NULL, 0);
+    coremap[cm_index].as = NULL;
+    coremap[cm_index].vm_addr = 0;
+    cm_free_frame(cm_index, false);
+    vmstat_inc(VMSTAT_PAGEOUT_RECLAIM);
+    return true;
+}
+
+static void pageout_thread(void *x1, unsigned long x2) {
+    unsigned shrinks;
+
+    (void)x1;
+    (void)x2;
+
+    while (1) {
+        spinlock_acquire(&pageout_lock);
+        while (!pageout_wanted)
+            wchan_sleep(pageout_wchan, &pageout_lock);
+        pageout_wanted = false;
+        spinlock_release(&pageout_lock);
+
+        pageout_clean(PAGEOUT_CLEAN_BATCH);
+        shrinks = 0;
+        while (cm_entries - cm_used < pageout_high) {
+            // Cold buffers go before user pages. Small ones don't always
+            // free a frame between them, so don't count on it forever
+            if (shrinks < pageout_high && buffer_reclaim(1) > 0) {
+                shrinks++;
+                vmstat_inc(VMSTAT_BUFFER_RECLAIM);
+                continue;
+            }
+            // Then cold pages of mapped files, which cost a write at most
+            if (pc_reclaim())
+                continue;
+            if (!pageout_reclaim())
+                break;
+        }
+    }
+}
+
+static const char *evict_policy_names[] = {
+    [CM_EVICT_RANDOM] = "random",
+    [CM_EVICT_CLOCK]  = "clock",
+};
+
+int cm_set_evict_policy(const char *name) {
+    unsigned i;
+
+    for (i = 0; i < sizeof(evict_policy_names) / sizeof(evict_policy_names[0]); i++) {
+        if (!strcmp(name, evict_policy_names[i])) {
+            evict_policy = i;
+            return 0;
+        }
+    }
+    return EINVAL;
+}
+
+const char *cm_get_evict_policy(void) {
+    return evict_policy_names[evict_policy];
+}
+
+/**
+ * @brief Decide how a neighbouring page may be preloaded into the TLB
+ * @details The caller holds the pagetable lock of the mapping, so the frame
+ *          cannot be unmapped under us. A busy frame may be half filled or
+ *          on its way out, so it is left for a real fault. A clean page is
+ *          mapped read-only so its first write still marks it dirty
+ *
+ * @param paddr Physical address of the resident page
+ * @return TLB entrylo flags, or 0 to leave the page alone
+ */
+uint32_t cm_preload_flags(paddr_t paddr) {
+    int cm_index = PADDR_TO_CM(paddr);
+    uint32_t flags = VALID;
+
+    if (coremap[cm_index].busy)
+        return 0;
+    // Page cache frames are dirtied through pc_set_dirty, so always fault
+    // on the first store
+    if (coremap[cm_index].is_kernel)
+        return flags;
+    if (coremap[cm_index].dirty && coremap[cm_index].refcount == 1)
+        flags |= WRITABLE;
+    return flags;
+}
+
+/**
+ * @brief Set the reference bit of a page
+ * @details Called by vm_fault whenever it loads a translation. The TLB does
+ *          not tell us about references, so instead the TLB is periodically
+ *          flushed (see vm_sample_references) and the refault lands here
+ * 
+ * @param paddr Physical address that was referenced
+ */
+void cm_mark_referenced(paddr_t paddr) {
+    coremap[PADDR_TO_CM(paddr)].used_recently = true;
+}
+
+/**
+ * @brief Clear the reference bit of a page
+ * @details For the page cache, whose frames the clock hand never visits
+ * 
+ * @param paddr Physical address of the page
+ * @return Whether the page had been referenced
+ */
+bool cm_clear_referenced(paddr_t paddr) {
+    int cm_index = PADDR_TO_CM(paddr);
+    bool used = coremap[cm_index].used_recently;
+
+    coremap[cm_index].used_recently = false;
+    return used;
+}
+
+/**
+ * @brief Map an already resident user page into another address space
+ * @details Used by fork. The frame is shared read-only until one side writes
+ *          to it, at which point vm_fault calls cm_cow_page. The new
+ *          mapping's pagetable entry must already point at the frame.
+ * 
+ * @param as Address space of the new mapping
+ * @param va Virtual address of the new mapping
+ * @param paddr Frame to share
+ * @return 0, EBUSY if the frame is busy, or ENOMEM
+ */
+int cm_share_page(struct addrspace *as, vaddr_t va, paddr_t paddr) {
+    int cm_index = PADDR_TO_CM(paddr);
+    struct cm_sharer *sharer;
+
+    sharer = kmalloc(sizeof(struct cm_sharer));
+    if (sharer == NULL)
+        return ENOMEM;
+
+    if (!cm_try_busy(cm_index)) {
+        kfree(sharer);
+        return EBUSY;
+    }
+
+    KASSERT(coremap[cm_index].allocated);
+    KASSERT(!coremap[cm_index].is_kernel);
+
+    sharer->as = as;
+    sharer->vm_addr = va;
+    sharer->slot = 0;
+    sharer->next = coremap[cm_index].sharers;
+    coremap[cm_index].sharers = sharer;
+    coremap[cm_index].refcount++;
+
+    coremap[cm_index].busy = false;
+    return 0;
+}
+
+/**
+ * @brief Check whether a frame is mapped by more than one pagetable entry
+ * @details The caller holds the lock of one of the mappings. A refcount of 1
+ *          can then only be raised by forking that same address space, so
+ *          the answer is stable while the lock is held
+ */
+bool cm_page_shared(paddr_t paddr) {
+    return coremap[PADDR_TO_CM(paddr)].refcount > 1;
+}
+
+/**
+ * @brief Give the mapping (as, va) a private copy of a shared frame
+ * @details The old frame stays busy while we allocate, so it cannot be
+ *          evicted out from under the copy. The caller holds the lock of the
+ *          pagetable entry for (as, va) and must store the returned address.
+ * 
+ * @return Physical address of the private page, or 0 if the shared frame is
+ *         busy and the caller should drop its locks and retry
+ */
+paddr_t cm_cow_page(struct addrspace *as, vaddr_t va, paddr_t paddr) {
+    int old_index = PADDR_TO_CM(paddr);
+    int new_index;
+
+    KASSERT(pte_locked(as, va));
+
+    if (!cm_try_busy(old_index))
+        return 0;
+
+    KASSERT(coremap[old_index].allocated);
+
+    // Everybody else let go in the meantime. The page is ours to write
+    if (coremap[old_index].refcount == 1) {
+        coremap[old_index].busy = false;
+        return paddr;
+    }
+
+    CM_DEBUG("copy on write (cm_entry) %d for (addrspace) %p...", old_index, as);
+    new_index = cm_alloc_entry(as, va, true);
+    memcpy((void *)PADDR_TO_KVADDR(CM_TO_PADDR(new_index)),
+           (const void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+
+    // Our swap slot, which comes along, has never seen this data
+    coremap[new_index].slot = cm_drop_mapping(old_index, as, va);
+    coremap[new_index].dirty = true;
+    coremap[new_index].busy = false;
+
+    KASSERT(coremap[old_index].refcount > 0);
+    coremap[old_index].busy = false;
+    CM_DONE;
+
+    return CM_TO_PADDR(new_index);
+}
+
+/**
+ * @brief Drop one user mapping of a frame
+ * @details If other address spaces still share the frame only the mapping is
+ *          removed. Otherwise the frame is deallocated.
+ * 
+ * @return false if the frame is busy, true otherwise
+ */
+bool cm_release_page(struct addrspace *as, vaddr_t va, paddr_t paddr) {
+    int cm_index = PADDR_TO_CM(paddr);
+    unsigned slot;
+
+    if (!cm_try_busy(cm_index))
+        return false;
+
+    KASSERT(coremap[cm_index].allocated);
+
+    if (coremap[cm_index].refcount > 1) {
+        slot = cm_drop_mapping(cm_index, as, va);
+        coremap[cm_index].busy = false;
+        if (slot != 0)
+            bs_dealloc_index(slot);
+        return true;
+    }
+
+    KASSERT(coremap[cm_index].as == as && coremap[cm_index].vm_addr == va);
+    slot = coremap[cm_index].slot;
+    coremap[cm_index].slot = 0;
+    coremap[cm_index].busy = false;
+    if (slot != 0)
+        bs_dealloc_index(slot);
+    return cm_dealloc_page(NULL, paddr);
+}
 
 /**
  * @brief Set a page to dirty, ignoring synchronization
@@ -596,6 +1451,14 @@ void bs_bootstrap() {
     if (bs_map == NULL)
         panic("bs_bootstrap: couldn't create disk map");
 
+    bs_nslots = mem_free / PAGE_SIZE;
+    // Pagetable entries can't name slots beyond this
+    if (bs_nslots > PT_MAX_SLOTS)
+        bs_nslots = PT_MAX_SLOTS;
+    bs_refs = kmalloc(bs_nslots * sizeof(uint16_t));
+    if (bs_refs == NULL)
+        panic("bs_bootstrap: couldn't create disk map refcounts");
+
     bs_map_lock = lock_create("disk map lock");
     if (bs_map_lock == NULL)
         panic("bs_bootstrap: couldn't create disk map lock");
@@ -607,9 +1470,64 @@ void bs_bootstrap() {
     bs_alloc_index();
     
     cm_mem_change(-1);
+
+    // Now that we have somewhere to put pages, start the pageout daemon
+    pageout_low = cm_entries / PAGEOUT_LOW_DIVISOR + 1;
+    pageout_high = cm_entries / PAGEOUT_HIGH_DIVISOR + 2;
+    pageout_wchan = wchan_create("pageout");
+    if (pageout_wchan == NULL)
+        panic("bs_bootstrap: couldn't create pageout wchan");
+    err = thread_fork("pageout", NULL, pageout_thread, NULL, 0);
+    if (err)
+        panic("bs_bootstrap: couldn't start pageout daemon");
+    pageout_started = true;
     
     return;
 }
+/**
+ * @brief Get the swap slot of a frame's primary mapping, allocating it now
+ *        if the page has never been written out
+ * @details Slots are picked next to the slots of the page's virtual
+ *          neighbours, so that paging can move runs of them in one transfer.
+ *          Assumes the primary mapping's pagetable entry is locked, which
+ *          covers its neighbours in the same L2 table
+ */
+static unsigned bs_frame_slot(int cm_index) {
+    struct addrspace *as = coremap[cm_index].as;
+    vaddr_t vaddr = coremap[cm_index].vm_addr;
+    struct pt_entry *next;
+    unsigned hint = 0, index_lo;
+
+    KASSERT(pte_locked(as, vaddr));
+    if (coremap[cm_index].slot != 0)
+        return coremap[cm_index].slot;
+
+    index_lo = vaddr >> 12 & (PT_LEVEL_SIZE - 1);
+    if (index_lo > 0) {
+        next = pt_get_entry(as, vaddr - PAGE_SIZE);
+        if (next->allocated && next->in_memory)
+            hint = coremap[PADDR_TO_CM(PT_PADDR(next))].slot;
+        else if (next->allocated)
+            hint = PT_SLOT(next);
+        if (hint != 0)
+            hint++;
+    }
+    if (hint == 0 && index_lo < PT_LEVEL_SIZE - 1) {
+        next = pt_get_entry(as, vaddr + PAGE_SIZE);
+        if (next->allocated && next->in_memory)
+            hint = coremap[PADDR_TO_CM(PT_PADDR(next))].slot;
+        else if (next->allocated)
+            hint = PT_SLOT(next);
+        if (hint > 1)
+            hint--;
+        else
+            hint = 0;
+    }
+
+    coremap[cm_index].slot = bs_alloc_index_near(hint);
+    return coremap[cm_index].slot;
+}
+
 /**
  * @brief Writes the page referenced by cm_index to disk
  * @details Assumes that the pagetable entry associated with the coremap entry
@@ -621,14 +1539,9 @@ void bs_bootstrap() {
 int bs_write_out(int cm_index) {
     int err, offset;
     paddr_t paddr = CM_TO_PADDR(cm_index);
-    struct addrspace *as = coremap[cm_index].as;
-    vaddr_t vaddr = coremap[cm_index].vm_addr;
 
-    KASSERT(pte_locked(as, vaddr));
-    struct pt_entry *pt_entry = pt_get_entry(as, vaddr);
-
-    KASSERT(pt_entry->store_index);
-    offset = pt_entry->store_index;
+    KASSERT(pte_locked(coremap[cm_index].as, coremap[cm_index].vm_addr));
+    offset = bs_frame_slot(cm_index);
 
     BS_DEBUG("writing page (paddr) %x to disk at (offset) %d...", paddr, offset);
     err = bs_write_page((void *) PADDR_TO_KVADDR(paddr), offset);
@@ -641,49 +1554,172 @@ int bs_write_out(int cm_index) {
 // NOTE: assert that we alread have locked the virtual address
 int bs_read_in(struct addrspace *as, vaddr_t vaddr, int cm_index) {
     int err;
-    unsigned offset;
+    unsigned offset, npages, k;
     paddr_t paddr = CM_TO_PADDR(cm_index);
+    void *kvaddrs[BS_CLUSTER];
+    int frames[BS_CLUSTER];
+    struct pt_entry *next;
+    vaddr_t next_va;
 
     KASSERT(pte_locked(as, vaddr));
     struct pt_entry *pte = pt_get_entry(as, vaddr);
 
-    KASSERT(pte->store_index);
-    offset = pte->store_index;
+    KASSERT(!pte->in_memory && PT_SLOT(pte) != 0);
+    offset = PT_SLOT(pte);
+
+    /*
+     * Read around: following pages in the same L2 table (so covered by the
+     * lock we hold) that are swapped out to the following private slots come
+     * in with the same transfer, as long as there are free frames for them.
+     * They are not marked referenced, so they go first if nobody uses them.
+     */
+    frames[0] = cm_index;
+    kvaddrs[0] = (void *) PADDR_TO_KVADDR(paddr);
+    for (npages = 1; npages < BS_CLUSTER; npages++) {
+        next_va = vaddr + npages * PAGE_SIZE;
+        if ((next_va >> 22) != (vaddr >> 22))
+            break;
+        next = pt_get_entry(as, next_va);
+        if (!next->allocated || next->in_memory ||
+            PT_SLOT(next) != offset + npages ||
+            bs_index_shared(offset + npages))
+            break;
+        frames[npages] = cm_get_free_page();
+        if (frames[npages] < 0)
+            break;
+        kvaddrs[npages] = (void *) PADDR_TO_KVADDR(CM_TO_PADDR(frames[npages]));
+    }
 
-    err = bs_read_page((void *) PADDR_TO_KVADDR(paddr), offset);
-    if (err)
+    err = bs_read_pages(kvaddrs, npages, offset);
+    if (err) {
+        for (k = 1; k < npages; k++)
+            cm_free_frame(frames[k], true);
         return err;
+    }
 
-    pte->in_memory = 1;
-    pte->p_addr = paddr;
+    for (k = 1; k < npages; k++) {
+        next_va = vaddr + k * PAGE_SIZE;
+        next = pt_get_entry(as, next_va);
+        coremap[frames[k]].allocated = 1;
+        coremap[frames[k]].vm_addr = next_va;
+        coremap[frames[k]].as = as;
+        coremap[frames[k]].is_kernel = 0;
+        coremap[frames[k]].has_next = 0;
+        coremap[frames[k]].dirty = 0;
+        coremap[frames[k]].used_recently = 0;
+        coremap[frames[k]].refcount = 1;
+        coremap[frames[k]].slot = offset + k;
+        coremap[frames[k]].sharers = NULL;
+        PT_SET_RESIDENT(next, CM_TO_PADDR(frames[k]));
+        cm_used_change(1);
+        vmstat_inc(VMSTAT_READAROUND);
+        spinlock_acquire(&busy_lock);
+        coremap[frames[k]].busy = false;
+        spinlock_release(&busy_lock);
+    }
+
+    // The slot is still shared with a forked address space. Let go of it so
+    // that our evictions never overwrite the other side's data; we get a
+    // private one when we are next written out
+    if (bs_index_shared(offset)) {
+        bs_dealloc_index(offset);
+        coremap[cm_index].slot = 0;
+        coremap[cm_index].dirty = true;
+    } else {
+        coremap[cm_index].slot = offset;
+    }
+
+    PT_SET_RESIDENT(pte, paddr);
     return 0;
 }
 
 
 int bs_write_page(void *vaddr, unsigned offset) {
-    struct iovec iov;
-    struct uio u;
-    uio_kinit(&iov, &u, vaddr, PAGE_SIZE, 
-        offset*PAGE_SIZE, UIO_WRITE);
-
-    return VOP_WRITE(bs_file,&u);
+    return bs_write_pages(&vaddr, 1, offset);
 }
 
 int bs_read_page(void *vaddr, unsigned offset) {
-    struct iovec iov;
+    return bs_read_pages(&vaddr, 1, offset);
+}
+
+/*
+ * Move a run of pages to or from consecutive swap slots starting at offset
+ * in a single transfer, one iovec per page
+ */
+static int bs_io_pages(void **vaddrs, unsigned npages, unsigned offset,
+                       enum uio_rw rw) {
+    struct iovec iov[BS_CLUSTER];
     struct uio u;
-    uio_kinit(&iov, &u, vaddr, PAGE_SIZE, 
-        offset*PAGE_SIZE, UIO_READ);
+    unsigned i, oldpri;
+    int result;
 
-    return VOP_READ(bs_file,&u);
+    KASSERT(npages > 0 && npages <= BS_CLUSTER);
+    for (i = 0; i < npages; i++) {
+        iov[i].iov_kbase = vaddrs[i];
+        iov[i].iov_len = PAGE_SIZE;
+    }
+    u.uio_iov = iov;
+    u.uio_iovcnt = npages;
+    u.uio_offset = (off_t)offset * PAGE_SIZE;
+    u.uio_resid = npages * PAGE_SIZE;
+    u.uio_segflg = UIO_SYSSPACE;
+    u.uio_rw = rw;
+    u.uio_space = NULL;
+
+    /* Paging goes ahead of ordinary file I/O on a shared disk */
+    oldpri = curthread->t_iopri;
+    curthread->t_iopri = IOPRI_SWAP;
+    if (rw == UIO_READ) {
+        vmstat_inc(VMSTAT_SWAP_READS);
+        result = VOP_READ(bs_file, &u);
+    } else {
+        vmstat_inc(VMSTAT_SWAP_WRITES);
+        result = VOP_WRITE(bs_file, &u);
+    }
+    curthread->t_iopri = oldpri;
+    return result;
+}
+
+int bs_write_pages(void **vaddrs, unsigned npages, unsigned offset) {
+    return bs_io_pages(vaddrs, npages, offset, UIO_WRITE);
+}
+
+int bs_read_pages(void **vaddrs, unsigned npages, unsigned offset) {
+    return bs_io_pages(vaddrs, npages, offset, UIO_READ);
 }
 
 unsigned bs_alloc_index() {
-    unsigned index;
+    return bs_alloc_index_near(0);
+}
+
+/**
+ * @brief Allocate a swap slot, preferably the one given
+ * @details Falls back to the next free slot after where the last allocation
+ *          ended, so that pages allocated one after another still end up next
+ *          to each other on disk
+ * 
+ * @param hint Slot we would like, or 0 for no preference
+ * @return The allocated slot
+ */
+unsigned bs_alloc_index_near(unsigned hint) {
+    unsigned index, scanned;
 
     lock_acquire(bs_map_lock);
-    if (bitmap_alloc(bs_map, &index))
-        panic("no space on disk");
+    if (hint > 0 && hint < bs_nslots && !bitmap_isset(bs_map, hint)) {
+        index = hint;
+    } else {
+        index = bs_rotor;
+        for (scanned = 0; scanned < bs_nslots; scanned++) {
+            if (!bitmap_isset(bs_map, index))
+                break;
+            index = (index + 1) % bs_nslots;
+        }
+        if (scanned == bs_nslots)
+            panic("no space on disk");
+    }
+    bitmap_mark(bs_map, index);
+    bs_refs[index] = 1;
+    bs_rotor = (index + 1) % bs_nslots;
     lock_release(bs_map_lock);
     return index;
 }
@@ -692,8 +1728,31 @@ void bs_dealloc_index(unsigned index) {
     lock_acquire(bs_map_lock);
 
     KASSERT(bitmap_isset(bs_map, index));
-    bitmap_unmark(bs_map, index);
+    KASSERT(bs_refs[index] > 0);
+    bs_refs[index]--;
+    if (bs_refs[index] == 0)
+        bitmap_unmark(bs_map, index);
 
     lock_release(bs_map_lock);
     return;
 }
+
+/* Share a swap slot between a parent and its forked child */
+void bs_share_index(unsigned index) {
+    lock_acquire(bs_map_lock);
+
+    KASSERT(bitmap_isset(bs_map, index));
+    KASSERT(bs_refs[index] < 0xffff);
+    bs_refs[index]++;
+
+    lock_release(bs_map_lock);
+}
+
+bool bs_index_shared(unsigned index) {
+    bool shared;
+
+    lock_acquire(bs_map_lock);
+    shared = bs_refs[index] > 1;
+    lock_release(bs_map_lock);
+    return shared;
+}
@@ -0,0 +1,743 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <current.h>
+#include <uio.h>
+#include <stat.h>
+#include <vnode.h>
+#include <vm.h>
+#include <addrspace.h>
+#include <pagetable.h>
+#include <coremap.h>
+#include <pagecache.h>
+
+/*
+ * Page cache; see pagecache.h.
+ *
+ * Pages are hashed twice: by (vnode, offset) for lookups from faults and
+ * file I/O, and by frame for the VM side, which only has the physical
+ * address from the pagetable entry. Each page also keeps the list of
+ * mappings of it, so the pageout daemon can take it away from all of them.
+ *
+ * Everything here is protected by pc_lock. Nothing holds pc_lock while
+ * taking a pagetable lock or doing I/O, so the VM can call in with
+ * pagetable locks held. I/O on a page happens with the page busy (being
+ * read in, reclaimed or freed) or pinned (copied by read/write or synced);
+ * a busy page is waited for on pc_cv, a pinned one can't be reclaimed.
+ *
+ * A write() to pages that aren't cached goes straight to the file system.
+ * While it does, its range is on pc_writes, and a fault on a page in it
+ * waits in pc_get (on pc_cv too) instead of reading the old contents in
+ * under the write.
+ *
+ * Each page holds a reference to its vnode, so writing it back never
+ * races with the file going away.
+ */
+
+#define PC_BUCKETS 64
+
+struct pc_mapping {
+    struct addrspace *as;
+    vaddr_t va;
+    struct pc_mapping *next;
+};
+
+struct pc_write {
+    struct thread *thread;
+    struct vnode *vnode;
+    off_t start, end;
+    struct pc_write *next;
+};
+
+struct pc_page {
+    struct vnode *vnode;
+    off_t offset;                   // Page aligned
+    paddr_t paddr;                  // 0 while being read in
+    struct pc_mapping *mappings;
+    unsigned pins;                  // Faults, reads, writes and syncs in progress
+    bool busy;                      // Being read in, reclaimed or freed
+    bool dirty;                     // Written through a mapping
+    unsigned syncgen;               // Last pc_sync pass that wrote it
+    struct pc_page *next;           // Chain by (vnode, offset)
+    struct pc_page *fnext;          // Chain by frame
+};
+
+static struct pc_page *pc_table[PC_BUCKETS];
+static struct pc_page *pc_frames[PC_BUCKETS];
+static unsigned pc_vnpages[PC_BUCKETS];     // Pages, by hash of the vnode alone
+static struct pc_write *pc_writes;          // Uncached writes in progress
+static unsigned pc_hand;
+static unsigned pc_syncgen;
+static struct lock *pc_lock;
+static struct cv *pc_cv;
+
+void pc_bootstrap(void) {
+    unsigned i;
+
+    for (i = 0; i < PC_BUCKETS; i++) {
+        pc_table[i] = NULL;
+        pc_frames[i] = NULL;
+        pc_vnpages[i] = 0;
+    }
+    pc_writes = NULL;
+    pc_hand = 0;
+    pc_syncgen = 0;
+
+    pc_lock = lock_create("pagecache");
+    if (pc_lock == NULL)
+        panic("pc_bootstrap: Out of memory\n");
+    pc_cv = cv_create("pagecache");
+    if (pc_cv == NULL)
+        panic("pc_bootstrap: Out of memory\n");
+}
+
+static unsigned pc_hash(struct vnode *v, off_t offset) {
+    return (((uintptr_t)v >> 6) ^ (unsigned)(offset / PAGE_SIZE)) % PC_BUCKETS;
+}
+
+static unsigned pc_vhash(struct vnode *v) {
+    return ((uintptr_t)v >> 6) % PC_BUCKETS;
+}
+
+static unsigned pc_fhash(paddr_t paddr) {
+    return (paddr / PAGE_SIZE) % PC_BUCKETS;
+}
+
+static struct pc_page *pc_lookup(struct vnode *v, off_t offset) {
+    struct pc_page *p;
+
+    KASSERT(lock_do_i_hold(pc_lock));
+    for (p = pc_table[pc_hash(v, offset)]; p != NULL; p = p->next) {
+        if (p->vnode == v && p->offset == offset)
+            return p;
+    }
+    return NULL;
+}
+
+static struct pc_page *pc_lookup_frame(paddr_t paddr) {
+    struct pc_page *p;
+
+    KASSERT(lock_do_i_hold(pc_lock));
+    for (p = pc_frames[pc_fhash(paddr)]; p != NULL; p = p->fnext) {
+        if (p->paddr == paddr)
+            return p;
+    }
+    return NULL;
+}
+
+/*
+ * Whether another thread's uncached write to the page of V at OFFSET is in
+ * progress. Our own doesn't count: its source may be a mapping of the very
+ * page, and that has to fault in for the write to finish.
+ */
+static bool pc_writing(struct vnode *v, off_t offset) {
+    struct pc_write *w;
+
+    KASSERT(lock_do_i_hold(pc_lock));
+    for (w = pc_writes; w != NULL; w = w->next) {
+        if (w->vnode == v && w->thread != curthread &&
+            w->start < offset + PAGE_SIZE && offset < w->end)
+            return true;
+    }
+    return false;
+}
+
+static void pc_insert(struct pc_page *p) {
+    unsigned b = pc_hash(p->vnode, p->offset);
+
+    p->next = pc_table[b];
+    pc_table[b] = p;
+    pc_vnpages[pc_vhash(p->vnode)]++;
+}
+
+static void pc_insert_frame(struct pc_page *p) {
+    unsigned b = pc_fhash(p->paddr);
+
+    p->fnext = pc_frames[b];
+    pc_frames[b] = p;
+}
+
+static void pc_remove(struct pc_page *p) {
+    struct pc_page **link;
+
+    for (link = &pc_table[pc_hash(p->vnode, p->offset)]; *link != p; link = &(*link)->next)
+        KASSERT(*link != NULL);
+    *link = p->next;
+
+    if (p->paddr != 0) {
+        for (link = &pc_frames[pc_fhash(p->paddr)]; *link != p; link = &(*link)->fnext)
+            KASSERT(*link != NULL);
+        *link = p->fnext;
+    }
+    pc_vnpages[pc_vhash(p->vnode)]--;
+}
+
+/*
+ * Read a page of the file. Past the end of the file, and past a short
+ * read, the page is zero.
+ */
+static int pc_fill(struct vnode *v, off_t offset, paddr_t paddr) {
+    struct iovec iov;
+    struct uio ku;
+    void *kva = (void *)PADDR_TO_KVADDR(paddr);
+
+    bzero(kva, PAGE_SIZE);
+    uio_kinit(&iov, &ku, kva, PAGE_SIZE, offset, UIO_READ);
+    vmstat_inc(VMSTAT_PCACHE_FILL);
+    return VOP_READ(v, &ku);
+}
+
+/*
+ * Write a page back through the file system, as much of it as is still
+ * inside the file. The page is busy or pinned.
+ */
+static int pc_writeback(struct pc_page *p) {
+    struct iovec iov;
+    struct uio ku;
+    struct stat st;
+    off_t len;
+    int result;
+
+    result = VOP_STAT(p->vnode, &st);
+    if (result)
+        return result;
+    if (p->offset >= st.st_size)
+        return 0;
+    len = st.st_size - p->offset;
+    if (len > PAGE_SIZE)
+        len = PAGE_SIZE;
+
+    uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(p->paddr), len, p->offset, UIO_WRITE);
+    result = VOP_WRITE(p->vnode, &ku);
+    vmstat_inc(VMSTAT_PCACHE_WRITEBACK);
+    if (result) {
+        kprintf("pagecache: writing back offset %llu: %s\n",
+                (unsigned long long)p->offset, strerror(result));
+    }
+    return result;
+}
+
+/*
+ * Free a page nobody holds any more, writing it back first if need be.
+ * Called with pc_lock held; returns with it released.
+ */
+static void pc_put(struct pc_page *p) {
+    KASSERT(lock_do_i_hold(pc_lock));
+
+    if (p->mappings != NULL || p->pins > 0 || p->busy) {
+        lock_release(pc_lock);
+        return;
+    }
+    p->busy = true;
+    lock_release(pc_lock);
+
+    if (p->dirty)
+        pc_writeback(p);
+
+    lock_acquire(pc_lock);
+    pc_remove(p);
+    cv_broadcast(pc_cv, pc_lock);
+    lock_release(pc_lock);
+
+    free_kpages(PADDR_TO_KVADDR(p->paddr));
+    VOP_DECREF(p->vnode);
+    kfree(p);
+}
+
+/**
+ * @brief Find or read in a page for a fault
+ * @details A page that isn't cached goes in busy, before the read, so two
+ *          faults on it don't both read it in, and not while a write() to
+ *          it is going past the cache. The frame is allocated with nothing
+ *          locked, since that may have to evict
+ *
+ * @return 0 with the pinned frame in *ret, or an error
+ */
+int pc_get(struct vnode *v, off_t offset, paddr_t *ret) {
+    struct pc_page *p, *newp;
+    paddr_t paddr;
+    int result;
+
+    KASSERT(offset % PAGE_SIZE == 0);
+
+    newp = kmalloc(sizeof(struct pc_page));
+    if (newp == NULL)
+        return ENOMEM;
+
+    lock_acquire(pc_lock);
+    for (;;) {
+        p = pc_lookup(v, offset);
+        if (p != NULL && !p->busy) {
+            p->pins++;
+            *ret = p->paddr;
+            lock_release(pc_lock);
+            kfree(newp);
+            return 0;
+        }
+        if (p == NULL && !pc_writing(v, offset))
+            break;
+        cv_wait(pc_cv, pc_lock);
+    }
+
+    p = newp;
+    p->vnode = v;
+    p->offset = offset;
+    p->paddr = 0;
+    p->mappings = NULL;
+    p->pins = 1;
+    p->busy = true;
+    p->dirty = false;
+    p->syncgen = 0;
+    VOP_INCREF(v);
+    pc_insert(p);
+    lock_release(pc_lock);
+
+    paddr = cm_alloc_npages(1);
+    result = paddr == 0 ? ENOMEM : pc_fill(v, offset, paddr);
+
+    lock_acquire(pc_lock);
+    p->busy = false;
+    cv_broadcast(pc_cv, pc_lock);
+    if (result) {
+        pc_remove(p);
+        lock_release(pc_lock);
+        if (paddr != 0)
+            free_kpages(PADDR_TO_KVADDR(paddr));
+        VOP_DECREF(v);
+        kfree(p);
+        return result;
+    }
+    p->paddr = paddr;
+    pc_insert_frame(p);
+    lock_release(pc_lock);
+
+    *ret = paddr;
+    return 0;
+}
+
+int pc_map(paddr_t paddr, struct addrspace *as, vaddr_t va) {
+    struct pc_mapping *m;
+    struct pc_page *p;
+
+    KASSERT(pte_locked(as, va));
+
+    m = kmalloc(sizeof(struct pc_mapping));
+    if (m == NULL)
+        return ENOMEM;
+    m->as = as;
+    m->va = va & PAGE_FRAME;
+
+    lock_acquire(pc_lock);
+    p = pc_lookup_frame(paddr);
+    KASSERT(p != NULL && p->pins > 0);
+    m->next = p->mappings;
+    p->mappings = m;
+    p->pins--;
+    lock_release(pc_lock);
+    return 0;
+}
+
+void pc_unpin(paddr_t paddr) {
+    struct pc_page *p;
+
+    lock_acquire(pc_lock);
+    p = pc_lookup_frame(paddr);
+    KASSERT(p != NULL && p->pins > 0);
+    p->pins--;
+    pc_put(p);
+}
+
+/*
+ * The pagetable lock of the page's existing mapping in the parent is held,
+ * so the page can't finish being reclaimed under us; if a reclaim is under
+ * way it will find the new mapping too.
+ */
+int pc_ref(paddr_t paddr, struct addrspace *as, vaddr_t va) {
+    struct pc_mapping *m;
+    struct pc_page *p;
+
+    m = kmalloc(sizeof(struct pc_mapping));
+    if (m == NULL)
+        return ENOMEM;
+    m->as = as;
+    m->va = va & PAGE_FRAME;
+
+    lock_acquire(pc_lock);
+    p = pc_lookup_frame(paddr);
+    KASSERT(p != NULL);
+    m->next = p->mappings;
+    p->mappings = m;
+    lock_release(pc_lock);
+    return 0;
+}
+
+/*
+ * If the page is being reclaimed, wait: the reclaimer may be about to lock
+ * our pagetable, which must not go away until it's done. Once it is, the
+ * mapping may no longer be there, or the page may be gone altogether;
+ * either way the reclaimer dropped it for us.
+ */
+void pc_unref(paddr_t paddr, struct addrspace *as, vaddr_t va) {
+    struct pc_mapping **link, *m;
+    struct pc_page *p;
+
+    va &= PAGE_FRAME;
+
+    lock_acquire(pc_lock);
+    while ((p = pc_lookup_frame(paddr)) != NULL && p->busy)
+        cv_wait(pc_cv, pc_lock);
+    if (p == NULL) {
+        lock_release(pc_lock);
+        return;
+    }
+
+    for (link = &p->mappings; *link != NULL; link = &(*link)->next) {
+        if ((*link)->as == as && (*link)->va == va)
+            break;
+    }
+    if (*link == NULL) {
+        lock_release(pc_lock);
+        return;
+    }
+    m = *link;
+    *link = m->next;
+    kfree(m);
+
+    pc_put(p);
+}
+
+void pc_set_dirty(paddr_t paddr) {
+    struct pc_page *p;
+
+    lock_acquire(pc_lock);
+    p = pc_lookup_frame(paddr);
+    KASSERT(p != NULL);
+    p->dirty = true;
+    lock_release(pc_lock);
+}
+
+/*
+ * Pin the cached page of V at OFFSET for read/write, waiting out a read
+ * or reclaim in progress. NULL if it isn't cached.
+ */
+static struct pc_page *pc_lookup_pin(struct vnode *v, off_t offset) {
+    struct pc_page *p;
+
+    lock_acquire(pc_lock);
+    while ((p = pc_lookup(v, offset)) != NULL && p->busy)
+        cv_wait(pc_cv, pc_lock);
+    if (p != NULL)
+        p->pins++;
+    lock_release(pc_lock);
+    return p;
+}
+
+static void pc_unpin_page(struct pc_page *p) {
+    lock_acquire(pc_lock);
+    KASSERT(p->pins > 0);
+    p->pins--;
+    pc_put(p);
+}
+
+/*
+ * How much of the RESID bytes from POS, which isn't cached, can go to the
+ * file system in one piece: up to the next page that is.
+ */
+static size_t pc_uncached_run(struct vnode *v, off_t pos, size_t resid) {
+    size_t len;
+
+    KASSERT(lock_do_i_hold(pc_lock));
+    len = PAGE_SIZE - pos % PAGE_SIZE;
+    while (len < resid && pc_lookup(v, pos + len) == NULL)
+        len += PAGE_SIZE;
+    return len < resid ? len : resid;
+}
+
+/*
+ * Do I/O on the uncached run starting at the uio's offset, with the uio's
+ * residual count cut down to fit. Returns the bytes moved in *moved.
+ *
+ * A write is put on pc_writes in the same hold of pc_lock that found the
+ * run uncached, so no fault can start reading those pages in until it's
+ * done.
+ */
+static int pc_uncached_io(struct vnode *v, struct uio *uio, size_t *moved) {
+    struct pc_write w, **link;
+    size_t len, resid;
+    int result;
+
+    lock_acquire(pc_lock);
+    len = pc_uncached_run(v, uio->uio_offset, uio->uio_resid);
+    if (uio->uio_rw == UIO_WRITE) {
+        w.thread = curthread;
+        w.vnode = v;
+        w.start = uio->uio_offset;
+        w.end = uio->uio_offset + len;
+        w.next = pc_writes;
+        pc_writes = &w;
+    }
+    lock_release(pc_lock);
+
+    resid = uio->uio_resid;
+    uio->uio_resid = len;
+    if (uio->uio_rw == UIO_READ)
+        result = VOP_READ(v, uio);
+    else
+        result = VOP_WRITE(v, uio);
+    *moved = len - uio->uio_resid;
+    uio->uio_resid = resid - *moved;
+
+    if (uio->uio_rw == UIO_WRITE) {
+        lock_acquire(pc_lock);
+        for (link = &pc_writes; *link != &w; link = &(*link)->next)
+            KASSERT(*link != NULL);
+        *link = w.next;
+        cv_broadcast(pc_cv, pc_lock);
+        lock_release(pc_lock);
+    }
+    return result;
+}
+
+/*
+ * Only regular files are ever mapped; devices, the console and the like go
+ * straight to VOP_READ/VOP_WRITE.
+ */
+static bool pc_isfile(struct vnode *v) {
+    mode_t type;
+
+    if (VOP_GETTYPE(v, &type))
+        return false;
+    return (type & S_IFMT) == S_IFREG;
+}
+
+/*
+ * Whether read() on V needs to look at the cache at all. An unlocked peek:
+ * a page cached as we look hasn't been written through a mapping yet.
+ */
+static bool pc_hascached(struct vnode *v) {
+    return pc_vnpages[pc_vhash(v)] != 0 && pc_isfile(v);
+}
+
+/*
+ * read(): pages that are cached are copied out of their frames, which may
+ * hold stores made through mappings that haven't reached the file yet.
+ * Everything else goes to the file system in as few pieces as possible.
+ */
+int pc_read(struct vnode *v, struct uio *uio) {
+    struct pc_page *p;
+    struct stat st;
+    off_t pos;
+    size_t len;
+    int result;
+
+    KASSERT(uio->uio_rw == UIO_READ);
+
+    // Nothing of this file is cached; the usual case
+    if (!pc_hascached(v))
+        return VOP_READ(v, uio);
+
+    result = VOP_STAT(v, &st);
+    if (result)
+        return result;
+
+    while (uio->uio_resid > 0 && uio->uio_offset < st.st_size) {
+        pos = uio->uio_offset;
+        p = pc_lookup_pin(v, pos - pos % PAGE_SIZE);
+        if (p == NULL) {
+            result = pc_uncached_io(v, uio, &len);
+            if (result)
+                return result;
+            if (len == 0)
+                break;
+            continue;
+        }
+
+        len = PAGE_SIZE - pos % PAGE_SIZE;
+        if (len > uio->uio_resid)
+            len = uio->uio_resid;
+        if ((off_t)len > st.st_size - pos)
+            len = st.st_size - pos;
+        result = uiomove((char *)PADDR_TO_KVADDR(p->paddr) + pos % PAGE_SIZE, len, uio);
+        pc_unpin_page(p);
+        if (result)
+            return result;
+    }
+    return 0;
+}
+
+/*
+ * write(): data for a cached page goes into its frame, where mappings see
+ * it at once, and from there on through the file system, which takes care
+ * of the file size and journaling. Everything else goes straight through,
+ * fenced off from faults (see pc_uncached_io).
+ *
+ * Unlike read(), a regular file goes this way even with nothing cached,
+ * since a fault may start reading a page in at any moment.
+ */
+int pc_write(struct vnode *v, struct uio *uio) {
+    struct pc_page *p;
+    struct iovec iov;
+    struct uio ku;
+    off_t pos;
+    size_t len, resid;
+    char *kva;
+    int result;
+
+    KASSERT(uio->uio_rw == UIO_WRITE);
+
+    if (!pc_isfile(v))
+        return VOP_WRITE(v, uio);
+
+    while (uio->uio_resid > 0) {
+        pos = uio->uio_offset;
+        p = pc_lookup_pin(v, pos - pos % PAGE_SIZE);
+        if (p == NULL) {
+            result = pc_uncached_io(v, uio, &len);
+            if (result)
+                return result;
+            if (len == 0)
+                break;
+            continue;
+        }
+
+        len = PAGE_SIZE - pos % PAGE_SIZE;
+        if (len > uio->uio_resid)
+            len = uio->uio_resid;
+        kva = (char *)PADDR_TO_KVADDR(p->paddr) + pos % PAGE_SIZE;
+        resid = uio->uio_resid;
+        result = uiomove(kva, len, uio);
+        // Send on whatever made it into the frame, even after a fault
+        len = resid - uio->uio_resid;
+        if (len > 0) {
+            uio_kinit(&iov, &ku, kva, len, pos, UIO_WRITE);
+            if (VOP_WRITE(v, &ku)) {
+                // Try again when the page is written back
+                pc_set_dirty(p->paddr);
+            }
+        }
+        pc_unpin_page(p);
+        if (result)
+            return result;
+    }
+    return 0;
+}
+
+/*
+ * Pages can't be marked clean while they are mapped: a mapping may still
+ * have a writable translation and store to the page without telling us.
+ * So a mapped page is written again on every sync until it's unmapped.
+ * syncgen keeps one pass from writing a page twice as the scan restarts.
+ */
+int pc_sync(struct vnode *v) {
+    struct pc_page *p;
+    unsigned gen, b;
+    int err, result = 0;
+
+    lock_acquire(pc_lock);
+    gen = ++pc_syncgen;
+    b = 0;
+    while (b < PC_BUCKETS) {
+        for (p = pc_table[b]; p != NULL; p = p->next) {
+            if ((v == NULL || p->vnode == v) && p->dirty && !p->busy &&
+                p->syncgen != gen)
+                break;
+        }
+        if (p == NULL) {
+            b++;
+            continue;
+        }
+        p->syncgen = gen;
+        p->pins++;
+        lock_release(pc_lock);
+
+        err = pc_writeback(p);
+        if (err && result == 0)
+            result = err;
+
+        lock_acquire(pc_lock);
+        p->pins--;
+        pc_put(p);
+        lock_acquire(pc_lock);
+    }
+    lock_release(pc_lock);
+    return result;
+}
+
+/*
+ * Take a page away from one of its mappings, if the pagetable entry still
+ * maps it. The entry goes back to unallocated, so the next touch faults
+ * the page in from the cache or the file again.
+ */
+static void pc_unmap(paddr_t paddr, struct addrspace *as, vaddr_t va) {
+    struct pt_entry *pte;
+
+    pte = pte_lock(as, va);
+    if (pte != NULL && pte->allocated && pte->pcache && PT_PADDR(pte) == paddr) {
+        pt_write_begin(as);
+        vm_shootdown(as, va);
+        PT_SET_SWAPPED(pte, 0);
+        pte->allocated = 0;
+        pte->pcache = 0;
+        pt_write_end(as);
+    }
+    pte_unlock(as, va);
+}
+
+/**
+ * @brief Give a cold page's frame back to the VM system
+ * @details Second chance, like the coremap clock: pages whose frame was
+ *          referenced since we last looked get their bit cleared and are
+ *          skipped. The victim is made busy, so the owners of its mappings
+ *          wait in pc_unref instead of tearing down pagetables we are
+ *          about to lock
+ *
+ * @return true if a frame was freed
+ */
+bool pc_reclaim(void) {
+    struct pc_mapping *m;
+    struct pc_page *p = NULL;
+    unsigned n, b;
+
+    lock_acquire(pc_lock);
+    for (n = 0; n < 2 * PC_BUCKETS && p == NULL; n++) {
+        b = pc_hand;
+        pc_hand = (pc_hand + 1) % PC_BUCKETS;
+        for (p = pc_table[b]; p != NULL; p = p->next) {
+            if (p->busy || p->pins > 0)
+                continue;
+            if (cm_clear_referenced(p->paddr))
+                continue;
+            break;
+        }
+    }
+    if (p == NULL) {
+        lock_release(pc_lock);
+        return false;
+    }
+
+    p->busy = true;
+    while ((m = p->mappings) != NULL) {
+        p->mappings = m->next;
+        lock_release(pc_lock);
+        pc_unmap(p->paddr, m->as, m->va);
+        kfree(m);
+        lock_acquire(pc_lock);
+    }
+    lock_release(pc_lock);
+
+    // No mapping can write to it any more
+    if (p->dirty)
+        pc_writeback(p);
+
+    lock_acquire(pc_lock);
+    pc_remove(p);
+    cv_broadcast(pc_cv, pc_lock);
+    lock_release(pc_lock);
+
+    free_kpages(PADDR_TO_KVADDR(p->paddr));
+    VOP_DECREF(p->vnode);
+    kfree(p);
+    vmstat_inc(VMSTAT_PCACHE_RECLAIM);
+    return true;
+}
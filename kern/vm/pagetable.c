@@ -8,6 +8,7 @@
 #include <copyinout.h>
 #include <pagetable.h>
 #include <coremap.h>
+#include <pagecache.h>
 
 //#define DEBUG_PT
 
@@ -35,7 +36,8 @@
 inline struct pt_entry* pte_lock(struct addrspace *as, vaddr_t vaddr) {
     int index_hi = vaddr >> 22;
     if (as->pt_locks[index_hi] == NULL) {
-        as->pt_locks[index_hi] = lock_create("pt");
+        if (pt_prepare(as, vaddr))
+            panic("pte_lock: out of memory");
     }
     lock_acquire(as->pt_locks[index_hi]);
     return pt_get_entry(as, vaddr);
@@ -53,6 +55,140 @@ inline bool pte_locked(struct addrspace *as, vaddr_t vaddr) {
 	return lock_do_i_hold(as->pt_locks[index_hi]);
 }
 
+/**
+ * @brief Allocate an empty L2 pagetable
+ * @details With 4-byte entries a table is exactly one page, so it comes
+ *          straight from the coremap rather than through kmalloc
+ * 
+ * @return The table, or NULL if out of memory
+ */
+struct pt_entry* pt_alloc_table(void) {
+	struct pt_entry *table;
+	paddr_t paddr;
+
+	COMPILE_ASSERT(PT_LEVEL_SIZE * sizeof(struct pt_entry) == PAGE_SIZE);
+	// Not alloc_kpages, which panics rather than fail
+	paddr = cm_alloc_npages(1);
+	if (paddr == 0)
+		return NULL;
+	table = (struct pt_entry *)PADDR_TO_KVADDR(paddr);
+	bzero(table, PAGE_SIZE);
+	return table;
+}
+
+/**
+ * @brief Create the L2 pagetable and its lock for a virtual address
+ * @details Two threads of a process can fault in the same 4MB window at
+ *          once. Both may allocate, but only the first to take the spinlock
+ *          installs its table and lock; the other frees its copies. Once
+ *          installed, neither goes away until the address space does
+ * 
+ * @param addrspace Address space to prepare
+ * @param vaddr Any address in the window
+ * 
+ * @return 0, or ENOMEM
+ */
+int pt_prepare(struct addrspace *as, vaddr_t vaddr) {
+    int index_hi = vaddr >> 22;
+    struct pt_entry *table = NULL;
+    struct lock *lock = NULL;
+
+    if (as->pagetable[index_hi] == NULL) {
+        table = pt_alloc_table();
+        if (table == NULL)
+            return ENOMEM;
+    }
+    if (as->pt_locks[index_hi] == NULL) {
+        lock = lock_create("pt");
+        if (lock == NULL) {
+            if (table)
+                free_kpages((vaddr_t)table);
+            return ENOMEM;
+        }
+    }
+
+    spinlock_acquire(&as->pt_spinlock);
+    if (table != NULL && as->pagetable[index_hi] == NULL) {
+        as->pagetable[index_hi] = table;
+        table = NULL;
+    }
+    if (lock != NULL && as->pt_locks[index_hi] == NULL) {
+        as->pt_locks[index_hi] = lock;
+        lock = NULL;
+    }
+    spinlock_release(&as->pt_spinlock);
+
+    if (table)
+        free_kpages((vaddr_t)table);
+    if (lock)
+        lock_destroy(lock);
+    return 0;
+}
+
+void pt_write_begin(struct addrspace *as) {
+    spinlock_acquire(&as->pt_spinlock);
+    as->pt_writers++;
+    as->pt_seq++;
+    spinlock_release(&as->pt_spinlock);
+}
+
+void pt_write_end(struct addrspace *as) {
+    spinlock_acquire(&as->pt_spinlock);
+    KASSERT(as->pt_writers > 0);
+    as->pt_writers--;
+    as->pt_seq++;
+    spinlock_release(&as->pt_spinlock);
+}
+
+/**
+ * @brief Start a lockless lookup
+ * @details Fails while any update is in progress: the update may already
+ *          have shot down a translation it has not yet removed from the
+ *          pagetable, and we would load it again
+ * 
+ * @return true with the sequence number in *seq, false to take the lock
+ */
+bool pt_read_begin(struct addrspace *as, unsigned *seq) {
+    bool ok;
+
+    spinlock_acquire(&as->pt_spinlock);
+    ok = as->pt_writers == 0;
+    *seq = as->pt_seq;
+    spinlock_release(&as->pt_spinlock);
+    return ok;
+}
+
+/**
+ * @brief Finish a lockless lookup
+ * @details If no update started or finished since pt_read_begin, any later
+ *          one will shoot down what we loaded after it changes the pte
+ */
+bool pt_read_valid(struct addrspace *as, unsigned seq) {
+    bool ok;
+
+    spinlock_acquire(&as->pt_spinlock);
+    ok = as->pt_writers == 0 && as->pt_seq == seq;
+    spinlock_release(&as->pt_spinlock);
+    return ok;
+}
+
+/**
+ * @brief Look up a pagetable entry without the pte lock
+ * @details The contents may be torn by a concurrent update; only trust them
+ *          between pt_read_begin and a successful pt_read_valid
+ * 
+ * @return The entry, or NULL if the L2 table does not exist
+ */
+struct pt_entry* pt_peek_entry(struct addrspace *as, vaddr_t vaddr) {
+    uint32_t index_hi = vaddr >> 22;
+    uint32_t index_lo = vaddr >> 12 & 0x000003FF;
+    struct pt_entry *table = as->pagetable[index_hi];
+
+    if (table == NULL)
+        return NULL;
+    return &table[index_lo];
+}
+
 /* Create a new page table. The new page table will be associated with an addrspace. */
 struct pt_entry** pagetable_create() {
 	int i;
@@ -73,28 +209,30 @@ struct pt_entry** pagetable_create() {
  * 
  * @param addrspace Address space under which to create this
  * @param vaddr The virtual address that this page will have in the address space
+ * @param busy If set, the page is not zeroed and is left busy for the caller
+ *             to fill in and release with cm_unbusy_page
  * 
  * @return The new pagetable entry that was just allocated
  */
-struct pt_entry* pt_alloc_page(struct addrspace *as, vaddr_t vaddr) {
+struct pt_entry* pt_alloc_page(struct addrspace *as, vaddr_t vaddr, bool busy) {
 	PT_DEBUG("Allocating %x...", vaddr);
 	uint32_t index_hi = vaddr >> 22;
 
 	//pte_lock(as, vaddr);
 	KASSERT(pte_locked(as, vaddr));
 
-	// Check that the L2 pagetable exists, creating if it doesn't
-	if (as->pagetable[index_hi] == NULL) {
-		as->pagetable[index_hi] = kmalloc(PT_LEVEL_SIZE * sizeof(struct pt_entry));
-		memset(as->pagetable[index_hi], 0, PT_LEVEL_SIZE * sizeof(struct pt_entry));
-	}
+	// pt_prepare creates the L2 pagetable before anyone can lock it
+	KASSERT(as->pagetable[index_hi] != NULL);
 
 	struct pt_entry *pt_entry = pt_get_entry(as, vaddr);
 
-	pt_entry->store_index = bs_alloc_index();
-	pt_entry->in_memory = true;
+	// No swap slot yet. One is picked, next to the page's virtual
+	// neighbours, the first time the page is written out
+	if (busy)
+		PT_SET_RESIDENT(pt_entry, cm_alloc_page_busy(as, vaddr));
+	else
+		PT_SET_RESIDENT(pt_entry, cm_alloc_page(as, vaddr));
 	pt_entry->allocated = true;
-	pt_entry->p_addr = cm_alloc_page(as, vaddr);
 
 	//pte_unlock(as, vaddr);
 
@@ -115,12 +253,24 @@ void pt_dealloc_page(struct addrspace *as, vaddr_t vaddr) {
 
 	struct pt_entry *pt_entry = pt_get_entry(as, vaddr);
 
+	// Page cache frames aren't ours to free. Let go of the pte lock first:
+	// the last mapping out writes the page back
+	if (pt_entry->pcache) {
+		paddr_t paddr = PT_PADDR(pt_entry);
+		PT_SET_SWAPPED(pt_entry, 0);
+		pt_entry->allocated = 0;
+		pt_entry->pcache = 0;
+		pte_unlock(as, vaddr);
+		pc_unref(paddr, as, vaddr);
+		return;
+	}
+
 	// If in memory, try to deallocate that segment and block until it's gone
 	if (pt_entry->in_memory) {
 		bool success = false;
 		while (true) {
-			// Try to deallocate the page in the coremap. This might fail if the coremap is busy
-			success = cm_dealloc_page(NULL, pt_entry->p_addr);
+			// Try to drop our mapping in the coremap. This might fail if the coremap is busy
+			success = cm_release_page(as, vaddr, PT_PADDR(pt_entry));
 			KASSERT(pte_locked(as, vaddr));
 
 			// Yay! Freed!
@@ -140,10 +290,10 @@ void pt_dealloc_page(struct addrspace *as, vaddr_t vaddr) {
 		}
 	}
 
-	bs_dealloc_index(pt_entry->store_index);
-	pt_entry->p_addr = 0;
-	pt_entry->store_index = 0;
-	pt_entry->in_memory = 0;
+	// A resident page's slot went with its frame
+	if (!pt_entry->in_memory)
+		bs_dealloc_index(PT_SLOT(pt_entry));
+	PT_SET_SWAPPED(pt_entry, 0);
 	pt_entry->allocated = 0;
 
 	pte_unlock(as, vaddr);
@@ -193,13 +343,13 @@ void pt_destroy(struct addrspace *as, struct pt_entry** pagetable) {
             for (j = 0; j < PT_LEVEL_SIZE; j++) {
                 pt_entry = &pagetable[i][j];
                 if (pt_entry->allocated) {
-                	PT_DEBUG("dealloc {paddr: %x, store_index: %x, in_memory: %d, allocated: %d}\n",
-                		pt_entry->p_addr, pt_entry->store_index, pt_entry->in_memory, pt_entry->allocated);
+                	PT_DEBUG("dealloc {frame/slot: %x, in_memory: %d, allocated: %d}\n",
+                		pt_entry->frame, pt_entry->in_memory, pt_entry->allocated);
                     pt_dealloc_page(as, (i << 22) | (j << 12));
                 }
             }
         	lock_acquire(as->pt_locks[i]);
-       		kfree(pagetable[i]);
+       		free_kpages((vaddr_t)pagetable[i]);
        		lock_release(as->pt_locks[i]);
         }
     }
@@ -4,6 +4,7 @@
 #include <spl.h>
 #include <spinlock.h>
 #include <proc.h>
+#include <thread.h>
 #include <current.h>
 #include <mips/tlb.h>
 #include <tlb.h>
@@ -13,19 +14,84 @@
 #include <spinlock.h>
 #include <mainbus.h>
 #include <coremap.h>
+#include <pagecache.h>
 #include <elf.h>
+#include <cpu.h>
+#include <platform/maxcpus.h>
 
 #define TLB_DEBUG(message...) kprintf("sbrk: ");kprintf(message);
 #define TLB_DONE kprintf("done\n");
 //#define TLB_DEBUG(message...) ;
 //#define TLB_DONE (void)0;
 
+/* Flush the local TLB every this many hardclocks to sample page references */
+#define REFSAMPLE_HARDCLOCKS 8
+
+/*
+ * A TLB miss maps the whole naturally aligned block of this many pages
+ * around the faulting one, as far as its pages are resident
+ */
+#define TLB_BLOCK_PAGES 8
+
 static struct lock *tlb_lock;
 
+/*
+ * Reads of anonymous pages that have never been written map this frame
+ * read-only, so they cost neither a frame nor a swap slot until the first
+ * write, which faults and allocates the real page.
+ */
+static paddr_t zero_page;
+
+/*
+ * ASIDs are handed out in generations. When a generation runs out, every
+ * address space gets a new ASID the next time it runs, and each cpu flushes
+ * its TLB the first time it activates an address space of the new
+ * generation. ASID 0 is never handed out; it's what kernel threads run with.
+ */
+static struct spinlock asid_lock = SPINLOCK_INITIALIZER;
+static unsigned asid_next = 1;
+static unsigned asid_gen = 1;
+static unsigned tlb_gen[MAXCPUS];       /* Generation each cpu last flushed for */
+static unsigned cur_asid[MAXCPUS];      /* PID each cpu is running with */
+
+static unsigned vmstats[MAXCPUS][VMSTAT_NUM];
+
+static const char *vmstat_names[VMSTAT_NUM] = {
+    [VMSTAT_FAULT]        = "faults",
+    [VMSTAT_FAULT_TLB]    = "  tlb only",
+    [VMSTAT_FAULT_FAST]   = "    without locking",
+    [VMSTAT_FAULT_ZERO]   = "  zero fill",
+    [VMSTAT_FAULT_ZEROPAGE] = "  zero page maps",
+    [VMSTAT_FAULT_FILE]   = "  from executable",
+    [VMSTAT_FAULT_DISK]   = "  from disk",
+    [VMSTAT_FAULT_COW]    = "  copy on write",
+    [VMSTAT_FAULT_PCACHE] = "  from page cache",
+    [VMSTAT_EVICT]        = "evictions",
+    [VMSTAT_EVICT_DIRTY]  = "  dirty",
+    [VMSTAT_REFSAMPLE]    = "reference samples",
+    [VMSTAT_TLB_PRELOAD]  = "tlb preloads",
+    [VMSTAT_DIRECT_RECLAIM]  = "direct reclaims",
+    [VMSTAT_PAGEOUT_RECLAIM] = "pageout reclaims",
+    [VMSTAT_PAGEOUT_CLEAN]   = "pageout cleans",
+    [VMSTAT_BUFFER_RECLAIM]  = "buffer cache shrinks",
+    [VMSTAT_READAROUND]      = "read-around pages",
+    [VMSTAT_SWAP_READS]      = "swap read transfers",
+    [VMSTAT_SWAP_WRITES]     = "swap write transfers",
+    [VMSTAT_PCACHE_FILL]     = "page cache fills",
+    [VMSTAT_PCACHE_WRITEBACK] = "page cache writebacks",
+    [VMSTAT_PCACHE_RECLAIM]  = "page cache reclaims",
+};
+
 void vm_bootstrap(void)
 {
     cm_bootstrap();
+    pc_bootstrap();
     tlb_lock = lock_create("TLB");
+
+    zero_page = cm_alloc_npages(1);
+    if (zero_page == 0)
+        panic("vm_bootstrap: no memory for the zero page");
+    bzero((void *)PADDR_TO_KVADDR(zero_page), PAGE_SIZE);
 }
 
 /* Allocate/free some kernel-space virtual pages */
@@ -46,9 +112,50 @@ void free_kpages(vaddr_t addr)
     cm_dealloc_page(NULL, paddr);
 }
 
+/*
+ * Counters are per cpu so that faults on different cpus don't fight over a
+ * cache line. Interrupts are off so we can't migrate in the middle
+ */
+void vmstat_inc(enum vmstat which)
+{
+    int spl;
+
+    KASSERT(which < VMSTAT_NUM);
+    spl = splhigh();
+    vmstats[CURCPU_EXISTS() ? curcpu->c_number : 0][which]++;
+    splx(spl);
+}
+
+void vm_printstats(void)
+{
+    unsigned i, j, total;
+
+    kprintf("vm: page replacement policy: %s\n", cm_get_evict_policy());
+    for (i = 0; i < VMSTAT_NUM; i++) {
+        total = 0;
+        for (j = 0; j < MAXCPUS; j++)
+            total += vmstats[j][i];
+        kprintf("vm: %-20s %u\n", vmstat_names[i], total);
+    }
+}
+
+/*
+ * The MIPS TLB has no referenced bit. Every so often throw away this cpu's
+ * translations; pages still in use will refault through vm_fault, which
+ * marks them referenced in the coremap for the clock hand to see.
+ */
+void vm_sample_references(void)
+{
+    if (curcpu->c_hardclocks % REFSAMPLE_HARDCLOCKS == 0) {
+        vm_tlbflush_all();
+        vmstat_inc(VMSTAT_REFSAMPLE);
+    }
+}
+
+// Too many pages were queued for one shootdown; drop everything
 void vm_tlbshootdown_all(void)
 {
-    panic("HELP!!! vm_tlbshootdown_all called");
+    vm_tlbflush_all();
 }
 
 void vm_tlbflush_all(void)
@@ -60,25 +167,213 @@ void vm_tlbflush_all(void)
     for (i = 0; i < NUM_TLB; i++) {
         tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
     }
+    tlb_setpid(cur_asid[curcpu->c_number]);
     splx(spl);
 }
 
+// Invalidate a page of the address space we are running
 void vm_tlbflush(vaddr_t target) {
     int spl;
     int i;
+    unsigned pid;
 
     spl = splhigh();
-    i = tlb_probe(target & PAGE_MASK, 0);
+    pid = cur_asid[curcpu->c_number];
+    i = tlb_probe((target & PAGE_MASK) | (pid << TLBHI_PIDSHIFT), 0);
     if (i != -1)
         tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+    tlb_setpid(pid);
     splx(spl);
 }
 
+// Called on the target cpu; the page may belong to any address space
 void
 vm_tlbshootdown(const struct tlbshootdown *ts)
 {
-    vm_tlbflush(ts->target);
-    V(ts->sem);
+    int spl;
+    int i;
+
+    spl = splhigh();
+    i = tlb_probe((ts->target & PAGE_MASK) | (ts->asid << TLBHI_PIDSHIFT), 0);
+    if (i != -1)
+        tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+    tlb_setpid(cur_asid[curcpu->c_number]);
+    splx(spl);
+}
+
+/*
+ * The MIPS-161 TLB only has 4K pages, so a large mapping can't be one
+ * entry. Get most of the benefit by loading the resident neighbours of
+ * a faulting page in the same aligned block, so that walking through a
+ * big array takes one miss per block instead of one per page. The
+ * caller holds the L2 lock (a block never crosses L2 tables) and has
+ * interrupts off. The faulting page itself is left to the caller.
+ */
+static void vm_tlb_preload(struct addrspace *as, vaddr_t faultaddress, unsigned pid)
+{
+    vaddr_t base, va;
+    struct pt_entry *pte;
+    uint32_t flags, tlbhi;
+    unsigned i;
+
+    base = faultaddress & PAGE_MASK & ~(vaddr_t)(TLB_BLOCK_PAGES * PAGE_SIZE - 1);
+    for (i = 0; i < TLB_BLOCK_PAGES; i++) {
+        va = base + i * PAGE_SIZE;
+        if (va == (faultaddress & PAGE_MASK))
+            continue;
+        pte = pt_get_entry(as, va);
+        if (pte == NULL || !pte->allocated || !pte->in_memory)
+            continue;
+        flags = cm_preload_flags(PT_PADDR(pte));
+        if (flags == 0)
+            continue;
+        tlbhi = va | (pid << TLBHI_PIDSHIFT);
+        // Never load two entries for the same page
+        if (tlb_probe(tlbhi, 0) >= 0)
+            continue;
+        tlb_random(tlbhi, (PT_PADDR(pte) & PAGE_MASK) | flags);
+        vmstat_inc(VMSTAT_TLB_PRELOAD);
+    }
+}
+
+/*
+ * TLB refill for a resident page without taking the pte lock. Gives up
+ * (and vm_fault takes the lock) whenever anything is unusual: the page
+ * isn't resident, its frame is busy, or a pagetable update overlapped us.
+ */
+static bool vm_fault_fast(struct addrspace *as, vaddr_t faultaddress)
+{
+    struct pt_entry *pte;
+    paddr_t paddr;
+    uint32_t flags, tlbhi;
+    unsigned seq;
+    int spl;
+
+    spl = splhigh();
+    if (!pt_read_begin(as, &seq))
+        goto slow;
+
+    pte = pt_peek_entry(as, faultaddress);
+    if (pte == NULL || !pte->allocated || !pte->in_memory)
+        goto slow;
+    paddr = PT_PADDR(pte);
+    flags = cm_preload_flags(paddr);
+    if (flags == 0)
+        goto slow;
+
+    tlbhi = (faultaddress & PAGE_MASK) | (cur_asid[curcpu->c_number] << TLBHI_PIDSHIFT);
+    tlb_random(tlbhi, (paddr & PAGE_MASK) | flags);
+
+    if (!pt_read_valid(as, seq)) {
+        vm_tlbflush(faultaddress);
+        goto slow;
+    }
+    cm_mark_referenced(paddr);
+    splx(spl);
+    return true;
+
+slow:
+    splx(spl);
+    return false;
+}
+
+void vm_asid_activate(struct addrspace *as)
+{
+    int spl;
+    unsigned cpu;
+    bool flush = false;
+
+    spl = splhigh();
+    cpu = curcpu->c_number;
+
+    spinlock_acquire(&asid_lock);
+    if (as->asid_gen != asid_gen) {
+        if (asid_next == NUM_TLBPID) {
+            asid_gen++;
+            asid_next = 1;
+        }
+        as->asid = asid_next++;
+        as->asid_gen = asid_gen;
+        // Translations under the old ASID can't be matched any more
+        as->asid_cpus = 0;
+    }
+    if (tlb_gen[cpu] != asid_gen) {
+        tlb_gen[cpu] = asid_gen;
+        flush = true;
+    }
+    as->asid_cpus |= (uint32_t)1 << cpu;
+    cur_asid[cpu] = as->asid;
+    spinlock_release(&asid_lock);
+
+    if (flush)
+        vm_tlbflush_all();
+    else
+        tlb_setpid(as->asid);
+
+    splx(spl);
+}
+
+void vm_asid_deactivate(void)
+{
+    int spl;
+
+    spl = splhigh();
+    cur_asid[curcpu->c_number] = 0;
+    tlb_setpid(0);
+    splx(spl);
+}
+
+/*
+ * An ASID is not handed out again until every cpu has flushed for a new
+ * generation, so whatever is cached under the old one is dead everywhere.
+ */
+void vm_asid_invalidate(struct addrspace *as)
+{
+    spinlock_acquire(&asid_lock);
+    as->asid_gen = 0;
+    spinlock_release(&asid_lock);
+
+    if (as == proc_getas())
+        vm_asid_activate(as);
+}
+
+void vm_shootdown(struct addrspace *as, vaddr_t vaddr)
+{
+    vm_shootdown_batch(&as, &vaddr, 1);
+}
+
+/*
+ * Only cpus that have run one of the address spaces since it got its ASID
+ * can hold its translations. When that is just us, skip the IPI.
+ */
+void vm_shootdown_batch(struct addrspace *const *ases, const vaddr_t *vaddrs,
+                        unsigned n)
+{
+    struct tlbshootdown ts[TLBSHOOTDOWN_MAX];
+    uint32_t cpumask = 0;
+    unsigned i;
+    int spl;
+
+    KASSERT(n <= TLBSHOOTDOWN_MAX);
+
+    spl = splhigh();
+    spinlock_acquire(&asid_lock);
+    for (i = 0; i < n; i++) {
+        ts[i].target = vaddrs[i] & PAGE_MASK;
+        ts[i].asid = ases[i]->asid;
+        cpumask |= ases[i]->asid_cpus;
+    }
+    spinlock_release(&asid_lock);
+
+    if ((cpumask & ~((uint32_t)1 << curcpu->c_number)) == 0) {
+        for (i = 0; i < n; i++)
+            vm_tlbshootdown(&ts[i]);
+        splx(spl);
+        return;
+    }
+    splx(spl);
+
+    ipi_tlbshootdown_cpus(cpumask, ts, n);
 }
 
 int vm_fault(int faulttype, vaddr_t faultaddress)
@@ -88,11 +383,16 @@ int vm_fault(int faulttype, vaddr_t faultaddress)
 
     struct pt_entry *pt_entry;
     uint32_t tlbhi, tlblo;
-    int spl, perms;
+    int spl, perms, err;
+    bool fresh = false;
+    struct vnode *vn;
+    off_t offset;
+    paddr_t frame;
 
     struct addrspace* as = curproc->p_addrspace;
 
     //KASSERT(faultaddress != 0);
+    vmstat_inc(VMSTAT_FAULT);
 
     // Address space checks
     perms = as_check_region(as, faultaddress);
@@ -111,42 +411,160 @@ int vm_fault(int faulttype, vaddr_t faultaddress)
 
     // If we have reached this point, the process has access to the faulting address
 
-    // Create L2 lock if necessary
-    int index_hi = faultaddress >> 22;
-    if (as->pt_locks[index_hi] == NULL) {
-        as->pt_locks[index_hi] = lock_create("pt");
-    }
-    if (as->pagetable[index_hi] == NULL) {
-        as->pagetable[index_hi] = kmalloc(PT_LEVEL_SIZE * sizeof(struct pt_entry));
-        memset(as->pagetable[index_hi], 0, PT_LEVEL_SIZE * sizeof(struct pt_entry));
+    // Most misses are for pages that are already resident
+    if (faulttype != VM_FAULT_READONLY && vm_fault_fast(as, faultaddress)) {
+        vmstat_inc(VMSTAT_FAULT_TLB);
+        vmstat_inc(VMSTAT_FAULT_FAST);
+        return 0;
     }
 
+    // Create L2 table and lock if necessary
+    err = pt_prepare(as, faultaddress);
+    if (err)
+        return err;
+
+retry:
     // Lock pagetable entry
     pte_lock(as, faultaddress);
     pt_entry = pt_get_entry(as, faultaddress);
 
     // Check if the page containing the address has been allocated.
     // If not, we will allocate the page and let the switch block handle tlb loading
-    if (!pt_entry || !pt_entry->allocated) {
-        pt_entry = pt_alloc_page(as, faultaddress & PAGE_MASK);
+    if ((!pt_entry || !pt_entry->allocated) &&
+        as_shared_file_page(as, faultaddress, &vn, &offset)) {
+        // First touch of a shared file mapping. The page may already be
+        // cached for someone else; if not, it's read in with no locks held
+        pte_unlock(as, faultaddress);
+        err = pc_get(vn, offset, &frame);
+        if (err)
+            return err;
+        pte_lock(as, faultaddress);
+        pt_entry = pt_get_entry(as, faultaddress);
+        if (pt_entry->allocated) {
+            pte_unlock(as, faultaddress);
+            pc_unpin(frame);
+            goto retry;
+        }
+        PT_SET_RESIDENT(pt_entry, frame);
+        pt_entry->pcache = 1;
+        pt_entry->allocated = 1;
+        err = pc_map(frame, as, faultaddress);
+        if (err) {
+            PT_SET_SWAPPED(pt_entry, 0);
+            pt_entry->pcache = 0;
+            pt_entry->allocated = 0;
+            pte_unlock(as, faultaddress);
+            pc_unpin(frame);
+            return err;
+        }
+        vmstat_inc(VMSTAT_FAULT_PCACHE);
+    }
+    else if ((!pt_entry || !pt_entry->allocated) && as_file_page(as, faultaddress)) {
+        // First touch of an executable page. Read it while the frame is busy
+        // but the pagetable lock is dropped: the file system may need memory,
+        // and reclaiming it could want this lock
+        pt_entry = pt_alloc_page(as, faultaddress & PAGE_MASK, true);
+        frame = PT_PADDR(pt_entry);
+        pte_unlock(as, faultaddress);
+        err = as_load_page(as, faultaddress, frame);
+        pte_lock(as, faultaddress);
+        // The swap slot has never seen this data
+        cm_set_dirty(frame);
+        cm_unbusy_page(frame);
+        if (err) {
+            pte_unlock(as, faultaddress);
+            return err;
+        }
+        vmstat_inc(VMSTAT_FAULT_FILE);
+    }
+    else if ((!pt_entry || !pt_entry->allocated) && faulttype == VM_FAULT_READ) {
+        // Nothing to read yet. Share the zero page until the first write
+        pte_unlock(as, faultaddress);
+        vmstat_inc(VMSTAT_FAULT_ZEROPAGE);
+
+        spl = splhigh();
+        tlbhi = (faultaddress & PAGE_MASK) | (cur_asid[curcpu->c_number] << TLBHI_PIDSHIFT);
+        tlb_random(tlbhi, zero_page | VALID);
+        splx(spl);
+        return 0;
+    }
+    else if (!pt_entry || !pt_entry->allocated) {
+        // Writing to the page, possibly over a zero page mapping. Even if
+        // this cpu has none (VM_FAULT_WRITE), others we ran on may: TLBs
+        // aren't flushed on a switch any more, and a thread that moves back
+        // to one would go on reading zeros
+        vm_shootdown(as, faultaddress);
+        pt_entry = pt_alloc_page(as, faultaddress & PAGE_MASK, false);
+        fresh = true;
+        vmstat_inc(VMSTAT_FAULT_ZERO);
     }
-
     // The page has been allocated. Check if it is in physical memory.
-    if (!pt_entry->in_memory) {
+    else if (!pt_entry->in_memory) {
         // KASSERT(faulttype != VM_FAULT_READONLY);
         cm_load_page(as, faultaddress & PAGE_MASK);
+        vmstat_inc(VMSTAT_FAULT_DISK);
+    }
+    else if (faulttype != VM_FAULT_READONLY) {
+        vmstat_inc(VMSTAT_FAULT_TLB);
     }
 
-    // All the above checks *should* mean it's safe to just load it in
-    tlbhi = faultaddress & PAGE_MASK;
-    tlblo = (pt_entry->p_addr & PAGE_MASK) | VALID;
+    // Stores to a shared file mapping reach the file, so unlike everywhere
+    // else the protection is enforced
+    if (pt_entry->pcache && faulttype != VM_FAULT_READ && !(perms & PF_W)) {
+        pte_unlock(as, faultaddress);
+        return EFAULT;
+    }
 
-    paddr_t paddr = pt_entry->p_addr;
+    // Writing to a page shared with a forked address space. Get our own copy
+    if (faulttype == VM_FAULT_READONLY && !pt_entry->pcache &&
+        cm_page_shared(PT_PADDR(pt_entry))) {
+        paddr_t copy = cm_cow_page(as, faultaddress & PAGE_MASK, PT_PADDR(pt_entry));
+        if (copy == 0) {
+            // The shared frame is busy, probably being evicted. Let that finish
+            pte_unlock(as, faultaddress);
+            thread_yield();
+            goto retry;
+        }
+        if (copy != PT_PADDR(pt_entry)) {
+            vmstat_inc(VMSTAT_FAULT_COW);
+            // Other cpus we ran on may still map the shared frame
+            pt_write_begin(as);
+            PT_SET_RESIDENT(pt_entry, copy);
+            vm_shootdown(as, faultaddress);
+            pt_write_end(as);
+        }
+    }
 
-    pte_unlock(as, faultaddress);
+    cm_mark_referenced(PT_PADDR(pt_entry));
+
+    // All the above checks *should* mean it's safe to just load it in
+    tlblo = (PT_PADDR(pt_entry) & PAGE_MASK) | VALID;
+
+    paddr_t paddr = PT_PADDR(pt_entry);
+
+    // Mark the page dirty now, under only the pagetable lock: the page
+    // cache lock can sleep, which mustn't happen once spl is raised below.
+    // A brand new page about to be written, a write to a shared file page,
+    // and a write to a clean page (READONLY) all get a writable mapping
+    // straight away rather than faulting again to be marked dirty
+    if (faulttype == VM_FAULT_READONLY ||
+        (faulttype == VM_FAULT_WRITE && (fresh || pt_entry->pcache))) {
+        if (pt_entry->pcache)
+            pc_set_dirty(paddr);
+        else
+            cm_set_dirty(paddr);
+        tlblo |= WRITABLE;
+    }
 
+    // Keep the pagetable lock while loading the TLB. Eviction shoots a page
+    // down under the same lock, so nothing we map here can go stale
     spl = splhigh();
 
+    tlbhi = (faultaddress & PAGE_MASK) | (cur_asid[curcpu->c_number] << TLBHI_PIDSHIFT);
+
+    if (faulttype != VM_FAULT_READONLY)
+        vm_tlb_preload(as, faultaddress, cur_asid[curcpu->c_number]);
+
     switch (faulttype) {
         case VM_FAULT_READ:
             // This occurs when reading from a page not in the TLB
@@ -158,17 +576,18 @@ int vm_fault(int faulttype, vaddr_t faultaddress)
         case VM_FAULT_READONLY:
             // This occurs when the user tries to write to a clean page
 
-            // Set the pagetable entry to now be dirty
-            cm_set_dirty(paddr);
-
-            tlblo |= WRITABLE;
-
-            // Replace the faulting entry with the writable one
-            int index = tlb_probe(faultaddress & PAGE_MASK, 0);
-            tlb_write(tlbhi, tlblo, index);
+            // Replace the faulting entry with the writable one. It may have
+            // been shot down while we were copying it
+            int index = tlb_probe(tlbhi, 0);
+            if (index < 0)
+                tlb_random(tlbhi, tlblo);
+            else
+                tlb_write(tlbhi, tlblo, index);
     }
 
     splx(spl);
 
+    pte_unlock(as, faultaddress);
+
     return 0;
 }
\ No newline at end of file
@@ -225,6 +225,9 @@ dumpsb(void)
 	dumpvalf("Block size", "%u bytes", SFS_BLOCKSIZE);
 	dumpvalf("Journal start", "%u", SWAP32(sb.sb_journalstart));
 	dumpvalf("Journal size", "%u blocks", SWAP32(sb.sb_journalblocks));
+	dumpvalf("Flags", "0x%x", SWAP32(sb.sb_flags));
+	dumpvalf("Data checksums", "%s",
+		 (SWAP32(sb.sb_flags) & SFS_SBF_FASTSUM) ? "words" : "adler32");
 	dumplval("Volume name", sb.sb_volname);
 
 	for (i=0; i<ARRAYCOUNT(sb.reserved); i++) {
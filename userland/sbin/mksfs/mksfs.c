@@ -164,6 +164,7 @@ writesuper(const char *volname, uint32_t nblocks)
 	strcpy(sb.sb_volname, volname);
 	sb.sb_journalstart = SWAP32(journalstart);
 	sb.sb_journalblocks = SWAP32(journalblocks);
+	sb.sb_flags = SWAP32(SFS_SBF_FASTSUM);
 
 	/* and write it out. */
 	diskwrite(&sb, SFS_SUPER_BLOCK);
@@ -98,6 +98,13 @@ sb_check(void)
 		warnx("Journal extends past volume end (NOT FIXED)");
 		setbadness(EXIT_UNRECOV);
 	}
+	if (sb.sb_flags & ~SFS_SBF_ALL) {
+		warnx("Unknown superblock flags 0x%lx (cleared)",
+		      (unsigned long)(sb.sb_flags & ~SFS_SBF_ALL));
+		sb.sb_flags &= SFS_SBF_ALL;
+		setbadness(EXIT_RECOV);
+		schanged = 1;
+	}
 	if (checkzeroed(sb.reserved, sizeof(sb.reserved))) {
 		warnx("Reserved section of superblock not zeroed (fixed)");
 		setbadness(EXIT_RECOV);
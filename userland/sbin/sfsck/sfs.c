@@ -65,6 +65,7 @@ swapsb(struct sfs_superblock *sb)
 	sb->sb_nblocks = SWAP32(sb->sb_nblocks);
 	sb->sb_journalstart = SWAP32(sb->sb_journalstart);
 	sb->sb_journalblocks = SWAP32(sb->sb_journalblocks);
+	sb->sb_flags = SWAP32(sb->sb_flags);
 }
 
 static